@@ -48,15 +48,92 @@ typedef struct _NOTIFICATION_REQUEST_
 	ULONG				Entries[0];
 }NOTIFICATION_REQUEST, *PNOTIFICATION_REQUEST;
 
-typedef struct _HOOK_ACL_
+typedef struct _HOOK_ACL_ENTRIES_* PHOOK_ACL_ENTRIES;
+
+typedef struct _HOOK_ACL_ENTRIES_
 {
+	// the snapshot this one has replaced; all are released together with the ACL...
+	PHOOK_ACL_ENTRIES       Retired;
 	ULONG                   Count;
 	BOOL                    IsExclusive;
-	ULONG                   Entries[MAX_ACE_COUNT];
+	// sorted in ascending order without duplicates
+	ULONG                   Entries[1];
+}HOOK_ACL_ENTRIES;
+
+typedef struct _HOOK_ACL_
+{
+	// immutable snapshot, NULL is an empty inclusive ACL
+	volatile PHOOK_ACL_ENTRIES	Current;
 }HOOK_ACL;
 
+typedef struct _HOOK_CALLER_RANGE_
+{
+	UCHAR*					Start;
+	UCHAR*					End; // exclusive
+}HOOK_CALLER_RANGE;
+
+typedef struct _HOOK_CALLER_FILTER_* PHOOK_CALLER_FILTER;
+
+typedef struct _HOOK_CALLER_FILTER_
+{
+	// the filter this one has replaced; all are released together with the hook...
+	PHOOK_CALLER_FILTER		Retired;
+	ULONG					Count;
+	BOOL					IsExclusive;
+	// sorted in ascending order, overlapping ranges are merged
+	HOOK_CALLER_RANGE		Ranges[1];
+}HOOK_CALLER_FILTER;
+
+/*
+    One shard of the call statistics of a hook, see LhSetHookStatistics(). The
+    shard size equals LOCAL_HOOK_SHARD_SIZE and shards are selected just like
+    the execution counter shards.
+*/
+typedef struct _LOCAL_HOOK_STATISTICS_
+{
+	LONGLONG				Handled;
+	LONGLONG				Recursion;
+	LONGLONG				AclDenied;
+	LONGLONG				CallerFiltered;
+	LONGLONG				Unsampled;
+	LONGLONG				LoaderLock;
+	LONGLONG				NoThreadStorage;
+	LONGLONG				HandlerCycles;
+}LOCAL_HOOK_STATISTICS;
+
+typedef struct _HOOK_SAMPLING_POLICY_* PHOOK_SAMPLING_POLICY;
+
+typedef struct _HOOK_SAMPLING_POLICY_
+{
+	// the policy this one has replaced; all are released together with the hook...
+	PHOOK_SAMPLING_POLICY	Retired;
+	// EASYHOOK_SAMPLING_XXX
+	ULONG					Mode;
+	// every nth call is sampled
+	ULONG					Interval;
+	// a random value below the threshold is sampled
+	ULONG					Threshold;
+	// token bucket, in thousandths of a call
+	ULONG					TokensPerTick;
+	ULONG					Capacity;
+}HOOK_SAMPLING_POLICY;
+
 #define LOCAL_HOOK_SIGNATURE            ((ULONG)0x6A910BE2)
 
+typedef struct _LOCAL_HOOK_HANDLER_* PLOCAL_HOOK_HANDLER;
+
+typedef struct _LOCAL_HOOK_HANDLER_
+{
+	// immutable while active, the assembler code jumps through HookProc...
+	void*					HookProc;
+	void*					Callback;
+	// only used after the handler has been replaced, see LhReplaceHookHandler()
+	PLOCAL_HOOK_HANDLER		Next;
+	PLOCAL_HOOK_INFO		Hook;
+	ULONG					RetireTime;
+	ULONG					QuiescentShards;
+}LOCAL_HOOK_HANDLER;
+
 typedef struct _LOCAL_HOOK_INFO_
 {
     PLOCAL_HOOK_INFO        Next;
@@ -70,20 +147,113 @@ typedef struct _LOCAL_HOOK_INFO_
     ULONG					HLSIndex;
 	ULONG					HLSIdent;
 	void*					Callback;
+	volatile PLOCAL_HOOK_HANDLER	Handler;
 	HOOK_ACL				LocalACL;
+	// immutable snapshot, NULL accepts all callers, see LhSetCallerFilter()
+	volatile PHOOK_CALLER_FILTER	CallerFilter;
+	// EASYHOOK_STATISTICS_XXX, zero if disabled; the shards are kept until the hook is released...
+	volatile LONG			StatisticsFlags;
+	LOCAL_HOOK_STATISTICS*	Statistics;
+	void*					StatisticsBuffer;
+	// immutable snapshot, NULL passes all calls to the handler, see LhSetSamplingPolicy()
+	volatile PHOOK_SAMPLING_POLICY	SamplingPolicy;
     ULONG                   Signature;
     TRACED_HOOK_HANDLE      Tracking;
+	PLOCAL_HOOK_INFO		NextByTarget;
+	PLOCAL_HOOK_INFO		NextById;
+	ULONG					RemovalTime;
+	ULONG					RemovalPasses;
+	ULONG					RemovalState;
+	ULONG					QuiescentShards;
+	// registry reader shards seen at zero since the removal, see LhRegistryIsQuiescent()
+	ULONG					ReaderShards;
+	/*
+		Hooks installed at an entry point that is already hooked share the trampoline
+		of the first one, the patch site. The patch site dispatches calls through
+		its chain of handlers, see LhBarrierIntro()...
+	*/
+	PLOCAL_HOOK_INFO		ChainHead;
+	volatile PLOCAL_HOOK_INFO	Chain;
+	volatile PLOCAL_HOOK_INFO	NextInChain;
+	ULONG					ChainMembers;
+	ULONG					ChainRefs;
+	BOOL					IsDetached;
+	// installed by LhInstallRawHook(), there is no barrier and no execution counter...
+	BOOL					IsRaw;
+	// EASYHOOK_ARGS_XXX, the argument registers saved by the trampoline
+	ULONG					ArgFlags;
 
 	void*					RandomValue; // fixed
 	void*					HookIntro; // fixed
 	UCHAR*					OldProc; // fixed
 	UCHAR*					HookProc; // fixed
 	void*					HookOutro; // fixed
-	int*					IsExecutedPtr; // fixed
+	LONG_PTR*				IsExecutedPtr; // fixed
 }LOCAL_HOOK_INFO, *PLOCAL_HOOK_INFO;
 
+/*
+    The execution counter of a hook is split into cache line sized shards, so
+    calls on different cores don't contend for the same cache line. A thread
+    selects its shard by the address of its return address when entering the
+    trampoline. The trampoline uses the same formula, see trampoline.c! The
+    shard is released through the pointer remembered on entry, never by hashing
+    again, because a __stdcall handler has already popped its arguments.
+*/
+#define LOCAL_HOOK_SHARD_COUNT          16
+#define LOCAL_HOOK_SHARD_SIZE           64
+#define LOCAL_HOOK_HOT_DATA_SIZE        (LOCAL_HOOK_SHARD_COUNT * LOCAL_HOOK_SHARD_SIZE)
+
+// relocated entry point including the jumper back into the original method
+#define LOCAL_HOOK_MAX_ENTRY_SIZE       256
+
+// trampoline emitted by LhEmitTrampoline(), including alignment
+#define LOCAL_HOOK_MAX_TRAMPOLINE_SIZE  272
+
+NTSTATUS LhEmitTrampoline(
+            PLOCAL_HOOK_INFO InHook,
+            ULONG* OutSize);
+
+#define LhGetShardIndex(InAddrOfRetAddr) \
+    ((((ULONG_PTR)(InAddrOfRetAddr) >> 12) ^ ((ULONG_PTR)(InAddrOfRetAddr) >> 20)) & (LOCAL_HOOK_SHARD_COUNT - 1))
+
+#define LhGetExecutionShard(InHook, InAddrOfRetAddr) \
+    ((LONG_PTR*)((UCHAR*)(InHook)->IsExecutedPtr + LOCAL_HOOK_SHARD_SIZE * LhGetShardIndex(InAddrOfRetAddr)))
+
+#define LhGetStatisticsShard(InHook, InAddrOfRetAddr) \
+    (&(InHook)->Statistics[LhGetShardIndex(InAddrOfRetAddr)])
+
+LONG_PTR LhGetExecutionCount(PLOCAL_HOOK_INFO InHook);
+
+
+// upper limit of simultaneous hooks, see LhAllocateSlot()
+#define LOCAL_HOOK_MAX_SLOTS            (64 * 1024)
+
+BOOL LhAllocateSlot(PLOCAL_HOOK_INFO InHook);
+
+void LhReleaseSlot(ULONG InHLSIndex);
+
+void LhSlotFinalize();
+
+void LhRegistryInitialize();
+
+void LhRegistryFinalize();
+
+void LhRegistryInsert(PLOCAL_HOOK_INFO InHook);
+
+void LhRegistryRemove(PLOCAL_HOOK_INFO InHook);
+
+PLOCAL_HOOK_INFO LhRegistryRemoveAll();
+
+PLOCAL_HOOK_INFO LhRegistryLookup(
+            void* InEntryPoint,
+            ULONG InHLSIdent,
+            TRACED_HOOK_HANDLE* OutTracking);
+
+BOOL LhRegistryIsQuiescent(ULONG* RefReaderShards);
+
+void LhDiscardChainMember(PLOCAL_HOOK_INFO InHook);
+
 
-extern LOCAL_HOOK_INFO          GlobalHookListHead;
 extern LOCAL_HOOK_INFO          GlobalRemovalListHead;
 extern RTL_SPIN_LOCK            GlobalHookLock;
 
@@ -95,15 +265,62 @@ void LhCriticalInitialize();
 
 void LhModuleInfoFinalize();
 
+void LhApplyModuleNotification(
+            BOOL InIsLoaded,
+            void* InImageBase,
+            SIZE_T InImageSize,
+            UNICODE_STRING* InImagePath);
+
+ULONG LhGetTickCount();
+
 void LhCriticalFinalize();
 
-void* LhAllocateMemory(void* InEntryPoint);
+void LhRemovalInitialize();
+
+void LhAllocatorInitialize();
+
+void LhAllocatorFinalize();
+
+void* LhAllocateMemory(
+            void* InEntryPoint,
+            void** OutHotData);
 
 void LhFreeMemory(PLOCAL_HOOK_INFO* RefHandle);
 
+void LhQuarantineMemory(PLOCAL_HOOK_INFO* RefHandle);
+
 HOOK_ACL* LhBarrierGetAcl();
 
-ULONGLONG LhBarrierIntro(LOCAL_HOOK_INFO* InHandle, void* InRetAddr, void** InAddrOfRetAddr);
+NTSTATUS LhBarrierSetAcl(
+            HOOK_ACL* InAcl,
+            BOOL InIsExclusive,
+            ULONG* InIdList,
+            ULONG InIdCount);
+
+void LhBarrierReleaseAcl(HOOK_ACL* InAcl);
+
+NTSTATUS LhBarrierSetCallerFilter(
+            PLOCAL_HOOK_INFO InHook,
+            BOOL InIsExclusive,
+            HOOK_CALLER_RANGE* InRanges,
+            ULONG InRangeCount);
+
+void LhBarrierReleaseCallerFilter(PLOCAL_HOOK_INFO InHook);
+
+void LhBarrierReleaseStatistics(PLOCAL_HOOK_INFO InHook);
+
+void LhBarrierReleaseSamplingPolicy(PLOCAL_HOOK_INFO InHook);
+
+// the last module a thread has found, see LhBarrierPointerToModule()
+typedef struct _MODULE_HINT_
+{
+	void*					Snapshot;
+	ULONG					Index;
+}MODULE_HINT;
+
+MODULE_HINT* LhBarrierGetModuleHint();
+
+void* __stdcall LhBarrierIntro(LOCAL_HOOK_INFO* InHandle, void* InRetAddr, void** InAddrOfRetAddr);
 
 void* __stdcall LhBarrierOutro(LOCAL_HOOK_INFO* InHandle, void** InAddrOfRetAddr);
 
@@ -114,23 +331,42 @@ EASYHOOK_NT_INTERNAL LhDisassembleInstruction(
             LONG buffSize, 
             ULONG64 *nextInstr);
 
-EASYHOOK_NT_INTERNAL LhRelocateRIPRelativeInstruction(
-	        ULONGLONG InOffset,
-	        ULONGLONG InTargetOffset,
-            BOOL* OutWasRelocated);
+/*
+    The entry point is decoded once and the resulting records are
+    used for both, rounding to the next instruction and relocation.
+*/
+#define LH_MAX_ENTRY_INSTRUCTIONS       16
+
+typedef struct _LH_INSTRUCTION_
+{
+	UCHAR					Length;
+	UCHAR					DispOffset; // offset of a RIP-relative displacement, zero if there is none
+}LH_INSTRUCTION;
+
+typedef struct _LH_ENTRY_POINT_
+{
+	UCHAR*					Code;
+	ULONG					Size;
+	ULONG					Count;
+	LH_INSTRUCTION			Instructions[LH_MAX_ENTRY_INSTRUCTIONS];
+}LH_ENTRY_POINT;
+
+EASYHOOK_NT_INTERNAL LhDecodeEntryPoint(
+			void* InEntryPoint,
+			ULONG InMinSize,
+			LH_ENTRY_POINT* OutEntry);
 
 EASYHOOK_NT_INTERNAL LhRelocateEntryPoint(
-				UCHAR* InEntryPoint,
-				ULONG InEPSize,
+				LH_ENTRY_POINT* InEntry,
 				UCHAR* Buffer,
 				ULONG* OutRelocSize);
 
-EASYHOOK_NT_INTERNAL LhRoundToNextInstruction(
-			void* InCodePtr,
-			ULONG InCodeSize);
-
 EASYHOOK_NT_INTERNAL LhGetInstructionLength(void* InPtr);
 
+EASYHOOK_NT_INTERNAL LhDecodeInstructionLength(
+            void* InPtr,
+            UCHAR* OutDispOffset);
+
 /*
     Helper API
 */
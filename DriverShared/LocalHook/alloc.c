@@ -22,12 +22,494 @@
 */
 #include "stdafx.h"
 
+/*
+    Hooks are packed into regions of LH_REGION_SIZE bytes. The first pages of
+    a region hold the code slots (LOCAL_HOOK_INFO, trampoline and relocated
+    entry point), the remaining pages the hot data slots (execution counter
+    shards). Code and frequently written data never share a page, which 
+    avoids self-modifying code penalties. Freed slots are chained into 
+    a per-region free list and reused.
+*/
+#define LH_REGION_SIZE                  0x10000
+
+typedef struct _HOOK_MEMORY_REGION_* PHOOK_MEMORY_REGION;
+
+typedef struct _HOOK_MEMORY_REGION_
+{
+    PHOOK_MEMORY_REGION     Next;
+    UCHAR*                  Code;
+    UCHAR*                  HotData;
+    ULONG                   UsedCount;
+    ULONG                   FreeHead;
+    // next free slot for every slot, SlotCount terminates the list
+    ULONG                   FreeList[1];
+}HOOK_MEMORY_REGION;
+
+static PHOOK_MEMORY_REGION      GlobalRegionList = NULL;
+static RTL_SPIN_LOCK            GlobalRegionLock;
+static ULONG                    CodeSlotSize = 0;
+static ULONG                    SlotCount = 0;
+static ULONG                    CodeAreaSize = 0;
+static ULONG                    RegionCount = 0;
+static ULONG                    HookCount = 0;
+
+#if defined(_M_X64) && !defined(DRIVER)
+
+/*
+    In 64-Bit user mode, regions are committed from larger reservations near
+    the hooked modules. A reservation serves all entry points within reach,
+    so the address space has only to be searched once per +-2 GB window.
+*/
+#define LH_RESERVATION_SIZE             (16 * LH_REGION_SIZE)
+#define LH_REACH                        ((LONGLONG)0x7FFFFF00 - LH_REGION_SIZE)
+
+typedef struct _HOOK_MEMORY_RESERVATION_* PHOOK_MEMORY_RESERVATION;
+
+typedef struct _HOOK_MEMORY_RESERVATION_
+{
+    PHOOK_MEMORY_RESERVATION    Next;
+    UCHAR*                      Base;
+    ULONG                       Size;
+    ULONG                       Committed;
+}HOOK_MEMORY_RESERVATION;
+
+static PHOOK_MEMORY_RESERVATION GlobalReservationList = NULL;
+
+#endif
+
+static ULONG LhRoundUp(
+            ULONG InValue,
+            ULONG InAlignment)
+{
+    return (InValue + InAlignment - 1) & ~(InAlignment - 1);
+}
+
+
+
+
+void LhAllocatorInitialize()
+{
+/*
+Description:
+
+    Determines the region layout. Called by LhCriticalInitialize().
+*/
+#if !defined(DRIVER)
+    SYSTEM_INFO		    SysInfo;
+    ULONG               PAGE_SIZE;
+
+    GetSystemInfo(&SysInfo);
+
+    PAGE_SIZE = SysInfo.dwPageSize;
+#endif
+
+    RtlInitializeLock(&GlobalRegionLock);
+
+    GlobalRegionList = NULL;
+    RegionCount = 0;
+    HookCount = 0;
+
+#if defined(_M_X64) && !defined(DRIVER)
+    GlobalReservationList = NULL;
+#endif
+
+    CodeSlotSize = LhRoundUp(sizeof(LOCAL_HOOK_INFO) + LOCAL_HOOK_MAX_TRAMPOLINE_SIZE + LOCAL_HOOK_MAX_ENTRY_SIZE, 64);
+
+    // as many slots as possible, while code and hot data have their own pages
+    for(SlotCount = LH_REGION_SIZE / (CodeSlotSize + LOCAL_HOOK_HOT_DATA_SIZE); SlotCount > 1; SlotCount--)
+    {
+        CodeAreaSize = LhRoundUp(SlotCount * CodeSlotSize, PAGE_SIZE);
+
+        if(CodeAreaSize + LhRoundUp(SlotCount * LOCAL_HOOK_HOT_DATA_SIZE, PAGE_SIZE) <= LH_REGION_SIZE)
+            break;
+    }
+
+    CodeAreaSize = LhRoundUp(SlotCount * CodeSlotSize, PAGE_SIZE);
+}
+
+
+
+
+void LhAllocatorFinalize()
+{
+/*
+Description:
+
+    Releases all regions that don't contain any hook. Regions with hooks
+    that could not be released are leaked intentionally.
+*/
+    PHOOK_MEMORY_REGION     Region;
+    PHOOK_MEMORY_REGION     Next;
+    PHOOK_MEMORY_REGION     UsedList = NULL;
+
+#if defined(_M_X64) && !defined(DRIVER)
+    PHOOK_MEMORY_RESERVATION    Reservation;
+    PHOOK_MEMORY_RESERVATION    NextReservation;
+#endif
+
+    for(Region = GlobalRegionList, GlobalRegionList = NULL; Region != NULL; Region = Next)
+    {
+        Next = Region->Next;
+
+        if(Region->UsedCount > 0)
+        {
+            Region->Next = UsedList;
+            UsedList = Region;
+
+            continue;
+        }
+
+#if defined(_M_X64) && !defined(DRIVER)
+        // released together with its reservation
+#elif !defined(DRIVER)
+        VirtualFree(Region->Code, 0, MEM_RELEASE);
+#else
+        RtlFreeMemory(Region->Code);
+#endif
+
+        RtlFreeMemory(Region);
+    }
+
+#if defined(_M_X64) && !defined(DRIVER)
+    for(Reservation = GlobalReservationList; Reservation != NULL; Reservation = NextReservation)
+    {
+        NextReservation = Reservation->Next;
+
+        for(Region = UsedList; Region != NULL; Region = Region->Next)
+        {
+            if((Region->Code >= Reservation->Base) && (Region->Code < Reservation->Base + Reservation->Size))
+                break;
+        }
+
+        if(Region == NULL)
+            VirtualFree(Reservation->Base, 0, MEM_RELEASE);
+
+        RtlFreeMemory(Reservation);
+    }
+
+    GlobalReservationList = NULL;
+#endif
+
+    RtlDeleteLock(&GlobalRegionLock);
+}
+
+
+
+
+static BOOL LhIsRegionReachable(
+            PHOOK_MEMORY_REGION InRegion,
+            void* InEntryPoint)
+{
+/*
+Description:
+
+    In 64-Bit user mode, the whole region has to be in a 31-bit boundary
+    around the entry point, so that a relative jumper can be used.
+*/
+#if defined(_M_X64) && !defined(DRIVER)
+    LONGLONG            Distance = (LONGLONG)InRegion->Code - (LONGLONG)InEntryPoint;
+
+    return (Distance > -LH_REACH) && (Distance < LH_REACH);
+#else
+    UNREFERENCED_PARAMETER(InRegion);
+    UNREFERENCED_PARAMETER(InEntryPoint);
+
+    return TRUE;
+#endif
+}
+
+
+
+
+#if defined(_M_X64) && !defined(DRIVER)
+
+static BOOL LhFindFreeRange(
+            void* InEntryPoint,
+            LONGLONG* OutBase,
+            ULONG* OutSize)
+{
+/*
+Description:
+
+    Walks the memory map of the process with VirtualQuery() from the lower
+    end of the reach upwards and returns the nearest free range that is
+    completely within reach. Instead of probing every page with VirtualAlloc(),
+    this only needs one call per region of the memory map.
+
+Parameters:
+
+    - InEntryPoint
+
+        The entry point the range shall be reachable from.
+
+    - OutBase
+
+        Receives the base of the range, aligned to allocation granularity.
+
+    - OutSize
+
+        Receives the size of the range, at least LH_REGION_SIZE and at
+        most LH_RESERVATION_SIZE.
+
+Returns:
+
+    FALSE if there is no free range within reach.
+*/
+    MEMORY_BASIC_INFORMATION    Info;
+    SYSTEM_INFO		            SysInfo;
+    LONGLONG		            iStart;
+    LONGLONG		            iEnd;
+    LONGLONG                    Granularity;
+    LONGLONG                    Addr;
+    LONGLONG                    Lo;
+    LONGLONG                    Hi;
+    LONGLONG                    RangeLo;
+    LONGLONG                    RangeHi;
+    LONGLONG                    UpBase = 0;
+    LONGLONG                    UpSize = 0;
+    LONGLONG                    DownBase = 0;
+    LONGLONG                    DownSize = 0;
+
+    GetSystemInfo(&SysInfo);
+
+    Granularity = SysInfo.dwAllocationGranularity;
+
+    iStart = ((LONGLONG)InEntryPoint) - LH_REACH;
+    iEnd = ((LONGLONG)InEntryPoint) + LH_REACH;
+
+    if(iStart < (LONGLONG)SysInfo.lpMinimumApplicationAddress)
+        iStart = (LONGLONG)SysInfo.lpMinimumApplicationAddress; // shall not be null, because then VirtualAlloc() will not work as expected
+
+    if(iEnd > (LONGLONG)SysInfo.lpMaximumApplicationAddress)
+        iEnd = (LONGLONG)SysInfo.lpMaximumApplicationAddress;
+
+    /*
+        The map is walked upwards only, because VirtualQuery() reports a region from the 
+        queried page to its end. Walking downwards would therefore need one call per page 
+        of large allocations. Free ranges below the entry point are reserved from their 
+        top, so the last fitting one is the nearest...
+    */
+    for(Addr = iStart; Addr < iEnd; Addr = (LONGLONG)Info.BaseAddress + Info.RegionSize)
+    {
+        if(VirtualQuery((void*)Addr, &Info, sizeof(Info)) == 0)
+            break;
+
+        if(Info.State != MEM_FREE)
+            continue;
+
+        Lo = (LONGLONG)Info.BaseAddress;
+        Hi = (LONGLONG)Info.BaseAddress + Info.RegionSize;
+
+        if(Lo < iStart)
+            Lo = iStart;
+
+        if(Hi > iEnd)
+            Hi = iEnd;
+
+        // the part below the entry point
+        RangeLo = (Lo + Granularity - 1) & ~(Granularity - 1);
+        RangeHi = ((Hi < (LONGLONG)InEntryPoint)?Hi:(LONGLONG)InEntryPoint) & ~(Granularity - 1);
+
+        if(RangeHi - RangeLo >= LH_REGION_SIZE)
+        {
+            DownSize = (RangeHi - RangeLo > LH_RESERVATION_SIZE)?LH_RESERVATION_SIZE:(RangeHi - RangeLo);
+            DownBase = RangeHi - DownSize;
+        }
+
+        // the part above the entry point, the first fitting one is the nearest
+        RangeLo = (((Lo > (LONGLONG)InEntryPoint)?Lo:(LONGLONG)InEntryPoint) + Granularity - 1) & ~(Granularity - 1);
+        RangeHi = Hi & ~(Granularity - 1);
+
+        if(RangeHi - RangeLo >= LH_REGION_SIZE)
+        {
+            UpBase = RangeLo;
+            UpSize = (RangeHi - RangeLo > LH_RESERVATION_SIZE)?LH_RESERVATION_SIZE:(RangeHi - RangeLo);
+
+            break;
+        }
+    }
+
+    if((UpSize == 0) && (DownSize == 0))
+        return FALSE;
+
+    if((DownSize == 0) || ((UpSize != 0) && (UpBase - (LONGLONG)InEntryPoint < (LONGLONG)InEntryPoint - DownBase)))
+    {
+        *OutBase = UpBase;
+        *OutSize = (ULONG)UpSize;
+    }
+    else
+    {
+        *OutBase = DownBase;
+        *OutSize = (ULONG)DownSize;
+    }
+
+    return TRUE;
+}
+
+#endif
+
+
+
+static UCHAR* LhAllocateRegionMemory(void* InEntryPoint)
+{
+/*
+Description:
+
+    Allocates the memory of a new region. In 64-Bit user mode, the region will
+    be as near as possible to the given entry point.
+
+Returns:
+
+    NULL if no memory could be allocated, a valid pointer otherwise.
+*/
+    UCHAR*			    Res = NULL;
+
+#if defined(_M_X64) && !defined(DRIVER)
+    PHOOK_MEMORY_RESERVATION    Reservation;
+    LONGLONG                    Distance;
+    LONGLONG                    Base;
+    ULONG                       Size;
+    ULONG                       Attempt;
+
+    // commit from a cached reservation within reach
+    for(Reservation = GlobalReservationList; Reservation != NULL; Reservation = Reservation->Next)
+    {
+        if(Reservation->Committed >= Reservation->Size)
+            continue;
+
+        Distance = (LONGLONG)(Reservation->Base + Reservation->Committed) - (LONGLONG)InEntryPoint;
+
+        if((Distance > -LH_REACH) && (Distance < LH_REACH))
+            break;
+    }
+
+    if(Reservation == NULL)
+    {
+        if((Reservation = (PHOOK_MEMORY_RESERVATION)RtlAllocateMemory(TRUE, sizeof(HOOK_MEMORY_RESERVATION))) == NULL)
+            return NULL;
+
+        // another thread might take the range between query and reservation...
+        for(Attempt = 0; Attempt < 16; Attempt++)
+        {
+            if(!LhFindFreeRange(InEntryPoint, &Base, &Size))
+                break;
+
+            if((Reservation->Base = (UCHAR*)VirtualAlloc((void*)Base, Size, MEM_RESERVE, PAGE_NOACCESS)) != NULL)
+                break;
+        }
+
+        if(Reservation->Base == NULL)
+        {
+            RtlFreeMemory(Reservation);
+
+            return NULL;
+        }
+
+        Reservation->Size = Size;
+        Reservation->Committed = 0;
+        Reservation->Next = GlobalReservationList;
+
+        GlobalReservationList = Reservation;
+    }
+
+    if((Res = (UCHAR*)VirtualAlloc(Reservation->Base + Reservation->Committed, LH_REGION_SIZE, MEM_COMMIT, PAGE_EXECUTE_READWRITE)) == NULL)
+        return NULL;
+
+    Reservation->Committed += LH_REGION_SIZE;
+#elif !defined(DRIVER)
+    // in 32-bit mode the trampoline will always be reachable
+    UNREFERENCED_PARAMETER(InEntryPoint);
+
+    if((Res = (UCHAR*)VirtualAlloc(NULL, LH_REGION_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE)) == NULL)
+        return NULL;
+#else
+    UNREFERENCED_PARAMETER(InEntryPoint);
+
+    if((Res = (UCHAR*)RtlAllocateMemory(TRUE, LH_REGION_SIZE)) == NULL)
+        return NULL;
+#endif
+
+#ifndef DRIVER
+    {
+        DWORD           OldProtect;
+
+        // hot data is never executed
+        VirtualProtect(Res + CodeAreaSize, LH_REGION_SIZE - CodeAreaSize, PAGE_READWRITE, &OldProtect);
+    }
+#endif
+
+    return Res;
+}
+
+
+
+
+static void LhReleaseHookResources(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Releases everything a hook owns besides its code slot.
+*/
+    LhBarrierReleaseAcl(&InHook->LocalACL);
+
+    LhBarrierReleaseCallerFilter(InHook);
+
+    LhBarrierReleaseStatistics(InHook);
+
+    LhBarrierReleaseSamplingPolicy(InHook);
+
+    if(InHook->HLSIdent != 0)
+        LhReleaseSlot(InHook->HLSIndex);
+
+    if(InHook->Handler != NULL)
+        RtlFreeMemory(InHook->Handler);
+
+    InHook->HLSIdent = 0;
+    InHook->Handler = NULL;
+}
+
+
+
+
+void LhQuarantineMemory(PLOCAL_HOOK_INFO* RefHandle)
+{
+/*
+Description:
+
+    Releases a removed raw hook, but never reuses its code slot. Raw hooks
+    have no execution counter, so a handler might still run on the trampoline 
+    or call the relocated entry point, for example while blocking in the 
+    original method. Such code must never be overwritten by another hook.
+    The slot is only released together with its region, which is leaked
+    by LhAllocatorFinalize().
+
+Parameters:
+
+    - RefHandle
+
+        A pointer to a valid hook handle. It will be set to NULL
+        by this method!
+*/
+    LhReleaseHookResources(*RefHandle);
+
+    // the bypass address stays valid, but the handle is dead...
+    (*RefHandle)->Signature = 0;
+
+    *RefHandle = NULL;
+}
+
+
+
+
 void LhFreeMemory(PLOCAL_HOOK_INFO* RefHandle)
 {
 /*
 Description:
 
-    Will release the memory for a given hook.
+    Will release the memory for a given hook. The slot is put back
+    into the free list of its region. Hooks sharing the trampoline of
+    another one don't have a slot, see LhPrepareChainMember().
 
 Parameters:
 
@@ -36,12 +518,42 @@ Parameters:
         A pointer to a valid hook handle. It will be set to NULL
         by this method!
 */
+    PHOOK_MEMORY_REGION     Region;
+    ULONG                   Index;
+    UCHAR*                  Hook = (UCHAR*)*RefHandle;
 
-#if defined(_M_X64) && !defined(DRIVER)
-    VirtualFree(*RefHandle, 0, MEM_RELEASE);
-#else
-    RtlFreeMemory(*RefHandle);
-#endif
+    LhReleaseHookResources(*RefHandle);
+
+    if((*RefHandle)->ChainHead != *RefHandle)
+    {
+        RtlFreeMemory(*RefHandle);
+
+        *RefHandle = NULL;
+
+        return;
+    }
+
+    RtlAcquireLock(&GlobalRegionLock);
+    {
+        for(Region = GlobalRegionList; Region != NULL; Region = Region->Next)
+        {
+            if((Hook < Region->Code) || (Hook >= Region->Code + CodeAreaSize))
+                continue;
+
+            Index = (ULONG)(Hook - Region->Code) / CodeSlotSize;
+
+            Region->FreeList[Index] = Region->FreeHead;
+            Region->FreeHead = Index;
+            Region->UsedCount--;
+
+            HookCount--;
+
+            break;
+        }
+
+        ASSERT(Region != NULL,L"alloc.c - Region != NULL");
+    }
+    RtlReleaseLock(&GlobalRegionLock);
 
     *RefHandle = NULL;
 }
@@ -49,12 +561,15 @@ Parameters:
 ///////////////////////////////////////////////////////////////////////////////////
 /////////////////////// LhAllocateMemory
 ///////////////////////////////////////////////////////////////////////////////////
-void* LhAllocateMemory(void* InEntryPoint)
+void* LhAllocateMemory(
+            void* InEntryPoint,
+            void** OutHotData)
 {
 /*
 Description:
 
-    Allocates one page of hook specific memory.
+    Allocates a zeroed code slot for LOCAL_HOOK_INFO, trampoline and relocated
+    entry point, as well as a zeroed hot data slot in a separate page.
 
 Parameters:
 
@@ -65,71 +580,127 @@ Parameters:
         a relative jumper can still be placed instead of having to consume much more entry
         point bytes for an absolute jump!
 
+    - OutHotData
+
+        Receives LOCAL_HOOK_HOT_DATA_SIZE bytes for the execution counter shards.
+
 Returns:
 
     NULL if no memory could be allocated, a valid pointer otherwise.
 
 */
+    PHOOK_MEMORY_REGION     Region;
+    UCHAR*                  Memory;
+    UCHAR*                  Res = NULL;
+    ULONG                   Index;
 
-    UCHAR*			    Res = NULL;
+    RtlAcquireLock(&GlobalRegionLock);
+    {
+        for(Region = GlobalRegionList; Region != NULL; Region = Region->Next)
+        {
+            if((Region->FreeHead < SlotCount) && LhIsRegionReachable(Region, InEntryPoint))
+                break;
+        }
 
-#if defined(_M_X64) && !defined(DRIVER)
-    LONGLONG            Base;
-    LONGLONG		    iStart;
-    LONGLONG		    iEnd;
-    LONGLONG            Index;
+        if(Region == NULL)
+        {
+            // create a new region
+            if((Region = (PHOOK_MEMORY_REGION)RtlAllocateMemory(FALSE, 
+                    sizeof(HOOK_MEMORY_REGION) + sizeof(ULONG) * SlotCount)) == NULL)
+                goto ERROR_ABORT;
 
-#endif
-	
-#if !defined(DRIVER)
-    SYSTEM_INFO		    SysInfo;
-    ULONG               PAGE_SIZE;
+            if((Memory = LhAllocateRegionMemory(InEntryPoint)) == NULL)
+            {
+                RtlFreeMemory(Region);
 
-    GetSystemInfo(&SysInfo);
+                goto ERROR_ABORT;
+            }
 
-    PAGE_SIZE = SysInfo.dwPageSize;
-#endif
+            Region->Code = Memory;
+            Region->HotData = Memory + CodeAreaSize;
+            Region->UsedCount = 0;
+            Region->FreeHead = 0;
 
+            for(Index = 0; Index < SlotCount; Index++)
+            {
+                Region->FreeList[Index] = Index + 1;
+            }
 
-    // reserve page with execution privileges
-#if defined(_M_X64) && !defined(DRIVER)
+            Region->Next = GlobalRegionList;
+            GlobalRegionList = Region;
 
-    /*
-        Reserve memory around entry point...
-    */
-    iStart = ((LONGLONG)InEntryPoint) - ((LONGLONG)0x7FFFFF00);
-    iEnd = ((LONGLONG)InEntryPoint) + ((LONGLONG)0x7FFFFF00);
+            RegionCount++;
+        }
 
-    if(iStart < (LONGLONG)SysInfo.lpMinimumApplicationAddress)
-        iStart = (LONGLONG)SysInfo.lpMinimumApplicationAddress; // shall not be null, because then VirtualAlloc() will not work as expected
+        // pop free slot
+        Index = Region->FreeHead;
+        Region->FreeHead = Region->FreeList[Index];
+        Region->UsedCount++;
 
-    if(iEnd > (LONGLONG)SysInfo.lpMaximumApplicationAddress)
-        iEnd = (LONGLONG)SysInfo.lpMaximumApplicationAddress;
+        HookCount++;
 
-    // we are trying to get memory as near as possible to relocate most RIP-relative addressings
-    for(Base = (LONGLONG)InEntryPoint, Index = 0; ; Index += PAGE_SIZE)
-    {
-		if(Base + Index < iEnd)
-		{
-			if((Res = (UCHAR*)VirtualAlloc((void*)(Base + Index), PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE)) != NULL)
-				break;
-		}
+        Res = Region->Code + Index * CodeSlotSize;
+        *OutHotData = Region->HotData + Index * LOCAL_HOOK_HOT_DATA_SIZE;
 
-        if(Base - Index > iStart)
-        {
-	        if((Res = (BYTE*)VirtualAlloc((void*)(Base - Index), PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE)) != NULL)
-		        break;
-        }
+        RtlZeroMemory(Res, CodeSlotSize);
+        RtlZeroMemory(*OutHotData, LOCAL_HOOK_HOT_DATA_SIZE);
     }
+ERROR_ABORT:
+    RtlReleaseLock(&GlobalRegionLock);
 
-    if(Res == NULL)
-	    return NULL;
-#else
-    // in 32-bit mode the trampoline will always be reachable
-    if((Res = (UCHAR*)RtlAllocateMemory(TRUE, PAGE_SIZE)) == NULL)
-        return NULL;
+    return Res;
+}
 
-#endif
 
-    return Res;
-}
\ No newline at end of file
+
+
+EASYHOOK_NT_EXPORT LhGetMemoryStatistics(
+            ULONG* OutHookCount,
+            ULONG* OutRegionCount,
+            ULONG* OutBytesPerHook)
+{
+/*
+Description:
+
+    Returns statistics about the memory used for hooks.
+
+Parameters:
+
+    - OutHookCount
+
+        Receives the count of allocated hooks, including those pending removal
+        and removed raw hooks, whose slots are never reused.
+
+    - OutRegionCount
+
+        Receives the count of regions, each of them 64 KB in size.
+
+    - OutBytesPerHook
+
+        Receives the bytes occupied by one hook, including its hot data.
+*/
+    NTSTATUS                NtStatus;
+
+    if(!IsValidPointer(OutHookCount, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid hook count storage.");
+
+    if(!IsValidPointer(OutRegionCount, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid region count storage.");
+
+    if(!IsValidPointer(OutBytesPerHook, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_3, L"Invalid byte count storage.");
+
+    RtlAcquireLock(&GlobalRegionLock);
+    {
+        *OutHookCount = HookCount;
+        *OutRegionCount = RegionCount;
+        *OutBytesPerHook = CodeSlotSize + LOCAL_HOOK_HOT_DATA_SIZE;
+    }
+    RtlReleaseLock(&GlobalRegionLock);
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
@@ -29,6 +29,8 @@ I am using a >>well known<< library to check for OS loader lock ;-)
 	#include "Aux_ulib.h"
 #endif
 
+#include <intrin.h>
+
 
 typedef struct _RUNTIME_INFO_
 {
@@ -38,36 +40,790 @@ typedef struct _RUNTIME_INFO_
 	DWORD           HLSIdent;
 	// the return address of the current thread's hook handler...
 	void*           RetAddress;
-    // the address of the return address of the current thread's hook handler...
+	// the address of the return address of the current thread's hook handler...
 	void**          AddrOfRetAddr;
+	// the execution counter shard incremented by the trampoline, released by LhBarrierOutro()...
+	LONG_PTR*		ExecutionShard;
+	// the hook slot this entry is keyed by; HLSIdent detects a recycled slot...
+	ULONG           HLSIndex;
+	// the ACL generation the cached interception decision is based on, zero if none...
+	LONG            AclGeneration;
+	BOOL            IsIntercepted;
+	// the handler entered before this one at the same patch site, see LhBarrierIntro()...
+	struct _RUNTIME_INFO_*	ChainPrev;
+	// only used for the patch site itself, the innermost handler being executed...
+	struct _RUNTIME_INFO_*	ChainTop;
+	// the statistics shard charged with the handler time, NULL if not measured...
+	LONGLONG*		CycleCounter;
+	ULONGLONG		EnterTime;
+	// the sampling policy the state below belongs to, see IsCallSampled()...
+	PHOOK_SAMPLING_POLICY	SamplingPolicy;
+	// countdown, random state or tokens, depending on the policy mode
+	ULONG			SampleState;
+	ULONG			SampleTime;
 }RUNTIME_INFO;
 
-typedef struct _THREAD_RUNTIME_INFO_
-{
-	RUNTIME_INFO*		Entries;
-	RUNTIME_INFO*		Current;
-	void*				Callback;
-	BOOL				IsProtected;
-}THREAD_RUNTIME_INFO, *LPTHREAD_RUNTIME_INFO;
+typedef struct _RUNTIME_INFO_BLOCK_* PRUNTIME_INFO_BLOCK;
+
+typedef struct _RUNTIME_INFO_BLOCK_
+{
+	PRUNTIME_INFO_BLOCK		Next;
+	RUNTIME_INFO			Entries[1];
+}RUNTIME_INFO_BLOCK;
+
+/*
+	Most threads only ever enter a few hooks, so the first entries and
+	the initial hash table are embedded into the thread's registry entry.
+	The table size must be a power of two.
+*/
+#define RUNTIME_INFO_INLINE_COUNT		4
+#define RUNTIME_INFO_INLINE_TABLE		8
+
+typedef struct _THREAD_RUNTIME_INFO_
+{
+	// open addressed by HLSIndex, NULL until the thread enters its first hook...
+	RUNTIME_INFO**		Table;
+	ULONG				TableMask;
+	ULONG				EntryCount;
+	RUNTIME_INFO*		LastHit;
+	// entries never move, because handlers keep pointers to them...
+	PRUNTIME_INFO_BLOCK	Blocks;
+	RUNTIME_INFO*		FreeEntries;
+	ULONG				FreeCount;
+	RUNTIME_INFO*		Current;
+	void*				Callback;
+	BOOL				IsProtected;
+	MODULE_HINT			ModuleHint;
+	RUNTIME_INFO*		InlineTable[RUNTIME_INFO_INLINE_TABLE];
+	RUNTIME_INFO		InlineEntries[RUNTIME_INFO_INLINE_COUNT];
+}THREAD_RUNTIME_INFO, *LPTHREAD_RUNTIME_INFO;
+
+typedef struct _THREAD_LOCAL_STORAGE_SEGMENT_* PTHREAD_LOCAL_STORAGE_SEGMENT;
+
+typedef struct _THREAD_LOCAL_STORAGE_SEGMENT_
+{
+	// segments are only appended and are not released before process detach...
+	volatile PTHREAD_LOCAL_STORAGE_SEGMENT	Next;
+    THREAD_RUNTIME_INFO		Entries[MAX_THREAD_COUNT];
+    DWORD					IdList[MAX_THREAD_COUNT];
+	// the registration sequence number of each entry, used to detect recycled entries
+	ULONG					Sequence[MAX_THREAD_COUNT];
+}THREAD_LOCAL_STORAGE_SEGMENT;
+
+typedef struct _THREAD_LOCAL_STORAGE_
+{
+	THREAD_LOCAL_STORAGE_SEGMENT	First;
+    RTL_SPIN_LOCK			ThreadSafe;
+	ULONG					SequenceCounter;
+	ULONG					ActiveCount;
+	ULONG					Capacity;
+	ULONG					ReclaimedCount;
+#ifndef DRIVER
+	// a Windows TLS index below TLS_MINIMUM_AVAILABLE or TLS_OUT_OF_INDEXES
+	DWORD					FastSlot;
+	volatile LONG			IsReclaiming;
+#endif
+}THREAD_LOCAL_STORAGE;
+
+typedef struct _BARRIER_UNIT_
+{
+	HOOK_ACL				GlobalACL;
+	// incremented whenever any ACL changes, never zero...
+	volatile LONG			AclGeneration;
+	BOOL					IsInitialized;
+	THREAD_LOCAL_STORAGE	TLS;
+}BARRIER_UNIT;
+
+
+static BARRIER_UNIT         Unit;
+
+HOOK_ACL* LhBarrierGetAcl(){ return &Unit.GlobalACL; }
+
+
+
+
+NTSTATUS LhBarrierSetAcl(
+            HOOK_ACL* InAcl,
+            BOOL InIsExclusive,
+            ULONG* InIdList,
+            ULONG InIdCount)
+{
+/*
+Description:
+
+    Publishes a new ACL snapshot. The IDs are sorted, so the barrier
+    can use a binary search. Readers never lock, so the replaced 
+    snapshot is kept until LhBarrierReleaseAcl() is called. Any cached
+    interception decision is invalidated.
+
+    No parameter validation, please refer to LhSetACL().
+
+Parameters:
+
+    - InAcl
+
+        The global ACL or any LOCAL_HOOK_INFO::LocalACL.
+
+    - InIsExclusive
+
+        TRUE if all listed IDs shall be excluded from interception,
+        FALSE otherwise
+
+    - InIdList
+
+        An array of thread IDs in user mode or process IDs in kernel mode.
+
+    - InIdCount
+
+        The count of entries listed in the ID list.
+*/
+	HOOK_ACL_ENTRIES*		Snapshot;
+	ULONG					Gap;
+	ULONG					Count;
+	ULONG					Value;
+	ULONG					i;
+	ULONG					j;
+
+	if(InIdCount > (MAXULONG - sizeof(HOOK_ACL_ENTRIES)) / sizeof(ULONG))
+		return STATUS_INVALID_PARAMETER;
+
+	if((Snapshot = (HOOK_ACL_ENTRIES*)RtlAllocateMemory(FALSE, sizeof(HOOK_ACL_ENTRIES) + InIdCount * sizeof(ULONG))) == NULL)
+		return STATUS_NO_MEMORY;
+
+	RtlCopyMemory(Snapshot->Entries, InIdList, InIdCount * sizeof(ULONG));
+
+	// shell sort, we can't rely on a CRT...
+	for(Gap = InIdCount / 2; Gap > 0; Gap /= 2)
+	{
+		for(i = Gap; i < InIdCount; i++)
+		{
+			Value = Snapshot->Entries[i];
+
+			for(j = i; (j >= Gap) && (Snapshot->Entries[j - Gap] > Value); j -= Gap)
+			{
+				Snapshot->Entries[j] = Snapshot->Entries[j - Gap];
+			}
+
+			Snapshot->Entries[j] = Value;
+		}
+	}
+
+	for(i = 0, Count = 0; i < InIdCount; i++)
+	{
+		if((Count == 0) || (Snapshot->Entries[Count - 1] != Snapshot->Entries[i]))
+			Snapshot->Entries[Count++] = Snapshot->Entries[i];
+	}
+
+	Snapshot->Count = Count;
+	Snapshot->IsExclusive = InIsExclusive;
+
+	Snapshot->Retired = (PHOOK_ACL_ENTRIES)InterlockedExchangePointer((PVOID volatile*)&InAcl->Current, Snapshot);
+
+	// the snapshot has to be visible before the generation changes...
+	if(InterlockedIncrement(&Unit.AclGeneration) == 0)
+		InterlockedIncrement(&Unit.AclGeneration);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+
+void LhBarrierReleaseAcl(HOOK_ACL* InAcl)
+{
+/*
+Description:
+
+    Releases the current and all retired snapshots of the given ACL.
+    The caller has to make sure that no thread is evaluating the ACL
+    anymore, which is the case for a hook being released or on 
+    process detach.
+*/
+	PHOOK_ACL_ENTRIES		Snapshot;
+	PHOOK_ACL_ENTRIES		Retired;
+
+	for(Snapshot = InAcl->Current; Snapshot != NULL; Snapshot = Retired)
+	{
+		Retired = Snapshot->Retired;
+
+		RtlFreeMemory(Snapshot);
+	}
+
+	InAcl->Current = NULL;
+}
+
+
+
+
+NTSTATUS LhBarrierSetCallerFilter(
+            PLOCAL_HOOK_INFO InHook,
+            BOOL InIsExclusive,
+            HOOK_CALLER_RANGE* InRanges,
+            ULONG InRangeCount)
+{
+/*
+Description:
+
+    Publishes a new caller filter snapshot for the given hook. The ranges
+    are sorted and merged, so the barrier can use a binary search. Just like
+    ACLs, the replaced snapshot is kept until the hook is released.
+
+    No parameter validation, please refer to LhSetCallerFilter().
+
+Parameters:
+
+    - InIsExclusive
+
+        TRUE if calls from the given ranges shall not be intercepted,
+        FALSE if only those shall be intercepted.
+
+    - InRanges
+
+        The address ranges, usually module images. The array is sorted
+        in place.
+*/
+	HOOK_CALLER_FILTER*		Snapshot;
+	HOOK_CALLER_RANGE		Value;
+	ULONG					Gap;
+	ULONG					Count;
+	ULONG					i;
+	ULONG					j;
+
+	if(InRangeCount > (MAXULONG - sizeof(HOOK_CALLER_FILTER)) / sizeof(HOOK_CALLER_RANGE))
+		return STATUS_INVALID_PARAMETER;
+
+	if((Snapshot = (HOOK_CALLER_FILTER*)RtlAllocateMemory(FALSE, sizeof(HOOK_CALLER_FILTER) + InRangeCount * sizeof(HOOK_CALLER_RANGE))) == NULL)
+		return STATUS_NO_MEMORY;
+
+	// shell sort, we can't rely on a CRT...
+	for(Gap = InRangeCount / 2; Gap > 0; Gap /= 2)
+	{
+		for(i = Gap; i < InRangeCount; i++)
+		{
+			Value = InRanges[i];
+
+			for(j = i; (j >= Gap) && (InRanges[j - Gap].Start > Value.Start); j -= Gap)
+			{
+				InRanges[j] = InRanges[j - Gap];
+			}
+
+			InRanges[j] = Value;
+		}
+	}
+
+	for(i = 0, Count = 0; i < InRangeCount; i++)
+	{
+		if((Count > 0) && (InRanges[i].Start <= Snapshot->Ranges[Count - 1].End))
+		{
+			if(InRanges[i].End > Snapshot->Ranges[Count - 1].End)
+				Snapshot->Ranges[Count - 1].End = InRanges[i].End;
+		}
+		else
+			Snapshot->Ranges[Count++] = InRanges[i];
+	}
+
+	Snapshot->Count = Count;
+	Snapshot->IsExclusive = InIsExclusive;
+
+	Snapshot->Retired = (PHOOK_CALLER_FILTER)InterlockedExchangePointer((PVOID volatile*)&InHook->CallerFilter, Snapshot);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+
+void LhBarrierReleaseCallerFilter(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Releases the current and all retired caller filters of the given
+    hook. The hook must not be executed anymore.
+*/
+	PHOOK_CALLER_FILTER		Snapshot;
+	PHOOK_CALLER_FILTER		Retired;
+
+	for(Snapshot = InHook->CallerFilter; Snapshot != NULL; Snapshot = Retired)
+	{
+		Retired = Snapshot->Retired;
+
+		RtlFreeMemory(Snapshot);
+	}
+
+	InHook->CallerFilter = NULL;
+}
+
+
+
+
+static void AddStatistic(
+			LONGLONG* RefCounter,
+			LONGLONG InValue)
+{
+/*
+Description:
+
+    Atomically adds the given value to a statistics counter. Shards are
+    selected by stack address, so threads rarely contend for a counter.
+*/
+#ifdef _M_X64
+	_InterlockedExchangeAdd64(RefCounter, InValue);
+#else
+	LONGLONG				Value;
+
+	do
+	{
+		Value = *RefCounter;
+	}
+	while(_InterlockedCompareExchange64(RefCounter, Value + InValue, Value) != Value);
+#endif
+}
+
+
+
+
+static LONGLONG ReadStatistic(LONGLONG* InCounter)
+{
+/*
+Description:
+
+    Reads a statistics counter without tearing on 32-bit targets.
+*/
+#ifdef _M_X64
+	return *(volatile LONGLONG*)InCounter;
+#else
+	return _InterlockedCompareExchange64(InCounter, 0, 0);
+#endif
+}
+
+
+
+
+/*
+    Charges a call to the given counter of the given hook. Disabled statistics
+    only cost a single compare...
+*/
+#define CountCall(InHook, InAddrOfRetAddr, Counter) \
+	{ if((InHook)->StatisticsFlags != 0) AddStatistic(&LhGetStatisticsShard(InHook, InAddrOfRetAddr)->Counter, 1); }
+
+
+
+
+void LhBarrierReleaseStatistics(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Releases the statistics shards of the given hook. The hook must not
+    be executed anymore.
+*/
+	if(InHook->StatisticsBuffer != NULL)
+		RtlFreeMemory(InHook->StatisticsBuffer);
+
+	InHook->StatisticsFlags = 0;
+	InHook->Statistics = NULL;
+	InHook->StatisticsBuffer = NULL;
+}
+
+
+
+
+void LhBarrierReleaseSamplingPolicy(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Releases the current and all retired sampling policies of the given
+    hook. The hook must not be executed anymore.
+*/
+	PHOOK_SAMPLING_POLICY	Policy;
+	PHOOK_SAMPLING_POLICY	Retired;
+
+	for(Policy = InHook->SamplingPolicy; Policy != NULL; Policy = Retired)
+	{
+		Retired = Policy->Retired;
+
+		RtlFreeMemory(Policy);
+	}
+
+	InHook->SamplingPolicy = NULL;
+}
+
+
+
+
+void RuntimeInfoRelease(THREAD_RUNTIME_INFO* InInfo)
+{
+/*
+Description:
+
+    Releases all hook runtime entries of the given thread. The
+    entry itself has to be zeroed or unregistered by the caller.
+*/
+	PRUNTIME_INFO_BLOCK		Block;
+	PRUNTIME_INFO_BLOCK		Next;
+
+	for(Block = InInfo->Blocks; Block != NULL; Block = Next)
+	{
+		Next = Block->Next;
+
+		RtlFreeMemory(Block);
+	}
+
+	if((InInfo->Table != NULL) && (InInfo->Table != InInfo->InlineTable))
+		RtlFreeMemory(InInfo->Table);
+
+	InInfo->Blocks = NULL;
+	InInfo->Table = NULL;
+	InInfo->LastHit = NULL;
+}
+
+
+
+
+RUNTIME_INFO* RuntimeInfoLookup(
+			THREAD_RUNTIME_INFO* InInfo,
+			ULONG InHLSIndex)
+{
+/*
+Description:
+
+    Queries the hook runtime entry of the calling thread for the given 
+    hook slot and creates it if necessary. New entries are zeroed, so
+    the HLSIdent check of the caller will reset them...
+
+    The table is linear probed and never shrinks. Entries are never
+    removed, because a thread can only touch as many entries as there 
+    are hook slots and recycled slots are detected with HLSIdent.
+
+Parameters:
+
+    - InInfo
+
+        The caller's private storage entry.
+
+    - InHLSIndex
+
+        The slot of the hook being entered.
+
+Returns:
+
+    NULL if we are out of memory.
+*/
+	RUNTIME_INFO*			Runtime = InInfo->LastHit;
+	RUNTIME_INFO**			Table;
+	PRUNTIME_INFO_BLOCK		Block;
+	ULONG					Count;
+	ULONG					Index;
+	ULONG					i;
+
+	if((Runtime != NULL) && (Runtime->HLSIndex == InHLSIndex))
+		return Runtime;
+
+	if(InInfo->Table == NULL)
+	{
+		InInfo->Table = InInfo->InlineTable;
+		InInfo->TableMask = RUNTIME_INFO_INLINE_TABLE - 1;
+		InInfo->FreeEntries = InInfo->InlineEntries;
+		InInfo->FreeCount = RUNTIME_INFO_INLINE_COUNT;
+	}
+
+	for(Index = InHLSIndex & InInfo->TableMask; InInfo->Table[Index] != NULL; Index = (Index + 1) & InInfo->TableMask)
+	{
+		Runtime = InInfo->Table[Index];
+
+		if(Runtime->HLSIndex == InHLSIndex)
+		{
+			InInfo->LastHit = Runtime;
+
+			return Runtime;
+		}
+	}
+
+	// keep the load factor below 3/4...
+	if((InInfo->EntryCount + 1) * 4 > (InInfo->TableMask + 1) * 3)
+	{
+		Count = (InInfo->TableMask + 1) * 2;
+
+		if((Table = (RUNTIME_INFO**)RtlAllocateMemory(TRUE, Count * sizeof(RUNTIME_INFO*))) == NULL)
+			return NULL;
+
+		for(i = 0; i <= InInfo->TableMask; i++)
+		{
+			if((Runtime = InInfo->Table[i]) == NULL)
+				continue;
+
+			for(Index = Runtime->HLSIndex & (Count - 1); Table[Index] != NULL; Index = (Index + 1) & (Count - 1)) {}
+
+			Table[Index] = Runtime;
+		}
+
+		if(InInfo->Table != InInfo->InlineTable)
+			RtlFreeMemory(InInfo->Table);
+
+		InInfo->Table = Table;
+		InInfo->TableMask = Count - 1;
+
+		for(Index = InHLSIndex & InInfo->TableMask; InInfo->Table[Index] != NULL; Index = (Index + 1) & InInfo->TableMask) {}
+	}
+
+	if(InInfo->FreeCount == 0)
+	{
+		// double the entry count with each block...
+		Count = InInfo->EntryCount;
+
+		if((Block = (PRUNTIME_INFO_BLOCK)RtlAllocateMemory(TRUE, sizeof(RUNTIME_INFO_BLOCK) + (Count - 1) * sizeof(RUNTIME_INFO))) == NULL)
+			return NULL;
+
+		Block->Next = InInfo->Blocks;
+		InInfo->Blocks = Block;
+		InInfo->FreeEntries = Block->Entries;
+		InInfo->FreeCount = Count;
+	}
+
+	Runtime = InInfo->FreeEntries++;
+	InInfo->FreeCount--;
+
+	Runtime->HLSIndex = InHLSIndex;
+
+	InInfo->Table[Index] = Runtime;
+	InInfo->EntryCount++;
+	InInfo->LastHit = Runtime;
+
+	return Runtime;
+}
+
+
+
+BOOL TlsRegisterCurrentThread(
+			THREAD_LOCAL_STORAGE* InTls,
+			THREAD_LOCAL_STORAGE_SEGMENT** InOutNewSegment)
+{
+/*
+Description:
+
+    Assigns a free storage entry to the calling thread. 
+
+Parameters:
+
+    - InTls
+
+        The storage where the caller should be registered.
+
+    - InOutNewSegment
+
+        An optional pointer to a zeroed segment that is appended to the
+        storage if there is no free entry left. Is set to NULL if the
+        segment has been linked, otherwise the caller has to release it.
+
+Returns:
+
+    TRUE if the caller is now registered, FALSE if the storage is full.
+*/
+#ifndef DRIVER
+	ULONG		                    CurrentId = (ULONG)GetCurrentThreadId();
+#else
+	ULONG		                    CurrentId = (ULONG)PsGetCurrentThreadId();
+#endif
+	THREAD_LOCAL_STORAGE_SEGMENT*	Segment;
+	THREAD_LOCAL_STORAGE_SEGMENT*	FreeSegment = NULL;
+	THREAD_LOCAL_STORAGE_SEGMENT*	Last = NULL;
+	LONG		                    Index = -1;
+    LONG		                    i;
+
+    RtlAcquireLock(&InTls->ThreadSafe);
+
+    // select Index AND check whether thread is already registered.
+	for(Segment = &InTls->First; Segment != NULL; Segment = Segment->Next)
+	{
+		for(i = 0; i < MAX_THREAD_COUNT; i++)
+		{
+			if((Segment->IdList[i] == 0) && (Index == -1))
+			{
+				Index = i;
+				FreeSegment = Segment;
+			}
+
+			if(Segment->IdList[i] != CurrentId)
+				continue;
+
+#ifndef DRIVER
+			if((InTls->FastSlot != TLS_OUT_OF_INDEXES) &&
+				(((PTEB)NtCurrentTeb())->TlsSlots[InTls->FastSlot] != &Segment->Entries[i]))
+			{
+				/*
+					Our fast slot does not point to this entry, so it was left behind by a terminated
+					thread that had the same ID and never ran LhBarrierThreadDetach()...
+				*/
+				RuntimeInfoRelease(&Segment->Entries[i]);
+
+				Segment->IdList[i] = 0;
+				RtlZeroMemory(&Segment->Entries[i], sizeof(THREAD_RUNTIME_INFO));
+
+				InTls->ActiveCount--;
+				InTls->ReclaimedCount++;
+
+				if(Index == -1)
+				{
+					Index = i;
+					FreeSegment = Segment;
+				}
+
+				continue;
+			}
+#endif
+
+			/*
+				We got registered by a nested interception while
+				reclaiming entries. Nothing left to do...
+			*/
+			RtlReleaseLock(&InTls->ThreadSafe);
+
+			return TRUE;
+		}
+
+		Last = Segment;
+	}
+
+	if(Index == -1)
+	{
+		if((InOutNewSegment == NULL) || (*InOutNewSegment == NULL))
+		{
+			RtlReleaseLock(&InTls->ThreadSafe);
+
+			return FALSE;
+		}
+
+		FreeSegment = *InOutNewSegment;
+		FreeSegment->Next = NULL;
+
+		*InOutNewSegment = NULL;
+
+		// readers are walking the segment list without any lock...
+		InterlockedExchangePointer((PVOID volatile*)&Last->Next, FreeSegment);
+
+		InTls->Capacity += MAX_THREAD_COUNT;
+
+		Index = 0;
+	}
+
+	FreeSegment->IdList[Index] = CurrentId;
+	FreeSegment->Sequence[Index] = ++InTls->SequenceCounter;
+	RtlZeroMemory(&FreeSegment->Entries[Index], sizeof(THREAD_RUNTIME_INFO));
+
+	InTls->ActiveCount++;
+
+#ifndef DRIVER
+	if(InTls->FastSlot != TLS_OUT_OF_INDEXES)
+		((PTEB)NtCurrentTeb())->TlsSlots[InTls->FastSlot] = &FreeSegment->Entries[Index];
+#endif
+	
+	RtlReleaseLock(&InTls->ThreadSafe);
+
+	return TRUE;
+}
+
+
+
+
+#ifndef DRIVER
+BOOL TlsIsThreadTerminated(ULONG InThreadId)
+{
+/*
+Description:
+
+    Checks whether the given thread has terminated. Only a thread that
+    is known to be gone is reported, so a failing OpenThread() for any
+    other reason than an invalid ID keeps the entry alive.
+*/
+	HANDLE			hThread;
+	BOOL			Result;
+
+	if((hThread = OpenThread(SYNCHRONIZE, FALSE, InThreadId)) == NULL)
+		return (GetLastError() == ERROR_INVALID_PARAMETER);
+
+	Result = (WaitForSingleObject(hThread, 0) == WAIT_OBJECT_0);
+
+	CloseHandle(hThread);
 
-typedef struct _THREAD_LOCAL_STORAGE_
-{
-    THREAD_RUNTIME_INFO		Entries[MAX_THREAD_COUNT];
-    DWORD					IdList[MAX_THREAD_COUNT];
-    RTL_SPIN_LOCK			ThreadSafe;
-}THREAD_LOCAL_STORAGE;
+	return Result;
+}
 
-typedef struct _BARRIER_UNIT_
+
+
+
+void TlsReclaimTerminatedThreads(THREAD_LOCAL_STORAGE* InTls)
 {
-	HOOK_ACL				GlobalACL;
-	BOOL					IsInitialized;
-	THREAD_LOCAL_STORAGE	TLS;
-}BARRIER_UNIT;
+/*
+Description:
 
+    Releases all entries whose threads have terminated without 
+    running LhBarrierThreadDetach(), for example because they were
+    killed with TerminateThread() or because the host disabled
+    thread library calls.
 
-static BARRIER_UNIT         Unit;
+    We can't query thread states while holding the lock, because
+    the related APIs might be hooked themselves. Nested calls will
+    just grow the storage instead of reclaiming.
+
+Parameters:
+
+    - InTls
+
+        The storage to clean up.
+*/
+	ULONG		                    CurrentId = (ULONG)GetCurrentThreadId();
+	DWORD							LastError;
+	THREAD_LOCAL_STORAGE_SEGMENT*	Segment;
+	ULONG							ThreadId;
+	ULONG							Sequence;
+    LONG		                    i;
+
+	if(InterlockedCompareExchange(&InTls->IsReclaiming, TRUE, FALSE) != FALSE)
+		return;
+
+	// the intercepted thread shall not notice anything...
+	LastError = GetLastError();
+
+	for(Segment = &InTls->First; Segment != NULL; Segment = Segment->Next)
+	{
+		for(i = 0; i < MAX_THREAD_COUNT; i++)
+		{
+			RtlAcquireLock(&InTls->ThreadSafe);
+			{
+				ThreadId = Segment->IdList[i];
+				Sequence = Segment->Sequence[i];
+			}
+			RtlReleaseLock(&InTls->ThreadSafe);
+
+			if((ThreadId == 0) || (ThreadId == CurrentId) || !TlsIsThreadTerminated(ThreadId))
+				continue;
+
+			RtlAcquireLock(&InTls->ThreadSafe);
+			{
+				// the entry might have been recycled in the meantime...
+				if((Segment->IdList[i] == ThreadId) && (Segment->Sequence[i] == Sequence))
+				{
+					RuntimeInfoRelease(&Segment->Entries[i]);
+
+					Segment->IdList[i] = 0;
+					RtlZeroMemory(&Segment->Entries[i], sizeof(THREAD_RUNTIME_INFO));
+
+					InTls->ActiveCount--;
+					InTls->ReclaimedCount++;
+				}
+			}
+			RtlReleaseLock(&InTls->ThreadSafe);
+		}
+	}
+
+	SetLastError(LastError);
+
+	InterlockedExchange(&InTls->IsReclaiming, FALSE);
+}
+#endif
 
-HOOK_ACL* LhBarrierGetAcl(){ return &Unit.GlobalACL; }
 
 
 
@@ -81,14 +837,17 @@ Description:
     its private entry.
 
     This is a replacement for the Windows Thread Local Storage which seems
-    to cause trouble when using it in Explorer.EXE for example.
+    to cause trouble when using it in Explorer.EXE for example. In user mode
+    we still publish the entry through a TEB TLS slot if one is available,
+    so that TlsGetCurrentValue() does not have to scan the ID list.
 
-    No parameter validation (for performance reasons).
+    The storage grows by one segment of MAX_THREAD_COUNT entries whenever
+    it is full and no terminated thread can be reclaimed.
 
-    This method will raise an assertion if the thread was already added
-    to the storage!
+    No parameter validation (for performance reasons).
 
 Parameters:
+
     - InTls
 
         The thread local storage to allocate from.
@@ -97,38 +856,30 @@ Returns:
 
     TRUE on success, FALSE otherwise.
 */
-#ifndef DRIVER
-	ULONG		CurrentId = (ULONG)GetCurrentThreadId();
-#else
-	ULONG		CurrentId = (ULONG)PsGetCurrentThreadId();
-#endif
-	LONG		Index = -1;
-    LONG		i;
+	THREAD_LOCAL_STORAGE_SEGMENT*	NewSegment;
+	BOOL							Result;
 
-    RtlAcquireLock(&InTls->ThreadSafe);
+	if(TlsRegisterCurrentThread(InTls, NULL))
+		return TRUE;
 
-    // select Index AND check whether thread is already registered.
-	for(i = 0; i < MAX_THREAD_COUNT; i++)
-	{
-		if((InTls->IdList[i] == 0) && (Index == -1))
-			Index = i;
-		
-		ASSERT(InTls->IdList[i] != CurrentId,L"barrier.c - InTls->IdList[i] != CurrentId");
-	}
+#ifndef DRIVER
+	TlsReclaimTerminatedThreads(InTls);
 
-	if(Index == -1)
-	{
-		RtlReleaseLock(&InTls->ThreadSafe);
+	if(TlsRegisterCurrentThread(InTls, NULL))
+		return TRUE;
+#endif
 
+	// the kernel spin lock does not allow us to allocate within the lock...
+	if((NewSegment = (THREAD_LOCAL_STORAGE_SEGMENT*)RtlAllocateMemory(TRUE, sizeof(THREAD_LOCAL_STORAGE_SEGMENT))) == NULL)
 		return FALSE;
-	}
 
-	InTls->IdList[Index] = CurrentId;
-	RtlZeroMemory(&InTls->Entries[Index], sizeof(THREAD_RUNTIME_INFO));
-	
-	RtlReleaseLock(&InTls->ThreadSafe);
+	Result = TlsRegisterCurrentThread(InTls, &NewSegment);
 
-	return TRUE;
+	// another thread might have made room in the meantime...
+	if(NewSegment != NULL)
+		RtlFreeMemory(NewSegment);
+
+	return Result;
 }
 
 
@@ -162,19 +913,38 @@ Returns:
     FALSE if the caller was not registered in the storage, TRUE otherwise.
 */
 #ifndef DRIVER
-	ULONG		CurrentId = (ULONG)GetCurrentThreadId();
+	ULONG		                    CurrentId;
 #else
-	ULONG		CurrentId = (ULONG)PsGetCurrentThreadId();
+	ULONG		                    CurrentId = (ULONG)PsGetCurrentThreadId();
+#endif
+	THREAD_LOCAL_STORAGE_SEGMENT*	Segment;
+    LONG                            Index;
+
+#ifndef DRIVER
+	if(InTls->FastSlot != TLS_OUT_OF_INDEXES)
+	{
+		/*
+			This is a single FS/GS relative load. We are reading the TEB directly, because 
+			TlsGetValue() would reset the last error of the intercepted thread...
+		*/
+		*OutValue = (THREAD_RUNTIME_INFO*)((PTEB)NtCurrentTeb())->TlsSlots[InTls->FastSlot];
+
+		return (*OutValue != NULL);
+	}
+
+	CurrentId = (ULONG)GetCurrentThreadId();
 #endif
-    LONG        Index;
 
-	for(Index = 0; Index < MAX_THREAD_COUNT; Index++)
+	for(Segment = &InTls->First; Segment != NULL; Segment = Segment->Next)
 	{
-		if(InTls->IdList[Index] == CurrentId)
+		for(Index = 0; Index < MAX_THREAD_COUNT; Index++)
 		{
-			*OutValue = &InTls->Entries[Index];
+			if(Segment->IdList[Index] == CurrentId)
+			{
+				*OutValue = &Segment->Entries[Index];
 
-			return TRUE;
+				return TRUE;
+			}
 		}
 	}
 
@@ -200,24 +970,35 @@ Parameters:
         The storage from which the caller should be removed.
 */
 #ifndef DRIVER
-	ULONG		    CurrentId = (ULONG)GetCurrentThreadId();
+	ULONG		                    CurrentId = (ULONG)GetCurrentThreadId();
 #else
-	ULONG		    CurrentId = (ULONG)PsGetCurrentThreadId();
+	ULONG		                    CurrentId = (ULONG)PsGetCurrentThreadId();
 #endif
-    ULONG           Index;
+	THREAD_LOCAL_STORAGE_SEGMENT*	Segment;
+    ULONG                           Index;
 
     RtlAcquireLock(&InTls->ThreadSafe);
 
-	for(Index = 0; Index < MAX_THREAD_COUNT; Index++)
+	for(Segment = &InTls->First; Segment != NULL; Segment = Segment->Next)
 	{
-		if(InTls->IdList[Index] == CurrentId)
+		for(Index = 0; Index < MAX_THREAD_COUNT; Index++)
 		{
-			InTls->IdList[Index] = 0;
+			if(Segment->IdList[Index] == CurrentId)
+			{
+				Segment->IdList[Index] = 0;
 
-			RtlZeroMemory(&InTls->Entries[Index], sizeof(THREAD_RUNTIME_INFO));
+				RtlZeroMemory(&Segment->Entries[Index], sizeof(THREAD_RUNTIME_INFO));
+
+				InTls->ActiveCount--;
+			}
 		}
 	}
 
+#ifndef DRIVER
+	if(InTls->FastSlot != TLS_OUT_OF_INDEXES)
+		((PTEB)NtCurrentTeb())->TlsSlots[InTls->FastSlot] = NULL;
+#endif
+
 	RtlReleaseLock(&InTls->ThreadSafe);
 }
 
@@ -304,7 +1085,7 @@ Description:
 
 
 BOOL ACLContains(
-	HOOK_ACL* InACL,
+	HOOK_ACL_ENTRIES* InACL,
 	ULONG InCheckID)
 {
 /*
@@ -312,12 +1093,24 @@ Returns:
 
     TRUE if the given ACL contains the given ID, FALSE otherwise.
 */
+    ULONG           Lower = 0;
+    ULONG           Upper;
     ULONG           Index;
 
-	for(Index = 0; Index < InACL->Count; Index++)
+	if(InACL == NULL)
+		return FALSE;
+
+	for(Upper = InACL->Count; Lower < Upper; )
 	{
+		Index = Lower + (Upper - Lower) / 2;
+
 		if(InACL->Entries[Index] == InCheckID)
 			return TRUE;
+
+		if(InACL->Entries[Index] < InCheckID)
+			Lower = Index + 1;
+		else
+			Upper = Index;
 	}
 
 	return FALSE;
@@ -347,6 +1140,10 @@ Returns:
     FALSE otherwise.
 */
 	ULONG				CheckID;
+	HOOK_ACL_ENTRIES*	GlobalACL = Unit.GlobalACL.Current;
+	HOOK_ACL_ENTRIES*	LocalEntries = LocalACL->Current;
+	BOOL				IsGlobalExclusive = (GlobalACL != NULL) && GlobalACL->IsExclusive;
+	BOOL				IsLocalExclusive = (LocalEntries != NULL) && LocalEntries->IsExclusive;
 
 #ifndef DRIVER
 	if(InThreadID == 0)
@@ -360,35 +1157,35 @@ Returns:
 		CheckID = InProcessID;
 #endif
 
-	if(ACLContains(&Unit.GlobalACL, CheckID))
+	if(ACLContains(GlobalACL, CheckID))
 	{
-		if(ACLContains(LocalACL, CheckID))
+		if(ACLContains(LocalEntries, CheckID))
 		{
-			if(LocalACL->IsExclusive)
+			if(IsLocalExclusive)
 				return FALSE;
 		}
 		else
 		{
-			if(!LocalACL->IsExclusive)
+			if(!IsLocalExclusive)
 				return FALSE;
 		}
 
-		return !Unit.GlobalACL.IsExclusive;
+		return !IsGlobalExclusive;
 	}
 	else
 	{
-		if(ACLContains(LocalACL, CheckID))
+		if(ACLContains(LocalEntries, CheckID))
 		{
-			if(LocalACL->IsExclusive)
+			if(IsLocalExclusive)
 				return FALSE;
 		}
 		else
 		{
-			if(!LocalACL->IsExclusive)
+			if(!IsLocalExclusive)
 				return FALSE;
 		}
 
-		return Unit.GlobalACL.IsExclusive;
+		return IsGlobalExclusive;
 	}
 }
 
@@ -552,66 +1349,360 @@ FINALLY_OUTRO:
 
 
 
-EASYHOOK_NT_EXPORT LhBarrierBeginStackTrace(PVOID* OutBackup)
+EASYHOOK_NT_EXPORT LhBarrierBeginStackTrace(PVOID* OutBackup)
+{
+/*
+Description:
+
+    Is expected to be called inside a hook handler. Otherwise it
+    will fail with STATUS_NOT_SUPPORTED. 
+    Temporarily restores the call stack to allow stack traces.
+
+    You have to pass the stored backup pointer to 
+    LhBarrierEndStackTrace() BEFORE leaving the handler, otherwise
+    the application will be left in an unstable state!
+*/
+    NTSTATUS                    NtStatus;
+    LPTHREAD_RUNTIME_INFO       Runtime;
+
+    if(OutBackup == NULL)
+        THROW(STATUS_INVALID_PARAMETER, L"The given backup storage is invalid.");
+
+	if(!TlsGetCurrentValue(&Unit.TLS, &Runtime))
+        THROW(STATUS_NOT_SUPPORTED, L"The caller is not inside a hook handler.");
+
+	if(Runtime->Current == NULL)
+		THROW(STATUS_NOT_SUPPORTED, L"The caller is not inside a hook handler.");
+
+    *OutBackup = *Runtime->Current->AddrOfRetAddr;
+    *Runtime->Current->AddrOfRetAddr = Runtime->Current->RetAddress;
+
+    RETURN;
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+
+
+EASYHOOK_NT_EXPORT LhBarrierEndStackTrace(PVOID InBackup)
+{
+/*
+Description:
+
+    Is expected to be called inside a hook handler. Otherwise it
+    will fail with STATUS_NOT_SUPPORTED. 
+
+    You have to pass the backup pointer obtained with
+    LhBarrierBeginStackTrace().
+*/
+    NTSTATUS            NtStatus;
+    PVOID*              AddrOfRetAddr;
+
+    if(!IsValidPointer(InBackup, 1))
+        THROW(STATUS_INVALID_PARAMETER, L"The given stack backup pointer is invalid.");
+
+    FORCE(LhBarrierGetAddressOfReturnAddress(&AddrOfRetAddr));
+
+    *AddrOfRetAddr = InBackup;
+
+    RETURN;
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+
+
+EASYHOOK_NT_EXPORT LhBarrierGetThreadStatistics(
+            ULONG* OutActiveCount,
+            ULONG* OutCapacity,
+            ULONG* OutReclaimedCount)
+{
+/*
+Description:
+
+    Reports the occupancy of the barrier's thread registry. The registry
+    grows on demand, so the capacity is only limited by memory.
+
+Parameters:
+
+    - OutActiveCount
+
+        Receives the count of threads currently registered.
+
+    - OutCapacity
+
+        Receives the count of entries currently allocated.
+
+    - OutReclaimedCount
+
+        Receives the count of entries that have been released on behalf 
+        of threads which terminated without a regular thread detach.
+*/
+    NTSTATUS            NtStatus;
+
+    if(!IsValidPointer(OutActiveCount, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid active count storage specified.");
+
+    if(!IsValidPointer(OutCapacity, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid capacity storage specified.");
+
+    if(!IsValidPointer(OutReclaimedCount, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_3, L"Invalid reclaimed count storage specified.");
+
+    RtlAcquireLock(&Unit.TLS.ThreadSafe);
+    {
+        *OutActiveCount = Unit.TLS.ActiveCount;
+        *OutCapacity = Unit.TLS.Capacity;
+        *OutReclaimedCount = Unit.TLS.ReclaimedCount;
+    }
+    RtlReleaseLock(&Unit.TLS.ThreadSafe);
+
+    RETURN;
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+
+
+EASYHOOK_NT_EXPORT LhSetHookStatistics(
+            TRACED_HOOK_HANDLE InHandle,
+            ULONG InFlags)
+{
+/*
+Description:
+
+    Enables or disables the call statistics of the given hook. While 
+    enabled, the barrier counts every call it declines by reason and every
+    call passed to the handler. Counters are kept in cache line sized shards
+    selected like the execution counter shards and are only summed up by
+    LhQueryHookStatistics(). 
+    
+    Disabling the statistics keeps all counters, so they are cumulative 
+    for the lifetime of the hook.
+
+Parameters:
+
+    - InHandle
+
+        The hook handle whose statistics shall be changed. Raw hooks are
+        not supported.
+
+    - InFlags
+
+        EASYHOOK_STATISTICS_COUNTERS to count calls, optionally combined 
+        with EASYHOOK_STATISTICS_CYCLES to also accumulate the time spent
+        in the handler, measured in processor time stamp counter ticks.
+        Zero disables the statistics.
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    NTSTATUS                NtStatus;
+	void*					Buffer = NULL;
+
+    if(!LhIsValidHandle(InHandle, &Hook))
+        THROW(STATUS_INVALID_PARAMETER_1, L"The given hook handle is invalid or already disposed.");
+
+	if(Hook->IsRaw)
+		THROW(STATUS_NOT_SUPPORTED, L"Raw hooks don't support statistics.");
+
+	if((InFlags & ~(EASYHOOK_STATISTICS_COUNTERS | EASYHOOK_STATISTICS_CYCLES)) != 0)
+		THROW(STATUS_INVALID_PARAMETER_2, L"Unknown statistics flags specified.");
+
+	if((InFlags != 0) && !(InFlags & EASYHOOK_STATISTICS_COUNTERS))
+		THROW(STATUS_INVALID_PARAMETER_2, L"Cycle counting requires EASYHOOK_STATISTICS_COUNTERS.");
+
+	if((InFlags != 0) && (Hook->Statistics == NULL))
+	{
+		// the shards are aligned to a cache line, just like the execution counter...
+		if((Buffer = RtlAllocateMemory(TRUE, LOCAL_HOOK_SHARD_COUNT * sizeof(LOCAL_HOOK_STATISTICS) + LOCAL_HOOK_SHARD_SIZE)) == NULL)
+			THROW(STATUS_NO_MEMORY, L"Unable to allocate memory.");
+
+		RtlAcquireLock(&GlobalHookLock);
+		{
+			if(Hook->Statistics == NULL)
+			{
+				Hook->StatisticsBuffer = Buffer;
+				Hook->Statistics = (LOCAL_HOOK_STATISTICS*)(((ULONG_PTR)Buffer + LOCAL_HOOK_SHARD_SIZE - 1) & ~(ULONG_PTR)(LOCAL_HOOK_SHARD_SIZE - 1));
+
+				Buffer = NULL;
+			}
+		}
+		RtlReleaseLock(&GlobalHookLock);
+	}
+
+	// the shards have to be visible before the barrier starts counting...
+	InterlockedExchange(&Hook->StatisticsFlags, (LONG)InFlags);
+
+    RETURN;
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+	{
+		if(Buffer != NULL)
+			RtlFreeMemory(Buffer);
+
+		return NtStatus;
+	}
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhQueryHookStatistics(
+            TRACED_HOOK_HANDLE InHandle,
+            HOOK_STATISTICS* OutStatistics)
+{
+/*
+Description:
+
+    Sums up the call statistics of the given hook, see LhSetHookStatistics().
+    Shards are read without synchronization, so a result taken while the
+    hook is called is not an exact snapshot. Hooks whose statistics were
+    never enabled report zero for all counters.
+
+Parameters:
+
+    - InHandle
+
+        The hook handle whose statistics shall be queried.
+
+    - OutStatistics
+
+        Receives the statistics. "Calls" is the sum of all other counters
+        except "HandlerCycles".
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    NTSTATUS                NtStatus;
+	LOCAL_HOOK_STATISTICS*	Statistics;
+	ULONG					Index;
+
+    if(!LhIsValidHandle(InHandle, &Hook))
+        THROW(STATUS_INVALID_PARAMETER_1, L"The given hook handle is invalid or already disposed.");
+
+    if(!IsValidPointer(OutStatistics, sizeof(HOOK_STATISTICS)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid statistics storage specified.");
+
+	RtlZeroMemory(OutStatistics, sizeof(HOOK_STATISTICS));
+
+	if((Statistics = Hook->Statistics) != NULL)
+	{
+		for(Index = 0; Index < LOCAL_HOOK_SHARD_COUNT; Index++)
+		{
+			OutStatistics->Handled += ReadStatistic(&Statistics[Index].Handled);
+			OutStatistics->Recursion += ReadStatistic(&Statistics[Index].Recursion);
+			OutStatistics->AclDenied += ReadStatistic(&Statistics[Index].AclDenied);
+			OutStatistics->CallerFiltered += ReadStatistic(&Statistics[Index].CallerFiltered);
+			OutStatistics->Unsampled += ReadStatistic(&Statistics[Index].Unsampled);
+			OutStatistics->LoaderLock += ReadStatistic(&Statistics[Index].LoaderLock);
+			OutStatistics->NoThreadStorage += ReadStatistic(&Statistics[Index].NoThreadStorage);
+			OutStatistics->HandlerCycles += ReadStatistic(&Statistics[Index].HandlerCycles);
+		}
+
+		OutStatistics->Calls = OutStatistics->Handled + OutStatistics->Recursion + OutStatistics->AclDenied + 
+			OutStatistics->CallerFiltered + OutStatistics->Unsampled + OutStatistics->LoaderLock + 
+			OutStatistics->NoThreadStorage;
+	}
+
+    RETURN;
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+
+
+EASYHOOK_NT_EXPORT LhSetSamplingPolicy(
+            TRACED_HOOK_HANDLE InHandle,
+            ULONG InMode,
+            ULONG InRate,
+            ULONG InBurst)
 {
 /*
 Description:
 
-    Is expected to be called inside a hook handler. Otherwise it
-    will fail with STATUS_NOT_SUPPORTED. 
-    Temporarily restores the call stack to allow stack traces.
+    Sets the sampling policy of the given hook. Calls that are not sampled
+    are passed to the original method. The sampling state is kept per thread
+    and hook, and is reset whenever the policy changes. Calls declined by 
+    the caller filter, the ACL or the loader lock check are not counted by
+    the policy.
 
-    You have to pass the stored backup pointer to 
-    LhBarrierEndStackTrace() BEFORE leaving the handler, otherwise
-    the application will be left in an unstable state!
-*/
-    NTSTATUS                    NtStatus;
-    LPTHREAD_RUNTIME_INFO       Runtime;
+    Only if no other hook is installed at the same entry point, calls that
+    are not sampled skip the barrier entirely. 
 
-    if(OutBackup == NULL)
-        THROW(STATUS_INVALID_PARAMETER, L"The given backup storage is invalid.");
+Parameters:
 
-	if(!TlsGetCurrentValue(&Unit.TLS, &Runtime))
-        THROW(STATUS_NOT_SUPPORTED, L"The caller is not inside a hook handler.");
+    - InHandle
 
-	if(Runtime->Current == NULL)
-		THROW(STATUS_NOT_SUPPORTED, L"The caller is not inside a hook handler.");
+        The hook handle whose sampling policy is going to be set. Raw hooks
+        are not supported.
 
-    *OutBackup = *Runtime->Current->AddrOfRetAddr;
-    *Runtime->Current->AddrOfRetAddr = Runtime->Current->RetAddress;
+    - InMode
 
-    RETURN;
+        EASYHOOK_SAMPLING_ALL passes all calls to the handler, which is the
+        default. EASYHOOK_SAMPLING_EVERY_NTH samples the first and then every 
+        InRate-th call of a thread. EASYHOOK_SAMPLING_PROBABILISTIC samples
+        each call with a probability of one in InRate. 
+        EASYHOOK_SAMPLING_RATE_LIMIT samples at most InRate calls per second 
+        and thread, with bursts of up to InBurst calls.
 
-THROW_OUTRO:
-FINALLY_OUTRO:
-    return NtStatus;
-}
+    - InRate
 
+        See InMode, must not be zero unless all calls are sampled.
 
+    - InBurst
 
+        The token bucket size of a rate limit, must not be zero for a 
+        rate limit and is ignored otherwise.
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    NTSTATUS                NtStatus;
+	HOOK_SAMPLING_POLICY*	Policy;
 
+    if(!LhIsValidHandle(InHandle, &Hook))
+        THROW(STATUS_INVALID_PARAMETER_1, L"The given hook handle is invalid or already disposed.");
 
+	if(Hook->IsRaw)
+		THROW(STATUS_NOT_SUPPORTED, L"Raw hooks don't support sampling policies.");
 
-EASYHOOK_NT_EXPORT LhBarrierEndStackTrace(PVOID InBackup)
-{
-/*
-Description:
+	if(InMode > EASYHOOK_SAMPLING_RATE_LIMIT)
+		THROW(STATUS_INVALID_PARAMETER_2, L"Unknown sampling mode specified.");
 
-    Is expected to be called inside a hook handler. Otherwise it
-    will fail with STATUS_NOT_SUPPORTED. 
+	if((InMode != EASYHOOK_SAMPLING_ALL) && (InRate == 0))
+		THROW(STATUS_INVALID_PARAMETER_3, L"The sampling rate must not be zero.");
 
-    You have to pass the backup pointer obtained with
-    LhBarrierBeginStackTrace().
-*/
-    NTSTATUS            NtStatus;
-    PVOID*              AddrOfRetAddr;
+	if((InMode == EASYHOOK_SAMPLING_RATE_LIMIT) && ((InBurst == 0) || (InBurst > MAXULONG / 1000)))
+		THROW(STATUS_INVALID_PARAMETER_4, L"The burst size is out of range.");
 
-    if(!IsValidPointer(InBackup, 1))
-        THROW(STATUS_INVALID_PARAMETER, L"The given stack backup pointer is invalid.");
+	if((Policy = (HOOK_SAMPLING_POLICY*)RtlAllocateMemory(TRUE, sizeof(HOOK_SAMPLING_POLICY))) == NULL)
+		THROW(STATUS_NO_MEMORY, L"Unable to allocate memory.");
 
-    FORCE(LhBarrierGetAddressOfReturnAddress(&AddrOfRetAddr));
+	// sampling one in one is the same as sampling all...
+	Policy->Mode = (((InMode == EASYHOOK_SAMPLING_EVERY_NTH) || (InMode == EASYHOOK_SAMPLING_PROBABILISTIC)) && (InRate == 1))?EASYHOOK_SAMPLING_ALL:InMode;
+	Policy->Interval = InRate;
+	Policy->Threshold = (InRate > 0)?(MAXULONG / InRate):0;
+	// tick counts are milliseconds, so the rate per second is the rate in thousandths per tick
+	Policy->TokensPerTick = InRate;
+	Policy->Capacity = InBurst * 1000;
 
-    *AddrOfRetAddr = InBackup;
+	Policy->Retired = (PHOOK_SAMPLING_POLICY)InterlockedExchangePointer((PVOID volatile*)&Hook->SamplingPolicy, Policy);
 
     RETURN;
 
@@ -625,6 +1716,26 @@ FINALLY_OUTRO:
 
 
 
+MODULE_HINT* LhBarrierGetModuleHint()
+{
+/*
+Description:
+
+    Returns the module lookup cache of the calling thread, see
+    LhBarrierPointerToModule(). Threads that never entered a hook
+    have none and NULL is returned.
+*/
+	THREAD_RUNTIME_INFO*		Info;
+
+	if(!TlsGetCurrentValue(&Unit.TLS, &Info))
+		return NULL;
+
+	return &Info->ModuleHint;
+}
+
+
+
+
 void LhBarrierThreadDetach()
 {
 /*
@@ -635,12 +1746,7 @@ Description:
 	LPTHREAD_RUNTIME_INFO		Info;
 
 	if(TlsGetCurrentValue(&Unit.TLS, &Info))
-	{
-		if(Info->Entries != NULL)
-			RtlFreeMemory(Info->Entries);
-
-		Info->Entries = NULL;
-	}
+		RuntimeInfoRelease(Info);
 
 	TlsRemoveCurrentThread(&Unit.TLS);
 }
@@ -672,16 +1778,36 @@ Description:
 
     Will be called on DLL load and initializes all barrier structures.
 */
+	NTSTATUS			NtStatus;
+
 	RtlZeroMemory(&Unit, sizeof(Unit));
 
+	Unit.AclGeneration = 1;
+
 	// globally accept all threads...
-	Unit.GlobalACL.IsExclusive = TRUE;
+	if(!RTL_SUCCESS(NtStatus = LhBarrierSetAcl(&Unit.GlobalACL, TRUE, NULL, 0)))
+		return NtStatus;
 
 	// allocate private heap
     RtlInitializeLock(&Unit.TLS.ThreadSafe);
 
+	Unit.TLS.Capacity = MAX_THREAD_COUNT;
+
 #ifndef DRIVER
 
+	/*
+		Only the first TLS_MINIMUM_AVAILABLE slots live directly in the TEB. For
+		all others we fall back to scanning the ID list...
+	*/
+	Unit.TLS.FastSlot = TlsAlloc();
+
+	if((Unit.TLS.FastSlot != TLS_OUT_OF_INDEXES) && (Unit.TLS.FastSlot >= TLS_MINIMUM_AVAILABLE))
+	{
+		TlsFree(Unit.TLS.FastSlot);
+
+		Unit.TLS.FastSlot = TLS_OUT_OF_INDEXES;
+	}
+
     Unit.IsInitialized = AuxUlibInitialize()?TRUE:FALSE;
 
 	return STATUS_SUCCESS;
@@ -703,19 +1829,33 @@ Description:
 
     Will be called on DLL unload.
 */
-	ULONG			Index;
+	THREAD_LOCAL_STORAGE_SEGMENT*	Segment;
+	THREAD_LOCAL_STORAGE_SEGMENT*	Next;
+	ULONG			                Index;
 
 #ifdef DRIVER
 	PsRemoveCreateThreadNotifyRoutine(OnThreadDetach);
+#else
+	if(Unit.TLS.FastSlot != TLS_OUT_OF_INDEXES)
+		TlsFree(Unit.TLS.FastSlot);
 #endif
 
 	RtlDeleteLock(&Unit.TLS.ThreadSafe);
 
+	LhBarrierReleaseAcl(&Unit.GlobalACL);
+
 	// release thread specific resources
-	for(Index = 0; Index < MAX_THREAD_COUNT; Index++)
+	for(Segment = &Unit.TLS.First; Segment != NULL; Segment = Next)
 	{
-		if(Unit.TLS.Entries[Index].Entries != NULL)
-			RtlFreeMemory(Unit.TLS.Entries[Index].Entries);
+		for(Index = 0; Index < MAX_THREAD_COUNT; Index++)
+		{
+			RuntimeInfoRelease(&Segment->Entries[Index]);
+		}
+
+		Next = Segment->Next;
+
+		if(Segment != &Unit.TLS.First)
+			RtlFreeMemory(Segment);
 	}
 
 	RtlZeroMemory(&Unit, sizeof(Unit));
@@ -724,21 +1864,267 @@ Description:
 
 
 
-ULONGLONG LhBarrierIntro(LOCAL_HOOK_INFO* InHandle, void* InRetAddr, void** InAddrOfRetAddr)
+static RUNTIME_INFO* RuntimeInfoGet(
+			THREAD_RUNTIME_INFO* InInfo,
+			LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Queries the runtime entry of the calling thread for the given hook
+    and resets it if the hook slot was recycled.
+*/
+	RUNTIME_INFO*			Runtime;
+
+	if((Runtime = RuntimeInfoLookup(InInfo, InHook->HLSIndex)) == NULL)
+		return NULL;
+
+	if(Runtime->HLSIdent != InHook->HLSIdent)
+	{
+		// just reset execution information
+		Runtime->HLSIdent = InHook->HLSIdent;
+		Runtime->IsExecuting = FALSE;
+		Runtime->AclGeneration = 0;
+		Runtime->ChainTop = NULL;
+		Runtime->SamplingPolicy = NULL;
+	}
+
+	return Runtime;
+}
+
+
+
+
+static RUNTIME_INFO* RuntimeInfoFind(
+			THREAD_RUNTIME_INFO* InInfo,
+			LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Like RuntimeInfoGet(), but never allocates memory and therefore
+    can be used outside of the self protection.
+
+Returns:
+
+    NULL if the calling thread has no entry for the given hook yet.
+*/
+	RUNTIME_INFO*			Runtime = InInfo->LastHit;
+	ULONG					Index;
+
+	if((Runtime == NULL) || (Runtime->HLSIndex != InHook->HLSIndex))
+	{
+		Runtime = NULL;
+
+		if(InInfo->Table == NULL)
+			return NULL;
+
+		for(Index = InHook->HLSIndex & InInfo->TableMask; InInfo->Table[Index] != NULL; Index = (Index + 1) & InInfo->TableMask)
+		{
+			if(InInfo->Table[Index]->HLSIndex == InHook->HLSIndex)
+			{
+				Runtime = InInfo->LastHit = InInfo->Table[Index];
+
+				break;
+			}
+		}
+	}
+
+	if((Runtime == NULL) || (Runtime->HLSIdent != InHook->HLSIdent))
+		return NULL;
+
+	return Runtime;
+}
+
+
+
+
+static BOOL IsCallSampled(
+			PLOCAL_HOOK_INFO InHook,
+			RUNTIME_INFO* InRuntime,
+			ULONG* OutState,
+			ULONG* OutTime)
+{
+/*
+Description:
+
+    Evaluates the sampling policy of the given hook for the calling thread. 
+    The state is kept in the thread's runtime entry and is reset whenever
+    the policy changes. Must be called within the self protection, because
+    the tick count might be hooked.
+
+    The advanced state is only returned. The caller stores it as soon as
+    no other check can decline the call anymore, so calls passed to the
+    original method for other reasons don't consume samples.
+*/
+	PHOOK_SAMPLING_POLICY	Policy = InHook->SamplingPolicy;
+	ULONG					Now;
+	ULONG					State;
+	ULONG					Time;
+	ULONGLONG				Tokens;
+	BOOL					IsSampled = TRUE;
+
+	if((Policy != NULL) && (Policy->Mode != EASYHOOK_SAMPLING_ALL) && (InRuntime->SamplingPolicy != Policy))
+	{
+		InRuntime->SamplingPolicy = Policy;
+		InRuntime->SampleState = 0;
+
+		if(Policy->Mode == EASYHOOK_SAMPLING_PROBABILISTIC)
+			InRuntime->SampleState = ((ULONG)(ULONG_PTR)InRuntime * 2654435761UL) | 1;
+		else if(Policy->Mode == EASYHOOK_SAMPLING_RATE_LIMIT)
+		{
+			InRuntime->SampleState = Policy->Capacity;
+			InRuntime->SampleTime = LhGetTickCount();
+		}
+	}
+
+	State = InRuntime->SampleState;
+	Time = InRuntime->SampleTime;
+
+	if(Policy != NULL)
+	{
+		switch(Policy->Mode)
+		{
+		case EASYHOOK_SAMPLING_EVERY_NTH:
+			{
+				if(State == 0)
+					State = Policy->Interval - 1;
+				else
+				{
+					State--;
+
+					IsSampled = FALSE;
+				}
+			}break;
+		case EASYHOOK_SAMPLING_PROBABILISTIC:
+			{
+				// xorshift, the state never becomes zero...
+				State ^= State << 13;
+				State ^= State >> 17;
+				State ^= State << 5;
+
+				IsSampled = (State <= Policy->Threshold);
+			}break;
+		case EASYHOOK_SAMPLING_RATE_LIMIT:
+			{
+				Now = LhGetTickCount();
+
+				if(Now != Time)
+				{
+					Tokens = State + (ULONGLONG)(Now - Time) * Policy->TokensPerTick;
+
+					State = (Tokens < Policy->Capacity) ? (ULONG)Tokens : Policy->Capacity;
+					Time = Now;
+				}
+
+				if(State < 1000)
+					IsSampled = FALSE;
+				else
+					State -= 1000;
+			}break;
+		}
+	}
+
+	*OutState = State;
+	*OutTime = Time;
+
+	return IsSampled;
+}
+
+
+
+
+static BOOL IsCallerAccepted(
+			PLOCAL_HOOK_INFO InHook,
+			void* InRetAddr)
+{
+/*
+Description:
+
+    Evaluates the caller filter of the given hook for the given return
+    address. Hooks without filter accept all callers.
+*/
+	HOOK_CALLER_FILTER*		Filter = InHook->CallerFilter;
+	ULONG					Low = 0;
+	ULONG					High;
+	ULONG					Middle;
+	BOOL					IsListed;
+
+	if(Filter == NULL)
+		return TRUE;
+
+	// find the last range starting at or below the return address
+	for(High = Filter->Count; Low < High; )
+	{
+		Middle = Low + (High - Low) / 2;
+
+		if(Filter->Ranges[Middle].Start <= (UCHAR*)InRetAddr)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	IsListed = (Low > 0) && ((UCHAR*)InRetAddr < Filter->Ranges[Low - 1].End);
+
+	return IsListed != Filter->IsExclusive;
+}
+
+
+
+
+void* __stdcall LhBarrierIntro(LOCAL_HOOK_INFO* InHandle, void* InRetAddr, void** InAddrOfRetAddr)
 {
 /*
 Description:
 
     Will be called from assembler code and enters the 
     thread deadlock barrier.
+
+Returns:
+
+    NULL if the original method shall be called. Otherwise a pointer
+    to the address of the handler the assembler code has to jump to. The handler is read
+    only once, so the callback always belongs to the invoked handler, even
+    if LhReplaceHookHandler() is called concurrently...
 */
     LPTHREAD_RUNTIME_INFO		Info;
     RUNTIME_INFO*		        Runtime;
+    RUNTIME_INFO*		        SiteRuntime;
+	PLOCAL_HOOK_INFO			Hook;
+	PLOCAL_HOOK_HANDLER			Handler;
+	PLOCAL_HOOK_INFO			Sampled = NULL;
+	PHOOK_SAMPLING_POLICY		Policy;
 	BOOL						Exists;
+	BOOL						IsSampled;
+	ULONG						SampleState;
+	ULONG						SampleTime;
+	LONG						Generation;
+	LONG						Flags;
+	LOCAL_HOOK_STATISTICS*		Statistics;
+
+	// is a user handler available? (the hook might be removed already)
+	if(InHandle->HookProc == NULL)
+		return NULL;
+
+	/*
+		Caller filters only depend on the return address, so calls rejected by
+		all handlers don't have to enter the barrier at all...
+	*/
+	for(Hook = InHandle->Chain; Hook != NULL; Hook = Hook->NextInChain)
+	{
+		if(IsCallerAccepted(Hook, InRetAddr))
+			break;
+	}
+
+	if(Hook == NULL)
+	{
+		for(Hook = InHandle->Chain; Hook != NULL; Hook = Hook->NextInChain)
+		{
+			CountCall(Hook, InAddrOfRetAddr, CallerFiltered);
+		}
 
-	#ifdef _M_X64
-		InHandle -= 1;
-	#endif
+		return NULL;
+	}
 
 	// are we in OS loader lock?
 	if(IsLoaderLock())
@@ -751,7 +2137,42 @@ Description:
 
 		/*  !!Note that the assembler code does not invoke LhBarrierOutro() in this case!! */
 
-		return FALSE;
+		CountCall(InHandle, InAddrOfRetAddr, LoaderLock);
+
+		return NULL;
+	}
+
+	/*
+		Calls that are not sampled shall be as cheap as possible, so we decide
+		before entering the barrier if the patch site has no other handlers. 
+		Threads without runtime entry for this hook or without an up to date
+		interception decision take the regular path. Otherwise, nothing but a
+		concurrent ACL change can decline the call after this point...
+	*/
+	if(((Policy = InHandle->SamplingPolicy) != NULL) && (Policy->Mode != EASYHOOK_SAMPLING_ALL) &&
+		(InHandle->Chain == InHandle) && (InHandle->NextInChain == NULL) &&
+		TlsGetCurrentValue(&Unit.TLS, &Info) && !Info->IsProtected &&
+		((Runtime = RuntimeInfoFind(Info, InHandle)) != NULL) && !Runtime->IsExecuting &&
+		(Runtime->AclGeneration == Unit.AclGeneration) && Runtime->IsIntercepted)
+	{
+		Info->IsProtected = TRUE;
+		{
+			IsSampled = IsCallSampled(InHandle, Runtime, &SampleState, &SampleTime);
+		}
+		Info->IsProtected = FALSE;
+
+		if(!IsSampled)
+		{
+			Runtime->SampleState = SampleState;
+			Runtime->SampleTime = SampleTime;
+
+			CountCall(InHandle, InAddrOfRetAddr, Unsampled);
+
+			return NULL;
+		}
+
+		// the sample is consumed when the handler is entered, see below
+		Sampled = InHandle;
 	}
 
 	// open pointer table
@@ -760,7 +2181,11 @@ Description:
 	if(!Exists)
 	{
 		if(!TlsAddCurrentThread(&Unit.TLS))
-			return FALSE;
+		{
+			CountCall(InHandle, InAddrOfRetAddr, NoThreadStorage);
+
+			return NULL;
+		}
 	}
 
 	/*
@@ -775,69 +2200,146 @@ Description:
 	{
 		/*  !!Note that the assembler code does not invoke LhBarrierOutro() in this case!! */
 
-		return FALSE;
+		// the barrier itself has invoked the hooked method...
+		CountCall(InHandle, InAddrOfRetAddr, Recursion);
+
+		return NULL;
 	}
 
-	ASSERT(InHandle->HLSIndex < MAX_HOOK_COUNT,L"barrier.c - InHandle->HLSIndex < MAX_HOOK_COUNT");
+	ASSERT(InHandle->HLSIndex < LOCAL_HOOK_MAX_SLOTS,L"barrier.c - InHandle->HLSIndex < LOCAL_HOOK_MAX_SLOTS");
 
 	if(!Exists)
-	{
 		TlsGetCurrentValue(&Unit.TLS, &Info);
 
-		Info->Entries = (RUNTIME_INFO*)RtlAllocateMemory(TRUE, sizeof(RUNTIME_INFO) * MAX_HOOK_COUNT);
+	// get runtime info of the patch site, it keeps the handlers entered by this thread...
+	if((SiteRuntime = RuntimeInfoGet(Info, InHandle)) == NULL)
+	{
+		CountCall(InHandle, InAddrOfRetAddr, NoThreadStorage);
 
-		if(Info->Entries == NULL)
-			goto DONT_INTERCEPT;
+		goto DONT_INTERCEPT;
 	}
 
-	// get hook runtime info...
-	Runtime = &Info->Entries[InHandle->HLSIndex];
+	/*
+		Now we will negotiate thread/process access based on global and local ACL...
+		The decision is cached per thread and hook until any ACL changes. We have to
+		read the generation before evaluating the ACLs, otherwise we might cache an
+		outdated decision with an up to date generation.
+	*/
+	Generation = Unit.AclGeneration;
 
-	if(Runtime->HLSIdent != InHandle->HLSIdent)
-	{
-		// just reset execution information
-		Runtime->HLSIdent = InHandle->HLSIdent;
-		Runtime->IsExecuting = FALSE;
-	}
+	/*
+		Select the first handler in the chain which intercepts the current thread
+		and which is not executed by it yet. 
+
+		If a handler invokes the hooked method again, the call is therefore passed
+		to the next handler in the chain and the last one reaches the original method.
+		Because of the special HookLocalStorage, this is also the case if other hooks
+		invoked by the related handler are calling it again.
+
+		I call this the "Thread deadlock barrier".
 
-	// detect loops in hook execution hiearchy.
-	if(Runtime->IsExecuting)
+		!!Note that the assembler code does not invoke LhBarrierOutro() if no handler is left!!
+	*/
+	for(Hook = InHandle->Chain; Hook != NULL; Hook = Hook->NextInChain)
 	{
-		/*
-			This implies that actually the handler has invoked itself. Because of
-			the special HookLocalStorage, this is now also signaled if other
-			hooks invoked by the related handler are calling it again.
+		if(Hook == InHandle)
+			Runtime = SiteRuntime;
+		else if((Runtime = RuntimeInfoGet(Info, Hook)) == NULL)
+		{
+			CountCall(Hook, InAddrOfRetAddr, NoThreadStorage);
+
+			goto DONT_INTERCEPT;
+		}
 
-			I call this the "Thread deadlock barrier".
+		if(Runtime->IsExecuting)
+		{
+			CountCall(Hook, InAddrOfRetAddr, Recursion);
 
-			!!Note that the assembler code does not invoke LhBarrierOutro() in this case!!
-		*/
+			continue;
+		}
 
-		goto DONT_INTERCEPT;
-	}
+		if(!IsCallerAccepted(Hook, InRetAddr))
+		{
+			CountCall(Hook, InAddrOfRetAddr, CallerFiltered);
 
-	Info->Callback = InHandle->Callback;
-	Info->Current = Runtime;
+			continue;
+		}
 
-	/*
-		Now we will negotiate thread/process access based on global and local ACL...
-	*/
+		if(Runtime->AclGeneration != Generation)
+		{
 #ifndef DRIVER
-	Runtime->IsExecuting = IsThreadIntercepted(&InHandle->LocalACL, GetCurrentThreadId());
+			Runtime->IsIntercepted = IsThreadIntercepted(&Hook->LocalACL, GetCurrentThreadId());
 #else
-	Runtime->IsExecuting = IsProcessIntercepted(&InHandle->LocalACL, (ULONG)PsGetCurrentProcessId());
+			Runtime->IsIntercepted = IsProcessIntercepted(&Hook->LocalACL, (ULONG)PsGetCurrentProcessId());
 #endif
 
-	if(!Runtime->IsExecuting)
+			Runtime->AclGeneration = Generation;
+		}
+
+		if(!Runtime->IsIntercepted)
+		{
+			CountCall(Hook, InAddrOfRetAddr, AclDenied);
+
+			continue;
+		}
+
+		// sampling comes last, so only calls the handler would receive are counted by the policy
+		if(Hook == Sampled)
+			break;
+
+		IsSampled = IsCallSampled(Hook, Runtime, &SampleState, &SampleTime);
+
+		Runtime->SampleState = SampleState;
+		Runtime->SampleTime = SampleTime;
+
+		if(IsSampled)
+			break;
+
+		CountCall(Hook, InAddrOfRetAddr, Unsampled);
+	}
+
+	if(Hook == NULL)
 		goto DONT_INTERCEPT;
 
+	if(Hook == Sampled)
+	{
+		Runtime->SampleState = SampleState;
+		Runtime->SampleTime = SampleTime;
+	}
+
+	Handler = Hook->Handler;
+
+	Info->Callback = Handler->Callback;
+	Info->Current = Runtime;
+
 	// save some context specific information
+	Runtime->IsExecuting = TRUE;
 	Runtime->RetAddress = InRetAddr;
 	Runtime->AddrOfRetAddr = InAddrOfRetAddr;
+	Runtime->ExecutionShard = LhGetExecutionShard(InHandle, InAddrOfRetAddr);
+
+	// handlers at the same patch site are always left in reverse order
+	Runtime->ChainPrev = SiteRuntime->ChainTop;
+	SiteRuntime->ChainTop = Runtime;
+
+	Runtime->CycleCounter = NULL;
+
+	if((Flags = Hook->StatisticsFlags) != 0)
+	{
+		Statistics = LhGetStatisticsShard(Hook, InAddrOfRetAddr);
+
+		AddStatistic(&Statistics->Handled, 1);
+
+		if(Flags & EASYHOOK_STATISTICS_CYCLES)
+		{
+			Runtime->CycleCounter = &Statistics->HandlerCycles;
+			Runtime->EnterTime = __rdtsc();
+		}
+	}
 
 	ReleaseSelfProtection();
 	
-	return TRUE;
+	return &Handler->HookProc;
 
 DONT_INTERCEPT:
 	/*  !!Note that the assembler code does not invoke UnmanagedHookOutro() in this case!! */
@@ -850,7 +2352,7 @@ DONT_INTERCEPT:
 		ReleaseSelfProtection();
 	}
 
-	return FALSE;
+	return NULL;
 }
 
 
@@ -865,38 +2367,46 @@ Description:
     Will just reset the "thread deadlock barrier" for the current hook handler and provides
 	some important integrity checks. 
 
-	The hook handle is just passed through, because the assembler code has no chance to
-	save it in any efficient manner at this point of execution...
+	Returns the execution counter shard the assembler code has to release. It is the one
+	selected when entering the trampoline, because on x86 a __stdcall handler has already
+	removed its arguments and InAddrOfRetAddr might belong to another shard...
 */
     RUNTIME_INFO*			Runtime;
+    RUNTIME_INFO*			SiteRuntime;
     LPTHREAD_RUNTIME_INFO	Info;
 
-	#ifdef _M_X64
-		InHandle -= 1;
-	#endif
-
 	ASSERT(AcquireSelfProtection(),L"barrier.c - AcquireSelfProtection()");
 
 	ASSERT(TlsGetCurrentValue(&Unit.TLS, &Info) && (Info != NULL),L"barrier.c - TlsGetCurrentValue(&Unit.TLS, &Info) && (Info != NULL)");
 
-	Runtime = &Info->Entries[InHandle->HLSIndex];
+	SiteRuntime = RuntimeInfoLookup(Info, InHandle->HLSIndex);
 
 	// leave handler context
 	Info->Current = NULL;
 	Info->Callback = NULL;
 
+	ASSERT(SiteRuntime != NULL,L"barrier.c - SiteRuntime != NULL");
+
+	// the innermost handler entered at this patch site is returning...
+	Runtime = SiteRuntime->ChainTop;
+
 	ASSERT(Runtime != NULL,L"barrier.c - Runtime != NULL");
 
+	SiteRuntime->ChainTop = Runtime->ChainPrev;
+
 	ASSERT(Runtime->IsExecuting,L"barrier.c - Runtime->IsExecuting");
 
 	Runtime->IsExecuting = FALSE;
 
 	ASSERT(*InAddrOfRetAddr == NULL,L"barrier.c - *InAddrOfRetAddr == NULL");
 
+	if(Runtime->CycleCounter != NULL)
+		AddStatistic(Runtime->CycleCounter, (LONGLONG)(__rdtsc() - Runtime->EnterTime));
+
 	*InAddrOfRetAddr = Runtime->RetAddress;
 
 	ReleaseSelfProtection();
 
-	return InHandle;
+	return Runtime->ExecutionShard;
 
 }
\ No newline at end of file
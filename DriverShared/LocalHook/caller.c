@@ -60,31 +60,447 @@
 
 #undef CaptureStackBackTrace
 
-static MODULE_INFORMATION*					LhModuleArray = NULL;
-static ULONG								LhModuleCount = 0;
+/*
+    Modules are published as immutable snapshots sorted by base address, so
+    LhBarrierPointerToModule() runs a binary search without taking any lock.
+    After the first full scan, the snapshot is maintained by the load and
+    unload notifications of the loader, see LhApplyModuleNotification(). A
+    full rescan is only done if notifications are not available or a delta
+    could not be applied. Pointers not belonging to any module, like
+    dynamically generated code, are remembered for a while, so they don't
+    cause a rescan on every lookup.
+
+    Readers announce themselves in one of LOCAL_HOOK_SHARD_COUNT counters.
+    A replaced snapshot is released as soon as each of them has been seen
+    at zero, just like removed hooks, see LhReclaimModuleSnapshots().
+*/
+typedef struct _MODULE_SNAPSHOT_* PMODULE_SNAPSHOT;
+
+typedef struct _MODULE_SNAPSHOT_
+{
+	// the next snapshot waiting for its release
+	PMODULE_SNAPSHOT		Retired;
+	ULONG					QuiescentShards;
+	ULONG					Count;
+	// sorted in ascending order and linked through "Next" in the same order
+	MODULE_INFORMATION		Modules[1];
+}MODULE_SNAPSHOT;
+
+// one cache line per reader shard
+#define LH_MODULE_READER_STRIDE         (LOCAL_HOOK_SHARD_SIZE / sizeof(LONG))
+#define LH_ALL_MODULE_READER_SHARDS     ((1UL << LOCAL_HOOK_SHARD_COUNT) - 1)
+
+#define LhGetModuleReaderShard(InAddrOnStack) \
+    (&LhModuleReaders[LH_MODULE_READER_STRIDE * \
+        ((((ULONG_PTR)(InAddrOnStack) >> 12) ^ ((ULONG_PTR)(InAddrOnStack) >> 20)) & (LOCAL_HOOK_SHARD_COUNT - 1))])
+
+/*
+    Misses are remembered per 64 KB region, which is the allocation granularity
+    of user mode and thus no region can contain both, a module and code
+    generated at runtime.
+*/
+#define LH_MODULE_MISS_CACHE_SIZE       64
+#define LH_MODULE_MISS_TIMEOUT          1000 // milliseconds
+#define LH_MODULE_MISS_SHIFT            16
+
+typedef struct _MODULE_MISS_
+{
+	ULONG_PTR				Region;
+	ULONG					Time;
+}MODULE_MISS;
+
+#define LhGetModuleMiss(InPointer) \
+    (&LhModuleMisses[((ULONG_PTR)(InPointer) >> LH_MODULE_MISS_SHIFT) & (LH_MODULE_MISS_CACHE_SIZE - 1)])
+
+static volatile PMODULE_SNAPSHOT			LhModuleSnapshot = NULL;
+static volatile PMODULE_SNAPSHOT			LhRetiredModuleSnapshots = NULL;
+static volatile LONG						LhModuleReaders[LOCAL_HOOK_SHARD_COUNT * LH_MODULE_READER_STRIDE];
+static MODULE_MISS							LhModuleMisses[LH_MODULE_MISS_CACHE_SIZE];
+
+// the snapshot might not be up to date, so a miss requires a full rescan
+BOOLEAN										LhModuleListChanged = TRUE;
 
 #ifndef DRIVER
+
+	#define LDR_DLL_NOTIFICATION_REASON_LOADED		1
+	#define LDR_DLL_NOTIFICATION_REASON_UNLOADED	2
+
+	typedef struct _LDR_DLL_NOTIFICATION_DATA_
+	{
+		ULONG				Flags;
+		UNICODE_STRING*		FullDllName;
+		UNICODE_STRING*		BaseDllName;
+		PVOID				DllBase;
+		ULONG				SizeOfImage;
+	}LDR_DLL_NOTIFICATION_DATA;
+
+	typedef VOID CALLBACK PROC_LdrDllNotification(
+		ULONG InReason,
+		LDR_DLL_NOTIFICATION_DATA* InData,
+		PVOID InContext);
+
+	typedef NTSTATUS NTAPI PROC_LdrRegisterDllNotification(
+		ULONG InFlags,
+		PROC_LdrDllNotification* InCallback,
+		PVOID InContext,
+		PVOID* OutCookie);
+
+	typedef NTSTATUS NTAPI PROC_LdrUnregisterDllNotification(PVOID InCookie);
+
+	typedef NTSYSAPI VOID NTAPI PROC_RtlCaptureContext(CONTEXT* OutContext);
+
 	static PROC_RtlCaptureStackBackTrace*	RtlCaptureStackBackTrace = NULL;
-	static MODULEINFO*						LhNativeModuleArray = NULL;
-	static CHAR*							LhNativePathArray = NULL;
+	static PROC_RtlCaptureContext*			RtlCaptureContextProc = NULL;
 	static HMODULE							ProcessModules[1024];
-#else
-	static SYSTEM_MODULE_INFORMATION*		LhNativeModuleArray = NULL;
-	BOOLEAN									LhModuleListChanged = TRUE;
+	// only available since Windows Vista
+	static PVOID							LhDllNotificationCookie = NULL;
+	static BOOL								LhIsDllNotificationProbed = FALSE;
 #endif
 
 
-#ifdef DRIVER
+static void LhRetireModuleSnapshot(PMODULE_SNAPSHOT InSnapshot)
+{
+	PMODULE_SNAPSHOT		Head;
+
+	do
+	{
+		Head = LhRetiredModuleSnapshots;
+
+		InSnapshot->Retired = Head;
+	}
+	while(InterlockedCompareExchangePointer((PVOID volatile*)&LhRetiredModuleSnapshots, InSnapshot, Head) != Head);
+}
+
+static void LhReclaimModuleSnapshots()
+{
+/*
+Description:
+
+    Releases all replaced snapshots no reader can refer to anymore.
+    A reader shard seen at zero after a snapshot has been replaced
+    can't refer to it, because new readers only find its successor.
+    The others are retired again for the next attempt.
+*/
+	PMODULE_SNAPSHOT		List;
+	PMODULE_SNAPSHOT		Next;
+	ULONG					i;
+
+	List = (PMODULE_SNAPSHOT)InterlockedExchangePointer((PVOID volatile*)&LhRetiredModuleSnapshots, NULL);
+
+	for(; List != NULL; List = Next)
+	{
+		Next = List->Retired;
+
+		for(i = 0; i < LOCAL_HOOK_SHARD_COUNT; i++)
+		{
+			if(LhModuleReaders[i * LH_MODULE_READER_STRIDE] == 0)
+				List->QuiescentShards |= 1UL << i;
+		}
+
+		if(List->QuiescentShards == LH_ALL_MODULE_READER_SHARDS)
+			RtlFreeMemory(List);
+		else
+			LhRetireModuleSnapshot(List);
+	}
+}
 
 void LhModuleInfoFinalize()
 {
-	if(LhNativeModuleArray != NULL)
-		RtlFreeMemory(LhNativeModuleArray);
+/*
+Description:
+
+    Releases the current and all retired module snapshots. No thread
+    may look up a module anymore, which is the case on unload.
+*/
+	PMODULE_SNAPSHOT		Snapshot;
+	PMODULE_SNAPSHOT		Retired;
+
+#ifndef DRIVER
+	PROC_LdrUnregisterDllNotification*		Unregister;
+
+	if(LhDllNotificationCookie != NULL)
+	{
+		Unregister = (PROC_LdrUnregisterDllNotification*)GetProcAddress(hNtDll, "LdrUnregisterDllNotification");
+
+		if(Unregister != NULL)
+			Unregister(LhDllNotificationCookie);
+
+		LhDllNotificationCookie = NULL;
+	}
+#endif
+
+	if(LhModuleSnapshot != NULL)
+		RtlFreeMemory(LhModuleSnapshot);
+
+	for(Snapshot = LhRetiredModuleSnapshots; Snapshot != NULL; Snapshot = Retired)
+	{
+		Retired = Snapshot->Retired;
+
+		RtlFreeMemory(Snapshot);
+	}
+
+	LhModuleSnapshot = NULL;
+	LhRetiredModuleSnapshots = NULL;
+}
+
+static MODULE_SNAPSHOT* LhAllocateModuleSnapshot(ULONG InCount)
+{
+	if(InCount > (MAXULONG - sizeof(MODULE_SNAPSHOT)) / sizeof(MODULE_INFORMATION))
+		return NULL;
+
+	return (MODULE_SNAPSHOT*)RtlAllocateMemory(TRUE, sizeof(MODULE_SNAPSHOT) + InCount * sizeof(MODULE_INFORMATION));
+}
+
+static BOOL LhPublishModuleSnapshot(
+			MODULE_SNAPSHOT* InSnapshot,
+			MODULE_SNAPSHOT* InExpected)
+{
+/*
+Description:
+
+    Sorts the modules of the given snapshot by base address and publishes
+    it, unless the current snapshot lists the same modules. The snapshot
+    is released in the latter case. Only base address, image size and
+    path need to be set.
+
+Parameters:
+
+    - InExpected
+
+        The snapshot read before the given one was created. If another
+        one has been published in the meantime, nothing is published.
+
+Returns:
+
+    FALSE if the given snapshot was released because it is outdated, 
+    TRUE otherwise.
+*/
+	MODULE_INFORMATION		Value;
+	MODULE_INFORMATION*		Modules = InSnapshot->Modules;
+	MODULE_SNAPSHOT*		Current;
+	ULONG					Count = InSnapshot->Count;
+	ULONG					Gap;
+	ULONG					i;
+	ULONG					j;
+	CHAR*					Path;
+
+	// shell sort, we can't rely on a CRT...
+	for(Gap = Count / 2; Gap > 0; Gap /= 2)
+	{
+		for(i = Gap; i < Count; i++)
+		{
+			Value = Modules[i];
+
+			for(j = i; (j >= Gap) && (Modules[j - Gap].BaseAddress > Value.BaseAddress); j -= Gap)
+			{
+				Modules[j] = Modules[j - Gap];
+			}
+
+			Modules[j] = Value;
+		}
+	}
+
+	for(i = 0; i < Count; i++)
+	{
+		Path = Modules[i].Path;
+		Path[sizeof(Modules[i].Path) - 1] = 0;
+
+		// the file name follows the last backslash
+		Modules[i].ModuleName = Path;
+
+		for(j = 0; Path[j] != 0; j++)
+		{
+			if(Path[j] == '\\')
+				Modules[i].ModuleName = &Path[j + 1];
+		}
+
+		Modules[i].Next = (i + 1 < Count) ? &Modules[i + 1] : NULL;
+	}
+
+	Current = LhModuleSnapshot;
+
+	if(Current != InExpected)
+	{
+		RtlFreeMemory(InSnapshot);
+
+		return FALSE;
+	}
+
+	if((Current != NULL) && (Current->Count == Count))
+	{
+		for(i = 0; i < Count; i++)
+		{
+			if((Current->Modules[i].BaseAddress != Modules[i].BaseAddress) ||
+					(Current->Modules[i].ImageSize != Modules[i].ImageSize))
+				break;
+		}
+
+		if(i == Count)
+		{
+			RtlFreeMemory(InSnapshot);
+
+			return TRUE;
+		}
+	}
+
+	InSnapshot->Retired = NULL;
+	InSnapshot->QuiescentShards = 0;
+
+	if(InterlockedCompareExchangePointer((PVOID volatile*)&LhModuleSnapshot, InSnapshot, Current) != Current)
+	{
+		RtlFreeMemory(InSnapshot);
+
+		return FALSE;
+	}
+
+	if(Current != NULL)
+		LhRetireModuleSnapshot(Current);
+
+	LhReclaimModuleSnapshots();
+
+	return TRUE;
+}
+
+static BOOL LhApplyModuleDelta(
+			UCHAR* InImageBase,
+			ULONG InImageSize,
+			CHAR* InPath)
+{
+/*
+Description:
+
+    Publishes a copy of the current snapshot, without the given module
+    if it has been unloaded or with it if it has been loaded. In the latter
+    case all modules overlapping its image are removed. 
+
+Parameters:
+
+    - InPath
+
+        The path of a loaded module, NULL if the module has been unloaded.
+
+Returns:
+
+    FALSE if there is not enough memory.
+*/
+	MODULE_SNAPSHOT*		Current;
+	MODULE_SNAPSHOT*		Snapshot;
+	MODULE_INFORMATION*		Mod;
+	ULONG					Count;
+	ULONG					i;
+
+	do
+	{
+		Current = LhModuleSnapshot;
+		Count = (Current != NULL) ? Current->Count : 0;
+
+		if((Snapshot = LhAllocateModuleSnapshot(Count + 1)) == NULL)
+			return FALSE;
+
+		for(i = 0; i < Count; i++)
+		{
+			Mod = &Current->Modules[i];
+
+			if(InPath == NULL)
+			{
+				if(Mod->BaseAddress == InImageBase)
+					continue;
+			}
+			else
+			{
+				if((Mod->BaseAddress < InImageBase + InImageSize) && (InImageBase < Mod->BaseAddress + Mod->ImageSize))
+					continue;
+			}
+
+			Snapshot->Modules[Snapshot->Count++] = *Mod;
+		}
+
+		if(InPath != NULL)
+		{
+			Mod = &Snapshot->Modules[Snapshot->Count++];
+
+			Mod->BaseAddress = InImageBase;
+			Mod->ImageSize = InImageSize;
+
+			memcpy(Mod->Path, InPath, sizeof(Mod->Path));
+		}
+	}
+	while(!LhPublishModuleSnapshot(Snapshot, Current));
+
+	return TRUE;
+}
+
+void LhApplyModuleNotification(
+			BOOL InIsLoaded,
+			void* InImageBase,
+			SIZE_T InImageSize,
+			UNICODE_STRING* InImagePath)
+{
+/*
+Description:
+
+    Applies a load or unload notification of the loader to the module 
+    list. If this fails, the next lookup missing a module will fall back
+    to a full rescan.
+
+Parameters:
+
+    - InImagePath
+
+        The full path of the image, only required if it has been loaded.
+*/
+	CHAR					Path[256];
+	ULONG					Length = 0;
+
+	if(InIsLoaded)
+	{
+		if((InImagePath != NULL) && (InImagePath->Buffer != NULL))
+		{
+#ifndef DRIVER
+			Length = (ULONG)WideCharToMultiByte(
+				CP_ACP, 0, 
+				InImagePath->Buffer, InImagePath->Length / sizeof(WCHAR), 
+				Path, sizeof(Path) - 1, 
+				NULL, NULL);
+#else
+			// kernel paths are plain ASCII...
+			for(Length = 0; (Length < InImagePath->Length / sizeof(WCHAR)) && (Length < sizeof(Path) - 1); Length++)
+			{
+				Path[Length] = (InImagePath->Buffer[Length] < 0x80) ? (CHAR)InImagePath->Buffer[Length] : '?';
+			}
+#endif
+		}
+
+		Path[Length] = 0;
+	}
+
+	if((InImageSize > MAXULONG) || !LhApplyModuleDelta((UCHAR*)InImageBase, (ULONG)InImageSize, InIsLoaded ? Path : NULL))
+		LhModuleListChanged = TRUE;
 
-	if(LhModuleArray != NULL)
-		RtlFreeMemory(LhModuleArray);
+#ifdef DRIVER
+	// there is no unload notification for drivers, so the list is never known to be complete
+	LhModuleListChanged = TRUE;
+#endif
+}
+
+#ifndef DRIVER
+
+static VOID CALLBACK LhDllNotification(
+			ULONG InReason,
+			LDR_DLL_NOTIFICATION_DATA* InData,
+			PVOID InContext)
+{
+	if(InReason == LDR_DLL_NOTIFICATION_REASON_LOADED)
+		LhApplyModuleNotification(TRUE, InData->DllBase, InData->SizeOfImage, InData->FullDllName);
+	else if(InReason == LDR_DLL_NOTIFICATION_REASON_UNLOADED)
+		LhApplyModuleNotification(FALSE, InData->DllBase, InData->SizeOfImage, NULL);
 }
 
+#endif
+
+
+#ifdef DRIVER
+
 EASYHOOK_NT_INTERNAL LhUpdateModuleInformation()
 {
 	NTSTATUS						NtStatus;
@@ -92,13 +508,19 @@ EASYHOOK_NT_INTERNAL LhUpdateModuleInformation()
 	ULONG							RequiredSize = 0;
 	ULONG							i;
 	PSYSTEM_MODULE					Mod;
-	MODULE_INFORMATION*				List = NULL;
+	MODULE_SNAPSHOT*				Snapshot = NULL;
+
+	MODULE_SNAPSHOT*				Expected;
 
 	if(!LhModuleListChanged)
 		return STATUS_SUCCESS;
 
 	LhModuleListChanged = FALSE;
 
+LABEL_RESCAN:
+
+	Expected = LhModuleSnapshot;
+
 	if(ZwQuerySystemInformation(11, NULL, 0, &RequiredSize) != STATUS_INFO_LENGTH_MISMATCH)
 		THROW(STATUS_INTERNAL_ERROR, L"Unable to enumerate system modules.");
 
@@ -108,67 +530,53 @@ EASYHOOK_NT_INTERNAL LhUpdateModuleInformation()
 	if(!RTL_SUCCESS(ZwQuerySystemInformation(11, NativeList, RequiredSize, &RequiredSize)))
 		THROW(STATUS_INTERNAL_ERROR, L"Unable to enumerate system modules.");
 
-	if((List = RtlAllocateMemory(FALSE, sizeof(MODULE_INFORMATION) * NativeList->Count)) == NULL)
+	if((Snapshot = LhAllocateModuleSnapshot(NativeList->Count)) == NULL)
 		THROW(STATUS_NO_MEMORY, L"Unable to allocate memory.");
 
 	for(i = 0; i < NativeList->Count; i++)
 	{
 		Mod = &NativeList->Modules[i];
 
-		List[i].BaseAddress = Mod->ImageBaseAddress;
-		List[i].ImageSize = Mod->ImageSize;
-		List[i].ModuleName = Mod->Name + Mod->NameOffset;
+		Snapshot->Modules[i].BaseAddress = Mod->ImageBaseAddress;
+		Snapshot->Modules[i].ImageSize = Mod->ImageSize;
 		
-		memcpy(List[i].Path, Mod->Name, 256);
-
-		if(i + 1 < NativeList->Count)
-			List[i].Next = &List[i + 1];
-		else
-			List[i].Next = NULL;
+		memcpy(Snapshot->Modules[i].Path, Mod->Name, 256);
 	}
 
-	RtlAcquireLock(&GlobalHookLock);
+	Snapshot->Count = NativeList->Count;
+
+	// a notification has changed the list while we were scanning...
+	if(!LhPublishModuleSnapshot(Snapshot, Expected))
 	{
-		if(LhNativeModuleArray != NULL)
-			RtlFreeMemory(LhNativeModuleArray);
+		Snapshot = NULL;
+
+		RtlFreeMemory(NativeList);
 
-		if(LhModuleArray != NULL)
-			RtlFreeMemory(LhModuleArray);
+		NativeList = NULL;
 
-		LhNativeModuleArray = NativeList;
-		LhModuleArray = List;
-		LhModuleCount = NativeList->Count;
+		goto LABEL_RESCAN;
 	}
-	RtlReleaseLock(&GlobalHookLock);
+
+	Snapshot = NULL;
 
     RETURN;
 
 THROW_OUTRO:
+	{
+		if(Snapshot != NULL)
+			RtlFreeMemory(Snapshot);
+	}
+FINALLY_OUTRO:
 	{
 		if(NativeList != NULL)
 			RtlFreeMemory(NativeList);
 
-		if(List != NULL)
-			RtlFreeMemory(List);
+		return NtStatus;
 	}
-FINALLY_OUTRO:
-    return NtStatus;
 }
 
 #else
 
-void LhModuleInfoFinalize()
-{
-	if(LhNativeModuleArray != NULL)
-		RtlFreeMemory(LhNativeModuleArray);
-
-	if(LhModuleArray != NULL)
-		RtlFreeMemory(LhModuleArray);
-
-	if(LhNativePathArray != NULL)
-		RtlFreeMemory(LhNativePathArray);
-}
-
 EASYHOOK_NT_INTERNAL LhUpdateModuleInformation()
 {
 	
@@ -178,23 +586,41 @@ Description:
     Is supposed to be called interlocked... "ProcessModules" is 
     outsourced to prevent "__chkstk".
     Will just enumerate current process modules and extract
-    required information for each of them.
+    required information for each of them. Loader notifications
+    are registered by the first call, so the list is kept up to
+    date afterwards.
 */
     LONG					NtStatus = STATUS_UNHANDLED_EXCEPTION;
     ULONG					Index;
     ULONG					ModIndex;
-    MODULEINFO*				NativeList = NULL;
     ULONG					ModuleCount;
-	MODULEINFO*				Mod = NULL;
-	MODULE_INFORMATION*		List = NULL;
-	CHAR*					PathList = NULL;
-	CHAR*					ModPath = NULL;
-	ULONG					ModPathSize = 0;
-	LONG					iChar = 0;
+	MODULEINFO				NativeInfo;
+	MODULE_INFORMATION*		Mod;
+	MODULE_SNAPSHOT*		Snapshot = NULL;
+	MODULE_SNAPSHOT*		Expected;
+	PROC_LdrRegisterDllNotification*	Register;
+
+LABEL_RESCAN:
 
     // enumerate modules...
 	RtlAcquireLock(&GlobalHookLock);
 	{
+		if(!LhIsDllNotificationProbed)
+		{
+			LhIsDllNotificationProbed = TRUE;
+
+			Register = (PROC_LdrRegisterDllNotification*)GetProcAddress(hNtDll, "LdrRegisterDllNotification");
+
+			if((Register != NULL) && !RTL_SUCCESS(Register(0, LhDllNotification, NULL, &LhDllNotificationCookie)))
+				LhDllNotificationCookie = NULL;
+		}
+
+		// notifications received from now on are applied to the current snapshot
+		if(LhDllNotificationCookie != NULL)
+			LhModuleListChanged = FALSE;
+
+		Expected = LhModuleSnapshot;
+
 		if(!EnumProcessModules(
 				GetCurrentProcess(),
 				ProcessModules,
@@ -210,14 +636,11 @@ Description:
 
     ModuleCount /= sizeof(HMODULE);
 
-    // retrieve module information
-    if((NativeList = (MODULEINFO*)RtlAllocateMemory(FALSE, ModuleCount * sizeof(NativeList[0]))) == NULL)
-        THROW(STATUS_NO_MEMORY, L"Unable to allocate memory for module information.");
-
-	if((List = (MODULE_INFORMATION*)RtlAllocateMemory(TRUE, sizeof(MODULE_INFORMATION) * ModuleCount)) == NULL)
-		THROW(STATUS_NO_MEMORY, L"Unable to allocate memory.");
+	if(ModuleCount > sizeof(ProcessModules) / sizeof(HMODULE))
+		ModuleCount = sizeof(ProcessModules) / sizeof(HMODULE);
 
-	if((PathList = (CHAR*)RtlAllocateMemory(TRUE, MAX_PATH * ModuleCount)) == NULL)
+    // retrieve module information
+	if((Snapshot = LhAllocateModuleSnapshot(ModuleCount)) == NULL)
 		THROW(STATUS_NO_MEMORY, L"Unable to allocate memory.");
 
     for(Index = 0, ModIndex = 0; Index < ModuleCount; Index++)
@@ -226,75 +649,43 @@ Description:
         if(!GetModuleInformation(
                 GetCurrentProcess(),
                 ProcessModules[Index],
-                &NativeList[ModIndex],
-                sizeof(NativeList[ModIndex])))
+                &NativeInfo,
+                sizeof(NativeInfo)))
             continue;
 
+		Mod = &Snapshot->Modules[ModIndex];
+
 		GetModuleFileNameA(
 				ProcessModules[Index],
-				&PathList[ModIndex * MAX_PATH],
-				MAX_PATH);
+				Mod->Path,
+				sizeof(Mod->Path));
 
 		if(GetLastError() != ERROR_SUCCESS)
 			continue;
 
-        Mod = &NativeList[ModIndex];
-
 		// normalize module information
-		List[ModIndex].BaseAddress = (UCHAR*)Mod->lpBaseOfDll;
-		List[ModIndex].ImageSize = Mod->SizeOfImage;
-
-		memcpy(List[ModIndex].Path, &PathList[ModIndex * MAX_PATH], MAX_PATH + 1);
-
-		ModPath = List[ModIndex].Path;
-		ModPathSize = RtlAnsiLength(ModPath);
-
-		for(iChar = ModPathSize; iChar >= 0; iChar--)
-		{
-			if(ModPath[iChar] == '\\')
-			{
-				List[ModIndex].ModuleName = &ModPath[iChar + 1];
-
-				break;
-			}
-		}
-
-		if(ModIndex + 1 < ModuleCount)
-			List[ModIndex].Next = &List[ModIndex + 1];
-		else
-			List[ModIndex].Next = NULL;
+		Mod->BaseAddress = (UCHAR*)NativeInfo.lpBaseOfDll;
+		Mod->ImageSize = NativeInfo.SizeOfImage;
 
         ModIndex++;
     }
 
-    // save changes...
-	RtlAcquireLock(&GlobalHookLock);
-	{
-		if(LhNativeModuleArray != NULL)
-			RtlFreeMemory(LhNativeModuleArray);
-
-		if(LhModuleArray != NULL)
-			RtlFreeMemory(LhModuleArray);
+	Snapshot->Count = ModIndex;
 
-		if(LhNativePathArray != NULL)
-			RtlFreeMemory(LhNativePathArray);
+    // save changes, unless a notification has changed the list in the meantime...
+	if(!LhPublishModuleSnapshot(Snapshot, Expected))
+	{
+		Snapshot = NULL;
 
-		LhNativePathArray = PathList;
-		LhNativeModuleArray = NativeList;
-		LhModuleArray = List;
-		LhModuleCount = ModIndex;
+		goto LABEL_RESCAN;
 	}
-	RtlReleaseLock(&GlobalHookLock);
 
     RETURN;
 
 THROW_OUTRO:
 	{
-		if(NativeList != NULL)
-			RtlFreeMemory(NativeList);
-
-		if(List != NULL)
-			RtlFreeMemory(List);
+		if(Snapshot != NULL)
+			RtlFreeMemory(Snapshot);
 	}
 FINALLY_OUTRO:
     return NtStatus;
@@ -331,36 +722,30 @@ Parameters:
 		depending on the caller's context. This pointer must be specified if no
 		module buffer is passed; if one is passed, this parameter is optional.
 */
-	ULONG					ModIndex = 0;
+	ULONG					ModIndex;
 	NTSTATUS				NtStatus;
-	MODULE_INFORMATION*		List;
-
-	if(IsValidPointer(OutModuleArray, InMaxModuleCount * sizeof(PVOID)))
-	{
-		// loop through the module list...
-		RtlAcquireLock(&GlobalHookLock);
-		{
-			if(IsValidPointer(OutModuleCount, sizeof(ULONG)))
-				*OutModuleCount = LhModuleCount;
+	MODULE_SNAPSHOT*		Snapshot;
+	ULONG					Count;
+	volatile LONG*			Shard = LhGetModuleReaderShard(&Snapshot);
 
-			List = LhModuleArray;
+	InterlockedIncrement(Shard);
 
-			// walk through process modules
-			while(List != NULL)
-			{
-				if(ModIndex > InMaxModuleCount)
-				{
-					RtlReleaseLock(&GlobalHookLock);
+	Snapshot = LhModuleSnapshot;
+	Count = (Snapshot != NULL) ? Snapshot->Count : 0;
 
-					THROW(STATUS_BUFFER_TOO_SMALL, L"The given buffer was filled but could not hold all modules.");
-				}
+	if(IsValidPointer(OutModuleArray, InMaxModuleCount * sizeof(PVOID)))
+	{
+		if(IsValidPointer(OutModuleCount, sizeof(ULONG)))
+			*OutModuleCount = Count;
 
-				OutModuleArray[ModIndex++] = (HMODULE)List->BaseAddress;
+		// walk through process modules
+		for(ModIndex = 0; ModIndex < Count; ModIndex++)
+		{
+			if(ModIndex >= InMaxModuleCount)
+				THROW(STATUS_BUFFER_TOO_SMALL, L"The given buffer was filled but could not hold all modules.");
 
-				List = List->Next;
-			}	
-		}	
-		RtlReleaseLock(&GlobalHookLock);
+			OutModuleArray[ModIndex] = (HMODULE)Snapshot->Modules[ModIndex].BaseAddress;
+		}
 	}
 	else
 	{
@@ -368,17 +753,99 @@ Parameters:
 		if(!IsValidPointer(OutModuleCount, sizeof(ULONG)))
 			THROW(STATUS_INVALID_PARAMETER_3, L"If no buffer is specified you need to pass a module count storage.");
 
-		*OutModuleCount = LhModuleCount;
+		*OutModuleCount = Count;
 	}
 
 	RETURN;
 
 THROW_OUTRO:
 FINALLY_OUTRO:
-    return NtStatus;
-}
+	{
+		InterlockedDecrement(Shard);
+
+		return NtStatus;
+	}
+}
+
+
+
+static MODULE_INFORMATION* LhLookupModule(
+            MODULE_SNAPSHOT* InSnapshot,
+            UCHAR* InPointer,
+            MODULE_HINT* InHint)
+{
+/*
+Description:
+
+    Searches the module containing the given pointer in the given snapshot.
+    The last hit of the calling thread is tried first, if it has one.
+*/
+	MODULE_INFORMATION*		Mod;
+	ULONG					Low = 0;
+	ULONG					High = InSnapshot->Count;
+	ULONG					Middle;
+
+	// the hint might refer to a released snapshot whose memory has been reused
+	if((InHint != NULL) && (InHint->Snapshot == InSnapshot) && (InHint->Index < InSnapshot->Count))
+	{
+		Mod = &InSnapshot->Modules[InHint->Index];
+
+		if((InPointer >= Mod->BaseAddress) && (InPointer < Mod->BaseAddress + Mod->ImageSize))
+			return Mod;
+	}
+
+	// find the last module starting at or below the pointer
+	while(Low < High)
+	{
+		Middle = Low + (High - Low) / 2;
+
+		if(InSnapshot->Modules[Middle].BaseAddress <= InPointer)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if(Low == 0)
+		return NULL;
 
+	Mod = &InSnapshot->Modules[Low - 1];
+
+	if(InPointer >= Mod->BaseAddress + Mod->ImageSize)
+		return NULL;
+
+	if(InHint != NULL)
+	{
+		InHint->Snapshot = InSnapshot;
+		InHint->Index = Low - 1;
+	}
+
+	return Mod;
+}
+
+static BOOL LhIsRescanRequired(UCHAR* InPointer)
+{
+/*
+Description:
+
+    A pointer not found in the current snapshot only requires a rescan
+    if the module list might be out of date and it hasn't missed recently.
+*/
+	MODULE_MISS*			Miss = LhGetModuleMiss(InPointer);
 
+	if((InPointer == NULL) || (InPointer == (UCHAR*)~0) || !LhModuleListChanged)
+		return FALSE;
+
+	return (Miss->Region != ((ULONG_PTR)InPointer >> LH_MODULE_MISS_SHIFT)) || 
+			(LhGetTickCount() - Miss->Time >= LH_MODULE_MISS_TIMEOUT);
+}
+
+static void LhRememberModuleMiss(UCHAR* InPointer)
+{
+	MODULE_MISS*			Miss = LhGetModuleMiss(InPointer);
+
+	Miss->Region = (ULONG_PTR)InPointer >> LH_MODULE_MISS_SHIFT;
+	Miss->Time = LhGetTickCount();
+}
 
 EASYHOOK_NT_EXPORT LhBarrierPointerToModule(
               PVOID InPointer,
@@ -388,7 +855,10 @@ EASYHOOK_NT_EXPORT LhBarrierPointerToModule(
 Description:
 
     Translates the given pointer (likely a method) to its
-    owning module if possible.
+    owning module if possible. Lookups don't take any lock
+    and the calling thread's last hit is tried first. A miss
+    only causes a full rescan if the module list might be out
+    of date and the pointer hasn't missed recently.
 
 Parameters:
 
@@ -409,49 +879,65 @@ Returns:
     UCHAR*					Pointer = (UCHAR*)InPointer;
     NTSTATUS				NtStatus;
     BOOL					CanTryAgain = TRUE;
-	MODULE_INFORMATION*		List;
+	MODULE_SNAPSHOT*		Snapshot;
+	MODULE_INFORMATION*		Mod;
+	MODULE_HINT*			Hint;
+	volatile LONG*			Shard = LhGetModuleReaderShard(&Mod);
 
 	if(!IsValidPointer(OutModule, sizeof(MODULE_INFORMATION)))
 		THROW(STATUS_INVALID_PARAMETER_2, L"The given module storage is invalid.");
 
+	Hint = LhBarrierGetModuleHint();
+
 LABEL_TRY_AGAIN:
 
-	RtlAcquireLock(&GlobalHookLock);
+	InterlockedIncrement(Shard);
 	{
-		List = LhModuleArray;
+		if((Snapshot = LhModuleSnapshot) == NULL)
+			Mod = NULL;
+		else
+			Mod = LhLookupModule(Snapshot, Pointer, Hint);
 
-		// walk through process modules
-		while(List != NULL)
+#ifdef DRIVER
+		// the entry of an unloaded driver stays until the next rescan...
+		if((Mod != NULL) && !MmIsAddressValid(Mod->BaseAddress))
 		{
-			if((Pointer >= List->BaseAddress) && (Pointer <= List->BaseAddress + List->ImageSize))
-			{
-				*OutModule = *List;
+			LhModuleListChanged = TRUE;
 
-				RtlReleaseLock(&GlobalHookLock);
+			Mod = NULL;
+		}
+#endif
 
-				RETURN;
-			}
+		if(Mod != NULL)
+		{
+			*OutModule = *Mod;
 
-			List = List->Next;
+			// don't let the copy refer to the snapshot's path
+			OutModule->ModuleName = OutModule->Path + (Mod->ModuleName - Mod->Path);
 		}
 	}
-	RtlReleaseLock(&GlobalHookLock);
+	InterlockedDecrement(Shard);
+
+	if(Mod != NULL)
+		RETURN;
 
     if((InPointer == NULL) || (InPointer == (PVOID)~0))
     {
         // this pointer does not belong to any module...
     }
-    else
+	else if(!CanTryAgain)
+	{
+		// remember the miss to prevent a rescan for each call from generated code...
+		LhRememberModuleMiss(Pointer);
+	}
+	else if(LhIsRescanRequired(Pointer))
     {
         // unable to find calling module...
         FORCE(LhUpdateModuleInformation());
 
-        if(CanTryAgain)
-        {
-            CanTryAgain = FALSE;
+        CanTryAgain = FALSE;
 
-            goto LABEL_TRY_AGAIN;
-        }
+        goto LABEL_TRY_AGAIN;
     }
 
     THROW(STATUS_NOT_FOUND, L"Unable to determine module.");
@@ -534,6 +1020,408 @@ FINALLY_OUTRO:
     }
 }
 
+// the longest near call, "call [base+index*scale+disp32]", is seven bytes
+#define LH_MAX_CALL_SIZE        7
+
+static BOOL LhIsPrecededByCall(UCHAR* InReturnAddress)
+{
+/*
+Description:
+
+    Checks whether the given address directly follows a near call,
+    either "call rel32" or one of the "call r/m" (FF /2) forms.
+*/
+	UCHAR*					Call;
+	UCHAR					ModRM;
+	ULONG					Size;
+	ULONG					Length;
+
+	if(InReturnAddress[-5] == 0xE8)
+		return TRUE;
+
+	for(Length = 2; Length <= LH_MAX_CALL_SIZE; Length++)
+	{
+		Call = InReturnAddress - Length;
+		ModRM = Call[1];
+
+		if((Call[0] != 0xFF) || (((ModRM >> 3) & 7) != 2))
+			continue;
+
+		// the size of the ModR/M operand has to match the distance
+		Size = 2;
+
+		if(((ModRM & 0xC0) != 0xC0) && ((ModRM & 7) == 4))
+		{
+			// SIB, without a base if mod is zero and the base is five
+			Size++;
+
+			if(((ModRM & 0xC0) == 0x00) && ((Call[2] & 7) == 5))
+				Size += 4;
+		}
+
+		switch(ModRM & 0xC0)
+		{
+		case 0x00: if((ModRM & 7) == 5) Size += 4; break;
+		case 0x40: Size += 1; break;
+		case 0x80: Size += 4; break;
+		}
+
+		if(Size == Length)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static BOOL LhIsReturnAddress(
+			MODULE_SNAPSHOT* InSnapshot,
+			UCHAR* InPointer,
+			MODULE_HINT* InHint,
+			UCHAR** OutMissed)
+{
+/*
+Description:
+
+    Code without frame pointers uses EBP/RBP as general purpose register,
+    so a saved "frame pointer" may hold any value and so may the "return 
+    address" next to it. A return address is only accepted if it lies in a 
+    module of the given snapshot and directly follows a call. Code generated 
+    at runtime is thus never accepted.
+
+Parameters:
+
+    - OutMissed
+
+        Receives the given pointer if it isn't part of any module but a
+        rescan of the module list might find it.
+*/
+	MODULE_INFORMATION*		Mod;
+
+	if((InSnapshot == NULL) || ((Mod = LhLookupModule(InSnapshot, InPointer, InHint)) == NULL))
+	{
+		if(LhIsRescanRequired(InPointer))
+			*OutMissed = InPointer;
+
+		return FALSE;
+	}
+
+	// the image is mapped as a whole, so the call before it can be read
+	if(InPointer < Mod->BaseAddress + LH_MAX_CALL_SIZE)
+		return FALSE;
+
+#ifdef DRIVER
+	// ... except for discarded sections, like INIT
+	if(!MmIsAddressValid(InPointer - LH_MAX_CALL_SIZE) || !MmIsAddressValid(InPointer - 1))
+		return FALSE;
+#endif
+
+	return LhIsPrecededByCall(InPointer);
+}
+
+static ULONG LhWalkFramePointers(
+			void** InAddrOfRetAddr,
+			ULONG_PTR InFramePointer,
+			ULONG InFramesToSkip,
+			MODULE_SNAPSHOT* InSnapshot,
+			MODULE_HINT* InHint,
+			STACK_FRAME_INFORMATION* OutFrames,
+			ULONG InMaxFrameCount,
+			UCHAR** OutMissed)
+{
+/*
+Description:
+
+    Follows the chain of saved frame pointers, starting with the given one.
+    The walk stops at the first frame outside of the current stack or not
+    above its predecessor and at the first return address rejected by 
+    LhIsReturnAddress(). A method without a frame pointer doesn't leave a 
+    trace on the chain, so the walk either skips its frame or, because its
+    caller's frame pointer has been overwritten, ends there.
+
+Parameters:
+
+    - InAddrOfRetAddr
+
+        The return address of the capturing method. It is always reported
+        and all frames below it are ignored.
+
+    - InSnapshot
+
+        The module snapshot to validate return addresses with. The caller
+        has to be registered as its reader.
+
+    - OutMissed
+
+        Receives the return address that ended the walk, if a rescan of 
+        the module list might have accepted it. Otherwise it is left
+        untouched.
+*/
+	ULONG_PTR				Low;
+	ULONG_PTR				High;
+	ULONG_PTR				Frame = InFramePointer;
+	ULONG_PTR				Next;
+	ULONG					Count = 0;
+	ULONG					Skip = InFramesToSkip;
+	void*					RetAddr = *InAddrOfRetAddr;
+
+#ifndef DRIVER
+	Low = (ULONG_PTR)((NT_TIB*)NtCurrentTeb())->StackLimit;
+	High = (ULONG_PTR)((NT_TIB*)NtCurrentTeb())->StackBase;
+#else
+	IoGetStackLimits(&Low, &High);
+#endif
+
+	while(Count < InMaxFrameCount)
+	{
+		if(Skip > 0)
+			Skip--;
+		else
+			OutFrames[Count++].ReturnAddress = RetAddr;
+
+		// the frame of the capturing method, if any, lies below its return address
+		do
+		{
+			if((Frame < Low) || (Frame > High - 2 * sizeof(void*)) || ((Frame & (sizeof(void*) - 1)) != 0))
+				return Count;
+
+			Next = ((ULONG_PTR*)Frame)[0];
+			RetAddr = NULL;
+
+			if(Frame > (ULONG_PTR)InAddrOfRetAddr)
+			{
+				if((RetAddr = ((void**)Frame)[1]) == NULL)
+					return Count;
+
+				if(!LhIsReturnAddress(InSnapshot, (UCHAR*)RetAddr, InHint, OutMissed))
+					return Count;
+			}
+			else if(Next <= Frame)
+				return Count;
+
+			// frame pointers always point upwards, the last frame is reported anyway
+			Frame = (Next > Frame) ? Next : 0;
+		}
+		while(RetAddr == NULL);
+	}
+
+	return Count;
+}
+
+EASYHOOK_NT_EXPORT LhBarrierCaptureStackTrace(
+            ULONG InFlags,
+            ULONG InFramesToSkip,
+            STACK_FRAME_INFORMATION* OutFrames,
+            ULONG InMaxFrameCount,
+            ULONG* OutFrameCount)
+{
+/*
+Description:
+
+    Creates a call stack trace and attributes each frame to its owning
+    module in one pass over the current module snapshot. The module list 
+    is rescanned at most once for the whole trace.
+
+Parameters:
+
+    - InFlags
+
+        EASYHOOK_STACK_TRACE_UNWIND uses RtlCaptureStackBackTrace(), which
+        unwinds through unwind information on x64. It is precise but slow.
+
+        EASYHOOK_STACK_TRACE_FRAME_POINTERS follows the saved frame pointers.
+        It is several times faster, but only accepts return addresses within
+        known modules that directly follow a call. The trace ends at the first
+        one that doesn't, which is where a method without frame pointer has
+        overwritten EBP/RBP or where code generated at runtime is reached. 
+        Such a method may also be missing from the trace. Most x64 code is
+        compiled without frame pointers, so there this mostly yields a short
+        trace. On x86, RtlCaptureStackBackTrace() also follows frame pointers.
+
+    - InFramesToSkip
+
+        The count of frames to skip, starting with the caller of this method.
+
+    - OutFrames
+
+        An array receiving the frames on the call stack.
+
+    - InMaxFrameCount
+
+        The length of the frame array, which is the maximum depth of the trace.
+
+    - OutFrameCount
+
+        Receives the actual count of frames.
+
+Returns:
+
+    STATUS_NOT_IMPLEMENTED
+
+        Only supported since Windows XP.
+*/
+    NTSTATUS				NtStatus;
+    PVOID					Backup = NULL;
+	CONTEXT					Context;
+	ULONG_PTR				FramePointer;
+	ULONG					Count = 0;
+	ULONG					Chunk;
+	ULONG					Captured;
+	ULONG					Index;
+	BOOL					CanTryAgain = TRUE;
+	UCHAR*					Pointer;
+	UCHAR*					Missed;
+	MODULE_SNAPSHOT*		Snapshot;
+	MODULE_INFORMATION*		Mod;
+	MODULE_HINT				Hint = {NULL, 0};
+	volatile LONG*			Shard = LhGetModuleReaderShard(&Hint);
+
+	if((InFlags & ~EASYHOOK_STACK_TRACE_FRAME_POINTERS) != 0)
+		THROW(STATUS_INVALID_PARAMETER_1, L"Unknown stack trace flags.");
+
+	if((InMaxFrameCount > MAXULONG / sizeof(STACK_FRAME_INFORMATION)) ||
+			!IsValidPointer(OutFrames, InMaxFrameCount * sizeof(STACK_FRAME_INFORMATION)))
+		THROW(STATUS_INVALID_PARAMETER_3, L"The given frame buffer is invalid.");
+
+	if(!IsValidPointer(OutFrameCount, sizeof(ULONG)))
+		THROW(STATUS_INVALID_PARAMETER_5, L"Invalid frame count storage.");
+
+    FORCE(LhBarrierBeginStackTrace(&Backup));
+
+	if((InFlags & EASYHOOK_STACK_TRACE_FRAME_POINTERS) != 0)
+	{
+#ifndef DRIVER
+		if(RtlCaptureContextProc == NULL)
+			RtlCaptureContextProc = (PROC_RtlCaptureContext*)GetProcAddress(hKernel32, "RtlCaptureContext");
+
+		if(RtlCaptureContextProc == NULL)
+			THROW(STATUS_NOT_IMPLEMENTED, L"This method requires Windows XP or later.");
+
+		RtlCaptureContextProc(&Context);
+#else
+		RtlCaptureContext(&Context);
+#endif
+
+#ifdef _M_X64
+		FramePointer = (ULONG_PTR)Context.Rbp;
+#else
+		FramePointer = (ULONG_PTR)Context.Ebp;
+#endif
+
+		if(LhModuleSnapshot == NULL)
+			FORCE(LhUpdateModuleInformation());
+
+		// a return address missing in an outdated snapshot would end the walk early
+LABEL_WALK_AGAIN:
+
+		Missed = NULL;
+
+		InterlockedIncrement(Shard);
+		{
+			Count = LhWalkFramePointers((void**)_AddressOfReturnAddress(), FramePointer, InFramesToSkip,
+					LhModuleSnapshot, &Hint, OutFrames, InMaxFrameCount, &Missed);
+		}
+		InterlockedDecrement(Shard);
+
+		if(Missed != NULL)
+		{
+			if(!CanTryAgain)
+				LhRememberModuleMiss(Missed);
+			else
+			{
+				FORCE(LhUpdateModuleInformation());
+
+				CanTryAgain = FALSE;
+
+				goto LABEL_WALK_AGAIN;
+			}
+		}
+	}
+	else
+	{
+#ifndef DRIVER
+		if(RtlCaptureStackBackTrace == NULL)
+			RtlCaptureStackBackTrace = (PROC_RtlCaptureStackBackTrace*)GetProcAddress(hKernel32, "RtlCaptureStackBackTrace");
+
+		if(RtlCaptureStackBackTrace == NULL)
+			THROW(STATUS_NOT_IMPLEMENTED, L"This method requires Windows XP or later.");
+#endif
+
+		/*
+			The addresses are captured into the front of the frame array, at most 62 at 
+			once because of Windows XP, and are spread out afterwards...
+		*/
+		while(Count < InMaxFrameCount)
+		{
+			Chunk = (InMaxFrameCount - Count < 62) ? InMaxFrameCount - Count : 62;
+			Captured = RtlCaptureStackBackTrace(1 + InFramesToSkip + Count, Chunk, (PVOID*)OutFrames + Count, NULL);
+
+			Count += Captured;
+
+			if(Captured < Chunk)
+				break;
+		}
+
+		for(Index = Count; Index > 0; Index--)
+		{
+			OutFrames[Index - 1].ReturnAddress = ((PVOID*)OutFrames)[Index - 1];
+		}
+	}
+
+LABEL_TRY_AGAIN:
+
+	Missed = NULL;
+
+	InterlockedIncrement(Shard);
+	{
+		Snapshot = LhModuleSnapshot;
+
+		for(Index = 0; Index < Count; Index++)
+		{
+			Pointer = (UCHAR*)OutFrames[Index].ReturnAddress;
+
+			if((Snapshot != NULL) && ((Mod = LhLookupModule(Snapshot, Pointer, &Hint)) != NULL))
+			{
+				OutFrames[Index].ModuleBase = Mod->BaseAddress;
+				OutFrames[Index].ModuleSize = Mod->ImageSize;
+			}
+			else
+			{
+				OutFrames[Index].ModuleBase = NULL;
+				OutFrames[Index].ModuleSize = 0;
+
+				if(!CanTryAgain)
+					LhRememberModuleMiss(Pointer);
+				else if((Missed == NULL) && LhIsRescanRequired(Pointer))
+					Missed = Pointer;
+			}
+		}
+	}
+	InterlockedDecrement(Shard);
+
+	if(Missed != NULL)
+	{
+		// unable to find a calling module...
+		FORCE(LhUpdateModuleInformation());
+
+		CanTryAgain = FALSE;
+
+		goto LABEL_TRY_AGAIN;
+	}
+
+	*OutFrameCount = Count;
+
+    RETURN;
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+     {
+        if(Backup != NULL)
+            LhBarrierEndStackTrace(Backup);
+
+        return NtStatus;
+    }
+}
+
 EASYHOOK_NT_EXPORT LhBarrierGetCallingModule(MODULE_INFORMATION* OutModule)
 {
 /*
@@ -560,4 +1448,82 @@ Returns:
 THROW_OUTRO:
 FINALLY_OUTRO:
 	return NtStatus;
-}
\ No newline at end of file
+}
+
+
+EASYHOOK_NT_EXPORT LhSetCallerFilter(
+            TRACED_HOOK_HANDLE InHandle,
+            BOOL InIsExclusive,
+            HMODULE* InModuleList,
+            ULONG InModuleCount)
+{
+/*
+Description:
+
+    Sets the caller filter of the given hook. An inclusive filter only 
+    intercepts calls returning into one of the listed modules, an exclusive
+    one intercepts all other calls. Calls rejected by the filter are passed
+    to the original method without entering the barrier. An exclusive
+    filter without modules accepts all callers, which is the default.
+
+Parameters:
+
+    - InHandle
+
+        The hook handle whose caller filter is going to be set. Raw hooks
+        are not supported.
+
+    - InIsExclusive
+
+        TRUE if calls from the listed modules shall not be intercepted,
+        FALSE if only those shall be intercepted.
+
+    - InModuleList
+
+        An array of module handles. Any address within a module is accepted.
+
+    - InModuleCount
+
+        The count of entries listed in the module list.
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    NTSTATUS                NtStatus;
+	HOOK_CALLER_RANGE*		Ranges = NULL;
+	MODULE_INFORMATION		Module;
+	ULONG					Index;
+
+    if(!LhIsValidHandle(InHandle, &Hook))
+        THROW(STATUS_INVALID_PARAMETER_1, L"The given hook handle is invalid or already disposed.");
+
+	if(Hook->IsRaw)
+		THROW(STATUS_NOT_SUPPORTED, L"Raw hooks don't support caller filters.");
+
+	if((InModuleCount > MAXULONG / sizeof(HOOK_CALLER_RANGE)) ||
+			!IsValidPointer(InModuleList, InModuleCount * sizeof(HMODULE)))
+		THROW(STATUS_INVALID_PARAMETER_3, L"The given module list is invalid.");
+
+	if((Ranges = (HOOK_CALLER_RANGE*)RtlAllocateMemory(FALSE, InModuleCount * sizeof(HOOK_CALLER_RANGE) + 1)) == NULL)
+		THROW(STATUS_NO_MEMORY, L"Unable to allocate memory.");
+
+	for(Index = 0; Index < InModuleCount; Index++)
+	{
+		if(!RTL_SUCCESS(LhBarrierPointerToModule(InModuleList[Index], &Module)))
+			THROW(STATUS_INVALID_PARAMETER_3, L"The given module list contains an address not belonging to any module.");
+
+		Ranges[Index].Start = Module.BaseAddress;
+		Ranges[Index].End = Module.BaseAddress + Module.ImageSize;
+	}
+
+	FORCE(LhBarrierSetCallerFilter(Hook, InIsExclusive, Ranges, InModuleCount));
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+	{
+		if(Ranges != NULL)
+			RtlFreeMemory(Ranges);
+
+		return NtStatus;
+	}
+}
@@ -23,15 +23,34 @@
 #include "stdafx.h"
 
 
-UCHAR* GetTrampolinePtr();
-ULONG GetTrampolineSize();
+// size of the jumper written into the entry point
+#ifdef X64_DRIVER
+    #define LH_JUMPER_SIZE          12
+#else
+    #define LH_JUMPER_SIZE          5
+#endif
 
-LOCAL_HOOK_INFO             GlobalHookListHead;
 LOCAL_HOOK_INFO             GlobalRemovalListHead;
 RTL_SPIN_LOCK               GlobalHookLock;
-static ULONG                GlobalSlotList[MAX_HOOK_COUNT];
 static LONG                 UniqueIDCounter = 0x10000000;
 
+/*
+    The HLS slots are managed by a bitmap of up to LH_SLOT_SEGMENT_COUNT
+    segments, which are allocated on demand.
+*/
+#define LH_SLOT_SEGMENT_SIZE        1024
+#define LH_SLOT_SEGMENT_WORDS       (LH_SLOT_SEGMENT_SIZE / 32)
+#define LH_SLOT_SEGMENT_COUNT       (LOCAL_HOOK_MAX_SLOTS / LH_SLOT_SEGMENT_SIZE)
+#define LH_SLOT_WORD_COUNT          (LOCAL_HOOK_MAX_SLOTS / 32)
+
+typedef struct _HOOK_SLOT_SEGMENT_
+{
+    volatile LONG           Bits[LH_SLOT_SEGMENT_WORDS];
+}HOOK_SLOT_SEGMENT;
+
+static HOOK_SLOT_SEGMENT* volatile  GlobalSlotSegments[LH_SLOT_SEGMENT_COUNT];
+static volatile LONG                GlobalSlotHint = 0;
+
 void LhCriticalInitialize()
 {
 /*
@@ -39,10 +58,15 @@ Description:
     
     Fail safe initialization of global hooking structures...
 */
-    RtlZeroMemory(&GlobalHookListHead, sizeof(GlobalHookListHead));
     RtlZeroMemory(&GlobalRemovalListHead, sizeof(GlobalRemovalListHead));
 
     RtlInitializeLock(&GlobalHookLock);
+
+    LhRegistryInitialize();
+
+    LhAllocatorInitialize();
+
+    LhRemovalInitialize();
 }
 
 
@@ -83,108 +107,51 @@ Description:
 }
 
 
-EASYHOOK_NT_EXPORT LhInstallHook(
+static NTSTATUS LhPrepareHook(
             void* InEntryPoint,
             void* InHookProc,
             void* InCallback,
-            TRACED_HOOK_HANDLE OutHandle)
+            ULONG InArgFlags,
+            BOOL InIsRaw,
+            LOCAL_HOOK_INFO** OutHook)
 {
 /*
 Description:
 
-    Installs a hook at the given entry point, redirecting all
-    calls to the given hooking method. The returned handle will
-    either be released on library unloading or explicitly through
-    LhUninstallHook() or LhUninstallAllHooks().
-
-Parameters:
-
-    - InEntryPoint
-
-        An entry point to hook. Not all entry points are hookable. In such
-        a case STATUS_NOT_SUPPORTED will be returned.
-
-    - InHookProc
-
-        The method that should be called instead of the given entry point.
-        Please note that calling convention, parameter count and return value
-        shall match EXACTLY!
-
-    - InCallback
-
-        An uninterpreted callback later available through
-        LhBarrierGetCallback().
-
-    - OutPHandle
-
-        The memory portion supplied by *OutHandle is expected to be preallocated
-        by the caller. This structure is then filled by the method on success and
-        must stay valid for hook-life time. Only if you explicitly call one of
-        the hook uninstallation APIs, you can safely release the handle memory.
-
-Returns:
-
-    STATUS_NO_MEMORY
-    
-        Unable to allocate memory around the target entry point.
-    
-    STATUS_NOT_SUPPORTED
-    
-        The target entry point contains unsupported instructions.
-    
-    STATUS_INSUFFICIENT_RESOURCES
-    
-        The limit of MAX_HOOK_COUNT simultaneous hooks was reached.
-    
+    Allocates a hook around the given entry point and emits the trampoline
+    and the relocated entry point. Nothing is published and the entry point
+    is not modified yet. See LhInstallHookEx() for parameters. Raw hooks get
+    a plain jump to the handler instead of the trampoline.
 */
     LOCAL_HOOK_INFO*			Hook = NULL;
     ULONG           			EntrySize;
-    ULONG                       Index;
     LONGLONG          			RelAddr;
     ULONG           			RelocSize;
-    UCHAR			            Jumper[12] = {0xE9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     UCHAR*                      MemoryPtr;
-    ULONGLONG                   AtomicCache;
-    BOOL                        Exists;
+    void*                       HotData;
+    ULONG                       TrampolineSize;
+    LH_ENTRY_POINT              Entry;
     LONG                        NtStatus = STATUS_INTERNAL_ERROR;
 
 #if X64_DRIVER
 	UCHAR			            Jumper_x64[12] = {0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xe0};
-	ULONGLONG					AtomicCache_x64;
-#endif
-
-#ifndef _M_X64
-    UCHAR*			            Ptr;
 #endif
 
-
-    // validate parameters
-    if(!IsValidPointer(InEntryPoint, 1))
-        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid entry point.");
-
-    if(!IsValidPointer(InHookProc, 1))
-        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid hook procedure.");
-
-    if(!IsValidPointer(OutHandle, sizeof(HOOK_TRACE_INFO)))
-        THROW(STATUS_INVALID_PARAMETER_4, L"The hook handle storage is expected to be allocated by the caller.");
-
-    if(OutHandle->Link != NULL)
-        THROW(STATUS_INVALID_PARAMETER_4, L"The given trace handle seems to already be associated with a hook.");
+    *OutHook = NULL;
 
     // allocate around entry point
-	if((Hook = (LOCAL_HOOK_INFO*)LhAllocateMemory(InEntryPoint)) == NULL)
+	if((Hook = (LOCAL_HOOK_INFO*)LhAllocateMemory(InEntryPoint, &HotData)) == NULL)
         THROW(STATUS_NO_MEMORY, L"Failed to allocate memory.");
 
-    FORCE(RtlProtectMemory(Hook, 4096, PAGE_EXECUTE_READWRITE));
+    // this is a patch site, see LhPrepareChainMember()
+    Hook->ChainHead = Hook;
 
     MemoryPtr = (UCHAR*)(Hook + 1);
 
-    // determine entry point size
-#ifdef X64_DRIVER
-	FORCE(EntrySize = LhRoundToNextInstruction(InEntryPoint, 12));
-#else
-    FORCE(EntrySize = LhRoundToNextInstruction(InEntryPoint, 5));
-#endif
+    // decode the instructions overwritten by the jumper, they are relocated below
+    FORCE(LhDecodeEntryPoint(InEntryPoint, LH_JUMPER_SIZE, &Entry));
+
+    EntrySize = Entry.Size;
 
     // create and initialize hook handle
     Hook->NativeSize = sizeof(LOCAL_HOOK_INFO);
@@ -192,9 +159,16 @@ Returns:
     Hook->HookProc = (UCHAR*)InHookProc;
     Hook->TargetProc = (UCHAR*)InEntryPoint;
     Hook->EntrySize = EntrySize;	
-    Hook->IsExecutedPtr = (int*)((UCHAR*)Hook + 2048);
+    Hook->IsExecutedPtr = (LONG_PTR*)HotData;
     Hook->Callback = InCallback;
-    *Hook->IsExecutedPtr = 0;
+    Hook->Chain = Hook;
+
+    // the assembler code jumps to the handler selected by LhBarrierIntro()
+    if((Hook->Handler = (PLOCAL_HOOK_HANDLER)RtlAllocateMemory(TRUE, sizeof(LOCAL_HOOK_HANDLER))) == NULL)
+        THROW(STATUS_NO_MEMORY, L"Failed to allocate memory.");
+
+    Hook->Handler->HookProc = InHookProc;
+    Hook->Handler->Callback = InCallback;
 
     /*
 	    The following will be called by the trampoline before the user defined handler is invoked.
@@ -204,13 +178,14 @@ Returns:
     Hook->HookIntro = (PVOID)LhBarrierIntro;
     Hook->HookOutro = (PVOID)LhBarrierOutro;
 
-    // copy trampoline
     Hook->Trampoline = MemoryPtr; 
-    MemoryPtr += GetTrampolineSize();
+    Hook->IsRaw = InIsRaw;
+    Hook->ArgFlags = InArgFlags;
 
-    Hook->NativeSize += GetTrampolineSize();
+    FORCE(LhEmitTrampoline(Hook, &TrampolineSize));
 
-    RtlCopyMemory(Hook->Trampoline, GetTrampolinePtr(), GetTrampolineSize());
+    MemoryPtr += TrampolineSize;
+    Hook->NativeSize += TrampolineSize;
 
     /*
 	    Relocate entry point (the same for both archs)
@@ -221,7 +196,9 @@ Returns:
     RelocSize = 0;
     Hook->OldProc = MemoryPtr; 
 
-    FORCE(LhRelocateEntryPoint(Hook->TargetProc, EntrySize, Hook->OldProc, &RelocSize));
+    FORCE(LhRelocateEntryPoint(&Entry, Hook->OldProc, &RelocSize));
+
+	ASSERT(RelocSize + 12 <= LOCAL_HOOK_MAX_ENTRY_SIZE,L"install.c - RelocSize + 12 <= LOCAL_HOOK_MAX_ENTRY_SIZE");
 
     MemoryPtr += RelocSize + 12;
     Hook->NativeSize += RelocSize + 12;
@@ -256,197 +233,951 @@ Returns:
 	Hook->TargetBackup_x64 = *((ULONGLONG*)(Hook->TargetProc + 8)); 
 #endif
 
-#ifndef _M_X64
-
-    /*
-	    Replace absolute placeholders with proper addresses...
-    */
-    Ptr = Hook->Trampoline;
-
-    for(Index = 0; Index < GetTrampolineSize(); Index++)
-    {
-    #pragma warning (disable:4311) // pointer truncation
-	    switch(*((ULONG*)(Ptr)))
-	    {
-	    /*Handle*/			case 0x1A2B3C05: *((ULONG*)Ptr) = (ULONG)Hook; break;
-	    /*UnmanagedIntro*/	case 0x1A2B3C03: *((ULONG*)Ptr) = (ULONG)Hook->HookIntro; break;
-	    /*OldProc*/			case 0x1A2B3C01: *((ULONG*)Ptr) = (ULONG)Hook->OldProc; break;
-	    /*Ptr:NewProc*/		case 0x1A2B3C07: *((ULONG*)Ptr) = (ULONG)&Hook->HookProc; break;
-	    /*NewProc*/			case 0x1A2B3C00: *((ULONG*)Ptr) = (ULONG)Hook->HookProc; break;
-	    /*UnmanagedOutro*/	case 0x1A2B3C06: *((ULONG*)Ptr) = (ULONG)Hook->HookOutro; break;
-	    /*IsExecuted*/		case 0x1A2B3C02: *((ULONG*)Ptr) = (ULONG)Hook->IsExecutedPtr; break;
-	    /*RetAddr*/			case 0x1A2B3C04: *((ULONG*)Ptr) = (ULONG)(Hook->Trampoline + 92); break;
-	    }
-
-	    Ptr++;
-    }
-#endif
-
-	// Prepare jumper from entry point to hook stub...
-#if X64_DRIVER
-
-	// absolute jumper
-	RelAddr = (ULONGLONG)Hook->Trampoline;
-
-	RtlCopyMemory(Jumper, Jumper_x64, 12);
-	RtlCopyMemory(Jumper + 2, &RelAddr, 8);
-
-#else
-
-	// relative jumper
+#ifndef X64_DRIVER
+	// the jumper from entry point to hook stub is relative...
     RelAddr = (LONGLONG)Hook->Trampoline - ((LONGLONG)Hook->TargetProc + 5);
 
 	if(RelAddr != (LONG)RelAddr)
 		THROW(STATUS_NOT_SUPPORTED, L"The given entry point is out of reach.");
 
-    RtlCopyMemory(Jumper + 1, &RelAddr, 4);
-
     FORCE(RtlProtectMemory(Hook->TargetProc, Hook->EntrySize, PAGE_EXECUTE_READWRITE));
 #endif
 
-    // register in global HLS list
-    RtlAcquireLock(&GlobalHookLock);
-    {
-		Hook->HLSIdent = UniqueIDCounter++;
+    *OutHook = Hook;
 
-		Exists = FALSE;
+    RETURN(STATUS_SUCCESS);
 
-        for(Index = 0; Index < MAX_HOOK_COUNT; Index++)
+THROW_OUTRO:
+FINALLY_OUTRO:
+    {
+        if(!RTL_SUCCESS(NtStatus))
         {
-	        if(GlobalSlotList[Index] == 0)
-	        {
-		        GlobalSlotList[Index] = Hook->HLSIdent;
+	        if(Hook != NULL)
+	            LhFreeMemory(&Hook);
+        }
 
-		        Hook->HLSIndex = Index;
+        return NtStatus;
+    }
+}
 
-		        Exists = TRUE;
 
-		        break;
-	        }
-        }
-    }
-    RtlReleaseLock(&GlobalHookLock);
 
-	// ATTENTION: This must be the last THROW!!!!
-    if(!Exists)
-	    THROW(STATUS_INSUFFICIENT_RESOURCES, L"Not more than MAX_HOOK_COUNT hooks are supported simultaneously.");
 
-    // from now on the unrecoverable code section starts...
-#ifdef X64_DRIVER
+static NTSTATUS LhPrepareChainMember(
+            void* InEntryPoint,
+            void* InHookProc,
+            void* InCallback,
+            ULONG InArgFlags,
+            LOCAL_HOOK_INFO** OutHook)
+{
+/*
+Description:
 
-	AtomicCache = *((ULONGLONG*)(Hook->TargetProc + 8));
-    {
-		RtlCopyMemory(&AtomicCache_x64, Jumper, 8);
-	    RtlCopyMemory(&AtomicCache, Jumper + 8, 4);
+    If the given entry point is already hooked, prepares a hook that shares
+    the trampoline of the existing patch site instead of stacking another
+    trampoline on top of it. The patch site is kept alive until the hook is
+    linked by LhLinkChainMember() or released by LhDiscardChainMember().
+    See LhInstallHookEx() for parameters.
 
-		// backup entry point for later comparsion
-	    Hook->HookCopy = AtomicCache_x64;
-    }
-	*((ULONGLONG*)(Hook->TargetProc + 0)) = AtomicCache_x64;
-    *((ULONGLONG*)(Hook->TargetProc + 8)) = AtomicCache;
+Returns:
 
-#else
+    STATUS_NOT_FOUND if the entry point is not hooked by EasyHook, by a raw
+    hook only or if the trampoline doesn't save all argument registers
+    of the new handler.
+*/
+    LOCAL_HOOK_INFO*			Hook = NULL;
+    LOCAL_HOOK_INFO*			Site = NULL;
+    LONG                        NtStatus = STATUS_INTERNAL_ERROR;
 
-    AtomicCache = *((ULONGLONG*)Hook->TargetProc);
-    {
-	    RtlCopyMemory(&AtomicCache, Jumper, 5);
+    *OutHook = NULL;
 
-	    // backup entry point for later comparsion
-	    Hook->HookCopy = AtomicCache;
-    }
-    *((ULONGLONG*)Hook->TargetProc) = AtomicCache;
+    if(LhRegistryLookup(InEntryPoint, 0, NULL) == NULL)
+        THROW(STATUS_NOT_FOUND, L"The given entry point is not hooked.");
 
-#endif
+    if((Hook = (LOCAL_HOOK_INFO*)RtlAllocateMemory(TRUE, sizeof(LOCAL_HOOK_INFO))) == NULL)
+        THROW(STATUS_NO_MEMORY, L"Failed to allocate memory.");
+
+    if((Hook->Handler = (PLOCAL_HOOK_HANDLER)RtlAllocateMemory(TRUE, sizeof(LOCAL_HOOK_HANDLER))) == NULL)
+        THROW(STATUS_NO_MEMORY, L"Failed to allocate memory.");
 
-    /*
-        Add hook to global list and return handle...
-    */
     RtlAcquireLock(&GlobalHookLock);
     {
-        Hook->Next = GlobalHookListHead.Next;
-        GlobalHookListHead.Next = Hook;
+        // if someone else has overwritten our jumper, we have to hook his one...
+        if(((Site = LhRegistryLookup(InEntryPoint, 0, NULL)) != NULL) &&
+                ((Site = Site->ChainHead)->HookProc != NULL) && !Site->IsRaw &&
+                ((Site->ArgFlags & ~InArgFlags) == 0) &&
+                (Site->HookCopy == *((ULONGLONG*)Site->TargetProc)))
+        {
+            Site->ChainMembers++;
+            Site->ChainRefs++;
+        }
+        else
+            Site = NULL;
     }
     RtlReleaseLock(&GlobalHookLock);
 
-    Hook->Signature = LOCAL_HOOK_SIGNATURE;
-    Hook->Tracking = OutHandle;
-    OutHandle->Link = Hook;
+    if(Site == NULL)
+        THROW(STATUS_NOT_FOUND, L"The given entry point is not hooked.");
+
+    Hook->NativeSize = sizeof(LOCAL_HOOK_INFO);
+    Hook->RandomValue = (void*)0x69FAB738962376EF;
+    Hook->HookProc = (UCHAR*)InHookProc;
+    Hook->TargetProc = (UCHAR*)InEntryPoint;
+    Hook->EntrySize = Site->EntrySize;
+    Hook->Trampoline = Site->Trampoline;
+    Hook->OldProc = Site->OldProc;
+    Hook->IsExecutedPtr = Site->IsExecutedPtr;
+    Hook->Callback = InCallback;
+    Hook->ArgFlags = InArgFlags;
+    Hook->HookIntro = Site->HookIntro;
+    Hook->HookOutro = Site->HookOutro;
+    Hook->ChainHead = Site;
+
+    Hook->Handler->HookProc = InHookProc;
+    Hook->Handler->Callback = InCallback;
+
+    *OutHook = Hook;
 
     RETURN(STATUS_SUCCESS);
 
 THROW_OUTRO:
 FINALLY_OUTRO:
     {
-        if(!RTL_SUCCESS(NtStatus))
+        if(!RTL_SUCCESS(NtStatus) && (Hook != NULL))
         {
-	        if(Hook != NULL)
-	            LhFreeMemory(&Hook);
+            if(Hook->Handler != NULL)
+                RtlFreeMemory(Hook->Handler);
+
+            RtlFreeMemory(Hook);
         }
 
         return NtStatus;
     }
 }
 
-/*////////////////////// GetTrampolineSize
 
-DESCRIPTION:
 
-	Will dynamically detect the size in bytes of the assembler code stored
-	in "HookSpecifix_Xxx.asm".
+
+static BOOL LhLinkChainMember(LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Puts a hook prepared by LhPrepareChainMember() in front of the chain of
+    its patch site, so the most recent handler is called first, like it
+    would be with stacked trampolines. The hook has to own a HLS slot.
+
+    The caller has to own the global hook lock.
+
+Returns:
+
+    FALSE if the patch site was removed in the meantime.
 */
-static ULONG ___TrampolineSize = 0;
+    LOCAL_HOOK_INFO*            Site = InHook->ChainHead;
 
-#ifdef _M_X64
-	EXTERN_C void __stdcall Trampoline_ASM_x64();
-#else
-	EXTERN_C void __stdcall Trampoline_ASM_x86();
-#endif
+    if(Site->HookProc == NULL)
+        return FALSE;
 
-UCHAR* GetTrampolinePtr()
+    InHook->NextInChain = Site->Chain;
+
+    // the hook has to be initialized before it is visible to the barrier
+    InterlockedExchangePointer((PVOID*)&Site->Chain, InHook);
+
+    LhRegistryInsert(InHook);
+
+    return TRUE;
+}
+
+
+
+
+static void LhDiscardHook(LOCAL_HOOK_INFO** RefHook)
 {
-// bypass possible Visual Studio debug jump table
-#ifdef _M_X64
-	UCHAR* Ptr = (UCHAR*)Trampoline_ASM_x64;
-#else
-	UCHAR* Ptr = (UCHAR*)Trampoline_ASM_x86;
-#endif
+/*
+Description:
 
-	if(*Ptr == 0xE9)
-		Ptr += *((int*)(Ptr + 1)) + 5;
+    Releases a hook that was prepared but never installed.
+*/
+    if((*RefHook)->ChainHead != *RefHook)
+        LhDiscardChainMember(*RefHook);
+    else
+        LhFreeMemory(RefHook);
 
-#ifdef _M_X64
-	return Ptr + 5 * 8;
-#else
-	return Ptr;
-#endif
+    *RefHook = NULL;
 }
 
-ULONG GetTrampolineSize()
+
+
+
+static BOOL LhTryAcquireSlot(
+            HOOK_SLOT_SEGMENT* InSegment,
+            ULONG InWord,
+            ULONG* OutBit)
+{
+/*
+Description:
+
+    Tries to set the first clear bit of the given bitmap word.
+
+Returns:
+
+    FALSE if the word is full.
+*/
+    LONG                        Word;
+    ULONG                       Bit;
+
+    while((Word = InSegment->Bits[InWord]) != -1)
+    {
+        _BitScanForward(&Bit, ~((ULONG)Word));
+
+        if(InterlockedCompareExchange(&InSegment->Bits[InWord], Word | (LONG)(1UL << Bit), Word) == Word)
+        {
+            *OutBit = Bit;
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+
+
+BOOL LhAllocateSlot(LOCAL_HOOK_INFO* InHook)
 {
-    UCHAR*		Ptr = GetTrampolinePtr();
-	UCHAR*		BasePtr = Ptr;
-    ULONG       Signature;
-    ULONG       Index;
+/*
+Description:
+
+    Assigns a unique ID and a free HLS slot to the given hook. Slots are 
+    managed in a lock-free bitmap, which grows by one segment of 
+    LH_SLOT_SEGMENT_SIZE slots whenever all existing segments are full.
+    The search starts at the word of the most recently released slot.
+
+Returns:
+
+    FALSE if all LOCAL_HOOK_MAX_SLOTS slots are in use.
+*/
+    HOOK_SLOT_SEGMENT*          Segment;
+    HOOK_SLOT_SEGMENT*          NewSegment;
+    ULONG                       Start = (ULONG)GlobalSlotHint;
+    ULONG                       Index;
+    ULONG                       Word;
+    ULONG                       Bit;
 
-	if(___TrampolineSize != 0)
-		return ___TrampolineSize;
-	
-	// search for signature
-	for(Index = 0; Index < 2000 /* some always large enough value*/; Index++)
-	{
-		Signature = *((ULONG*)Ptr);
+    // existing segments first...
+    for(Index = 0; Index < LH_SLOT_WORD_COUNT; Index++)
+    {
+        Word = (Start + Index) % LH_SLOT_WORD_COUNT;
+
+        if((Segment = GlobalSlotSegments[Word / LH_SLOT_SEGMENT_WORDS]) == NULL)
+        {
+            // skip the whole segment
+            Index += LH_SLOT_SEGMENT_WORDS - 1 - (Word % LH_SLOT_SEGMENT_WORDS);
+
+            continue;
+        }
+
+        if(LhTryAcquireSlot(Segment, Word % LH_SLOT_SEGMENT_WORDS, &Bit))
+            goto SLOT_ACQUIRED;
+    }
+
+    // grow the bitmap
+    for(Index = 0; Index < LH_SLOT_WORD_COUNT; Index++)
+    {
+        Word = Index;
+
+        if((Segment = GlobalSlotSegments[Word / LH_SLOT_SEGMENT_WORDS]) == NULL)
+        {
+            if((NewSegment = (HOOK_SLOT_SEGMENT*)RtlAllocateMemory(TRUE, sizeof(HOOK_SLOT_SEGMENT))) == NULL)
+                return FALSE;
+
+            // another thread might have been faster...
+            if((Segment = (HOOK_SLOT_SEGMENT*)InterlockedCompareExchangePointer(
+                    (PVOID*)&GlobalSlotSegments[Word / LH_SLOT_SEGMENT_WORDS], NewSegment, NULL)) == NULL)
+                Segment = NewSegment;
+            else
+                RtlFreeMemory(NewSegment);
+        }
+
+        if(LhTryAcquireSlot(Segment, Word % LH_SLOT_SEGMENT_WORDS, &Bit))
+            goto SLOT_ACQUIRED;
+    }
+
+    return FALSE;
+
+SLOT_ACQUIRED:
 
-		if(Signature == 0x12345678)	
-		{
-			___TrampolineSize = (ULONG)(Ptr - BasePtr);
+    GlobalSlotHint = Word;
 
-			return ___TrampolineSize;
-		}
+    // a zero HLSIdent marks a hook without slot, see LhFreeMemory()
+    InHook->HLSIndex = Word * 32 + Bit;
+	InHook->HLSIdent = InterlockedIncrement(&UniqueIDCounter);
 
-		Ptr++;
-	}
+    return TRUE;
+}
+
+
+
+
+void LhReleaseSlot(ULONG InHLSIndex)
+{
+/*
+Description:
+
+    Gives back the HLS slot of a released hook. This must not be called before
+    the hook's memory is released, because threads that still execute the hook
+    would share their HLS with the next hook in this slot.
+*/
+    HOOK_SLOT_SEGMENT*          Segment = GlobalSlotSegments[InHLSIndex / LH_SLOT_SEGMENT_SIZE];
+    ULONG                       Word = (InHLSIndex % LH_SLOT_SEGMENT_SIZE) / 32;
+    LONG                        Mask = (LONG)(1UL << (InHLSIndex % 32));
+    LONG                        Value;
+
+    ASSERT(Segment != NULL,L"install.c - Segment != NULL");
 
-    ASSERT(FALSE,L"install.c - ULONG GetTrampolineSize()");
+    do
+    {
+        Value = Segment->Bits[Word];
+    }
+    while(InterlockedCompareExchange(&Segment->Bits[Word], Value & ~Mask, Value) != Value);
+
+    GlobalSlotHint = InHLSIndex / 32;
+}
 
-    return 0;
-}
\ No newline at end of file
+
+
+
+void LhSlotFinalize()
+{
+/*
+Description:
+
+    Releases the slot bitmap. Called by LhCriticalFinalize().
+*/
+    ULONG                       Index;
+
+    for(Index = 0; Index < LH_SLOT_SEGMENT_COUNT; Index++)
+    {
+        if(GlobalSlotSegments[Index] != NULL)
+            RtlFreeMemory(GlobalSlotSegments[Index]);
+
+        GlobalSlotSegments[Index] = NULL;
+    }
+}
+
+
+
+
+static void LhPatchEntryPoint(LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Writes the jumper to the trampoline into the entry point of a prepared
+    hook. This is the unrecoverable part of the installation...
+*/
+    LONGLONG          			RelAddr;
+    UCHAR			            Jumper[12] = {0xE9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    ULONGLONG                   AtomicCache;
+
+#if X64_DRIVER
+	UCHAR			            Jumper_x64[12] = {0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xe0};
+	ULONGLONG					AtomicCache_x64;
+#endif
+
+	// Prepare jumper from entry point to hook stub...
+#if X64_DRIVER
+
+	// absolute jumper
+	RelAddr = (ULONGLONG)InHook->Trampoline;
+
+	RtlCopyMemory(Jumper, Jumper_x64, 12);
+	RtlCopyMemory(Jumper + 2, &RelAddr, 8);
+
+	AtomicCache = *((ULONGLONG*)(InHook->TargetProc + 8));
+    {
+		RtlCopyMemory(&AtomicCache_x64, Jumper, 8);
+	    RtlCopyMemory(&AtomicCache, Jumper + 8, 4);
+
+		// backup entry point for later comparsion
+	    InHook->HookCopy = AtomicCache_x64;
+    }
+	*((ULONGLONG*)(InHook->TargetProc + 0)) = AtomicCache_x64;
+    *((ULONGLONG*)(InHook->TargetProc + 8)) = AtomicCache;
+
+#else
+
+	// relative jumper, the range was already checked by LhPrepareHook()
+    RelAddr = (LONGLONG)InHook->Trampoline - ((LONGLONG)InHook->TargetProc + 5);
+
+    RtlCopyMemory(Jumper + 1, &RelAddr, 4);
+
+    AtomicCache = *((ULONGLONG*)InHook->TargetProc);
+    {
+	    RtlCopyMemory(&AtomicCache, Jumper, 5);
+
+	    // backup entry point for later comparsion
+	    InHook->HookCopy = AtomicCache;
+    }
+    *((ULONGLONG*)InHook->TargetProc) = AtomicCache;
+
+#endif
+}
+
+
+
+
+static void LhPublishHook(
+            LOCAL_HOOK_INFO* InHook,
+            TRACED_HOOK_HANDLE OutHandle)
+{
+/*
+Description:
+
+    Associates an installed hook with its handle. The hook has to be
+    added to the registry already.
+*/
+    InHook->Signature = LOCAL_HOOK_SIGNATURE;
+    InHook->Tracking = OutHandle;
+    OutHandle->Link = InHook;
+}
+
+
+
+
+static NTSTATUS LhInstallSingleHook(
+            void* InEntryPoint,
+            void* InHookProc,
+            void* InCallback,
+            ULONG InArgFlags,
+            BOOL InIsRaw,
+            TRACED_HOOK_HANDLE OutHandle)
+{
+/*
+Description:
+
+    Installs a single hook, see LhInstallHookEx() and LhInstallRawHook().
+    Parameters are validated by the caller.
+*/
+    LOCAL_HOOK_INFO*			Hook = NULL;
+    BOOL                        IsLinked;
+    LONG                        NtStatus = STATUS_INTERNAL_ERROR;
+
+    // join the handler chain of an entry point that is already hooked...
+    if(!InIsRaw && ((NtStatus = LhPrepareChainMember(InEntryPoint, InHookProc, InCallback, InArgFlags, &Hook)) != STATUS_NOT_FOUND))
+        FORCE(NtStatus);
+
+    if(Hook != NULL)
+    {
+        if(!LhAllocateSlot(Hook))
+	        THROW(STATUS_INSUFFICIENT_RESOURCES, L"Not more than LOCAL_HOOK_MAX_SLOTS hooks are supported simultaneously.");
+
+        RtlAcquireLock(&GlobalHookLock);
+        {
+            IsLinked = LhLinkChainMember(Hook);
+        }
+        RtlReleaseLock(&GlobalHookLock);
+
+        if(IsLinked)
+        {
+            LhPublishHook(Hook, OutHandle);
+
+            RETURN(STATUS_SUCCESS);
+        }
+
+        // the entry point was unhooked in the meantime...
+        LhDiscardHook(&Hook);
+    }
+
+    FORCE(LhPrepareHook(InEntryPoint, InHookProc, InCallback, InArgFlags, InIsRaw, &Hook));
+
+    // acquire HLS slot
+	// ATTENTION: This must be the last THROW!!!!
+    if(!LhAllocateSlot(Hook))
+	    THROW(STATUS_INSUFFICIENT_RESOURCES, L"Not more than LOCAL_HOOK_MAX_SLOTS hooks are supported simultaneously.");
+
+    // from now on the unrecoverable code section starts...
+    LhPatchEntryPoint(Hook);
+
+    /*
+        Add hook to registry and return handle...
+    */
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        LhRegistryInsert(Hook);
+    }
+    RtlReleaseLock(&GlobalHookLock);
+
+    LhPublishHook(Hook, OutHandle);
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    {
+        if(!RTL_SUCCESS(NtStatus))
+        {
+	        if(Hook != NULL)
+	            LhDiscardHook(&Hook);
+        }
+
+        return NtStatus;
+    }
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhInstallHook(
+            void* InEntryPoint,
+            void* InHookProc,
+            void* InCallback,
+            TRACED_HOOK_HANDLE OutHandle)
+{
+/*
+Description:
+
+    Installs a hook at the given entry point, redirecting all
+    calls to the given hooking method. The returned handle will
+    either be released on library unloading or explicitly through
+    LhUninstallHook() or LhUninstallAllHooks().
+
+    If the entry point is already hooked, the new handler is put in
+    front of the existing ones, sharing their trampoline. Each handler 
+    has its own callback and ACL and reaches the next one by calling
+    the hooked method, the last one reaches the original method.
+
+Parameters:
+
+    - InEntryPoint
+
+        An entry point to hook. Not all entry points are hookable. In such
+        a case STATUS_NOT_SUPPORTED will be returned.
+
+    - InHookProc
+
+        The method that should be called instead of the given entry point.
+        Please note that calling convention, parameter count and return value
+        shall match EXACTLY!
+
+    - InCallback
+
+        An uninterpreted callback later available through
+        LhBarrierGetCallback().
+
+    - OutPHandle
+
+        The memory portion supplied by *OutHandle is expected to be preallocated
+        by the caller. This structure is then filled by the method on success and
+        must stay valid for hook-life time. Only if you explicitly call one of
+        the hook uninstallation APIs, you can safely release the handle memory.
+
+Returns:
+
+    STATUS_NO_MEMORY
+    
+        Unable to allocate memory around the target entry point.
+    
+    STATUS_NOT_SUPPORTED
+    
+        The target entry point contains unsupported instructions.
+    
+    STATUS_INSUFFICIENT_RESOURCES
+    
+        The limit of LOCAL_HOOK_MAX_SLOTS simultaneous hooks was reached.
+    
+*/
+    LONG                        NtStatus = STATUS_INTERNAL_ERROR;
+
+    // validate parameters
+    if(!IsValidPointer(InEntryPoint, 1))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid entry point.");
+
+    if(!IsValidPointer(InHookProc, 1))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid hook procedure.");
+
+    if(!IsValidPointer(OutHandle, sizeof(HOOK_TRACE_INFO)))
+        THROW(STATUS_INVALID_PARAMETER_4, L"The hook handle storage is expected to be allocated by the caller.");
+
+    if(OutHandle->Link != NULL)
+        THROW(STATUS_INVALID_PARAMETER_4, L"The given trace handle seems to already be associated with a hook.");
+
+    FORCE(LhInstallSingleHook(InEntryPoint, InHookProc, InCallback, EASYHOOK_ARGS_DEFAULT, FALSE, OutHandle));
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhInstallHookEx(
+            void* InEntryPoint,
+            void* InHookProc,
+            void* InCallback,
+            ULONG InArgFlags,
+            TRACED_HOOK_HANDLE OutHandle)
+{
+/*
+Description:
+
+    Like LhInstallHook(), but the trampoline only saves the argument
+    registers required by the calling convention of the hooked method,
+    while entering the barrier.
+
+Parameters:
+
+    - InArgFlags
+
+        EASYHOOK_ARGS_DEFAULT saves all argument registers, which is always
+        valid. EASYHOOK_ARGS_STACK_ONLY skips the general purpose registers
+        for methods that take all parameters from the stack, like __stdcall
+        and __cdecl on x86. EASYHOOK_ARGS_NO_FLOAT skips XMM0-XMM3 on x64 for
+        methods without floating point parameters.
+
+        A handler is only chained to an already hooked entry point if the
+        existing trampoline saves all registers the handler requires.
+
+    See LhInstallHook() for other parameters and return values.
+*/
+    LONG                        NtStatus = STATUS_INTERNAL_ERROR;
+
+    // validate parameters
+    if(!IsValidPointer(InEntryPoint, 1))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid entry point.");
+
+    if(!IsValidPointer(InHookProc, 1))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid hook procedure.");
+
+    if((InArgFlags & ~(EASYHOOK_ARGS_STACK_ONLY | EASYHOOK_ARGS_NO_FLOAT)) != 0)
+        THROW(STATUS_INVALID_PARAMETER_4, L"Unknown argument flags.");
+
+    if(!IsValidPointer(OutHandle, sizeof(HOOK_TRACE_INFO)))
+        THROW(STATUS_INVALID_PARAMETER_5, L"The hook handle storage is expected to be allocated by the caller.");
+
+    if(OutHandle->Link != NULL)
+        THROW(STATUS_INVALID_PARAMETER_5, L"The given trace handle seems to already be associated with a hook.");
+
+    FORCE(LhInstallSingleHook(InEntryPoint, InHookProc, InCallback, InArgFlags, FALSE, OutHandle));
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhInstallRawHook(
+            void* InEntryPoint,
+            void* InHookProc,
+            TRACED_HOOK_HANDLE OutHandle)
+{
+/*
+Description:
+
+    Installs a hook without the thread deadlock barrier. The entry point just
+    jumps to the given handler, so there is almost no overhead. This is meant
+    for very hot functions, whose handlers are simple enough to get along
+    without the barrier:
+
+    - The handler must call the original method through LhGetHookBypassAddress(),
+      calling the hooked method would invoke the handler again.
+
+    - ACLs, LhBarrierGetCallback() and the other barrier APIs are not available.
+
+    - Execution is not tracked, so the trampoline and relocated entry point of a
+      removed raw hook are never released or reused. A handler still running after
+      the removal, for example one blocking in the original method, thus stays safe.
+      Each removed raw hook leaks one code slot. LhReplaceHookHandler() is not 
+      supported.
+
+    Raw hooks are never chained, a hook installed later at the same entry point
+    stacks a trampoline on top of it. See LhInstallHook() for parameters.
+*/
+    LONG                        NtStatus = STATUS_INTERNAL_ERROR;
+
+    // validate parameters
+    if(!IsValidPointer(InEntryPoint, 1))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid entry point.");
+
+    if(!IsValidPointer(InHookProc, 1))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid hook procedure.");
+
+    if(!IsValidPointer(OutHandle, sizeof(HOOK_TRACE_INFO)))
+        THROW(STATUS_INVALID_PARAMETER_3, L"The hook handle storage is expected to be allocated by the caller.");
+
+    if(OutHandle->Link != NULL)
+        THROW(STATUS_INVALID_PARAMETER_3, L"The given trace handle seems to already be associated with a hook.");
+
+    FORCE(LhInstallSingleHook(InEntryPoint, InHookProc, NULL, EASYHOOK_ARGS_DEFAULT, TRUE, OutHandle));
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhGetHookBypassAddress(
+            TRACED_HOOK_HANDLE InHandle,
+            void*** OutAddress)
+{
+/*
+Description:
+
+    Returns the relocated entry point of the given hook. Calling it invokes the
+    original method without passing any hook handler at this entry point. Raw
+    hooks have to use it, but other handlers may use it as well to skip
+    the barrier.
+
+Parameters:
+
+    - InHandle
+
+        The handle of an installed hook.
+
+    - OutAddress
+
+        Receives the address of a variable holding the bypass address. The
+        variable is valid as long as the hook is installed, so a handler can
+        use it without caching the bypass address itself.
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    NTSTATUS                NtStatus;
+
+    if(!LhIsValidHandle(InHandle, &Hook))
+        THROW(STATUS_INVALID_PARAMETER_1, L"The given hook handle is invalid or already disposed.");
+
+    if(!IsValidPointer(OutAddress, sizeof(void**)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid address storage.");
+
+    *OutAddress = (void**)&Hook->OldProc;
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhInstallHooks(
+            HOOK_INSTALL_ENTRY* InEntries,
+            ULONG InCount,
+            BOOL InAllOrNothing)
+{
+/*
+Description:
+
+    Installs many hooks at once. All hooks are prepared and get their HLS slots
+    first, then all entry points are patched and all hooks are added to the
+    registry with a single lock acquisition. This is considerably faster than calling 
+    LhInstallHook() for every entry point.
+
+Parameters:
+
+    - InEntries
+
+        An array of hook descriptions. For every entry, the members EntryPoint,
+        HookProc, Callback and Handle have the same meaning as the parameters 
+        of LhInstallHook(). Status receives the result for this entry.
+        No two entries may refer to the same entry point, but entry points
+        that are already hooked are joined like by LhInstallHook().
+
+    - InCount
+
+        The count of entries.
+
+    - InAllOrNothing
+
+        If TRUE, either all hooks are installed or none. Entries that were
+        not installed because another one failed receive STATUS_CANCELLED.
+        Otherwise every successfully prepared hook is installed.
+
+Returns:
+
+    STATUS_SUCCESS if all hooks were installed, otherwise the status of the
+    first entry that failed.
+*/
+    HOOK_INSTALL_ENTRY*         Entry;
+    LOCAL_HOOK_INFO**           HookList = NULL;
+    LOCAL_HOOK_INFO*            Hook;
+    ULONG                       Index;
+    ULONG                       Other;
+    BOOL                        Failed = FALSE;
+    LONG                        NtStatus = STATUS_INTERNAL_ERROR;
+
+    if(!IsValidPointer(InEntries, sizeof(HOOK_INSTALL_ENTRY) * InCount))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid hook entry array.");
+
+    if(InCount == 0)
+        RETURN;
+
+    if((HookList = (LOCAL_HOOK_INFO**)RtlAllocateMemory(TRUE, sizeof(LOCAL_HOOK_INFO*) * InCount)) == NULL)
+        THROW(STATUS_NO_MEMORY, L"Failed to allocate memory.");
+
+    for(Index = 0; Index < InCount; Index++)
+    {
+        InEntries[Index].Status = STATUS_CANCELLED;
+    }
+
+    // prepare all trampolines and relocations without any lock...
+    for(Index = 0; Index < InCount; Index++)
+    {
+        Entry = &InEntries[Index];
+
+        if(!IsValidPointer(Entry->EntryPoint, 1))
+            Entry->Status = STATUS_INVALID_PARAMETER_1;
+        else if(!IsValidPointer(Entry->HookProc, 1))
+            Entry->Status = STATUS_INVALID_PARAMETER_2;
+        else if(!IsValidPointer(Entry->Handle, sizeof(HOOK_TRACE_INFO)) || (Entry->Handle->Link != NULL))
+            Entry->Status = STATUS_INVALID_PARAMETER_4;
+        else
+        {
+            Entry->Status = LhPrepareChainMember(Entry->EntryPoint, Entry->HookProc, Entry->Callback, EASYHOOK_ARGS_DEFAULT, &HookList[Index]);
+
+            if(Entry->Status == STATUS_NOT_FOUND)
+                Entry->Status = LhPrepareHook(Entry->EntryPoint, Entry->HookProc, Entry->Callback, EASYHOOK_ARGS_DEFAULT, FALSE, &HookList[Index]);
+        }
+
+        if(!RTL_SUCCESS(Entry->Status))
+        {
+            Failed = TRUE;
+
+            if(InAllOrNothing)
+                break;
+        }
+    }
+
+    /*
+        Overlapping entry points would overwrite each other's jumpers. The
+        relocated size of an entry point is only known after its preparation...
+    */
+    if(!Failed || !InAllOrNothing)
+    {
+        for(Index = 0; Index < InCount; Index++)
+        {
+            if(HookList[Index] == NULL)
+                continue;
+
+            for(Other = 0; Other < Index; Other++)
+            {
+                if((HookList[Other] != NULL) &&
+                        (HookList[Index]->TargetProc < HookList[Other]->TargetProc + HookList[Other]->EntrySize) &&
+                        (HookList[Index]->TargetProc + HookList[Index]->EntrySize > HookList[Other]->TargetProc))
+                    break;
+            }
+
+            if(Other == Index)
+                continue;
+
+            InEntries[Index].Status = STATUS_INVALID_PARAMETER;
+
+            LhDiscardHook(&HookList[Index]);
+
+            Failed = TRUE;
+
+            if(InAllOrNothing)
+                break;
+        }
+    }
+
+    // assign HLS slots, released again by LhFreeMemory()
+    if(!Failed || !InAllOrNothing)
+    {
+        for(Index = 0; Index < InCount; Index++)
+        {
+            if((HookList[Index] == NULL) || LhAllocateSlot(HookList[Index]))
+                continue;
+
+            InEntries[Index].Status = STATUS_INSUFFICIENT_RESOURCES;
+
+            LhDiscardHook(&HookList[Index]);
+
+            Failed = TRUE;
+
+            if(InAllOrNothing)
+                break;
+        }
+    }
+
+    if(Failed && InAllOrNothing)
+    {
+        for(Index = 0; Index < InCount; Index++)
+        {
+            if(HookList[Index] != NULL)
+                LhDiscardHook(&HookList[Index]);
+
+            if(RTL_SUCCESS(InEntries[Index].Status))
+                InEntries[Index].Status = STATUS_CANCELLED;
+        }
+    }
+    else
+    {
+        // from now on the unrecoverable code section starts...
+        for(Index = 0; Index < InCount; Index++)
+        {
+            if(((Hook = HookList[Index]) != NULL) && (Hook->ChainHead == Hook))
+                LhPatchEntryPoint(Hook);
+        }
+
+        RtlAcquireLock(&GlobalHookLock);
+        {
+            for(Index = 0; Index < InCount; Index++)
+            {
+                if((Hook = HookList[Index]) == NULL)
+                    continue;
+
+                if(Hook->ChainHead == Hook)
+                    LhRegistryInsert(Hook);
+                else if(!LhLinkChainMember(Hook))
+                {
+                    // only possible if LhUninstallAllHooks() is running concurrently
+                    InEntries[Index].Status = STATUS_NOT_FOUND;
+                }
+            }
+        }
+        RtlReleaseLock(&GlobalHookLock);
+
+        for(Index = 0; Index < InCount; Index++)
+        {
+            if(HookList[Index] == NULL)
+                continue;
+
+            if(RTL_SUCCESS(InEntries[Index].Status))
+                LhPublishHook(HookList[Index], InEntries[Index].Handle);
+            else
+                LhDiscardHook(&HookList[Index]);
+        }
+    }
+
+    // report the first failure
+    for(Index = 0; Index < InCount; Index++)
+    {
+        if(!RTL_SUCCESS(InEntries[Index].Status) && (InEntries[Index].Status != STATUS_CANCELLED))
+            THROW(InEntries[Index].Status, L"At least one hook could not be installed.");
+    }
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    {
+        if(HookList != NULL)
+            RtlFreeMemory(HookList);
+
+        return NtStatus;
+    }
+}
@@ -0,0 +1,344 @@
+/*
+    EasyHook - The reinvention of Windows API hooking
+
+    Copyright (C) 2009 Christoph Husse
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Please visit http://www.codeplex.com/easyhook for more information
+    about the project and latest updates.
+*/
+#include "stdafx.h"
+
+/*
+    A length-only instruction decoder. Installing a hook needs nothing but
+    instruction lengths and the location of RIP-relative displacements, so
+    instead of running the full Udis86 decoder, every opcode is described
+    by a single byte of properties telling whether a ModR/M byte and which
+    immediates follow. The 0F 38 and 0F 3A maps are uniform and need no table.
+    VEX, EVEX and XOP encoded instructions use the same maps.
+*/
+#define LH_MAX_INSTRUCTION_SIZE     15
+
+#define LH_OP_MODRM                 0x01
+#define LH_OP_IMM8                  0x02
+#define LH_OP_IMM16                 0x04
+#define LH_OP_IMMZ                  0x08 // 16 or 32 bits, depending on the operand size
+#define LH_OP_MOFFS                 0x10 // address sized
+#define LH_OP_PREFIX                0x20
+#define LH_OP_INVALID64             0x40 // not encodable in 64-bit mode
+
+#define N                           0
+#define M                           LH_OP_MODRM
+#define I1                          LH_OP_IMM8
+#define I2                          LH_OP_IMM16
+#define IZ                          LH_OP_IMMZ
+#define O                           LH_OP_MOFFS
+#define P                           LH_OP_PREFIX
+#define X                           LH_OP_INVALID64
+
+static const UCHAR LhOneByteOpcodes[256] =
+{
+    /*        0       1       2       3       4       5       6       7       8       9       A       B       C       D       E       F  */
+    /* 0 */   M,      M,      M,      M,      I1,     IZ,     X,      X,      M,      M,      M,      M,      I1,     IZ,     X,      N,
+    /* 1 */   M,      M,      M,      M,      I1,     IZ,     X,      X,      M,      M,      M,      M,      I1,     IZ,     X,      X,
+    /* 2 */   M,      M,      M,      M,      I1,     IZ,     P,      X,      M,      M,      M,      M,      I1,     IZ,     P,      X,
+    /* 3 */   M,      M,      M,      M,      I1,     IZ,     P,      X,      M,      M,      M,      M,      I1,     IZ,     P,      X,
+    /* 4 */   N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,
+    /* 5 */   N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,
+    /* 6 */   X,      X,      M,      M,      P,      P,      P,      P,      IZ,     M|IZ,   I1,     M|I1,   N,      N,      N,      N,
+    /* 7 */   I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,
+    /* 8 */   M|I1,   M|IZ,   M|I1|X, M|I1,   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 9 */   N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      IZ|I2|X,N,      N,      N,      N,      N,
+    /* A */   O,      O,      O,      O,      N,      N,      N,      N,      I1,     IZ,     N,      N,      N,      N,      N,      N,
+    /* B */   I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,
+    /* C */   M|I1,   M|I1,   I2,     N,      M|X,    M|X,    M|I1,   M|IZ,   I2|I1,  N,      I2,     N,      N,      I1,     X,      N,
+    /* D */   M,      M,      M,      M,      I1|X,   I1|X,   X,      N,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* E */   I1,     I1,     I1,     I1,     I1,     I1,     I1,     I1,     IZ,     IZ,     IZ|I2|X,I1,     N,      N,      N,      N,
+    /* F */   P,      N,      P,      P,      N,      N,      M,      M,      N,      N,      N,      N,      N,      N,      M,      M,
+};
+
+static const UCHAR LhTwoByteOpcodes[256] =
+{
+    /*        0       1       2       3       4       5       6       7       8       9       A       B       C       D       E       F  */
+    /* 0 */   M,      M,      M,      M,      N,      N,      N,      N,      N,      N,      N,      N,      N,      M,      N,      M|I1,
+    /* 1 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 2 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 3 */   N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,
+    /* 4 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 5 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 6 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 7 */   M|I1,   M|I1,   M|I1,   M|I1,   M,      M,      M,      N,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 8 */   IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,
+    /* 9 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* A */   N,      N,      N,      M,      M|I1,   M,      M,      M,      N,      N,      N,      M,      M|I1,   M,      M,      M,
+    /* B */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M|I1,   M,      M,      M,      M,      M,
+    /* C */   M,      M,      M|I1,   M,      M|I1,   M|I1,   M|I1,   M,      N,      N,      N,      N,      N,      N,      N,      N,
+    /* D */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* E */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* F */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+};
+
+#undef N
+#undef M
+#undef I1
+#undef I2
+#undef IZ
+#undef O
+#undef P
+#undef X
+
+EASYHOOK_NT_INTERNAL LhDecodeInstructionLength(
+            void* InPtr,
+            UCHAR* OutDispOffset)
+{
+/*
+Description:
+
+    Takes a pointer to machine code and returns the length of the
+    referenced instruction in bytes, without decoding its operands.
+
+Parameters:
+
+    - InPtr
+
+        The instruction to decode.
+
+    - OutDispOffset
+
+        Optional, receives the offset of the displacement of a RIP-relative
+        memory operand within the instruction or zero if there is none.
+
+Returns:
+
+    STATUS_INVALID_PARAMETER
+
+        The given pointer references invalid machine code.
+*/
+    UCHAR*          Code = (UCHAR*)InPtr;
+    UCHAR*          Ptr = Code;
+    UCHAR           Opcode;
+    UCHAR           Flags;
+    UCHAR           ModRM = 0;
+    UCHAR           Mod;
+    UCHAR           RM;
+    ULONG           Map = 0;
+    ULONG           DispOffset = 0;
+    BOOL            OperandSize16 = FALSE;
+    BOOL            AddressSizeOverride = FALSE;
+    BOOL            RexW = FALSE;
+    BOOL            IsEncoded = FALSE;
+
+    if(OutDispOffset != NULL)
+        *OutDispOffset = 0;
+
+    /////////////////////////////////////////////////////////
+    // legacy prefixes and REX, the latter only counts in front of the opcode
+    while(Ptr - Code < LH_MAX_INSTRUCTION_SIZE)
+    {
+        if(LhOneByteOpcodes[*Ptr] & LH_OP_PREFIX)
+        {
+            if(*Ptr == 0x66)
+                OperandSize16 = TRUE;
+            else if(*Ptr == 0x67)
+                AddressSizeOverride = TRUE;
+
+            RexW = FALSE;
+        }
+#ifdef _M_X64
+        else if((*Ptr & 0xF0) == 0x40)
+            RexW = (*Ptr & 0x08) != 0;
+#endif
+        else
+            break;
+
+        Ptr++;
+    }
+
+    /////////////////////////////////////////////////////////
+    // opcode map
+    Opcode = *(Ptr++);
+
+    if(Opcode == 0x0F)
+    {
+        Map = 1;
+        Opcode = *(Ptr++);
+
+        if(Opcode == 0x38)
+        {
+            Map = 2;
+            Opcode = *(Ptr++);
+        }
+        else if(Opcode == 0x3A)
+        {
+            Map = 3;
+            Opcode = *(Ptr++);
+        }
+    }
+#ifdef _M_X64
+    else if((Opcode == 0xC4) || (Opcode == 0xC5) || (Opcode == 0x62) ||
+#else
+    // outside of 64-bit mode these are LES, LDS and BOUND unless ModR/M selects a register
+    else if((((Opcode == 0xC4) || (Opcode == 0xC5) || (Opcode == 0x62)) && ((*Ptr & 0xC0) == 0xC0)) ||
+#endif
+            // AMD's XOP uses maps 8 to 10, a POP r/m has a zero reg field instead
+            ((Opcode == 0x8F) && ((*Ptr & 0x1F) >= 8)))
+    {
+        IsEncoded = TRUE;
+
+        if(Opcode == 0xC5)
+        {
+            // two byte VEX: R.vvvv.L.pp
+            Map = 1;
+            Ptr += 1;
+        }
+        else if((Opcode == 0xC4) || (Opcode == 0x8F))
+        {
+            // three byte VEX or XOP: R.X.B.mmmmm W.vvvv.L.pp
+            Map = Ptr[0] & 0x1F;
+            RexW = (Ptr[1] & 0x80) != 0;
+            Ptr += 2;
+        }
+        else
+        {
+            // EVEX: R.X.B.R'.0.mmm W.vvvv.1.pp z.L'L.b.V'.aaa
+            Map = Ptr[0] & 0x07;
+            RexW = (Ptr[1] & 0x80) != 0;
+            Ptr += 3;
+        }
+
+        Opcode = *(Ptr++);
+    }
+
+    switch(Map)
+    {
+    case 0:
+        {
+            if(IsEncoded)
+                return STATUS_INVALID_PARAMETER;
+
+            Flags = LhOneByteOpcodes[Opcode];
+        }break;
+    case 1: Flags = LhTwoByteOpcodes[Opcode]; break;
+    case 2: Flags = LH_OP_MODRM; break;                 // 0F 38
+    case 3: Flags = LH_OP_MODRM | LH_OP_IMM8; break;    // 0F 3A
+    case 5: // EVEX maps of the FP16 extension, no immediates
+    case 6:
+        {
+            if(!IsEncoded)
+                return STATUS_INVALID_PARAMETER;
+
+            Flags = LH_OP_MODRM;
+        }break;
+    case 8: Flags = LH_OP_MODRM | LH_OP_IMM8; break;    // XOP
+    case 9: Flags = LH_OP_MODRM; break;
+    case 10: Flags = LH_OP_MODRM | LH_OP_IMMZ; break;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+#ifdef _M_X64
+    if(Flags & LH_OP_INVALID64)
+        return STATUS_INVALID_PARAMETER;
+#endif
+
+    /////////////////////////////////////////////////////////
+    // ModR/M, SIB and displacement
+    if(Flags & LH_OP_MODRM)
+    {
+        ModRM = *(Ptr++);
+        Mod = ModRM >> 6;
+        RM = ModRM & 0x07;
+
+        // MOV to/from control and debug registers ignores the mod field
+        if((Map == 1) && (Opcode >= 0x20) && (Opcode <= 0x23))
+            Mod = 3;
+
+#ifndef _M_X64
+        if(AddressSizeOverride)
+        {
+            // 16-bit addressing has no SIB byte
+            if(((Mod == 0) && (RM == 6)) || (Mod == 2))
+                Ptr += 2;
+            else if(Mod == 1)
+                Ptr += 1;
+        }
+        else
+#endif
+        if(Mod != 3)
+        {
+            if((RM == 4) && ((*(Ptr++) & 0x07) == 5) && (Mod == 0))
+                Ptr += 4;
+
+            if((Mod == 0) && (RM == 5))
+            {
+#ifdef _M_X64
+                DispOffset = (ULONG)(Ptr - Code);
+#endif
+                Ptr += 4;
+            }
+            else if(Mod == 1)
+                Ptr += 1;
+            else if(Mod == 2)
+                Ptr += 4;
+        }
+    }
+
+    /////////////////////////////////////////////////////////
+    // immediates
+    if(Flags & LH_OP_IMM8)
+        Ptr += 1;
+
+    if(Flags & LH_OP_IMM16)
+        Ptr += 2;
+
+    if(Flags & LH_OP_IMMZ)
+    {
+#ifdef _M_X64
+        if((Map == 0) && (Opcode >= 0xB8) && (Opcode <= 0xBF) && RexW)
+            Ptr += 8; // mov r64, imm64
+        else if((Map == 1) || (Opcode == 0xE8) || (Opcode == 0xE9))
+            Ptr += 4; // near branches are always rel32 in 64-bit mode
+        else
+#endif
+        Ptr += (OperandSize16 && !RexW) ? 2 : 4;
+    }
+
+    if(Flags & LH_OP_MOFFS)
+    {
+#ifdef _M_X64
+        Ptr += AddressSizeOverride ? 4 : 8;
+#else
+        Ptr += AddressSizeOverride ? 2 : 4;
+#endif
+    }
+
+    // TEST r/m, imm is the only member of group 3 with an immediate
+    if((Map == 0) && ((Opcode == 0xF6) || (Opcode == 0xF7)) && (((ModRM >> 3) & 0x07) < 2))
+    {
+        if(Opcode == 0xF6)
+            Ptr += 1;
+        else
+            Ptr += (OperandSize16 && !RexW) ? 2 : 4;
+    }
+
+    if(Ptr - Code > LH_MAX_INSTRUCTION_SIZE)
+        return STATUS_INVALID_PARAMETER;
+
+    if(OutDispOffset != NULL)
+        *OutDispOffset = (UCHAR)DispOffset;
+
+    return (LONG)(Ptr - Code);
+}
@@ -0,0 +1,570 @@
+/*
+    EasyHook - The reinvention of Windows API hooking
+ 
+    Copyright (C) 2009 Christoph Husse
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Please visit http://www.codeplex.com/easyhook for more information
+    about the project and latest updates.
+*/
+#include "stdafx.h"
+
+/*
+    All installed hooks are indexed by their entry point and by their HLSIdent.
+    Both indices are chained hash tables sharing the same size. Modifications
+    require the global hook lock, but lookups don't. Readers detect concurrent
+    modifications with a sequence counter, which is odd while the registry is
+    being modified, and simply retry. Replaced tables are retired until 
+    LhRegistryFinalize().
+
+    Readers announce themselves in one of LOCAL_HOOK_SHARD_COUNT counters, just
+    like module snapshot readers. A removed hook is only released after each
+    of them has been seen at zero, see LhRegistryIsQuiescent(), so a reader
+    never touches released memory.
+*/
+#define LH_REGISTRY_INITIAL_SIZE        64
+
+// one cache line per reader shard
+#define LH_REGISTRY_READER_STRIDE       (LOCAL_HOOK_SHARD_SIZE / sizeof(LONG))
+#define LH_ALL_REGISTRY_READER_SHARDS   ((1UL << LOCAL_HOOK_SHARD_COUNT) - 1)
+
+#define LhGetRegistryReaderShard(InAddrOnStack) \
+    (&RegistryReaders[LH_REGISTRY_READER_STRIDE * \
+        ((((ULONG_PTR)(InAddrOnStack) >> 12) ^ ((ULONG_PTR)(InAddrOnStack) >> 20)) & (LOCAL_HOOK_SHARD_COUNT - 1))])
+
+typedef struct _HOOK_REGISTRY_TABLE_* PHOOK_REGISTRY_TABLE;
+
+typedef struct _HOOK_REGISTRY_TABLE_
+{
+    PHOOK_REGISTRY_TABLE    Retired;
+    ULONG                   Size;
+    ULONG                   Shift;
+    // Size buckets by entry point, followed by Size buckets by HLSIdent
+    PLOCAL_HOOK_INFO*       Buckets;
+}HOOK_REGISTRY_TABLE;
+
+static HOOK_REGISTRY_TABLE              InitialTable;
+static PLOCAL_HOOK_INFO                 InitialBuckets[2 * LH_REGISTRY_INITIAL_SIZE];
+static volatile PHOOK_REGISTRY_TABLE    GlobalRegistry = NULL;
+static volatile LONG                    RegistrySequence = 0;
+static ULONG                            RegistryCount = 0;
+static volatile LONG                    RegistryReaders[LOCAL_HOOK_SHARD_COUNT * LH_REGISTRY_READER_STRIDE];
+
+void LhRegistryInitialize()
+{
+/*
+Description:
+
+    Called by LhCriticalInitialize(). The initial table is static, so
+    the registry is always usable.
+*/
+    RtlZeroMemory(InitialBuckets, sizeof(InitialBuckets));
+
+    InitialTable.Retired = NULL;
+    InitialTable.Size = LH_REGISTRY_INITIAL_SIZE;
+    InitialTable.Shift = 32 - 6;
+    InitialTable.Buckets = InitialBuckets;
+
+    GlobalRegistry = &InitialTable;
+    RegistrySequence = 0;
+    RegistryCount = 0;
+}
+
+
+
+
+void LhRegistryFinalize()
+{
+/*
+Description:
+
+    Releases all tables. Called by LhCriticalFinalize().
+*/
+    PHOOK_REGISTRY_TABLE    Table;
+    PHOOK_REGISTRY_TABLE    Retired;
+
+    for(Table = GlobalRegistry; Table != NULL; Table = Retired)
+    {
+        Retired = Table->Retired;
+
+        if(Table != &InitialTable)
+            RtlFreeMemory(Table);
+    }
+
+    GlobalRegistry = NULL;
+}
+
+
+
+
+static ULONG LhHashEntryPoint(
+            PHOOK_REGISTRY_TABLE InTable,
+            void* InEntryPoint)
+{
+    ULONG_PTR               Value = (ULONG_PTR)InEntryPoint;
+
+#ifdef _M_X64
+    Value ^= Value >> 32;
+#endif
+
+    return ((ULONG)Value * 0x9E3779B1) >> InTable->Shift;
+}
+
+
+
+
+static ULONG LhHashIdent(
+            PHOOK_REGISTRY_TABLE InTable,
+            ULONG InHLSIdent)
+{
+    return InTable->Size + ((InHLSIdent * 0x9E3779B1) >> InTable->Shift);
+}
+
+
+
+
+static void LhRegistryLink(
+            PHOOK_REGISTRY_TABLE InTable,
+            PLOCAL_HOOK_INFO InHook)
+{
+    PLOCAL_HOOK_INFO*       Bucket;
+
+    Bucket = &InTable->Buckets[LhHashEntryPoint(InTable, InHook->TargetProc)];
+
+    InHook->NextByTarget = *Bucket;
+    *Bucket = InHook;
+
+    Bucket = &InTable->Buckets[LhHashIdent(InTable, InHook->HLSIdent)];
+
+    InHook->NextById = *Bucket;
+    *Bucket = InHook;
+}
+
+
+
+
+static void LhRegistryGrow()
+{
+/*
+Description:
+
+    Doubles the table size. If no memory is available, the current
+    table is kept and chains just get longer. The caller has to
+    own the global hook lock and to be within a write section.
+*/
+    PHOOK_REGISTRY_TABLE    Table = GlobalRegistry;
+    PHOOK_REGISTRY_TABLE    NewTable;
+    PLOCAL_HOOK_INFO        Hook;
+    PLOCAL_HOOK_INFO        Next;
+    ULONG                   Index;
+
+    if((NewTable = (PHOOK_REGISTRY_TABLE)RtlAllocateMemory(TRUE, 
+            sizeof(HOOK_REGISTRY_TABLE) + sizeof(PLOCAL_HOOK_INFO) * 4 * Table->Size)) == NULL)
+        return;
+
+    NewTable->Retired = Table;
+    NewTable->Size = Table->Size * 2;
+    NewTable->Shift = Table->Shift - 1;
+    NewTable->Buckets = (PLOCAL_HOOK_INFO*)(NewTable + 1);
+
+    for(Index = 0; Index < Table->Size; Index++)
+    {
+        for(Hook = Table->Buckets[Index]; Hook != NULL; Hook = Next)
+        {
+            Next = Hook->NextByTarget;
+
+            LhRegistryLink(NewTable, Hook);
+        }
+    }
+
+    GlobalRegistry = NewTable;
+}
+
+
+
+
+void LhRegistryInsert(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Adds an installed hook to the registry. If an entry point is hooked
+    more than once, the most recent hook is found first.
+
+    The caller has to own the global hook lock.
+*/
+    InterlockedIncrement(&RegistrySequence);
+    {
+        if((RegistryCount >= GlobalRegistry->Size) && (GlobalRegistry->Shift > 1))
+            LhRegistryGrow();
+
+        LhRegistryLink(GlobalRegistry, InHook);
+
+        RegistryCount++;
+    }
+    InterlockedIncrement(&RegistrySequence);
+}
+
+
+
+
+void LhRegistryRemove(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Removes a hook from the registry. The chain pointers of the hook 
+    itself are left intact for concurrent readers.
+
+    The caller has to own the global hook lock.
+*/
+    PHOOK_REGISTRY_TABLE    Table = GlobalRegistry;
+    PLOCAL_HOOK_INFO*       Ref;
+    BOOL                    IsFound = FALSE;
+
+    InterlockedIncrement(&RegistrySequence);
+    {
+        for(Ref = &Table->Buckets[LhHashEntryPoint(Table, InHook->TargetProc)]; *Ref != NULL; Ref = &(*Ref)->NextByTarget)
+        {
+            if(*Ref == InHook)
+            {
+                *Ref = InHook->NextByTarget;
+
+                IsFound = TRUE;
+
+                break;
+            }
+        }
+
+        for(Ref = &Table->Buckets[LhHashIdent(Table, InHook->HLSIdent)]; *Ref != NULL; Ref = &(*Ref)->NextById)
+        {
+            if(*Ref == InHook)
+            {
+                *Ref = InHook->NextById;
+
+                break;
+            }
+        }
+
+        if(IsFound)
+            RegistryCount--;
+    }
+    InterlockedIncrement(&RegistrySequence);
+}
+
+
+
+
+PLOCAL_HOOK_INFO LhRegistryRemoveAll()
+{
+/*
+Description:
+
+    Empties the registry. The caller has to own the global hook lock.
+
+Returns:
+
+    All hooks that were registered, linked by their "Next" member.
+*/
+    PHOOK_REGISTRY_TABLE    Table = GlobalRegistry;
+    PLOCAL_HOOK_INFO        Result = NULL;
+    PLOCAL_HOOK_INFO        Hook;
+    ULONG                   Index;
+
+    InterlockedIncrement(&RegistrySequence);
+    {
+        for(Index = 0; Index < Table->Size; Index++)
+        {
+            for(Hook = Table->Buckets[Index]; Hook != NULL; Hook = Hook->NextByTarget)
+            {
+                Hook->Next = Result;
+                Result = Hook;
+            }
+        }
+
+        RtlZeroMemory(Table->Buckets, sizeof(PLOCAL_HOOK_INFO) * 2 * Table->Size);
+
+        RegistryCount = 0;
+    }
+    InterlockedIncrement(&RegistrySequence);
+
+    return Result;
+}
+
+
+
+
+PLOCAL_HOOK_INFO LhRegistryLookup(
+            void* InEntryPoint,
+            ULONG InHLSIdent,
+            TRACED_HOOK_HANDLE* OutTracking)
+{
+/*
+Description:
+
+    Looks up a hook by entry point if InEntryPoint is not NULL,
+    otherwise by HLSIdent. No lock is required.
+
+    The hook might be removed and released as soon as this method returns,
+    so the result may only be dereferenced while owning the global hook lock.
+    Use OutTracking to read its handle consistently without the lock.
+
+Parameters:
+
+    - OutTracking
+
+        Optional, receives the handle associated with the hook that was
+        found or NULL.
+*/
+    PHOOK_REGISTRY_TABLE    Table;
+    PLOCAL_HOOK_INFO        Hook;
+    PLOCAL_HOOK_INFO        Result;
+    TRACED_HOOK_HANDLE      Tracking;
+    LONG                    Sequence;
+    ULONG                   Steps;
+    volatile LONG*          Shard = LhGetRegistryReaderShard(&Sequence);
+
+    InterlockedIncrement(Shard);
+
+    while(TRUE)
+    {
+        // wait for writers to leave
+        while((Sequence = RegistrySequence) & 1)
+        {
+            YieldProcessor();
+        }
+
+        MemoryBarrier();
+
+        Table = GlobalRegistry;
+        Result = NULL;
+        Tracking = NULL;
+
+        /*
+            A concurrent modification might make us follow a stale chain, but
+            it can't make us crash. The step limit protects against cycles...
+        */
+        if(InEntryPoint != NULL)
+        {
+            for(Hook = Table->Buckets[LhHashEntryPoint(Table, InEntryPoint)], Steps = 0; 
+                    (Hook != NULL) && (Steps < LOCAL_HOOK_MAX_SLOTS); Hook = Hook->NextByTarget, Steps++)
+            {
+                if(Hook->TargetProc == (UCHAR*)InEntryPoint)
+                {
+                    Result = Hook;
+
+                    break;
+                }
+            }
+        }
+        else
+        {
+            for(Hook = Table->Buckets[LhHashIdent(Table, InHLSIdent)], Steps = 0; 
+                    (Hook != NULL) && (Steps < LOCAL_HOOK_MAX_SLOTS); Hook = Hook->NextById, Steps++)
+            {
+                if(Hook->HLSIdent == InHLSIdent)
+                {
+                    Result = Hook;
+
+                    break;
+                }
+            }
+        }
+
+        // the handle is only consistent with the result within the validated section
+        if(Result != NULL)
+            Tracking = Result->Tracking;
+
+        MemoryBarrier();
+
+        if(RegistrySequence == Sequence)
+            break;
+    }
+
+    InterlockedDecrement(Shard);
+
+    if(OutTracking != NULL)
+        *OutTracking = Tracking;
+
+    return Result;
+}
+
+
+
+
+BOOL LhRegistryIsQuiescent(ULONG* RefReaderShards)
+{
+/*
+Description:
+
+    Records which registry reader shards are zero. A reader shard seen at zero
+    after a hook has been removed from the registry can't refer to it anymore,
+    because new readers don't find it.
+
+Returns:
+
+    TRUE if every shard has been zero at least once since RefReaderShards
+    was reset, which is done after removing the hook from the registry.
+*/
+    ULONG                   Index;
+
+    for(Index = 0; Index < LOCAL_HOOK_SHARD_COUNT; Index++)
+    {
+        if(RegistryReaders[Index * LH_REGISTRY_READER_STRIDE] == 0)
+            *RefReaderShards |= 1UL << Index;
+    }
+
+    return *RefReaderShards == LH_ALL_REGISTRY_READER_SHARDS;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhFindHook(
+            void* InEntryPoint,
+            TRACED_HOOK_HANDLE* OutHandle)
+{
+/*
+Description:
+
+    Determines whether the given entry point is hooked. This method
+    does not acquire any lock.
+
+Parameters:
+
+    - InEntryPoint
+
+        The entry point passed to LhInstallHook().
+
+    - OutHandle
+
+        Receives the handle of the hook. If the entry point was hooked
+        more than once, the most recent hook is returned.
+
+Returns:
+
+    STATUS_NOT_FOUND if the entry point is not hooked.
+*/
+    TRACED_HOOK_HANDLE      Tracking;
+    NTSTATUS                NtStatus;
+
+    if(InEntryPoint == NULL)
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid entry point.");
+
+    if(!IsValidPointer(OutHandle, sizeof(TRACED_HOOK_HANDLE)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid handle storage.");
+
+    // the handle is associated right after registration...
+    if((LhRegistryLookup(InEntryPoint, 0, &Tracking) == NULL) || (Tracking == NULL))
+        THROW(STATUS_NOT_FOUND, L"The given entry point is not hooked.");
+
+    *OutHandle = Tracking;
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhFindHookById(
+            ULONG InHookId,
+            TRACED_HOOK_HANDLE* OutHandle)
+{
+/*
+Description:
+
+    Returns the handle of the installed hook with the given ID. This method
+    does not acquire any lock.
+
+Parameters:
+
+    - InHookId
+
+        A hook ID obtained by LhGetHookId().
+
+    - OutHandle
+
+        Receives the handle of the hook.
+
+Returns:
+
+    STATUS_NOT_FOUND if there is no such hook installed.
+*/
+    TRACED_HOOK_HANDLE      Tracking;
+    NTSTATUS                NtStatus;
+
+    if(InHookId == 0)
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid hook ID.");
+
+    if(!IsValidPointer(OutHandle, sizeof(TRACED_HOOK_HANDLE)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid handle storage.");
+
+    if((LhRegistryLookup(NULL, InHookId, &Tracking) == NULL) || (Tracking == NULL))
+        THROW(STATUS_NOT_FOUND, L"There is no hook with the given ID.");
+
+    *OutHandle = Tracking;
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+EASYHOOK_NT_EXPORT LhGetHookId(
+            TRACED_HOOK_HANDLE InHandle,
+            ULONG* OutHookId)
+{
+/*
+Description:
+
+    Returns the process-wide unique ID of the given hook. IDs are never reused
+    while the library is loaded.
+
+Parameters:
+
+    - InHandle
+
+        The handle of an installed hook.
+
+    - OutHookId
+
+        Receives the hook ID.
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    NTSTATUS                NtStatus;
+
+    if(!LhIsValidHandle(InHandle, &Hook))
+        THROW(STATUS_INVALID_PARAMETER_1, L"The given hook handle is invalid or already disposed.");
+
+    if(!IsValidPointer(OutHookId, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid hook ID storage.");
+
+    *OutHookId = Hook->HLSIdent;
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
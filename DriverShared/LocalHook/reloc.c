@@ -25,7 +25,8 @@
 
 // GetInstructionLength_x64/x86 were replaced with the Udis86 library
 // (http://udis86.sourceforge.net) see udis86.h/.c for appropriate
-// licensing and copyright notices.
+// licensing and copyright notices. Lengths alone are determined by
+// the faster LhDecodeInstructionLength(), see length.c.
 
 EASYHOOK_NT_INTERNAL LhGetInstructionLength(void* InPtr)
 {
@@ -40,67 +41,76 @@ Returns:
 
         The given pointer references invalid machine code.
 */
-	LONG			length = -1;
-	// some exotic instructions might not be supported see the project
-    // at https://github.com/vmt/udis86 and the forums.
-
-    ud_t ud_obj;
-    ud_init(&ud_obj);
-#ifdef _M_X64
-    ud_set_mode(&ud_obj, 64);
-#else
-    ud_set_mode(&ud_obj, 32);
-#endif
-    ud_set_input_buffer(&ud_obj, (uint8_t *)InPtr, 32);
-    length = ud_disassemble(&ud_obj); // usually only between 1 and 5
-
-	if(length > 0)
-		return length;
-	else
-		return STATUS_INVALID_PARAMETER;
+    return LhDecodeInstructionLength(InPtr, NULL);
 }
 
-EASYHOOK_NT_INTERNAL LhRoundToNextInstruction(
-			void* InCodePtr,
-			ULONG InCodeSize)
+EASYHOOK_NT_INTERNAL LhDecodeEntryPoint(
+            void* InEntryPoint,
+            ULONG InMinSize,
+            LH_ENTRY_POINT* OutEntry)
 {
 /*
 Description:
 
-    Will round the given code size up so that the return
-    value spans at least over "InCodeSize" bytes and always
-    ends on instruction boundaries.
+    Decodes the instructions spanning at least over "InMinSize" bytes
+    of the given entry point. Each instruction is decoded only once and
+    described by a compact record, which is all that is needed to
+    relocate the entry point later.
 
 Parameters:
 
-    - InCodePtr
+    - InEntryPoint
+
+        The entry point to decode.
 
-        A code portion the given size should be aligned to.
+    - InMinSize
 
-    - InCodeSize
+        The minimum size of the decoded entry point, which always
+        ends on instruction boundaries.
 
-        The minimum return value.
+    - OutEntry
+
+        Receives the decoded instructions. OutEntry->Size is the
+        rounded entry point size.
 
 Returns:
 
     STATUS_INVALID_PARAMETER
 
         The given pointer references invalid machine code.
+
+    STATUS_NOT_SUPPORTED
+
+        More than LH_MAX_ENTRY_INSTRUCTIONS instructions would be needed.
 */
-	UCHAR*				Ptr = (UCHAR*)InCodePtr;
-	UCHAR*				BasePtr = Ptr;
-    NTSTATUS            NtStatus;
+    LH_INSTRUCTION*         Instr;
+    LONG                    Length;
+    UCHAR                   DispOffset;
+    NTSTATUS                NtStatus;
 
-	while(BasePtr + InCodeSize > Ptr)
-	{
-		FORCE(NtStatus = LhGetInstructionLength(Ptr));
+    OutEntry->Code = (UCHAR*)InEntryPoint;
+    OutEntry->Size = 0;
+    OutEntry->Count = 0;
 
-		Ptr += NtStatus;
-	}
+    while(OutEntry->Size < InMinSize)
+    {
+        if((Length = LhDecodeInstructionLength(OutEntry->Code + OutEntry->Size, &DispOffset)) <= 0)
+            THROW(STATUS_INVALID_PARAMETER, L"Unable to disassemble entry point. ");
+
+        if(OutEntry->Count >= LH_MAX_ENTRY_INSTRUCTIONS)
+            THROW(STATUS_NOT_SUPPORTED, L"The entry point consists of too many instructions.");
 
-	return (ULONG)(Ptr - BasePtr);
+        Instr = &OutEntry->Instructions[OutEntry->Count++];
+        Instr->Length = (UCHAR)Length;
+        Instr->DispOffset = DispOffset;
+
+        OutEntry->Size += Length;
+    }
+
+    RETURN(STATUS_SUCCESS);
 
 THROW_OUTRO:
+FINALLY_OUTRO:
     return NtStatus;
 }
 
@@ -140,118 +150,111 @@ Returns:
         return STATUS_INVALID_PARAMETER;
 }
 
-EASYHOOK_NT_INTERNAL LhRelocateRIPRelativeInstruction(
-            ULONGLONG InOffset,
-            ULONGLONG InTargetOffset,
-            BOOL* OutWasRelocated)
+static NTSTATUS LhRelocateRIPRelativeInstruction(
+            LH_INSTRUCTION* InInstr,
+            UCHAR* InOffset,
+            UCHAR* InTargetOffset)
 {
 /*
 Description:
 
-    Check whether the given instruction is RIP relative and
-    relocates it. If it is not RIP relative, nothing is done.
-    Only applicable to 64-bit processes, 32-bit will always
-    return FALSE.
+    Copies a RIP-relative instruction decoded by LhDecodeEntryPoint()
+    and corrects its displacement for the new location.
 
 Parameters:
 
+    - InInstr
+
+        The decoded instruction.
+
     - InOffset
 
-        The instruction pointer to check for RIP addressing and relocate.
+        The instruction pointer of the original instruction.
 
     - InTargetOffset
 
         The instruction pointer where the RIP relocation should go to.
         Please note that RIP relocation are relocated relative to the
         offset you specify here and therefore are still not absolute!
-
-    - OutWasRelocated
-
-        TRUE if the instruction was RIP relative and has been relocated,
-        FALSE otherwise.
 */
-
-#ifndef _M_X64
-    return FALSE;
-#else
-    NTSTATUS            NtStatus;
-    CHAR                    Buf[MAX_PATH];
-    ULONG                    AsmSize;
-    ULONG64                    NextInstr;
-    CHAR                    Line[MAX_PATH];
-    LONG                    Pos;
     LONGLONG                RelAddr;
     LONGLONG                MemDelta = InTargetOffset - InOffset;
+    NTSTATUS                NtStatus;
 
     ASSERT(MemDelta == (LONG)MemDelta,L"reloc.c - MemDelta == (LONG)MemDelta");
 
-    *OutWasRelocated = FALSE;
-
-    // test field...
-    /*BYTE t[10] = {0x8b, 0x05, 0x12, 0x34, 0x56, 0x78};
-    // udis86 outputs: 0000000000000000 8b0512345678     mov eax, [rip+0x78563412]
+    RelAddr = (LONGLONG)*((LONG*)(InOffset + InInstr->DispOffset)) - MemDelta;
 
-    InOffset = (LONGLONG)t;
-
-    MemDelta = InTargetOffset - InOffset;
-*/
+    // Ensure the RIP address can still be relocated
+    if(RelAddr != (LONG)RelAddr)
+        THROW(STATUS_NOT_SUPPORTED, L"The given entry point contains at least one RIP-Relative instruction that could not be relocated!");
 
-    // Disassemble the current instruction
-    if(!RTL_SUCCESS(LhDisassembleInstruction((void*)InOffset, &AsmSize, Buf, sizeof(Buf), &NextInstr)))
-        THROW(STATUS_INVALID_PARAMETER_1, L"Unable to disassemble entry point. ");
-    
-    // Check that the address is RIP relative (i.e. look for "[rip+")
-    Pos = RtlAnsiIndexOf(Buf, '[');
-      if(Pos < 0)
-        RETURN;
+    // Copy instruction to target and correct the displacement
+    RtlCopyMemory(InTargetOffset, InOffset, InInstr->Length);
 
-    if (Buf[Pos + 1] == 'r' && Buf[Pos + 2] == 'i' && Buf[Pos + 3] == 'p' &&  Buf[Pos + 4] == '+')
-    {
-        Pos += 4;
-        // parse content
-        if(RtlAnsiSubString(Buf, Pos + 1, RtlAnsiIndexOf(Buf, ']') - Pos - 1, Line, MAX_PATH) <= 0)
-            RETURN;
-
-        // Convert HEX string to LONG
-        RelAddr = strtol(Line, NULL, 16);
-        if (!RelAddr)
-            RETURN;
-
-        // Verify that we are really RIP relative...
-        if(RelAddr != (LONG)RelAddr)
-            RETURN;
-        // Ensure the RelAddr is equal to the RIP address in code
-        if(*((LONG*)(NextInstr - 4)) != RelAddr)
-            RETURN;
-    
-        /*
-            Relocate this instruction...
-        */
-        // Adjust the relative address
-        RelAddr = RelAddr - MemDelta;
-        // Ensure the RIP address can still be relocated
-        if(RelAddr != (LONG)RelAddr)
-            THROW(STATUS_NOT_SUPPORTED, L"The given entry point contains at least one RIP-Relative instruction that could not be relocated!");
-
-        // Copy instruction to target
-        RtlCopyMemory((void*)InTargetOffset, (void*)InOffset, (ULONG)(NextInstr - InOffset));
-        // Correct the rip address
-        *((LONG*)(InTargetOffset + (NextInstr - InOffset) - 4)) = (LONG)RelAddr;
-
-        *OutWasRelocated = TRUE;
-    }
+    *((LONG*)(InTargetOffset + InInstr->DispOffset)) = (LONG)RelAddr;
 
     RETURN;
 
 THROW_OUTRO:
 FINALLY_OUTRO:
     return NtStatus;
+}
+
+#ifdef _M_X64
+    #define LH_ABSOLUTE_JUMP_SIZE       14
+#else
+    #define LH_ABSOLUTE_JUMP_SIZE       5
+#endif
+
+static UCHAR* LhEmitAbsoluteJump(
+            UCHAR* InBuffer,
+            UCHAR* InTarget)
+{
+/*
+Description:
+
+    Writes a jump to the given target that does not touch any register
+    and returns the location following it. On x64 this is "jmp [rip]"
+    followed by the target, on x86 a "jmp rel32" always reaches.
+*/
+#ifdef _M_X64
+    *(InBuffer++) = 0xFF;
+    *(InBuffer++) = 0x25;
+    *((LONG*)InBuffer) = 0;
+    InBuffer += 4;
+
+    *((UCHAR**)InBuffer) = InTarget;
+
+    return InBuffer + 8;
+#else
+    *(InBuffer++) = 0xE9;
+    *((LONG*)InBuffer) = (LONG)(InTarget - (InBuffer + 4));
+
+    return InBuffer + 4;
 #endif
 }
 
+static BOOL LhIsInstructionPrefix(UCHAR InByte)
+{
+    switch(InByte)
+    {
+    case 0x26: case 0x2E: case 0x36: case 0x3E: case 0x64: case 0x65: // segments and branch hints
+    case 0x66: case 0x67: case 0xF0: case 0xF2: case 0xF3:
+        return TRUE;
+    }
+
+#ifdef _M_X64
+    // REX
+    if((InByte & 0xF0) == 0x40)
+        return TRUE;
+#endif
+
+    return FALSE;
+}
+
 EASYHOOK_NT_INTERNAL LhRelocateEntryPoint(
-				UCHAR* InEntryPoint,
-				ULONG InEPSize,
+				LH_ENTRY_POINT* InEntry,
 				UCHAR* Buffer,
 				ULONG* OutRelocSize)
 {
@@ -261,21 +264,23 @@ Description:
     Relocates the given entry point into the buffer and finally
     stores the relocated size in OutRelocSize.
 
-Parameters:
-
-    - InEntryPoint
+    Relative calls and (conditional) jumps, including jcxz and loop/loopcc,
+    are rewritten into equivalent sequences that reach the original target.
+    Conditional branches become an inverted condition skipping over a jump
+    to the target. Branches into the entry point itself are redirected to
+    the relocated copy of the instruction they target.
 
-        The entry point to relocate.
+Parameters:
 
-    - InEPSize
+    - InEntry
 
-        Size of the given entry point in bytes.
+        The entry point to relocate, as decoded by LhDecodeEntryPoint().
 
     - Buffer
 
         A buffer receiving the relocated entry point.
         To ensure that there is always enough space, you should
-        reserve around 100 bytes. After completion this method will
+        reserve LOCAL_HOOK_MAX_ENTRY_SIZE bytes. After completion this method will
         store the real size in bytes in "OutRelocSize".
 		Important: all instructions using RIP relative addresses will 
 		be relative to the buffer location in memory.
@@ -286,164 +291,220 @@ Parameters:
 
 Returns:
 
+    STATUS_NOT_SUPPORTED
+
+        The entry point contains a branch that can't be relocated, for
+        example one into the middle of an instruction of the entry point.
 */
 #ifdef _M_X64
     #define POINTER_TYPE    LONGLONG
 #else
     #define POINTER_TYPE    LONG
 #endif
+	UCHAR*				InEntryPoint = InEntry->Code;
+	ULONG				InEPSize = InEntry->Size;
 	UCHAR*				pRes = Buffer;
 	UCHAR*				pOld = InEntryPoint;
+	LH_INSTRUCTION*		Instr;
     UCHAR			    b1;
 	UCHAR			    b2;
-	ULONG			    OpcodeLen;
+	ULONG			    Prefixes;
+	BOOL			    HasOperandSize;
+	BOOL			    HasAddressSize;
+	BOOL			    IsBranch;
+	UCHAR*			    Target;
+	ULONG			    TargetIndex;
+	ULONG			    JumpSize;
 	POINTER_TYPE   	    AbsAddr;
-	BOOL			    a16;
-	BOOL			    IsRIPRelative;
-    ULONG               InstrLen;
+    ULONG               Index;
+    ULONG               Offsets[LH_MAX_ENTRY_INSTRUCTIONS];
+    UCHAR*              Fixups[LH_MAX_ENTRY_INSTRUCTIONS];
+    ULONG               FixupIndices[LH_MAX_ENTRY_INSTRUCTIONS];
+    ULONG               FixupCount = 0;
     NTSTATUS            NtStatus;
 
 	ASSERT(InEPSize < 20,L"reloc.c - InEPSize < 20");
 
-	while(pOld < InEntryPoint + InEPSize)
+	for(Index = 0; Index < InEntry->Count; Index++)
 	{
-		b1 = *(pOld);
-		b2 = *(pOld + 1);
-		OpcodeLen = 0;
-		AbsAddr = 0;
-		a16 = FALSE;
-		IsRIPRelative = FALSE;
-
-		// check for prefixes
-		switch(b1)
+		Instr = &InEntry->Instructions[Index];
+		Offsets[Index] = (ULONG)(pRes - Buffer);
+
+		// skip prefixes, their meaning is kept by copying the whole instruction
+		HasOperandSize = FALSE;
+		HasAddressSize = FALSE;
+
+		for(Prefixes = 0; (Prefixes + 1 < Instr->Length) && LhIsInstructionPrefix(pOld[Prefixes]); Prefixes++)
 		{
-		case 0x67: a16 = TRUE; continue;
+			if(pOld[Prefixes] == 0x66)
+				HasOperandSize = TRUE;
+			else if(pOld[Prefixes] == 0x67)
+				HasAddressSize = TRUE;
 		}
 
+		b1 = pOld[Prefixes];
+		b2 = pOld[Prefixes + 1];
+		IsBranch = TRUE;
+
 		/////////////////////////////////////////////////////////
-		// get relative address value
+		// get relative address value, it always ends the instruction
 		switch(b1)
 		{
-			case 0xE9: // jmp imm16/imm32
+		case 0xE8: // call imm32
+		case 0xE9: // jmp imm32
 			{
-				/* only allowed as first instruction and only if the trampoline can be planted 
-				   within a 32-bit boundary around the original entrypoint. So the jumper will 
-				   be only 5 bytes and whereever the underlying code returns it will always
-				   be in a solid state. But this can only be guaranteed if the jump is the first
-				   instruction... */
-				if(pOld != InEntryPoint)
-					THROW(STATUS_NOT_SUPPORTED, L"Hooking far jumps is only supported if they are the first instruction.");
-				
-				// ATTENTION: will continue in "case 0xE8"
-			}
-		case 0xE8: // call imm16/imm32
+				AbsAddr = *((__int32*)(pOld + Instr->Length - 4));
+			}break;
+		case 0x0F:
 			{
-				if(a16)
-				{
-					AbsAddr = *((__int16*)(pOld + 1));
-					OpcodeLen = 3;
-				}
+				if((b2 & 0xF0) == 0x80) // jcc imm32
+					AbsAddr = *((__int32*)(pOld + Instr->Length - 4));
 				else
-				{
-					AbsAddr = *((__int32*)(pOld + 1));
-					OpcodeLen = 5;
-				}
+					IsBranch = FALSE;
 			}break;
-
+		case 0xE0: // loopne imm8
+		case 0xE1: // loope imm8
+		case 0xE2: // loop imm8
+		case 0xE3: // jcxz imm8
         case 0xEB: // jmp imm8
             {
-                AbsAddr = *((__int8*)(pOld + 1));
-                OpcodeLen = 2;
+                AbsAddr = *((__int8*)(pOld + Instr->Length - 1));
             }break;
-        /*
-			The problem with (conditional) jumps is that there will be no return into the relocated entry point.
-			So the execution will be proceeded in the original method and this will cause the whole
-			application to remain in an unstable state. Only near jumps with 32-bit offset are allowed as
-			first instruction (see above)...
-		*/
-		case 0xE3: // jcxz imm8
+		default:
 			{
-				THROW(STATUS_NOT_SUPPORTED, L"Hooking near (conditional) jumps is not supported.");
+				if((b1 & 0xF0) == 0x70) // jcc imm8
+					AbsAddr = *((__int8*)(pOld + Instr->Length - 1));
+				else
+					IsBranch = FALSE;
 			}break;
-		case 0x0F:
+		}
+
+		if(!IsBranch)
+		{
+			// relocate RIP relative instructions, just copy all others
+			if(Instr->DispOffset != 0)
 			{
-				if((b2 & 0xF0) == 0x80) // jcc imm16/imm32
-					THROW(STATUS_NOT_SUPPORTED,  L"Hooking far conditional jumps is not supported.");
-			}break;
+				FORCE(LhRelocateRIPRelativeInstruction(Instr, pOld, pRes));
+			}
+			else
+				RtlCopyMemory(pRes, pOld, Instr->Length);
+
+			pRes += Instr->Length;
+			pOld += Instr->Length;
+
+			continue;
 		}
 
-		if((b1 & 0xF0) == 0x70) // jcc imm8
-			THROW(STATUS_NOT_SUPPORTED,  L"Hooking near conditional jumps is not supported.");
+		// a 16-bit operand size would truncate the instruction pointer
+		if(HasOperandSize)
+			THROW(STATUS_NOT_SUPPORTED, L"Hooking branches with 16-bit operand size is not supported.");
+
+		AbsAddr += (POINTER_TYPE)(pOld + Instr->Length);
+		Target = (UCHAR*)AbsAddr;
 
 		/////////////////////////////////////////////////////////
-		// convert to: mov eax, AbsAddr
+		// does the branch target the entry point itself?
+		TargetIndex = InEntry->Count;
 
-		if(OpcodeLen > 0)
+		if((Target >= InEntryPoint) && (Target < InEntryPoint + InEPSize))
 		{
-			AbsAddr += (POINTER_TYPE)(pOld + OpcodeLen);
+			for(TargetIndex = 0; TargetIndex < InEntry->Count; TargetIndex++)
+			{
+				if(Target == InEntryPoint)
+					break;
+
+				Target -= InEntry->Instructions[TargetIndex].Length;
+			}
+
+			if(TargetIndex == InEntry->Count)
+				THROW(STATUS_NOT_SUPPORTED, L"Hooking branches into the middle of an instruction of the hooked entry point is not supported.");
+
+			if(b1 == 0xE8)
+				THROW(STATUS_NOT_SUPPORTED, L"Hooking calls into the hooked entry point is not supported.");
+
+			// will be a "jmp rel32" into the relocated entry point
+			JumpSize = 5;
+		}
+		else
+			JumpSize = LH_ABSOLUTE_JUMP_SIZE;
 
+		/////////////////////////////////////////////////////////
+		// insert alternate code
+		if(b1 == 0xE8)
+		{
+			// convert to: mov eax, AbsAddr; call eax
 #ifdef _M_X64
 			*(pRes++) = 0x48; // REX.W-Prefix
 #endif
 			*(pRes++) = 0xB8;
 
-			*((LONGLONG*)pRes) = AbsAddr;
+			*((POINTER_TYPE*)pRes) = AbsAddr;
 
 			pRes += sizeof(void*);
 
-			// points into entry point?
-			if((AbsAddr >= (LONGLONG)InEntryPoint) && (AbsAddr < (LONGLONG)InEntryPoint + InEPSize))
-				/* is not really unhookable but not worth the effort... */
-				THROW(STATUS_NOT_SUPPORTED, L"Hooking jumps into the hooked entry point is not supported.");
-
-			/////////////////////////////////////////////////////////
-			// insert alternate code
-			switch(b1)
-			{
-			case 0xE8: // call eax
-				{
-					*(pRes++) = 0xFF;
-					*(pRes++) = 0xD0;
-				}break;
-			case 0xE9: // jmp eax
-            case 0xEB: // jmp imm8
-				{
-					*(pRes++) = 0xFF;
-					*(pRes++) = 0xE0;
-				}break;
-			}
-
-			/* such conversions shouldnt be necessary in general...
-			   maybe the method was already hooked or uses some hook protection or is just
-			   bad programmed. EasyHook is capable of hooking the same method
-			   many times simultanously. Even if other (unknown) hook libraries are hooking methods that
-			   are already hooked by EasyHook. Only if EasyHook hooks methods that are already
-			   hooked with other libraries there can be problems if the other libraries are not
-			   capable of such a "bad" circumstance.
-			*/
-
-			*OutRelocSize = (ULONG)(pRes - Buffer);
+			*(pRes++) = 0xFF;
+			*(pRes++) = 0xD0;
 		}
 		else
 		{
-            // Check for RIP relative instructions and relocate
-            LhRelocateRIPRelativeInstruction((ULONGLONG)pOld, (ULONGLONG)pRes, &IsRIPRelative);
-		}
+			if((b1 & 0xF0) == 0x70)
+			{
+				// skip the jump below if the inverted condition is met
+				*(pRes++) = (UCHAR)(0x70 | ((b1 & 0x0F) ^ 1));
+				*(pRes++) = (UCHAR)JumpSize;
+			}
+			else if(b1 == 0x0F)
+			{
+				*(pRes++) = (UCHAR)(0x70 | ((b2 & 0x0F) ^ 1));
+				*(pRes++) = (UCHAR)JumpSize;
+			}
+			else if((b1 >= 0xE0) && (b1 <= 0xE3))
+			{
+				/*
+					There is no inverted form of jcxz and loop/loopcc:
+						[addr32] loop +2
+						jmp +JumpSize
+						jmp Target
+				*/
+				if(HasAddressSize)
+					*(pRes++) = 0x67;
+
+				*(pRes++) = b1;
+				*(pRes++) = 0x02;
+				*(pRes++) = 0xEB;
+				*(pRes++) = (UCHAR)JumpSize;
+			}
 
-		// find next instruction
-		FORCE(InstrLen = LhGetInstructionLength(pOld));
+			if(TargetIndex < InEntry->Count)
+			{
+				// patched below, the relocated target might not be known yet
+				*(pRes++) = 0xE9;
 
-		if(OpcodeLen == 0)
-		{
-			// just copy the instruction
-			if(!IsRIPRelative)
-				RtlCopyMemory(pRes, pOld, InstrLen);
+				Fixups[FixupCount] = pRes;
+				FixupIndices[FixupCount++] = TargetIndex;
 
-			pRes += InstrLen;
+				pRes += 4;
+			}
+			else
+				pRes = LhEmitAbsoluteJump(pRes, (UCHAR*)AbsAddr);
 		}
 
-		pOld += InstrLen;
-		IsRIPRelative = FALSE;
+		/* such conversions shouldnt be necessary in general...
+		   maybe the method was already hooked or uses some hook protection or is just
+		   bad programmed. EasyHook is capable of hooking the same method
+		   many times simultanously. Even if other (unknown) hook libraries are hooking methods that
+		   are already hooked by EasyHook. Only if EasyHook hooks methods that are already
+		   hooked with other libraries there can be problems if the other libraries are not
+		   capable of such a "bad" circumstance.
+		*/
+
+		pOld += Instr->Length;
+	}
+
+	// redirect branches into the entry point to the relocated instructions
+	for(Index = 0; Index < FixupCount; Index++)
+	{
+		*((LONG*)Fixups[Index]) = (LONG)((Buffer + Offsets[FixupIndices[Index]]) - (Fixups[Index] + 4));
 	}
 
 	*OutRelocSize = (ULONG)(pRes - Buffer);
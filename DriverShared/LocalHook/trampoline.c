@@ -0,0 +1,682 @@
+/*
+    EasyHook - The reinvention of Windows API hooking
+
+    Copyright (C) 2009 Christoph Husse
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Please visit http://www.codeplex.com/easyhook for more information
+    about the project and latest updates.
+*/
+#include "stdafx.h"
+
+/*
+    Every hook gets its own trampoline, emitted directly into the hook memory
+    when the hook is prepared. All addresses a trampoline needs are known at
+    this time and are encoded as immediates, so there are no placeholders to
+    replace and no table lookups at runtime. Only the argument registers of
+    the hook's calling convention are saved while entering the barrier and
+    raw hooks just get a jump to their handler.
+
+    Branches to code that is not emitted yet are recorded in a small fixup
+    table and resolved after the whole trampoline is written.
+*/
+#define LH_MAX_FIXUPS               8
+
+// branch targets; LH_LABEL_OLD_PROC is the relocated entry point right behind the trampoline
+#define LH_LABEL_CALL_ORIGINAL      0
+#define LH_LABEL_EXIT               1
+#define LH_LABEL_OUTRO              2
+#define LH_LABEL_OLD_PROC           3
+#define LH_LABEL_COUNT              4
+
+#define LH_LABEL_UNDEFINED          ((ULONG)-1)
+
+#define LH_FIXUP_REL8               0
+#define LH_FIXUP_REL32              1
+#define LH_FIXUP_ABS32              2
+
+typedef struct _LH_FIXUP_
+{
+    ULONG                   Offset;
+    ULONG                   Type;
+    ULONG                   Label;
+}LH_FIXUP;
+
+typedef struct _LH_EMITTER_
+{
+    UCHAR*                  Code;
+    ULONG                   Size;
+    BOOL                    IsOverflow;
+    ULONG                   Labels[LH_LABEL_COUNT];
+    ULONG                   FixupCount;
+    LH_FIXUP                Fixups[LH_MAX_FIXUPS];
+}LH_EMITTER;
+
+#ifdef _M_X64
+
+    static const UCHAR      PushArgs_x64[] = {
+        0x51,                               // push rcx
+        0x52,                               // push rdx
+        0x41, 0x50,                         // push r8
+        0x41, 0x51};                        // push r9
+
+    static const UCHAR      PopArgs_x64[] = {
+        0x41, 0x59,                         // pop r9
+        0x41, 0x58,                         // pop r8
+        0x5A,                               // pop rdx
+        0x59};                              // pop rcx
+
+    // R10 = address of return address => R10 = shard offset, like LhGetExecutionShard()
+    static const UCHAR      SelectShard_x64[] = {
+        0x4D, 0x89, 0xD3,                   // mov r11, r10
+        0x49, 0xC1, 0xEA, 0x0C,             // shr r10, 12
+        0x49, 0xC1, 0xEB, 0x14,             // shr r11, 20
+        0x4D, 0x31, 0xDA,                   // xor r10, r11
+        0x41, 0x83, 0xE2, 0x0F,             // and r10d, LOCAL_HOOK_SHARD_COUNT - 1
+        0x41, 0xC1, 0xE2, 0x06};            // shl r10d, 6 (LOCAL_HOOK_SHARD_SIZE)
+
+    // the handler returns with RSP pointing behind the original return address
+    static const UCHAR      OutroEntry_x64[] = {
+        0x6A, 0x00,                         // push 0 (space for return address)
+        0x50,                               // push rax
+        0x48, 0x83, 0xEC, 0x30,             // sub rsp, 32 + 16 (shadow space and XMM0)
+        0x0F, 0x29, 0x44, 0x24, 0x20};      // movaps [rsp + 32], xmm0
+
+    static const UCHAR      OutroExit_x64[] = {
+        0xF0, 0x48, 0xFF, 0x08,             // lock dec qword ptr [rax]
+        0x0F, 0x28, 0x44, 0x24, 0x20,       // movaps xmm0, [rsp + 32]
+        0x48, 0x83, 0xC4, 0x30,             // add rsp, 32 + 16
+        0x58,                               // pop rax
+        0xC3};                              // ret
+
+#else
+
+    // ECX = address of return address => EDX = shard offset, like LhGetExecutionShard()
+    static const UCHAR      SelectShard_x86[] = {
+        0x89, 0xCA,                         // mov edx, ecx
+        0xC1, 0xEA, 0x0C,                   // shr edx, 12
+        0xC1, 0xE9, 0x14,                   // shr ecx, 20
+        0x31, 0xCA,                         // xor edx, ecx
+        0x83, 0xE2, 0x0F,                   // and edx, LOCAL_HOOK_SHARD_COUNT - 1
+        0xC1, 0xE2, 0x06};                  // shl edx, 6 (LOCAL_HOOK_SHARD_SIZE)
+
+    // the handler returns with ESP pointing behind the original return address
+    static const UCHAR      OutroEntry_x86[] = {
+        0x6A, 0x00,                         // push 0 (space for return address)
+        0x50,                               // push eax
+        0x52,                               // push edx
+        0x8D, 0x44, 0x24, 0x08,             // lea eax, [esp + 8]
+        0x50};                              // push eax
+
+    static const UCHAR      OutroExit_x86[] = {
+        0xF0, 0xFF, 0x08,                   // lock dec dword ptr [eax]
+        0x5A,                               // pop edx
+        0x58,                               // pop eax
+        0xC3};                              // ret
+
+#endif
+
+static void LhEmitCode(
+            LH_EMITTER* InEmitter,
+            const UCHAR* InCode,
+            ULONG InSize)
+{
+    ULONG           Index;
+
+    if(InEmitter->Size + InSize > LOCAL_HOOK_MAX_TRAMPOLINE_SIZE)
+    {
+        InEmitter->IsOverflow = TRUE;
+
+        return;
+    }
+
+    for(Index = 0; Index < InSize; Index++)
+    {
+        InEmitter->Code[InEmitter->Size++] = InCode[Index];
+    }
+}
+
+
+
+
+static void LhEmitByte(
+            LH_EMITTER* InEmitter,
+            UCHAR InByte)
+{
+    LhEmitCode(InEmitter, &InByte, 1);
+}
+
+
+
+
+static void LhEmitBytes(
+            LH_EMITTER* InEmitter,
+            UCHAR InByte1,
+            UCHAR InByte2)
+{
+    LhEmitByte(InEmitter, InByte1);
+    LhEmitByte(InEmitter, InByte2);
+}
+
+
+
+
+static void LhEmitULong(
+            LH_EMITTER* InEmitter,
+            ULONG InValue)
+{
+    LhEmitCode(InEmitter, (UCHAR*)&InValue, 4);
+}
+
+
+
+
+#ifdef _M_X64
+
+static void LhEmitPointer(
+            LH_EMITTER* InEmitter,
+            void* InValue)
+{
+    LhEmitCode(InEmitter, (UCHAR*)&InValue, 8);
+}
+
+#endif
+
+
+
+
+static void LhEmitStackOperand(
+            LH_EMITTER* InEmitter,
+            ULONG InRegister,
+            ULONG InOffset)
+{
+/*
+Description:
+
+    Completes an instruction with the ModR/M operand "[esp/rsp + InOffset]",
+    InRegister is the low three bits of the other operand or the opcode extension.
+*/
+    InRegister = (InRegister & 7) << 3;
+
+    if(InOffset == 0)
+    {
+        LhEmitBytes(InEmitter, (UCHAR)(0x04 | InRegister), 0x24);
+    }
+    else if(InOffset < 0x80)
+    {
+        LhEmitBytes(InEmitter, (UCHAR)(0x44 | InRegister), 0x24);
+        LhEmitByte(InEmitter, (UCHAR)InOffset);
+    }
+    else
+    {
+        LhEmitBytes(InEmitter, (UCHAR)(0x84 | InRegister), 0x24);
+        LhEmitULong(InEmitter, InOffset);
+    }
+}
+
+
+
+
+static void LhEmitReference(
+            LH_EMITTER* InEmitter,
+            ULONG InType,
+            ULONG InLabel)
+{
+/*
+Description:
+
+    Emits a placeholder for the given label and records it in the fixup table.
+    Relative references have to be the last field of their instruction.
+*/
+    LH_FIXUP*           Fixup;
+
+    if(InEmitter->FixupCount >= LH_MAX_FIXUPS)
+    {
+        InEmitter->IsOverflow = TRUE;
+
+        return;
+    }
+
+    Fixup = &InEmitter->Fixups[InEmitter->FixupCount++];
+
+    Fixup->Offset = InEmitter->Size;
+    Fixup->Type = InType;
+    Fixup->Label = InLabel;
+
+    if(InType == LH_FIXUP_REL8)
+        LhEmitByte(InEmitter, 0);
+    else
+        LhEmitULong(InEmitter, 0);
+}
+
+
+
+
+static void LhEmitLabel(
+            LH_EMITTER* InEmitter,
+            ULONG InLabel)
+{
+    InEmitter->Labels[InLabel] = InEmitter->Size;
+}
+
+
+
+
+#ifndef _M_X64
+
+static void LhEmitCall(
+            LH_EMITTER* InEmitter,
+            void* InTarget)
+{
+    // call rel32; always in reach within 32-bit address space
+    LhEmitByte(InEmitter, 0xE8);
+    LhEmitULong(InEmitter, (ULONG)InTarget - (ULONG)(InEmitter->Code + InEmitter->Size + 4));
+}
+
+#endif
+
+
+
+
+static NTSTATUS LhResolveFixups(LH_EMITTER* InEmitter)
+{
+/*
+Description:
+
+    Writes the final displacements and addresses of all recorded references.
+*/
+    LH_FIXUP*           Fixup;
+    ULONG               Index;
+    ULONG               Target;
+    LONG                Distance;
+    NTSTATUS            NtStatus;
+
+    for(Index = 0; Index < InEmitter->FixupCount; Index++)
+    {
+        Fixup = &InEmitter->Fixups[Index];
+        Target = InEmitter->Labels[Fixup->Label];
+
+        if(Target == LH_LABEL_UNDEFINED)
+            THROW(STATUS_INTERNAL_ERROR, L"A trampoline references an undefined label.");
+
+        switch(Fixup->Type)
+        {
+        case LH_FIXUP_REL8:
+            {
+                Distance = (LONG)Target - (LONG)(Fixup->Offset + 1);
+
+                if((Distance < -128) || (Distance > 127))
+                    THROW(STATUS_INTERNAL_ERROR, L"A short branch of a trampoline is out of reach.");
+
+                InEmitter->Code[Fixup->Offset] = (UCHAR)(CHAR)Distance;
+            }break;
+        case LH_FIXUP_REL32:
+            {
+                Distance = (LONG)Target - (LONG)(Fixup->Offset + 4);
+
+                RtlCopyMemory(InEmitter->Code + Fixup->Offset, &Distance, 4);
+            }break;
+        case LH_FIXUP_ABS32:
+            {
+            #pragma warning (disable:4311) // pointer truncation
+                Target = (ULONG)(InEmitter->Code + Target);
+
+                RtlCopyMemory(InEmitter->Code + Fixup->Offset, &Target, 4);
+            }break;
+        default:
+            THROW(STATUS_INTERNAL_ERROR, L"Unknown trampoline fixup.");
+        }
+    }
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+#ifdef _M_X64
+
+static void LhEmitBarrier(
+            LH_EMITTER* InEmitter,
+            LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Emits the x64 trampoline entering the thread deadlock barrier.
+
+    The frame below the saved argument registers contains the shadow space,
+    the saved SSE argument registers and the execution counter shard selected
+    on entry. RSP is 16 byte aligned while calling the barrier, so the SSE
+    registers can be saved with aligned moves.
+*/
+    ULONG           IntSize = (InHook->ArgFlags & EASYHOOK_ARGS_STACK_ONLY)?0:4 * 8;
+    ULONG           SseSize = (InHook->ArgFlags & EASYHOOK_ARGS_NO_FLOAT)?0:4 * 16;
+    ULONG           ShardSlot = 32 + SseSize;
+    ULONG           FrameSize = ShardSlot + 8;
+    ULONG           RetAddrSlot = FrameSize + IntSize;
+    ULONG           Index;
+
+    // save argument registers
+    if(IntSize != 0)
+        LhEmitCode(InEmitter, PushArgs_x64, sizeof(PushArgs_x64));
+
+    LhEmitBytes(InEmitter, 0x48, 0x83); // sub rsp, FrameSize
+    LhEmitBytes(InEmitter, 0xEC, (UCHAR)FrameSize);
+
+    for(Index = 0; Index * 16 < SseSize; Index++)
+    {
+        LhEmitBytes(InEmitter, 0x0F, 0x29); // movaps [rsp + X], xmmN
+        LhEmitStackOperand(InEmitter, Index, 32 + Index * 16);
+    }
+
+    // increment the execution counter shard of this thread and remember it
+    LhEmitBytes(InEmitter, 0x4C, 0x8D); // lea r10, [rsp + RetAddrSlot]
+    LhEmitStackOperand(InEmitter, 2, RetAddrSlot);
+
+    LhEmitCode(InEmitter, SelectShard_x64, sizeof(SelectShard_x64));
+
+    LhEmitBytes(InEmitter, 0x48, 0xB8); // mov rax, IsExecutedPtr
+    LhEmitPointer(InEmitter, InHook->IsExecutedPtr);
+
+    LhEmitBytes(InEmitter, 0x4A, 0x8D); // lea rax, [rax + r10]
+    LhEmitBytes(InEmitter, 0x04, 0x10);
+
+    LhEmitBytes(InEmitter, 0xF0, 0x48); // lock inc qword ptr [rax]
+    LhEmitBytes(InEmitter, 0xFF, 0x00);
+
+    LhEmitBytes(InEmitter, 0x48, 0x89); // mov [rsp + ShardSlot], rax
+    LhEmitStackOperand(InEmitter, 0, ShardSlot);
+
+    // Hook->HookIntro(Hook, RetAddr, AddrOfRetAddr)
+    LhEmitBytes(InEmitter, 0x48, 0xB9); // mov rcx, Hook
+    LhEmitPointer(InEmitter, InHook);
+
+    LhEmitBytes(InEmitter, 0x4C, 0x8D); // lea r8, [rsp + RetAddrSlot]
+    LhEmitStackOperand(InEmitter, 0, RetAddrSlot);
+
+    LhEmitBytes(InEmitter, 0x49, 0x8B); // mov rdx, [r8]
+    LhEmitByte(InEmitter, 0x10);
+
+    LhEmitBytes(InEmitter, 0x48, 0xB8); // mov rax, HookIntro
+    LhEmitPointer(InEmitter, InHook->HookIntro);
+
+    LhEmitBytes(InEmitter, 0xFF, 0xD0); // call rax
+
+    // should call original method?
+    LhEmitByte(InEmitter, 0x48); // test rax, rax
+    LhEmitBytes(InEmitter, 0x85, 0xC0);
+
+    LhEmitByte(InEmitter, 0x74); // jz CALL_ORIGINAL
+    LhEmitReference(InEmitter, LH_FIXUP_REL8, LH_LABEL_CALL_ORIGINAL);
+
+    // the handler shall return to the outro
+    LhEmitBytes(InEmitter, 0x4C, 0x8D); // lea r11, [OUTRO]
+    LhEmitByte(InEmitter, 0x1D);
+    LhEmitReference(InEmitter, LH_FIXUP_REL32, LH_LABEL_OUTRO);
+
+    LhEmitBytes(InEmitter, 0x4C, 0x89); // mov [rsp + RetAddrSlot], r11
+    LhEmitStackOperand(InEmitter, 3, RetAddrSlot);
+
+    // RAX = address of handler selected by the barrier
+    LhEmitBytes(InEmitter, 0x48, 0x8B); // mov rax, [rax]
+    LhEmitByte(InEmitter, 0x00);
+
+    // restore argument registers and jump to RAX
+    LhEmitLabel(InEmitter, LH_LABEL_EXIT);
+
+    for(Index = 0; Index * 16 < SseSize; Index++)
+    {
+        LhEmitBytes(InEmitter, 0x0F, 0x28); // movaps xmmN, [rsp + X]
+        LhEmitStackOperand(InEmitter, Index, 32 + Index * 16);
+    }
+
+    LhEmitBytes(InEmitter, 0x48, 0x83); // add rsp, FrameSize
+    LhEmitBytes(InEmitter, 0xC4, (UCHAR)FrameSize);
+
+    if(IntSize != 0)
+        LhEmitCode(InEmitter, PopArgs_x64, sizeof(PopArgs_x64));
+
+    LhEmitBytes(InEmitter, 0xFF, 0xE0); // jmp rax
+
+    // release the execution counter shard and call the original method
+    LhEmitLabel(InEmitter, LH_LABEL_CALL_ORIGINAL);
+
+    LhEmitBytes(InEmitter, 0x48, 0x8B); // mov rax, [rsp + ShardSlot]
+    LhEmitStackOperand(InEmitter, 0, ShardSlot);
+
+    LhEmitBytes(InEmitter, 0xF0, 0x48); // lock dec qword ptr [rax]
+    LhEmitBytes(InEmitter, 0xFF, 0x08);
+
+    LhEmitBytes(InEmitter, 0x48, 0x8D); // lea rax, [OLD_PROC]
+    LhEmitByte(InEmitter, 0x05);
+    LhEmitReference(InEmitter, LH_FIXUP_REL32, LH_LABEL_OLD_PROC);
+
+    LhEmitByte(InEmitter, 0xEB); // jmp EXIT
+    LhEmitReference(InEmitter, LH_FIXUP_REL8, LH_LABEL_EXIT);
+
+    // this is where the handler returns...
+    LhEmitLabel(InEmitter, LH_LABEL_OUTRO);
+
+    LhEmitCode(InEmitter, OutroEntry_x64, sizeof(OutroEntry_x64));
+
+    // Hook->HookOutro(Hook, AddrOfRetAddr) returns the execution counter shard to release
+    LhEmitBytes(InEmitter, 0x48, 0xB9); // mov rcx, Hook
+    LhEmitPointer(InEmitter, InHook);
+
+    LhEmitBytes(InEmitter, 0x48, 0x8D); // lea rdx, [rsp + 56]
+    LhEmitStackOperand(InEmitter, 2, 56);
+
+    LhEmitBytes(InEmitter, 0x48, 0xB8); // mov rax, HookOutro
+    LhEmitPointer(InEmitter, InHook->HookOutro);
+
+    LhEmitBytes(InEmitter, 0xFF, 0xD0); // call rax
+
+    LhEmitCode(InEmitter, OutroExit_x64, sizeof(OutroExit_x64));
+}
+
+#else
+
+static void LhEmitBarrier(
+            LH_EMITTER* InEmitter,
+            LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Emits the x86 trampoline entering the thread deadlock barrier.
+
+    ECX and EDX are saved for __fastcall and __thiscall. The barrier methods
+    are __stdcall, so the arguments are removed by the callee.
+*/
+    ULONG           IntSize = (InHook->ArgFlags & EASYHOOK_ARGS_STACK_ONLY)?0:2 * 4;
+
+    // save argument registers
+    if(IntSize != 0)
+        LhEmitBytes(InEmitter, 0x51, 0x52); // push ecx; push edx
+
+    // increment the execution counter shard of this thread and remember it
+    LhEmitByte(InEmitter, 0x8D); // lea ecx, [esp + IntSize]
+    LhEmitStackOperand(InEmitter, 1, IntSize);
+
+    LhEmitCode(InEmitter, SelectShard_x86, sizeof(SelectShard_x86));
+
+    LhEmitBytes(InEmitter, 0x8D, 0x92); // lea edx, [edx + IsExecutedPtr]
+    LhEmitULong(InEmitter, (ULONG)InHook->IsExecutedPtr);
+
+    LhEmitBytes(InEmitter, 0xF0, 0xFF); // lock inc dword ptr [edx]
+    LhEmitByte(InEmitter, 0x02);
+
+    LhEmitByte(InEmitter, 0x52); // push edx
+
+    // Hook->HookIntro(Hook, RetAddr, AddrOfRetAddr)
+    LhEmitByte(InEmitter, 0x8D); // lea ecx, [esp + IntSize + 4]
+    LhEmitStackOperand(InEmitter, 1, IntSize + 4);
+
+    LhEmitByte(InEmitter, 0x51); // push ecx
+
+    LhEmitBytes(InEmitter, 0xFF, 0x31); // push dword ptr [ecx]
+
+    LhEmitByte(InEmitter, 0x68); // push Hook
+    LhEmitULong(InEmitter, (ULONG)InHook);
+
+    LhEmitCall(InEmitter, InHook->HookIntro);
+
+    LhEmitByte(InEmitter, 0x5A); // pop edx
+
+    // should call original method?
+    LhEmitBytes(InEmitter, 0x85, 0xC0); // test eax, eax
+
+    LhEmitByte(InEmitter, 0x74); // jz CALL_ORIGINAL
+    LhEmitReference(InEmitter, LH_FIXUP_REL8, LH_LABEL_CALL_ORIGINAL);
+
+    // the handler shall return to the outro
+    LhEmitByte(InEmitter, 0xC7); // mov dword ptr [esp + IntSize], OUTRO
+    LhEmitStackOperand(InEmitter, 0, IntSize);
+    LhEmitReference(InEmitter, LH_FIXUP_ABS32, LH_LABEL_OUTRO);
+
+    // EAX = address of handler selected by the barrier
+    LhEmitBytes(InEmitter, 0x8B, 0x00); // mov eax, [eax]
+
+    // restore argument registers and jump to EAX
+    LhEmitLabel(InEmitter, LH_LABEL_EXIT);
+
+    if(IntSize != 0)
+        LhEmitBytes(InEmitter, 0x5A, 0x59); // pop edx; pop ecx
+
+    LhEmitBytes(InEmitter, 0xFF, 0xE0); // jmp eax
+
+    // release the execution counter shard and call the original method
+    LhEmitLabel(InEmitter, LH_LABEL_CALL_ORIGINAL);
+
+    LhEmitBytes(InEmitter, 0xF0, 0xFF); // lock dec dword ptr [edx]
+    LhEmitByte(InEmitter, 0x0A);
+
+    LhEmitByte(InEmitter, 0xB8); // mov eax, OLD_PROC
+    LhEmitReference(InEmitter, LH_FIXUP_ABS32, LH_LABEL_OLD_PROC);
+
+    LhEmitByte(InEmitter, 0xEB); // jmp EXIT
+    LhEmitReference(InEmitter, LH_FIXUP_REL8, LH_LABEL_EXIT);
+
+    // this is where the handler returns...
+    LhEmitLabel(InEmitter, LH_LABEL_OUTRO);
+
+    LhEmitCode(InEmitter, OutroEntry_x86, sizeof(OutroEntry_x86));
+
+    // Hook->HookOutro(Hook, AddrOfRetAddr) returns the execution counter shard to release
+    LhEmitByte(InEmitter, 0x68); // push Hook
+    LhEmitULong(InEmitter, (ULONG)InHook);
+
+    LhEmitCall(InEmitter, InHook->HookOutro);
+
+    LhEmitCode(InEmitter, OutroExit_x86, sizeof(OutroExit_x86));
+}
+
+#endif
+
+
+
+
+static void LhEmitRawJump(
+            LH_EMITTER* InEmitter,
+            LOCAL_HOOK_INFO* InHook)
+{
+/*
+Description:
+
+    Raw hooks just jump to their handler. The handler address is part of the
+    code, because Hook->HookProc is reset on removal while threads might still
+    be on their way...
+*/
+#ifdef _M_X64
+    LhEmitBytes(InEmitter, 0xFF, 0x25); // jmp qword ptr [rip + 0]
+    LhEmitULong(InEmitter, 0);
+    LhEmitPointer(InEmitter, InHook->HookProc);
+#else
+    LhEmitByte(InEmitter, 0xE9); // jmp HookProc
+    LhEmitULong(InEmitter, (ULONG)InHook->HookProc - (ULONG)(InEmitter->Code + InEmitter->Size + 4));
+#endif
+}
+
+
+
+
+NTSTATUS LhEmitTrampoline(
+            LOCAL_HOOK_INFO* InHook,
+            ULONG* OutSize)
+{
+/*
+Description:
+
+    Writes the trampoline of the given hook to InHook->Trampoline. The
+    relocated entry point has to be placed directly behind it.
+
+Parameters:
+
+    - InHook
+
+        A prepared hook. IsRaw, ArgFlags, HookProc, HookIntro, HookOutro
+        and IsExecutedPtr are encoded into the trampoline.
+
+    - OutSize
+
+        Receives the size of the trampoline, which is at most
+        LOCAL_HOOK_MAX_TRAMPOLINE_SIZE.
+*/
+    LH_EMITTER          Emitter;
+    ULONG               Index;
+    NTSTATUS            NtStatus;
+
+    Emitter.Code = InHook->Trampoline;
+    Emitter.Size = 0;
+    Emitter.IsOverflow = FALSE;
+    Emitter.FixupCount = 0;
+
+    for(Index = 0; Index < LH_LABEL_COUNT; Index++)
+    {
+        Emitter.Labels[Index] = LH_LABEL_UNDEFINED;
+    }
+
+    if(InHook->IsRaw)
+        LhEmitRawJump(&Emitter, InHook);
+    else
+        LhEmitBarrier(&Emitter, InHook);
+
+    // pad with int3, so the relocated entry point starts at a 16 byte boundary
+    while((((ULONG_PTR)(Emitter.Code + Emitter.Size) & 15) != 0) && !Emitter.IsOverflow)
+    {
+        LhEmitByte(&Emitter, 0xCC);
+    }
+
+    if(Emitter.IsOverflow)
+        THROW(STATUS_BUFFER_TOO_SMALL, L"The trampoline exceeds LOCAL_HOOK_MAX_TRAMPOLINE_SIZE.");
+
+    LhEmitLabel(&Emitter, LH_LABEL_OLD_PROC);
+
+    FORCE(LhResolveFixups(&Emitter));
+
+    *OutSize = Emitter.Size;
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
@@ -22,16 +22,776 @@
 */
 #include "stdafx.h"
 
+/*
+    Removed hooks are not released immediately. Their entry point is restored
+    on removal and afterwards they are kept in the removal list until all
+    execution counter shards have been zero for at least two reclamation passes
+    and the grace period has passed since the entry point was restored. Hooks
+    that are still busy after the timeout or whose entry point has been
+    overwritten by someone else are moved into the stuck list and reported to
+    the removal callback. Busy hooks are still released once they drain.
+
+    Replaced handlers are retired the same way, but without restoring anything.
+    Every thread executing the old handler has incremented one of the execution
+    counter shards before it selected the handler, so the old handler can be
+    released after each shard has been zero at least once since the replacement.
+    Handlers sharing the trampoline of a patch site are removed the same way,
+    while the patch site itself is only restored when its last handler is removed.
+*/
+#define LH_REMOVAL_GRACE_PERIOD             25
+#define LH_REMOVAL_TIMEOUT                  1000
+
+#define LH_REMOVAL_ENTRY_CHANGED            0x00000001
+#define LH_REMOVAL_TIMED_OUT                0x00000002
+#define LH_REMOVAL_RELEASED                 0x00000004
+
+#define LH_ALL_SHARDS                       ((1UL << LOCAL_HOOK_SHARD_COUNT) - 1)
+
+static PLOCAL_HOOK_INFO         GlobalStuckList = NULL;
+static PLOCAL_HOOK_HANDLER      GlobalRetiredHandlers = NULL;
+static PLOCAL_HOOK_HANDLER      GlobalStuckHandlers = NULL;
+static HOOK_REMOVAL_CALLBACK*   RemovalCallback = NULL;
+static void*                    RemovalContext = NULL;
+
+#ifndef DRIVER
+static HANDLE                   hRemovalEvent = NULL;
+// the timer handle and its state are only changed while owning the timer lock
+static RTL_SPIN_LOCK            RemovalTimerLock;
+// every timer holds a reference to our module, see LhArmRemovalTimer()
+static HANDLE                   hRemovalTimer = NULL;
+static volatile DWORD           RemovalTimerThreadId = 0;
+static volatile BOOL            IsFinalizing = FALSE;
+#endif
+
+void LhRemovalInitialize()
+{
+/*
+Description:
+
+    Called by LhCriticalInitialize(). The removal event is signaled 
+    as long as no removal is pending. The timer is created lazily by the
+    first removal, because timer queues shall not be used in DllMain().
+*/
+    GlobalStuckList = NULL;
+    GlobalRetiredHandlers = NULL;
+    GlobalStuckHandlers = NULL;
+    RemovalCallback = NULL;
+    RemovalContext = NULL;
+
+#ifndef DRIVER
+    hRemovalEvent = CreateEventW(NULL, TRUE, TRUE, NULL);
+    hRemovalTimer = NULL;
+    RemovalTimerThreadId = 0;
+    IsFinalizing = FALSE;
+
+    RtlInitializeLock(&RemovalTimerLock);
+#endif
+}
+
+
+
+
+ULONG LhGetTickCount()
+{
+/*
+Description:
+
+    Returns a millisecond tick count. Only differences are meaningful.
+*/
+#ifndef DRIVER
+    return GetTickCount();
+#else
+    LARGE_INTEGER           Ticks;
+
+    KeQueryTickCount(&Ticks);
+
+    return (ULONG)((Ticks.QuadPart * KeQueryTimeIncrement()) / 10000);
+#endif
+}
+
+
+
+
+static BOOL LhRestoreEntryPoint(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Restores the original entry point of the given hook, if it wasn't
+    changed by someone else in the meantime.
+
+Returns:
+
+    FALSE if the entry point was changed and the hook can never be released.
+*/
+    if(InHook->HookCopy != *((ULONGLONG*)InHook->TargetProc))
+        return FALSE;
+
+    *((ULONGLONG*)InHook->TargetProc) = InHook->TargetBackup;
+
+#ifdef X64_DRIVER
+    *((ULONGLONG*)(InHook->TargetProc + 8)) = InHook->TargetBackup_x64;
+#endif
+
+    return TRUE;
+}
+
+
+
+
+static BOOL LhIsQuiescent(
+            PLOCAL_HOOK_INFO InHook,
+            ULONG* RefQuiescentShards)
+{
+/*
+Description:
+
+    Records which execution counter shards of the given hook are zero.
+
+Returns:
+
+    TRUE if every shard has been zero at least once since RefQuiescentShards
+    was reset. 
+*/
+    ULONG                   Index;
+    LONG_PTR                Count;
+
+    for(Index = 0; Index < LOCAL_HOOK_SHARD_COUNT; Index++)
+    {
+        Count = *((volatile LONG_PTR*)((UCHAR*)InHook->IsExecutedPtr + Index * LOCAL_HOOK_SHARD_SIZE));
+
+        // a negative shard would hide a thread executing the hook...
+        ASSERT(Count >= 0,L"uninstall.c - Count >= 0");
+
+        if(Count == 0)
+            *RefQuiescentShards |= 1UL << Index;
+    }
+
+    return *RefQuiescentShards == LH_ALL_SHARDS;
+}
+
+
+
+
+static BOOL LhIsRemovalComplete(
+            PLOCAL_HOOK_INFO InHook,
+            ULONG InNow)
+{
+/*
+Description:
+
+    A removed hook can be released if no thread has been executing it
+    for at least two passes and the grace period is over. The latter
+    covers threads which passed the entry point just before it was
+    restored but did not enter the trampoline yet. Chained handlers
+    are retired like replaced handlers instead. Raw hooks have no 
+    execution counter, which therefore is always zero, but their code 
+    slot is never reused, see LhQuarantineMemory().
+
+    The caller has to own the global hook lock.
+*/
+    if(InHook->RemovalState & LH_REMOVAL_ENTRY_CHANGED)
+        return FALSE;
+
+    // lock-free registry lookups might still be reading the hook
+    if(!LhRegistryIsQuiescent(&InHook->ReaderShards))
+        return FALSE;
+
+    // a chained handler shares the trampoline and counters of its patch site
+    if(InHook->ChainHead != InHook)
+        return LhIsQuiescent(InHook, &InHook->QuiescentShards);
+
+    // ...which has to outlive all of its chained handlers
+    if(InHook->ChainRefs > 0)
+        return FALSE;
+
+    if(LhGetExecutionCount(InHook) > 0)
+    {
+        InHook->RemovalPasses = 0;
+
+        return FALSE;
+    }
+
+    if(++InHook->RemovalPasses < 2)
+        return FALSE;
+
+    return (InNow - InHook->RemovalTime) >= LH_REMOVAL_GRACE_PERIOD;
+}
+
+
+
+
+static BOOL LhIsHandlerRetired(PLOCAL_HOOK_HANDLER InHandler)
+{
+/*
+Description:
+
+    A replaced handler can be released if every execution counter shard
+    of its hook has been zero at least once since the replacement, or if
+    the hook itself is released in the current pass.
+
+    The caller has to own the global hook lock.
+*/
+    if(InHandler->Hook->RemovalState & LH_REMOVAL_RELEASED)
+        return TRUE;
+
+    return LhIsQuiescent(InHandler->Hook, &InHandler->QuiescentShards);
+}
+
+
+
+#ifndef DRIVER
+
+static void CALLBACK LhRemovalTimerProc(
+            void* InContext,
+            BOOLEAN InTimerOrWaitFired);
+
+static void LhArmRemovalTimer()
+{
+/*
+Description:
+
+    Makes sure that the removal timer runs periodically. Must not be
+    called while owning the global hook lock.
+
+    The timer callback is executed by a thread pool worker instead of the
+    timer thread, because it invokes the removal callback, which might block
+    for an arbitrary time.
+
+    Every timer holds a reference to our module until its last callback
+    returned, see LhDeleteRemovalTimer(). So FreeLibrary() never unloads
+    code a pool thread is about to execute. The reference is taken before
+    acquiring the timer lock, because the loader lock might be acquired
+    before the timer lock by a thread removing hooks in DllMain().
+*/
+    WCHAR                   ModulePath[MAX_PATH + 1];
+    HMODULE                 hModule = NULL;
+
+    // never create the timer during DLL_PROCESS_DETACH
+    if((hRemovalTimer != NULL) || IsFinalizing)
+        return;
+
+    // removals are still processed by LhWaitForPendingRemovals() if anything fails...
+    if(!RTL_SUCCESS(RtlGetCurrentModulePath(ModulePath, MAX_PATH)) ||
+            ((hModule = LoadLibraryW(ModulePath)) == NULL))
+        return;
+
+    RtlAcquireLock(&RemovalTimerLock);
+    {
+        if((hRemovalTimer == NULL) && !IsFinalizing)
+        {
+            if(CreateTimerQueueTimer(
+                    &hRemovalTimer,
+                    NULL,
+                    LhRemovalTimerProc,
+                    NULL,
+                    LH_REMOVAL_GRACE_PERIOD,
+                    LH_REMOVAL_GRACE_PERIOD,
+                    WT_EXECUTEDEFAULT))
+            {
+                // now owned by the timer
+                hModule = NULL;
+            }
+            else
+                hRemovalTimer = NULL;
+        }
+    }
+    RtlReleaseLock(&RemovalTimerLock);
+
+    if(hModule != NULL)
+        FreeLibrary(hModule);
+}
+
+
+
+
+static DWORD WINAPI LhRemovalTimerReleaseThread(void* InTimer)
+{
+/*
+Description:
+
+    Waits for the last callback of the given timer and drops its module
+    reference afterwards. Unloading EasyHook at this point is fine, because
+    FreeLibraryAndExitThread() never returns into our code.
+*/
+    DeleteTimerQueueTimer(NULL, (HANDLE)InTimer, INVALID_HANDLE_VALUE);
+
+    FreeLibraryAndExitThread(hCurrentModule, 0);
+
+    return 0;
+}
+
+
+
+
+static void LhDeleteRemovalTimer(BOOL InWait)
+{
+/*
+Description:
+
+    Deletes the removal timer. The next removal creates it again.
+
+Parameters:
+
+    - InWait
+
+        TRUE to wait for a running timer callback. Must be FALSE during
+        DLL_PROCESS_DETACH, because the callback might wait for the loader
+        lock, and within the timer callback itself. The module reference of 
+        the timer is then dropped by a separate thread once its callback
+        has drained.
+*/
+    HANDLE                  hTimer;
+    HANDLE                  hThread;
+
+    RtlAcquireLock(&RemovalTimerLock);
+    {
+        hTimer = hRemovalTimer;
+
+        hRemovalTimer = NULL;
+    }
+    RtlReleaseLock(&RemovalTimerLock);
+
+    if(hTimer == NULL)
+        return;
+
+    if(InWait)
+    {
+        DeleteTimerQueueTimer(NULL, hTimer, INVALID_HANDLE_VALUE);
+
+        // our caller still holds a reference, so this won't unload the module
+        FreeLibrary(hCurrentModule);
+    }
+    else if(IsFinalizing)
+    {
+        // the timer pins the module, so the process is terminating and no callback will run anymore
+        DeleteTimerQueueTimer(NULL, hTimer, NULL);
+    }
+    else if((hThread = CreateThread(NULL, 0, LhRemovalTimerReleaseThread, hTimer, 0, NULL)) != NULL)
+    {
+        CloseHandle(hThread);
+    }
+    else
+    {
+        // keep the module loaded for good rather than unloading it under a running callback
+        DeleteTimerQueueTimer(NULL, hTimer, NULL);
+    }
+}
+
+#endif
+
+
+
+
+static void LhEnqueueRemoval(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Restores the entry point of an already unlinked hook and puts it
+    into the removal list. Must not be called while owning the global hook lock,
+    because the target code might not be writable at DISPATCH_LEVEL. Chained
+    handlers don't own the entry point.
+*/
+    InHook->RemovalTime = LhGetTickCount();
+    InHook->RemovalPasses = 0;
+    InHook->RemovalState = 0;
+    InHook->QuiescentShards = 0;
+    InHook->ReaderShards = 0;
+
+    if((InHook->ChainHead == InHook) && !LhRestoreEntryPoint(InHook))
+        InHook->RemovalState |= LH_REMOVAL_ENTRY_CHANGED;
+
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        InHook->Next = GlobalRemovalListHead.Next;
+        GlobalRemovalListHead.Next = InHook;
+
+#ifndef DRIVER
+        if(hRemovalEvent != NULL)
+            ResetEvent(hRemovalEvent);
+#endif
+    }
+    RtlReleaseLock(&GlobalHookLock);
+}
+
+
+
+
+static void LhProcessRemovals(
+            ULONG* OutPendingCount,
+            ULONG* OutStuckCount)
+{
+/*
+Description:
+
+    Performs one reclamation pass. Released hooks and newly stuck ones
+    are reported to the removal callback outside of the global hook lock.
+
+Parameters:
+
+    - OutPendingCount
+
+        Optional, receives the count of hooks that are still waiting
+        for threads to leave them.
+
+    - OutStuckCount
+
+        Optional, receives the count of hooks that timed out or can
+        never be released.
+*/
+    PLOCAL_HOOK_INFO        Hook;
+    PLOCAL_HOOK_INFO        Prev;
+    PLOCAL_HOOK_INFO        Next;
+    PLOCAL_HOOK_INFO        ReleaseList = NULL;
+    PLOCAL_HOOK_INFO        ReportList = NULL;
+    PLOCAL_HOOK_HANDLER     Handler;
+    PLOCAL_HOOK_HANDLER     PrevHandler;
+    PLOCAL_HOOK_HANDLER     NextHandler;
+    PLOCAL_HOOK_HANDLER     HandlerList = NULL;
+    HOOK_REMOVAL_CALLBACK*  Callback;
+    void*                   Context;
+    void*                   EntryPoint;
+    ULONG                   Now = LhGetTickCount();
+    ULONG                   PendingCount = 0;
+    ULONG                   StuckCount = 0;
+
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        Callback = RemovalCallback;
+        Context = RemovalContext;
+
+        // check pending removals
+        Prev = &GlobalRemovalListHead;
+
+        for(Hook = Prev->Next; Hook != NULL; Hook = Next)
+        {
+            Next = Hook->Next;
+
+            if(LhIsRemovalComplete(Hook, Now))
+            {
+                Prev->Next = Next;
+
+                if(Hook->ChainHead != Hook)
+                    Hook->ChainHead->ChainRefs--;
+
+                Hook->RemovalState |= LH_REMOVAL_RELEASED;
+                Hook->Next = ReleaseList;
+                ReleaseList = Hook;
+            }
+            else if((Hook->RemovalState & LH_REMOVAL_ENTRY_CHANGED) || 
+                    ((Now - Hook->RemovalTime) >= LH_REMOVAL_TIMEOUT))
+            {
+                Prev->Next = Next;
+
+                if(!(Hook->RemovalState & LH_REMOVAL_ENTRY_CHANGED))
+                    Hook->RemovalState |= LH_REMOVAL_TIMED_OUT;
+
+                Hook->Next = ReportList;
+                ReportList = Hook;
+            }
+            else
+            {
+                PendingCount++;
+
+                Prev = Hook;
+            }
+        }
+
+        // busy hooks are released as soon as they drain
+        Prev = NULL;
+
+        for(Hook = GlobalStuckList; Hook != NULL; Hook = Next)
+        {
+            Next = Hook->Next;
+
+            if(LhIsRemovalComplete(Hook, Now))
+            {
+                if(Prev == NULL)
+                    GlobalStuckList = Next;
+                else
+                    Prev->Next = Next;
+
+                if(Hook->ChainHead != Hook)
+                    Hook->ChainHead->ChainRefs--;
+
+                Hook->RemovalState |= LH_REMOVAL_RELEASED;
+                Hook->Next = ReleaseList;
+                ReleaseList = Hook;
+            }
+            else
+            {
+                StuckCount++;
+
+                Prev = Hook;
+            }
+        }
+
+        // report stuck hooks only once...
+        for(Hook = ReportList; Hook != NULL; Hook = Hook->Next)
+        {
+            StuckCount++;
+        }
+
+        // replaced handlers are not reported to the removal callback
+        PrevHandler = NULL;
+
+        for(Handler = GlobalRetiredHandlers; Handler != NULL; Handler = NextHandler)
+        {
+            NextHandler = Handler->Next;
+
+            if(LhIsHandlerRetired(Handler))
+            {
+                if(PrevHandler == NULL)
+                    GlobalRetiredHandlers = NextHandler;
+                else
+                    PrevHandler->Next = NextHandler;
+
+                Handler->Next = HandlerList;
+                HandlerList = Handler;
+            }
+            else if((Now - Handler->RetireTime) >= LH_REMOVAL_TIMEOUT)
+            {
+                if(PrevHandler == NULL)
+                    GlobalRetiredHandlers = NextHandler;
+                else
+                    PrevHandler->Next = NextHandler;
+
+                Handler->Next = GlobalStuckHandlers;
+                GlobalStuckHandlers = Handler;
+            }
+            else
+            {
+                PendingCount++;
+
+                PrevHandler = Handler;
+            }
+        }
+
+        PrevHandler = NULL;
+
+        for(Handler = GlobalStuckHandlers; Handler != NULL; Handler = NextHandler)
+        {
+            NextHandler = Handler->Next;
+
+            if(LhIsHandlerRetired(Handler))
+            {
+                if(PrevHandler == NULL)
+                    GlobalStuckHandlers = NextHandler;
+                else
+                    PrevHandler->Next = NextHandler;
+
+                Handler->Next = HandlerList;
+                HandlerList = Handler;
+            }
+            else
+            {
+                StuckCount++;
+
+                PrevHandler = Handler;
+            }
+        }
+
+#ifndef DRIVER
+        if((PendingCount == 0) && (hRemovalEvent != NULL))
+            SetEvent(hRemovalEvent);
+#endif
+    }
+    RtlReleaseLock(&GlobalHookLock);
+
+    while(ReportList != NULL)
+    {
+        Hook = ReportList;
+        ReportList = Hook->Next;
+
+        if(Callback != NULL)
+            Callback(Context, Hook->TargetProc, 
+                (Hook->RemovalState & LH_REMOVAL_ENTRY_CHANGED)?STATUS_NOT_SUPPORTED:STATUS_TIMEOUT);
+
+        RtlAcquireLock(&GlobalHookLock);
+        {
+            Hook->Next = GlobalStuckList;
+            GlobalStuckList = Hook;
+        }
+        RtlReleaseLock(&GlobalHookLock);
+    }
+
+    while(HandlerList != NULL)
+    {
+        Handler = HandlerList;
+        HandlerList = Handler->Next;
+
+        RtlFreeMemory(Handler);
+    }
+
+    while(ReleaseList != NULL)
+    {
+        Hook = ReleaseList;
+        ReleaseList = Hook->Next;
+        EntryPoint = Hook->TargetProc;
+
+        if(Hook->IsRaw)
+            LhQuarantineMemory(&Hook);
+        else
+            LhFreeMemory(&Hook);
+
+        if(Callback != NULL)
+            Callback(Context, EntryPoint, STATUS_SUCCESS);
+    }
+
+    if(OutPendingCount != NULL)
+        *OutPendingCount = PendingCount;
+
+    if(OutStuckCount != NULL)
+        *OutStuckCount = StuckCount;
+}
+
+
+
+#ifndef DRIVER
+
+static void CALLBACK LhRemovalTimerProc(
+            void* InContext,
+            BOOLEAN InTimerOrWaitFired)
+{
+/*
+Description:
+
+    Runs in a thread pool worker while removals are pending. The timer is
+    deleted while owning the timer lock, before the removal list is checked
+    again. So a concurrent LhEnqueueRemoval() either creates a new timer after
+    it has been deleted here or its hook is seen here.
+*/
+    ULONG                   PendingCount;
+
+    UNREFERENCED_PARAMETER(InContext);
+    UNREFERENCED_PARAMETER(InTimerOrWaitFired);
+
+    if(IsFinalizing)
+        return;
+
+    RemovalTimerThreadId = GetCurrentThreadId();
+    {
+        LhProcessRemovals(&PendingCount, NULL);
+    }
+    RemovalTimerThreadId = 0;
+
+    if(PendingCount > 0)
+        return;
+
+    // releases our module reference as soon as this callback returned
+    LhDeleteRemovalTimer(FALSE);
+
+    if((GlobalRemovalListHead.Next != NULL) || (GlobalRetiredHandlers != NULL))
+        LhArmRemovalTimer();
+}
+
+#endif
+
+
+
+
+static void LhUnlinkChainMember(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Removes a handler from the chain of its patch site. Its own chain pointer
+    is left intact for threads currently walking the chain.
+
+    The caller has to own the global hook lock.
+*/
+    PLOCAL_HOOK_INFO volatile*  Ref;
+
+    for(Ref = &InHook->ChainHead->Chain; *Ref != NULL; Ref = &(*Ref)->NextInChain)
+    {
+        if(*Ref == InHook)
+        {
+            *Ref = InHook->NextInChain;
+
+            break;
+        }
+    }
+}
+
+
+
+
+static BOOL LhReleaseChainMember(PLOCAL_HOOK_INFO InSite)
+{
+/*
+Description:
+
+    Called whenever a handler sharing the trampoline of the given patch site
+    is removed. The caller has to own the global hook lock.
+
+Returns:
+
+    TRUE if the patch site has to be removed now, because its own handler
+    was already removed and this was the last chained one.
+*/
+    InSite->ChainMembers--;
+
+    if(!InSite->IsDetached || (InSite->ChainMembers > 0) || (InSite->HookProc == NULL))
+        return FALSE;
+
+    InSite->HookProc = NULL;
+
+    return TRUE;
+}
+
+
+
+
+void LhDiscardChainMember(PLOCAL_HOOK_INFO InHook)
+{
+/*
+Description:
+
+    Releases a handler prepared by LhPrepareChainMember() that has never
+    been linked into the chain of its patch site.
+*/
+    PLOCAL_HOOK_INFO        Site = InHook->ChainHead;
+    BOOL                    IsRemoving;
+
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        Site->ChainRefs--;
+
+        IsRemoving = LhReleaseChainMember(Site);
+    }
+    RtlReleaseLock(&GlobalHookLock);
+
+    LhFreeMemory(&InHook);
+
+    if(IsRemoving)
+    {
+        LhEnqueueRemoval(Site);
+
+#ifndef DRIVER
+        LhArmRemovalTimer();
+#endif
+    }
+}
+
+
+
 
 EASYHOOK_NT_EXPORT LhUninstallHook(TRACED_HOOK_HANDLE InHandle)
 {
 /*
 Description:
 
-    Removes the given hook. To also release associated resources,
-    you will have to call LhWaitForPendingRemovals(). In any case
+    Removes the given hook. The entry point is restored immediately and 
     your hook handler will never be executed again, after calling this
-    method.
+    method. Associated resources are released in the background as soon 
+    as no thread is executing the hook anymore. Use LhWaitForPendingRemovals(),
+    LhQueryPendingRemovals(), LhSetRemovalCallback() or, in user-mode,
+    LhGetRemovalEvent() to get notified about that.
+
+    If other handlers share the trampoline of this hook, only the handler
+    is removed from the chain and the entry point is restored together with
+    the last handler.
 
 Parameters:
 
@@ -41,8 +801,7 @@ Parameters:
         will still return STATUS_SUCCESS.
 */
     LOCAL_HOOK_INFO*        Hook = NULL;
-    LOCAL_HOOK_INFO*        List;
-    LOCAL_HOOK_INFO*        Prev;
+    LOCAL_HOOK_INFO*        Site = NULL;
     NTSTATUS                NtStatus;
     BOOLEAN                 IsAllocated = FALSE;
 
@@ -56,11 +815,7 @@ Parameters:
             InHandle->Link = NULL;
 
             if(Hook->HookProc != NULL)
-            {
-                Hook->HookProc = NULL;  
-
                 IsAllocated = TRUE;
-            }
         }
 
         if(!IsAllocated)
@@ -70,28 +825,40 @@ Parameters:
             RETURN;
         }
 
-        // remove from global list
-        List = GlobalHookListHead.Next;
-        Prev = &GlobalHookListHead;
+        LhRegistryRemove(Hook);
 
-        while(List != NULL)
-        {
-            if(List == Hook)
-            {
-                Prev->Next = Hook->Next;
+        LhUnlinkChainMember(Hook);
 
-                break;
-            }
+        if(Hook->ChainHead != Hook)
+        {
+            Hook->HookProc = NULL;
 
-            List = List->Next;
+            if(LhReleaseChainMember(Hook->ChainHead))
+                Site = Hook->ChainHead;
         }
+        else if(Hook->ChainMembers > 0)
+        {
+            // the trampoline keeps dispatching to the remaining handlers
+            Hook->IsDetached = TRUE;
+            Hook->Tracking = NULL;
 
-        // add to removal list
-        Hook->Next = GlobalRemovalListHead.Next;
-        GlobalRemovalListHead.Next = Hook;
+            Hook = NULL;
+        }
+        else
+            Hook->HookProc = NULL;
     }
     RtlReleaseLock(&GlobalHookLock);
 
+    if(Hook != NULL)
+        LhEnqueueRemoval(Hook);
+
+    if(Site != NULL)
+        LhEnqueueRemoval(Site);
+
+#ifndef DRIVER
+    LhArmRemovalTimer();
+#endif
+
     RETURN(STATUS_SUCCESS);
 
 THROW_OUTRO:
@@ -104,45 +871,182 @@ FINALLY_OUTRO:
 
 
 
+EASYHOOK_NT_EXPORT LhReplaceHookHandler(
+            TRACED_HOOK_HANDLE InHandle,
+            void* InHookProc,
+            void* InCallback)
+{
+/*
+Description:
+
+    Atomically replaces the handler and callback of an installed hook. The 
+    entry point and trampoline are not touched, so no call is missed. Every
+    call entering the trampoline after this method returned is dispatched to
+    the new handler, and LhBarrierGetCallback() always returns the callback
+    belonging to the handler that is being executed.
+
+    Threads might still execute the old handler for a while. It is retired like
+    a removed hook, so LhWaitForPendingRemovals() or, in user-mode, the removal
+    event tell you when no thread is executing the old handler anymore.
+
+Parameters:
+
+    - InHandle
+
+        A traced hook handle of an installed hook.
+
+    - InHookProc
+
+        The new hook handler. It has to share the calling convention
+        and parameters of the old one.
+
+    - InCallback
+
+        The new value returned by LhBarrierGetCallback().
+
+Returns:
+
+    STATUS_NOT_FOUND if the hook is not installed (anymore).
+    STATUS_NOT_SUPPORTED for raw hooks, see LhInstallRawHook().
+*/
+    LOCAL_HOOK_INFO*        Hook = NULL;
+    PLOCAL_HOOK_HANDLER     Handler = NULL;
+    PLOCAL_HOOK_HANDLER     OldHandler;
+    NTSTATUS                NtStatus;
+
+    if(!IsValidPointer(InHandle, sizeof(HOOK_TRACE_INFO)))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid hook handle.");
+
+    if(!IsValidPointer(InHookProc, 1))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid hook procedure.");
+
+    if((Handler = (PLOCAL_HOOK_HANDLER)RtlAllocateMemory(TRUE, sizeof(LOCAL_HOOK_HANDLER))) == NULL)
+        THROW(STATUS_NO_MEMORY, L"Failed to allocate memory.");
+
+    Handler->HookProc = InHookProc;
+    Handler->Callback = InCallback;
+
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        if(!LhIsValidHandle(InHandle, &Hook))
+        {
+            RtlReleaseLock(&GlobalHookLock);
+
+            THROW(STATUS_NOT_FOUND, L"The given hook is not installed.");
+        }
+
+        if(Hook->IsRaw)
+        {
+            RtlReleaseLock(&GlobalHookLock);
+
+            THROW(STATUS_NOT_SUPPORTED, L"The handler of raw hooks can't be replaced.");
+        }
+
+        Hook->HookProc = (UCHAR*)InHookProc;
+        Hook->Callback = InCallback;
+
+        // full barrier, the execution counter shards are read after the exchange
+        OldHandler = (PLOCAL_HOOK_HANDLER)InterlockedExchangePointer((PVOID*)&Hook->Handler, Handler);
+
+        OldHandler->Hook = Hook;
+        OldHandler->RetireTime = LhGetTickCount();
+        OldHandler->QuiescentShards = 0;
+        OldHandler->Next = GlobalRetiredHandlers;
+
+        GlobalRetiredHandlers = OldHandler;
+
+#ifndef DRIVER
+        if(hRemovalEvent != NULL)
+            ResetEvent(hRemovalEvent);
+#endif
+    }
+    RtlReleaseLock(&GlobalHookLock);
+
+    Handler = NULL;
+
+#ifndef DRIVER
+    LhArmRemovalTimer();
+#endif
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    {
+        if(Handler != NULL)
+            RtlFreeMemory(Handler);
+
+        return NtStatus;
+    }
+}
+
+
+
+
+
+
 EASYHOOK_NT_EXPORT LhUninstallAllHooks()
 {
 /*
 Description:
 
-    Will remove ALL hooks. To also release associated resources,
-    you will have to call LhWaitForPendingRemovals().
+    Will remove ALL hooks. Associated resources are released in
+    the background, see LhUninstallHook().
 */
     LOCAL_HOOK_INFO*        Hook;
     LOCAL_HOOK_INFO*        List;
+    LOCAL_HOOK_INFO*        SiteList = NULL;
     NTSTATUS                NtStatus;
 
     RtlAcquireLock(&GlobalHookLock);
     {
-        // remove from global list
-        List = GlobalHookListHead.Next;
+        // remove from registry
+        List = LhRegistryRemoveAll();
 
-        while(List != NULL)
+        for(Hook = List; Hook != NULL; Hook = Hook->Next)
         {
-            Hook = List;
-            List = List->Next;
-
             // remove tracking
             if(LhIsValidHandle(Hook->Tracking, NULL))
             {
                 Hook->Tracking->Link = NULL;
             }
 
-            // add to removal list
             Hook->HookProc = NULL;
-            Hook->Next = GlobalRemovalListHead.Next;
 
-            GlobalRemovalListHead.Next = Hook;
+            LhUnlinkChainMember(Hook);
+
+            // patch sites whose own handler is already removed are not registered
+            if((Hook->ChainHead != Hook) && LhReleaseChainMember(Hook->ChainHead))
+            {
+                Hook->ChainHead->Next = SiteList;
+                SiteList = Hook->ChainHead;
+            }
         }
 
-		GlobalHookListHead.Next = NULL;
+        while(SiteList != NULL)
+        {
+            Hook = SiteList;
+            SiteList = Hook->Next;
+
+            Hook->Next = List;
+            List = Hook;
+        }
     }
     RtlReleaseLock(&GlobalHookLock);
 
+    // add to removal list
+    while(List != NULL)
+    {
+        Hook = List;
+        List = List->Next;
+
+        LhEnqueueRemoval(Hook);
+
+#ifndef DRIVER
+        LhArmRemovalTimer();
+#endif
+    }
+
     RETURN(STATUS_SUCCESS);
 
 FINALLY_OUTRO:
@@ -154,76 +1058,204 @@ FINALLY_OUTRO:
 
 
 
-EASYHOOK_NT_EXPORT LhWaitForPendingRemovals()
+LONG_PTR LhGetExecutionCount(PLOCAL_HOOK_INFO InHook)
 {
 /*
-Descriptions:
+Description:
+
+    Sums up all execution counter shards of the given hook. Every shard
+    is only modified by interlocked operations and a thread always releases
+    the shard it has incremented, so each shard counts the threads that
+    selected it.
 
-    For stability reasons, all resources associated with a hook
-    have to be released if no thread is currently executing the
-    handler. Separating this wait loop from the uninstallation
-    method is a great performance gain, because you can release
-    all hooks first, and then wait for all removals simultaneously.
+Returns:
 
+    The count of threads currently executing the trampoline or handler.
 */
-    PLOCAL_HOOK_INFO        Hook;
-    NTSTATUS                NtStatus = STATUS_SUCCESS;
-    UINT32                  Timeout = 1000;
-    while(TRUE)
+    LONG_PTR                Result = 0;
+    ULONG                   Index;
+
+    for(Index = 0; Index < LOCAL_HOOK_SHARD_COUNT; Index++)
     {
-        // pop from removal list
-        RtlAcquireLock(&GlobalHookLock);
-        {
-            Hook = GlobalRemovalListHead.Next;
-            
-            if(Hook == NULL)
-            {
-                RtlReleaseLock(&GlobalHookLock);
+        Result += *((volatile LONG_PTR*)((UCHAR*)InHook->IsExecutedPtr + Index * LOCAL_HOOK_SHARD_SIZE));
+    }
 
-                break;
-            }
+    return Result;
+}
 
-            GlobalRemovalListHead.Next = Hook->Next;
-        }
-        RtlReleaseLock(&GlobalHookLock);
 
-        // restore entry point...
-        if(Hook->HookCopy == *((ULONGLONG*)Hook->TargetProc))
-        {
-            *((ULONGLONG*)Hook->TargetProc) = Hook->TargetBackup;
 
-#ifdef X64_DRIVER
-			*((ULONGLONG*)(Hook->TargetProc + 8)) = Hook->TargetBackup_x64;
+
+
+
+EASYHOOK_NT_EXPORT LhSetRemovalCallback(
+            HOOK_REMOVAL_CALLBACK* InCallback,
+            void* InContext)
+{
+/*
+Description:
+
+    Registers a callback that is invoked for every removed hook, either
+    when its resources were released (STATUS_SUCCESS), or when it is still
+    busy after the removal timeout (STATUS_TIMEOUT), or when its entry
+    point was overwritten and it can never be released (STATUS_NOT_SUPPORTED).
+    A hook that timed out is reported again with STATUS_SUCCESS if it drains later.
+
+    The callback is invoked without owning any EasyHook lock, but in user-mode
+    usually from within a thread pool worker. During DLL_PROCESS_DETACH it
+    is not invoked anymore.
+
+Parameters:
+
+    - InCallback
+
+        The callback or NULL to unregister.
+
+    - InContext
+
+        An arbitrary value passed to the callback.
+*/
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        RemovalCallback = InCallback;
+        RemovalContext = InContext;
+    }
+    RtlReleaseLock(&GlobalHookLock);
+
+    return STATUS_SUCCESS;
+}
+
+
+
+
+
+
+EASYHOOK_NT_EXPORT LhQueryPendingRemovals(
+            ULONG* OutPendingCount,
+            ULONG* OutStuckCount)
+{
+/*
+Description:
+
+    Performs a reclamation pass and returns the current state. In kernel-mode
+    there is no timer, so drivers have to poll this method or call
+    LhWaitForPendingRemovals() to get resources released.
+
+Parameters:
+
+    - OutPendingCount
+
+        Receives the count of hooks still waiting for threads to leave them.
+
+    - OutStuckCount
+
+        Receives the count of hooks that timed out or can never be released.
+*/
+    NTSTATUS                NtStatus;
+
+    if(!IsValidPointer(OutPendingCount, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid pending count storage.");
+
+    if(!IsValidPointer(OutStuckCount, sizeof(ULONG)))
+        THROW(STATUS_INVALID_PARAMETER_2, L"Invalid stuck count storage.");
+
+    LhProcessRemovals(OutPendingCount, OutStuckCount);
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
+
+
+
+
+#ifndef DRIVER
+
+EASYHOOK_NT_EXPORT LhGetRemovalEvent(HANDLE* OutEvent)
+{
+/*
+Description:
+
+    Returns a manual-reset event that is signaled whenever no removal
+    is pending anymore. The handle is owned by EasyHook and must not be closed.
+
+Parameters:
+
+    - OutEvent
+
+        Receives the event handle.
+*/
+    NTSTATUS                NtStatus;
+
+    if(!IsValidPointer(OutEvent, sizeof(HANDLE)))
+        THROW(STATUS_INVALID_PARAMETER_1, L"Invalid event storage.");
+
+    if(hRemovalEvent == NULL)
+        THROW(STATUS_NOT_SUPPORTED, L"Unable to create the removal event.");
+
+    *OutEvent = hRemovalEvent;
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
+
 #endif
 
-            while (TRUE)
-            {
-                if (*Hook->IsExecutedPtr <= 0)
-                {
-                    // release memory...
-                    LhFreeMemory(&Hook);
-                    break;
-                }
-
-                if (Timeout < 0)
-                {
-                    // this hook was not released within timeout or cannot be released.
-                    // We will leak the memory, but not hang forever.
-                    NtStatus = STATUS_TIMEOUT;
-                    break;
-                }
-
-                RtlSleep(25);
-                Timeout -= 25;
-            }
-        }
-        else
+
+
+
+
+EASYHOOK_NT_EXPORT LhWaitForPendingRemovals()
+{
+/*
+Descriptions:
+
+    Resources of removed hooks are released in the background (user-mode) or
+    whenever removals are queried (kernel-mode). This method performs 
+    reclamation passes until no removal is pending anymore or the removal
+    timeout expired.
+
+    In user-mode, the removal timer is deleted once no removal is pending
+    anymore. So after this method succeeded outside of DllMain() and the
+    timer callback, no timer callback is running anymore.
+
+Returns:
+
+    STATUS_TIMEOUT if there are still pending removals after the timeout.
+    Hooks that timed out or can never be released are reported by 
+    LhQueryPendingRemovals() and the removal callback.
+*/
+    ULONG                   PendingCount;
+    ULONG                   Start = LhGetTickCount();
+
+    while(TRUE)
+    {
+        LhProcessRemovals(&PendingCount, NULL);
+
+        if(PendingCount == 0)
         {
-            // hook was changed... no chance to release resources
+#ifndef DRIVER
+            /*
+                Never wait for the timer callback during DLL_PROCESS_DETACH or within
+                the callback itself, the removal callback might have called us...
+            */
+            LhDeleteRemovalTimer(!IsFinalizing && (RemovalTimerThreadId != GetCurrentThreadId()));
+#endif
+
+            return STATUS_SUCCESS;
         }
-    }
 
-    return NtStatus;
+        if((LhGetTickCount() - Start) > LH_REMOVAL_TIMEOUT + LH_REMOVAL_GRACE_PERIOD)
+            return STATUS_TIMEOUT;
+
+        RtlSleep(LH_REMOVAL_GRACE_PERIOD);
+    }
 }
 
 
@@ -237,9 +1269,43 @@ Description:
     Will be called in the DLL_PROCESS_DETACH event and just uninstalls
     all hooks. If it is possible also their memory is released. 
 */
+#ifndef DRIVER
+    IsFinalizing = TRUE;
+
+    // user code must not run under the loader lock, not even a pass still running in the background...
+    RtlAcquireLock(&GlobalHookLock);
+    {
+        RemovalCallback = NULL;
+        RemovalContext = NULL;
+    }
+    RtlReleaseLock(&GlobalHookLock);
+
+    /*
+        Waiting for a running timer callback could deadlock, if it waits for the loader
+        lock. But every timer keeps the module loaded until its last callback returned,
+        so if there is one left, the process is terminating and its threads are gone.
+    */
+    LhDeleteRemovalTimer(FALSE);
+#endif
+
     LhUninstallAllHooks();
 
     LhWaitForPendingRemovals();
 
+#ifndef DRIVER
+    if(hRemovalEvent != NULL)
+        CloseHandle(hRemovalEvent);
+
+    hRemovalEvent = NULL;
+
+    RtlDeleteLock(&RemovalTimerLock);
+#endif
+
+    LhAllocatorFinalize();
+
+    LhSlotFinalize();
+
+    LhRegistryFinalize();
+
 	RtlDeleteLock(&GlobalHookLock);
-}
\ No newline at end of file
+}
@@ -80,6 +80,31 @@ namespace EasyHook
                     Int32 InThreadCount,
                     IntPtr InHandle);
 
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhSetCallerFilter(
+                    IntPtr InHandle,
+                    Boolean InIsExclusive,
+                    [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 3)]
+                    IntPtr[] InModuleList,
+                    Int32 InModuleCount);
+
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhSetHookStatistics(
+                    IntPtr InHandle,
+                    Int32 InFlags);
+
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhQueryHookStatistics(
+                    IntPtr InHandle,
+                    [Out] HookStatistics OutStatistics);
+
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhSetSamplingPolicy(
+                    IntPtr InHandle,
+                    Int32 InMode,
+                    Int32 InRate,
+                    Int32 InBurst);
+
         [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
         public static extern Int32 LhSetGlobalInclusiveACL(
                     [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)]
@@ -122,6 +147,14 @@ namespace EasyHook
         [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
         public static extern Int32 LhBarrierGetCallingModule(out IntPtr OutValue);
 
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhBarrierCaptureStackTrace(
+                    Int32 InFlags,
+                    Int32 InFramesToSkip,
+                    IntPtr OutFrames,
+                    Int32 InMaxFrameCount,
+                    out Int32 OutFrameCount);
+
         /*
             Debug helper API.
         */
@@ -270,6 +303,31 @@ namespace EasyHook
                     Int32 InThreadCount,
                     IntPtr InHandle);
 
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhSetCallerFilter(
+                    IntPtr InHandle,
+                    Boolean InIsExclusive,
+                    [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 3)]
+                    IntPtr[] InModuleList,
+                    Int32 InModuleCount);
+
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhSetHookStatistics(
+                    IntPtr InHandle,
+                    Int32 InFlags);
+
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhQueryHookStatistics(
+                    IntPtr InHandle,
+                    [Out] HookStatistics OutStatistics);
+
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhSetSamplingPolicy(
+                    IntPtr InHandle,
+                    Int32 InMode,
+                    Int32 InRate,
+                    Int32 InBurst);
+
         [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
         public static extern Int32 LhSetGlobalInclusiveACL(
                     [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)]
@@ -312,6 +370,14 @@ namespace EasyHook
         [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
         public static extern Int32 LhBarrierGetCallingModule(out IntPtr OutValue);
 
+        [DllImport(DllName, CallingConvention = CallingConvention.StdCall)]
+        public static extern Int32 LhBarrierCaptureStackTrace(
+                    Int32 InFlags,
+                    Int32 InFramesToSkip,
+                    IntPtr OutFrames,
+                    Int32 InMaxFrameCount,
+                    out Int32 OutFrameCount);
+
         /*
             Debug helper API.
         */
@@ -552,6 +618,42 @@ namespace EasyHook
             else Force( NativeAPI_x86.LhSetExclusiveACL(InThreadIdList, InThreadCount, InHandle));
         }
 
+        public static void LhSetCallerFilter(
+                    IntPtr InHandle,
+                    Boolean InIsExclusive,
+                    IntPtr[] InModuleList,
+                    Int32 InModuleCount)
+        {
+            if (Is64Bit) Force(NativeAPI_x64.LhSetCallerFilter(InHandle, InIsExclusive, InModuleList, InModuleCount));
+            else Force(NativeAPI_x86.LhSetCallerFilter(InHandle, InIsExclusive, InModuleList, InModuleCount));
+        }
+
+        public static void LhSetHookStatistics(
+                    IntPtr InHandle,
+                    Int32 InFlags)
+        {
+            if (Is64Bit) Force(NativeAPI_x64.LhSetHookStatistics(InHandle, InFlags));
+            else Force(NativeAPI_x86.LhSetHookStatistics(InHandle, InFlags));
+        }
+
+        public static void LhQueryHookStatistics(
+                    IntPtr InHandle,
+                    HookStatistics OutStatistics)
+        {
+            if (Is64Bit) Force(NativeAPI_x64.LhQueryHookStatistics(InHandle, OutStatistics));
+            else Force(NativeAPI_x86.LhQueryHookStatistics(InHandle, OutStatistics));
+        }
+
+        public static void LhSetSamplingPolicy(
+                    IntPtr InHandle,
+                    Int32 InMode,
+                    Int32 InRate,
+                    Int32 InBurst)
+        {
+            if (Is64Bit) Force(NativeAPI_x64.LhSetSamplingPolicy(InHandle, InMode, InRate, InBurst));
+            else Force(NativeAPI_x86.LhSetSamplingPolicy(InHandle, InMode, InRate, InBurst));
+        }
+
         public static void LhSetGlobalInclusiveACL(
                     Int32[] InThreadIdList,
                     Int32 InThreadCount)
@@ -574,6 +676,17 @@ namespace EasyHook
             else Force(NativeAPI_x86.LhBarrierGetCallingModule(out OutValue));
         }
 
+        public static void LhBarrierCaptureStackTrace(
+                    Int32 InFlags,
+                    Int32 InFramesToSkip,
+                    IntPtr OutFrames,
+                    Int32 InMaxFrameCount,
+                    out Int32 OutFrameCount)
+        {
+            if (Is64Bit) Force(NativeAPI_x64.LhBarrierCaptureStackTrace(InFlags, InFramesToSkip, OutFrames, InMaxFrameCount, out OutFrameCount));
+            else Force(NativeAPI_x86.LhBarrierCaptureStackTrace(InFlags, InFramesToSkip, OutFrames, InMaxFrameCount, out OutFrameCount));
+        }
+
         public static void LhBarrierGetCallback(out IntPtr OutValue)
         {
             if (Is64Bit) Force( NativeAPI_x64.LhBarrierGetCallback(out OutValue));
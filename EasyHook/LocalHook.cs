@@ -67,9 +67,6 @@ namespace EasyHook
         /// global ACL.
         /// </remarks>
         /// <param name="InACL">Threads to be explicitly included in negotiation.</param>
-        /// <exception cref="ArgumentException">
-        /// The limit of 128 access entries is exceeded!
-        /// </exception>
         public void SetInclusiveACL(Int32[] InACL)
         {
             if (InACL == null)
@@ -96,9 +93,6 @@ namespace EasyHook
         /// global ACL.
         /// </remarks>
         /// <param name="InACL">Threads to be explicitly included in negotiation.</param>
-        /// <exception cref="ArgumentException">
-        /// The limit of 128 access entries is exceeded!
-        /// </exception>
         public void SetExclusiveACL(Int32[] InACL)
         {
             if (InACL == null)
@@ -137,6 +131,203 @@ namespace EasyHook
         }
     }
 
+    /// <summary>
+    /// Restricts a hook to calls from dedicated unmanaged modules. The caller is determined by the
+    /// return address and checked before the hook handler is entered, so rejected calls are
+    /// directly passed to the original method without any managed transition.
+    /// </summary>
+    /// <remarks>
+    /// The filter is evaluated in addition to the thread ACLs. Only calls accepted by both
+    /// are intercepted. By default, all callers are accepted.
+    /// </remarks>
+    public class HookCallerFilter
+    {
+        private ProcessModule[] m_Modules = new ProcessModule[0];
+        private IntPtr m_Handle;
+        private Boolean m_IsExclusive = true;
+
+        /// <summary>
+        /// Is this filter an exclusive one? Refer to <see cref="SetExclusive"/> for more information.
+        /// </summary>
+        public Boolean IsExclusive { get { return m_IsExclusive; } }
+        /// <summary>
+        /// Is this filter an inclusive one? Refer to <see cref="SetInclusive"/> for more information.
+        /// </summary>
+        public Boolean IsInclusive { get { return !IsExclusive; } }
+
+        /// <summary>
+        /// Sets an inclusive filter. This means only calls from the modules in <paramref name="InModules"/>
+        /// are intercepted. Of course this will overwrite the existing filter.
+        /// </summary>
+        /// <param name="InModules">Modules whose calls shall be intercepted.</param>
+        public void SetInclusive(ProcessModule[] InModules)
+        {
+            Set(false, InModules);
+        }
+
+        /// <summary>
+        /// Sets an exclusive filter. This means calls from the modules in <paramref name="InModules"/>
+        /// are NOT intercepted while all others are. Of course this will overwrite the existing filter.
+        /// Pass an empty array to accept all callers again.
+        /// </summary>
+        /// <param name="InModules">Modules whose calls shall not be intercepted.</param>
+        public void SetExclusive(ProcessModule[] InModules)
+        {
+            Set(true, InModules);
+        }
+
+        private void Set(Boolean InIsExclusive, ProcessModule[] InModules)
+        {
+            ProcessModule[] Modules = (InModules == null) ? new ProcessModule[0] : (ProcessModule[])InModules.Clone();
+            IntPtr[] Bases = new IntPtr[Modules.Length];
+
+            for (int i = 0; i < Modules.Length; i++)
+            {
+                Bases[i] = Modules[i].BaseAddress;
+            }
+
+            NativeAPI.LhSetCallerFilter(m_Handle, InIsExclusive, Bases, Bases.Length);
+
+            m_Modules = Modules;
+            m_IsExclusive = InIsExclusive;
+        }
+
+        /// <summary>
+        /// Creates a copy of the module list associated with this filter.
+        /// </summary>
+        /// <returns>
+        /// A copy of the internal module entries.
+        /// </returns>
+        public ProcessModule[] GetEntries()
+        {
+            return (ProcessModule[])m_Modules.Clone();
+        }
+
+        internal HookCallerFilter(IntPtr InHandle)
+        {
+            m_Handle = InHandle;
+        }
+    }
+
+    /// <summary>
+    /// Selects which call statistics are collected for a hook, see <see cref="LocalHook.StatisticsMode"/>.
+    /// </summary>
+    public enum HookStatisticsMode
+    {
+        /// <summary>
+        /// No statistics are collected. This is the default.
+        /// </summary>
+        Disabled = 0,
+        /// <summary>
+        /// Counts intercepted calls and calls declined by the barrier.
+        /// </summary>
+        Counters = 1,
+        /// <summary>
+        /// Like <see cref="Counters"/>, but also accumulates the processor time stamp counter ticks
+        /// spent in the hook handler.
+        /// </summary>
+        CountersAndCycles = 3,
+    }
+
+    /// <summary>
+    /// Selects which calls are passed to the hook handler, see <see cref="LocalHook.SetSamplingPolicy"/>.
+    /// </summary>
+    public enum HookSamplingMode
+    {
+        /// <summary>
+        /// All calls are passed to the hook handler. This is the default.
+        /// </summary>
+        All = 0,
+        /// <summary>
+        /// The first and then every n-th call of each thread is passed to the hook handler.
+        /// </summary>
+        EveryNth = 1,
+        /// <summary>
+        /// Each call is passed to the hook handler with a probability of one in n.
+        /// </summary>
+        Probabilistic = 2,
+        /// <summary>
+        /// At most n calls per second and thread are passed to the hook handler.
+        /// </summary>
+        RateLimit = 3,
+    }
+
+    /// <summary>
+    /// A snapshot of the call statistics of a hook, see <see cref="LocalHook.Statistics"/>. All
+    /// counters are cumulative since statistics were first enabled for the hook.
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential)]
+    public class HookStatistics
+    {
+        private Int64 m_Calls;
+        private Int64 m_Handled;
+        private Int64 m_Recursion;
+        private Int64 m_AclDenied;
+        private Int64 m_CallerFiltered;
+        private Int64 m_Unsampled;
+        private Int64 m_LoaderLock;
+        private Int64 m_NoThreadStorage;
+        private Int64 m_HandlerCycles;
+
+        /// <summary>
+        /// The count of calls seen by the hook, the sum of all other counters except <see cref="HandlerCycles"/>.
+        /// </summary>
+        public Int64 Calls { get { return m_Calls; } }
+        /// <summary>
+        /// The count of calls passed to the hook handler.
+        /// </summary>
+        public Int64 Handled { get { return m_Handled; } }
+        /// <summary>
+        /// The count of calls declined because the calling thread was already executing the hook handler.
+        /// </summary>
+        public Int64 Recursion { get { return m_Recursion; } }
+        /// <summary>
+        /// The count of calls declined by the thread ACLs.
+        /// </summary>
+        public Int64 AclDenied { get { return m_AclDenied; } }
+        /// <summary>
+        /// The count of calls declined by the <see cref="LocalHook.CallerFilter"/>.
+        /// </summary>
+        public Int64 CallerFiltered { get { return m_CallerFiltered; } }
+        /// <summary>
+        /// The count of calls declined by the sampling policy, see <see cref="LocalHook.SetSamplingPolicy"/>.
+        /// </summary>
+        public Int64 Unsampled { get { return m_Unsampled; } }
+        /// <summary>
+        /// The count of calls declined because the calling thread owned the OS loader lock.
+        /// </summary>
+        public Int64 LoaderLock { get { return m_LoaderLock; } }
+        /// <summary>
+        /// The count of calls declined because no per thread storage could be allocated.
+        /// </summary>
+        public Int64 NoThreadStorage { get { return m_NoThreadStorage; } }
+        /// <summary>
+        /// The processor time stamp counter ticks spent in the hook handler, including nested calls.
+        /// Only collected with <see cref="HookStatisticsMode.CountersAndCycles"/>.
+        /// </summary>
+        public Int64 HandlerCycles { get { return m_HandlerCycles; } }
+
+        internal HookStatistics() { }
+    }
+
+    /// <summary>
+    /// Selects how <see cref="HookRuntimeInfo.UnmanagedStackTrace"/> walks the call stack.
+    /// </summary>
+    public enum StackTraceMode
+    {
+        /// <summary>
+        /// Uses <c>RtlCaptureStackBackTrace</c>, which unwinds through the unwind information on x64.
+        /// Precise but slow.
+        /// </summary>
+        Unwind = 0,
+        /// <summary>
+        /// Follows the saved frame pointers (EBP/RBP). Several times faster, but the trace ends at the
+        /// first return address that isn't within a known module or doesn't follow a call, for example
+        /// in JIT compiled code. Most x64 code doesn't keep frame pointers, so use <see cref="Unwind"/> there.
+        /// </summary>
+        FramePointers = 1,
+    }
+
     /// <summary>
     /// This class is intended to be used within hook handlers,
     /// to access associated runtime information.
@@ -148,7 +339,10 @@ namespace EasyHook
     public class HookRuntimeInfo
     {
         private static ProcessModule[] ModuleArray = new ProcessModule[0];
+        private static Dictionary<Int64, ProcessModule> ModuleByBase = new Dictionary<Int64, ProcessModule>();
         private static Int64 LastUpdate = 0;
+        private static Int32 m_StackTraceDepth = 32;
+        private static StackTraceMode m_StackTraceMode = StackTraceMode.Unwind;
 
         /// <summary>
         ///	Is the current thread within a valid hook handler? This is only the case
@@ -210,13 +404,17 @@ namespace EasyHook
         public static void UpdateUnmanagedModuleList()
         {
             List<ProcessModule> ModList = new List<ProcessModule>();
+            Dictionary<Int64, ProcessModule> ModMap = new Dictionary<Int64, ProcessModule>();
 
             foreach (ProcessModule Module in Process.GetCurrentProcess().Modules)
             {
                 ModList.Add(Module);
+
+                ModMap[Module.BaseAddress.ToInt64()] = Module;
             }
 
             ModuleArray = ModList.ToArray();
+            ModuleByBase = ModMap;
 
             LastUpdate = DateTime.Now.Ticks;
         }
@@ -340,22 +538,23 @@ namespace EasyHook
 
         private class StackTraceBuffer : CriticalFinalizerObject
         {
+            // see STACK_FRAME_INFORMATION in "easyhook.h"
+            public static readonly Int32 FrameSize = 3 * IntPtr.Size;
+
             public IntPtr Unmanaged;
-            public IntPtr[] Managed;
-            public ProcessModule[] Modules;
+            public Int32 Capacity;
 
-            public StackTraceBuffer()
+            public StackTraceBuffer(Int32 InCapacity)
             {
-                if ((Unmanaged = Marshal.AllocCoTaskMem(64 * IntPtr.Size)) == IntPtr.Zero)
+                if ((Unmanaged = Marshal.AllocCoTaskMem(InCapacity * FrameSize)) == IntPtr.Zero)
                     throw new OutOfMemoryException();
 
-                Managed = new IntPtr[64];
-                Modules = new ProcessModule[64];
+                Capacity = InCapacity;
             }
 
-            public void Synchronize(Int32 InCount)
+            public IntPtr GetModuleBase(Int32 InIndex)
             {
-                Marshal.Copy(Unmanaged, Managed, 0, Math.Min(64, InCount));
+                return Marshal.ReadIntPtr(Unmanaged, InIndex * FrameSize + IntPtr.Size);
             }
 
             ~StackTraceBuffer()
@@ -370,11 +569,58 @@ namespace EasyHook
         [ThreadStatic]
         private static StackTraceBuffer StackBuffer = null;
 
+        /// <summary>
+        /// The maximum count of frames returned by <see cref="UnmanagedStackTrace"/>. The default is 32.
+        /// </summary>
+        public static Int32 UnmanagedStackTraceDepth
+        {
+            get { return m_StackTraceDepth; }
+            set
+            {
+                if ((value < 1) || (value > 1024))
+                    throw new ArgumentOutOfRangeException("value", "The stack trace depth must be between 1 and 1024.");
+
+                m_StackTraceDepth = value;
+            }
+        }
+
+        /// <summary>
+        /// Selects how <see cref="UnmanagedStackTrace"/> walks the call stack. The default is
+        /// <see cref="StackTraceMode.Unwind"/>.
+        /// </summary>
+        public static StackTraceMode UnmanagedStackTraceMode
+        {
+            get { return m_StackTraceMode; }
+            set { m_StackTraceMode = value; }
+        }
+
+        private static ProcessModule BaseToModule(IntPtr InBaseAddress)
+        {
+            ProcessModule Result;
+
+            if (InBaseAddress == IntPtr.Zero)
+                return null;
+
+            if (ModuleByBase.TryGetValue(InBaseAddress.ToInt64(), out Result))
+                return Result;
+
+            // the native module list already knows this module...
+            if ((DateTime.Now.Ticks - LastUpdate) > 1000 * 1000 * 10 /* 1000 ms*/)
+            {
+                UpdateUnmanagedModuleList();
+
+                ModuleByBase.TryGetValue(InBaseAddress.ToInt64(), out Result);
+            }
+
+            return Result;
+        }
+
         /// <summary>
         /// Creates a call stack trace of the unmanaged code path that finally
         /// lead to your hook. To detect whether the desired module is within the
         /// call stack you will have to walk through the whole list!
-        /// Executes in max. 20 micro secounds.
+        /// The frames are attributed to their modules in one native pass, see
+        /// <see cref="UnmanagedStackTraceDepth"/> and <see cref="UnmanagedStackTraceMode"/>.
         /// </summary>
         /// <remarks>
         /// This method is not supported on Windows 2000 and will just return the
@@ -394,31 +640,22 @@ namespace EasyHook
                     return Module;
                 }
 
-                IntPtr Backup;
+                Int32 Depth = m_StackTraceDepth;
+                Int32 Count;
 
-                NativeAPI.LhBarrierBeginStackTrace(out Backup);
-
-                try
-                {
-                    if(StackBuffer == null)
-                        StackBuffer = new StackTraceBuffer();
-                    
-                    Int16 Count = NativeAPI.RtlCaptureStackBackTrace(0, 32, StackBuffer.Unmanaged, IntPtr.Zero);
-                    ProcessModule[] Result = new ProcessModule[Count];
+                if ((StackBuffer == null) || (StackBuffer.Capacity < Depth))
+                    StackBuffer = new StackTraceBuffer(Depth);
 
-                    StackBuffer.Synchronize(Count);
+                NativeAPI.LhBarrierCaptureStackTrace((Int32)m_StackTraceMode, 0, StackBuffer.Unmanaged, Depth, out Count);
 
-                    for (int i = 0; i < Count; i++)
-                    {
-                        Result[i] = PointerToModule(StackBuffer.Managed[i]);
-                    }
+                ProcessModule[] Result = new ProcessModule[Count];
 
-                    return Result;
-                }
-                finally
+                for (int i = 0; i < Count; i++)
                 {
-                    NativeAPI.LhBarrierEndStackTrace(Backup);
+                    Result[i] = BaseToModule(StackBuffer.GetModuleBase(i));
                 }
+
+                return Result;
             }
         }
 
@@ -469,6 +706,9 @@ namespace EasyHook
         private Delegate m_HookProc;
         private Object m_Callback;
         private HookAccessControl m_ThreadACL;
+        private HookCallerFilter m_CallerFilter;
+        private HookStatisticsMode m_StatisticsMode = HookStatisticsMode.Disabled;
+        private HookSamplingMode m_SamplingMode = HookSamplingMode.All;
         private static HookAccessControl m_GlobalThreadACL = new HookAccessControl(IntPtr.Zero);
 
         /// <summary>
@@ -503,6 +743,126 @@ namespace EasyHook
             }
         }
 
+        /// <summary>
+        /// Returns the caller filter associated with this hook. Calls rejected by the filter never
+        /// reach the hook handler.
+        /// </summary>
+        /// <exception cref="ObjectDisposedException">
+        /// The underlying hook is already disposed.
+        /// </exception>
+        public HookCallerFilter CallerFilter {
+            get
+            {
+                if (IntPtr.Zero == m_Handle)
+                    throw new ObjectDisposedException(typeof(LocalHook).FullName);
+
+                return m_CallerFilter;
+            }
+        }
+
+        /// <summary>
+        /// Gets or sets which call statistics are collected for this hook. Collected statistics are
+        /// kept when disabled again, until the hook is disposed.
+        /// </summary>
+        /// <exception cref="ObjectDisposedException">
+        /// The underlying hook is already disposed.
+        /// </exception>
+        public HookStatisticsMode StatisticsMode {
+            get
+            {
+                if (IntPtr.Zero == m_Handle)
+                    throw new ObjectDisposedException(typeof(LocalHook).FullName);
+
+                return m_StatisticsMode;
+            }
+            set
+            {
+                lock (m_ThreadSafe)
+                {
+                    if (IntPtr.Zero == m_Handle)
+                        throw new ObjectDisposedException(typeof(LocalHook).FullName);
+
+                    NativeAPI.LhSetHookStatistics(m_Handle, (Int32)value);
+
+                    m_StatisticsMode = value;
+                }
+            }
+        }
+
+        /// <summary>
+        /// The sampling mode set by <see cref="SetSamplingPolicy"/>.
+        /// </summary>
+        /// <exception cref="ObjectDisposedException">
+        /// The underlying hook is already disposed.
+        /// </exception>
+        public HookSamplingMode SamplingMode {
+            get
+            {
+                if (IntPtr.Zero == m_Handle)
+                    throw new ObjectDisposedException(typeof(LocalHook).FullName);
+
+                return m_SamplingMode;
+            }
+        }
+
+        /// <summary>
+        /// Restricts the calls passed to the hook handler. All other calls go straight to the original
+        /// method. The sampling state is kept per thread, so a rate limit applies to each thread on its own.
+        /// </summary>
+        /// <remarks>
+        /// If no other hook is installed for the same entry point, calls that are not sampled skip the
+        /// thread deadlock barrier entirely and are almost as cheap as unhooked calls. Calls declined by the
+        /// ACL, a caller filter or the loader lock check are not counted by the policy.
+        /// </remarks>
+        /// <param name="InMode">The sampling mode.</param>
+        /// <param name="InRate">
+        /// The n of <see cref="HookSamplingMode.EveryNth"/> and <see cref="HookSamplingMode.Probabilistic"/>,
+        /// or the calls per second of <see cref="HookSamplingMode.RateLimit"/>. Ignored for <see cref="HookSamplingMode.All"/>.
+        /// </param>
+        /// <param name="InBurst">
+        /// The count of calls a thread may make in a burst with <see cref="HookSamplingMode.RateLimit"/>. Ignored otherwise.
+        /// </param>
+        /// <exception cref="ObjectDisposedException">
+        /// The underlying hook is already disposed.
+        /// </exception>
+        public void SetSamplingPolicy(HookSamplingMode InMode, Int32 InRate, Int32 InBurst)
+        {
+            lock (m_ThreadSafe)
+            {
+                if (IntPtr.Zero == m_Handle)
+                    throw new ObjectDisposedException(typeof(LocalHook).FullName);
+
+                NativeAPI.LhSetSamplingPolicy(m_Handle, (Int32)InMode, InRate, InBurst);
+
+                m_SamplingMode = InMode;
+            }
+        }
+
+        /// <summary>
+        /// Queries the call statistics of this hook. Counters are summed up on each query, so a result
+        /// taken while the hook is called is not an exact snapshot. Refer to <see cref="StatisticsMode"/>
+        /// to enable the statistics.
+        /// </summary>
+        /// <exception cref="ObjectDisposedException">
+        /// The underlying hook is already disposed.
+        /// </exception>
+        public HookStatistics Statistics {
+            get
+            {
+                HookStatistics Result = new HookStatistics();
+
+                lock (m_ThreadSafe)
+                {
+                    if (IntPtr.Zero == m_Handle)
+                        throw new ObjectDisposedException(typeof(LocalHook).FullName);
+
+                    NativeAPI.LhQueryHookStatistics(m_Handle, Result);
+                }
+
+                return Result;
+            }
+        }
+
         /// <summary>
         /// Checks whether a given thread ID will be intercepted by the underlying hook.
         /// </summary>
@@ -651,7 +1011,7 @@ namespace EasyHook
         /// The given entry point contains machine code that can not be hooked.
         /// </exception>
         /// <exception cref="InsufficientMemoryException">
-        /// The maximum amount of hooks has been installed. This is currently set to MAX_HOOK_COUNT (1024).
+        /// The maximum amount of hooks has been installed. This is currently limited to 65536 simultaneous hooks.
         /// </exception>
         public static LocalHook Create(
             IntPtr InTargetProc,
@@ -686,6 +1046,7 @@ namespace EasyHook
             }
 
             Result.m_ThreadACL = new HookAccessControl(Result.m_Handle);
+            Result.m_CallerFilter = new HookCallerFilter(Result.m_Handle);
 
             return Result;
         }
@@ -734,7 +1095,7 @@ namespace EasyHook
         /// The given entry point contains machine code that can not be hooked.
         /// </exception>
         /// <exception cref="InsufficientMemoryException">
-        /// The maximum amount of hooks has been installed. This is currently set to MAX_HOOK_COUNT (1024).
+        /// The maximum amount of hooks has been installed. This is currently limited to 65536 simultaneous hooks.
         /// </exception>
         public static LocalHook CreateUnmanaged(
             IntPtr InTargetProc,
@@ -766,6 +1127,7 @@ namespace EasyHook
             }
 
             Result.m_ThreadACL = new HookAccessControl(Result.m_Handle);
+            Result.m_CallerFilter = new HookCallerFilter(Result.m_Handle);
 
             return Result;
         }
@@ -48,17 +48,13 @@ Parameters:
         it will be automatically replaced with the calling thread ID.
 
     - InThreadCount
-        The count of entries listed in the thread ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the thread ID list.
 */
 
     ULONG           Index;
 
     ASSERT(IsValidPointer(InAcl, sizeof(HOOK_ACL)),L"acl.c - IsValidPointer(InAcl, sizeof(HOOK_ACL))");
 
-    if(InThreadCount > MAX_ACE_COUNT)
-        return STATUS_INVALID_PARAMETER_2;
-
     if(!IsValidPointer(InThreadIdList, InThreadCount * sizeof(ULONG)))
         return STATUS_INVALID_PARAMETER_1;
 
@@ -69,12 +65,7 @@ Parameters:
     }
 
     // set ACL...
-    InAcl->IsExclusive = InIsExclusive;
-    InAcl->Count = InThreadCount;
-
-    RtlCopyMemory(InAcl->Entries, InThreadIdList, InThreadCount * sizeof(ULONG));
-
-    return STATUS_SUCCESS;
+    return LhBarrierSetAcl(InAcl, InIsExclusive, InThreadIdList, InThreadCount);
 }
 
 EASYHOOK_NT_EXPORT LhSetInclusiveACL(
@@ -96,8 +87,7 @@ Parameters:
         it will be automatically replaced with the calling thread ID.
 
     - InThreadCount
-        The count of entries listed in the thread ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the thread ID list.
 
     - InHandle
         The hook handle whose local ACL is going to be set.
@@ -126,8 +116,7 @@ Parameters:
         it will be automatically replaced with the calling thread ID.
 
     - InThreadCount
-        The count of entries listed in the thread ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the thread ID list.
 
     - InHandle
         The hook handle whose local ACL is going to be set.
@@ -155,8 +144,7 @@ Parameters:
         it will be automatically replaced with the calling thread ID.
 
     - InThreadCount
-        The count of entries listed in the thread ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the thread ID list.
 */
     return LhSetACL(LhBarrierGetAcl(), FALSE, InThreadIdList, InThreadCount);
 }
@@ -176,8 +164,7 @@ Parameters:
         it will be automatically replaced with the calling thread ID.
 
     - InThreadCount
-        The count of entries listed in the thread ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the thread ID list.
 */
     return LhSetACL(LhBarrierGetAcl(), TRUE, InThreadIdList, InThreadCount);
 }
\ No newline at end of file
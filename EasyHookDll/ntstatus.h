@@ -40,6 +40,7 @@
 #define STATUS_WOW_ASSERTION             ((NTSTATUS)0xC0009898L)
 #define STATUS_BUFFER_OVERFLOW           ((NTSTATUS)0x80000005L)
 #define STATUS_DLL_INIT_FAILED           ((NTSTATUS)0xC0000142L)
+#define STATUS_CANCELLED                 ((NTSTATUS)0xC0000120L)
 
 
 #define STATUS_INVALID_PARAMETER_1       ((NTSTATUS)0xC00000EFL)
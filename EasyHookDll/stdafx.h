@@ -67,7 +67,7 @@ HOOK_ACL* LhBarrierGetAcl();
 void LhBarrierThreadDetach();
 NTSTATUS LhBarrierProcessAttach();
 void LhBarrierProcessDetach();
-ULONGLONG LhBarrierIntro(LOCAL_HOOK_INFO* InHandle, void* InRetAddr, void** InAddrOfRetAddr);
+void* __stdcall LhBarrierIntro(LOCAL_HOOK_INFO* InHandle, void* InRetAddr, void** InAddrOfRetAddr);
 void* __stdcall LhBarrierOutro(LOCAL_HOOK_INFO* InHandle, void** InAddrOfRetAddr);
 
 LONG DbgRelocateRIPRelative(
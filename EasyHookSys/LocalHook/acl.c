@@ -48,17 +48,13 @@ Parameters:
         it will be automatically replaced with the calling process ID.
 
     - InProcessCount
-        The count of entries listed in the process ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the process ID list.
 */
 
     ULONG           Index;
 
     ASSERT(IsValidPointer(InAcl, sizeof(HOOK_ACL)));
 
-    if(InProcessCount > MAX_ACE_COUNT)
-        return STATUS_INVALID_PARAMETER_2;
-
     if(!IsValidPointer(InProcessIdList, InProcessCount * sizeof(ULONG)))
         return STATUS_INVALID_PARAMETER_1;
 
@@ -69,12 +65,7 @@ Parameters:
     }
 
     // set ACL...
-    InAcl->IsExclusive = InIsExclusive;
-    InAcl->Count = InProcessCount;
-
-    RtlCopyMemory(InAcl->Entries, InProcessIdList, InProcessCount * sizeof(ULONG));
-
-    return STATUS_SUCCESS;
+    return LhBarrierSetAcl(InAcl, InIsExclusive, InProcessIdList, InProcessCount);
 }
 
 EASYHOOK_NT_EXPORT LhSetInclusiveACL(
@@ -96,8 +87,7 @@ Parameters:
         it will be automatically replaced with the calling process ID.
 
     - InProcessCount
-        The count of entries listed in the process ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the process ID list.
 
     - InHandle
         The hook handle whose local ACL is going to be set.
@@ -126,8 +116,7 @@ Parameters:
         it will be automatically replaced with the calling process ID.
 
     - InProcessCount
-        The count of entries listed in the process ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the process ID list.
 
     - InHandle
         The hook handle whose local ACL is going to be set.
@@ -155,8 +144,7 @@ Parameters:
         it will be automatically replaced with the calling process ID.
 
     - InProcessCount
-        The count of entries listed in the process ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the process ID list.
 */
     return LhSetACL(LhBarrierGetAcl(), FALSE, InProcessIdList, InProcessCount);
 }
@@ -176,8 +164,7 @@ Parameters:
         it will be automatically replaced with the calling process ID.
 
     - InProcessCount
-        The count of entries listed in the process ID list. This value must not exceed
-        MAX_ACE_COUNT! 
+        The count of entries listed in the process ID list.
 */
     return LhSetACL(LhBarrierGetAcl(), TRUE, InProcessIdList, InProcessCount);
 }
\ No newline at end of file
@@ -62,7 +62,13 @@ void OnImageLoadNotification(
     IN HANDLE  ProcessId, // where image is mapped
     IN PIMAGE_INFO  ImageInfo)
 {
-	LhModuleListChanged = TRUE;
+	/*
+		Images mapped into user processes don't change the kernel module list.
+		There is no notification for unloaded drivers, so the module list stays
+		marked as changed and lookups drop entries whose image is gone...
+	*/
+	if(ImageInfo->SystemModeImage)
+		LhApplyModuleNotification(TRUE, ImageInfo->ImageBase, ImageInfo->ImageSize, FullImageName);
 }
 
 /**************************************************************
@@ -225,6 +231,8 @@ VOID EasyHookUnload(IN PDRIVER_OBJECT InDriverObject)
 
 	PsRemoveLoadImageNotifyRoutine(OnImageLoadNotification);
 
+	LhModuleInfoFinalize();
+
     /*
 		Delete the symbolic link
     */
@@ -0,0 +1,846 @@
+#include "EasyHook.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <psapi.h>
+
+#pragma warning(disable: 4005)
+#include <ntstatus.h>
+#pragma warning(default: 4005)
+
+#ifndef _M_X64
+    #pragma comment(lib, "EasyHook32.lib")
+    #define EASYHOOK_DLL_NAME       "EasyHook32.dll"
+#else
+    #pragma comment(lib, "EasyHook64.lib")
+    #define EASYHOOK_DLL_NAME       "EasyHook64.dll"
+#endif
+
+#pragma comment(lib, "psapi.lib")
+
+#define FORCE(expr)     {if(!SUCCEEDED(NtStatus = (expr))) goto ERROR_ABORT;}
+
+/*
+    Measures the local hooking hot paths. Run the release build on an otherwise
+    idle machine; all numbers are printed to the console.
+
+    The main thread is excluded from every barrier hook, so only the worker threads
+    started by a benchmark are intercepted. The install benchmark runs first,
+    because every hook installed before reserves memory near the targets.
+*/
+#define CALL_COUNT                  10000000
+#define SCALING_DURATION            1000
+#define FIRST_CALL_THREAD_COUNT     10000
+#define FIRST_CALL_STACK_SIZE       (64 * 1024)
+#define INSTALL_TARGET_COUNT        256
+#define INSTALL_TARGET_SIZE         16
+#define FRAGMENT_RANGE              (512 * 1024 * 1024)
+#define FRAGMENT_HOLE_DISTANCE      (16 * 1024 * 1024)
+#define MODULE_COUNT                500
+#define MODULE_POINTER_COUNT        4096
+
+typedef ULONG __stdcall BENCH_PROC(ULONG InValue);
+
+/*
+    Hook targets must not be inlined or folded into each other...
+*/
+#pragma optimize("", off)
+
+__declspec(noinline) static ULONG __stdcall PlainTarget(ULONG InValue) { return InValue + 1; }
+__declspec(noinline) static ULONG __stdcall BarrierTarget(ULONG InValue) { return InValue + 2; }
+__declspec(noinline) static ULONG __stdcall RawTarget(ULONG InValue) { return InValue + 3; }
+__declspec(noinline) static ULONG __stdcall SampledTarget(ULONG InValue) { return InValue + 4; }
+__declspec(noinline) static ULONG __stdcall FirstCallTarget(ULONG InValue) { return InValue + 5; }
+__declspec(noinline) static ULONG __stdcall RawBypassTarget(ULONG InValue) { return InValue + 6; }
+
+#pragma optimize("", on)
+
+static BENCH_PROC**         RawBypass = NULL;
+static PVOID                ModulePointers[MODULE_POINTER_COUNT];
+static LARGE_INTEGER        Frequency;
+static ULONG                ACLEntries[1] = {0};
+
+static ULONG __stdcall BenchHandler(ULONG InValue)
+{
+    return InValue;
+}
+
+static ULONG __stdcall RawBypassHandler(ULONG InValue)
+{
+    return (*RawBypass)(InValue);
+}
+
+static ULONG __stdcall LookupModuleProc(ULONG InValue)
+{
+    MODULE_INFORMATION      Mod;
+
+    LhBarrierPointerToModule(ModulePointers[InValue % MODULE_POINTER_COUNT], &Mod);
+
+    return InValue + 1;
+}
+
+static double GetElapsed(LARGE_INTEGER InStart, LARGE_INTEGER InEnd)
+{
+    // in seconds
+    return (double)(InEnd.QuadPart - InStart.QuadPart) / (double)Frequency.QuadPart;
+}
+
+static ULONG GetProcessorCount()
+{
+    SYSTEM_INFO             Info;
+
+    GetSystemInfo(&Info);
+
+    return Info.dwNumberOfProcessors;
+}
+
+static SIZE_T GetPrivateBytes()
+{
+    PROCESS_MEMORY_COUNTERS_EX  Counters;
+
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&Counters, sizeof(Counters)))
+        return 0;
+
+    return Counters.PrivateUsage;
+}
+
+static NTSTATUS InstallHook(
+            void* InEntryPoint,
+            void* InHookProc,
+            TRACED_HOOK_HANDLE OutHandle)
+{
+    NTSTATUS                NtStatus;
+
+    FORCE(LhInstallHook(InEntryPoint, InHookProc, NULL, OutHandle));
+
+    // intercept every thread except the main thread
+    FORCE(LhSetExclusiveACL(ACLEntries, 1, OutHandle));
+
+ERROR_ABORT:
+
+    return NtStatus;
+}
+
+static NTSTATUS RemoveAllHooks()
+{
+    NTSTATUS                NtStatus;
+
+    FORCE(LhUninstallAllHooks());
+    FORCE(LhWaitForPendingRemovals());
+
+ERROR_ABORT:
+
+    return NtStatus;
+}
+
+/*
+    Per call cost on a worker thread...
+*/
+typedef struct _CALL_COST_
+{
+    BENCH_PROC*             Proc;
+    double                  Nanoseconds;
+}CALL_COST;
+
+static DWORD WINAPI CallCostThread(void* InParams)
+{
+    CALL_COST*              Cost = (CALL_COST*)InParams;
+    BENCH_PROC* volatile    Proc = Cost->Proc;
+    LARGE_INTEGER           Start;
+    LARGE_INTEGER           End;
+    ULONG                   Value = 0;
+    ULONG                   Index;
+
+    // the first call allocates the barrier storage of this thread
+    Value = Proc(Value);
+
+    QueryPerformanceCounter(&Start);
+
+    for(Index = 0; Index < CALL_COUNT; Index++)
+    {
+        Value = Proc(Value);
+    }
+
+    QueryPerformanceCounter(&End);
+
+    Cost->Nanoseconds = GetElapsed(Start, End) * 1e9 / CALL_COUNT;
+
+    return Value;
+}
+
+static double MeasureCallCost(BENCH_PROC* InProc)
+{
+    CALL_COST               Cost = {InProc, 0};
+    HANDLE                  hThread;
+
+    if((hThread = CreateThread(NULL, 0, CallCostThread, &Cost, 0, NULL)) == NULL)
+        return 0;
+
+    WaitForSingleObject(hThread, INFINITE);
+    CloseHandle(hThread);
+
+    return Cost.Nanoseconds;
+}
+
+/*
+    Threads that entered a hook once and are parked afterwards...
+*/
+typedef struct _PARKED_THREADS_
+{
+    BENCH_PROC*             Proc;
+    HANDLE                  hRelease;
+    HANDLE*                 hThreads;
+    ULONG                   Count;
+    volatile LONG           ReadyCount;
+    // first call latency per thread, in performance counter ticks
+    LONGLONG*               FirstCall;
+    volatile LONG           NextIndex;
+}PARKED_THREADS;
+
+static DWORD WINAPI ParkedThread(void* InParams)
+{
+    PARKED_THREADS*         Parked = (PARKED_THREADS*)InParams;
+    LONG                    Index = InterlockedIncrement(&Parked->NextIndex) - 1;
+    LARGE_INTEGER           Start;
+    LARGE_INTEGER           End;
+
+    QueryPerformanceCounter(&Start);
+
+    Parked->Proc(0);
+
+    QueryPerformanceCounter(&End);
+
+    if(Parked->FirstCall != NULL)
+        Parked->FirstCall[Index] = End.QuadPart - Start.QuadPart;
+
+    InterlockedIncrement(&Parked->ReadyCount);
+
+    WaitForSingleObject(Parked->hRelease, INFINITE);
+
+    return 0;
+}
+
+static BOOL StartParkedThreads(
+            PARKED_THREADS* InParked,
+            BENCH_PROC* InProc,
+            ULONG InCount,
+            SIZE_T InStackSize,
+            BOOL InMeasureFirstCall)
+{
+    ULONG                   Index;
+
+    memset(InParked, 0, sizeof(PARKED_THREADS));
+
+    InParked->Proc = InProc;
+
+    if((InParked->hRelease = CreateEventA(NULL, TRUE, FALSE, NULL)) == NULL)
+        return FALSE;
+
+    if(InCount == 0)
+        return TRUE;
+
+    if((InParked->hThreads = (HANDLE*)calloc(InCount, sizeof(HANDLE))) == NULL)
+        return FALSE;
+
+    if(InMeasureFirstCall && ((InParked->FirstCall = (LONGLONG*)calloc(InCount, sizeof(LONGLONG))) == NULL))
+        return FALSE;
+
+    for(Index = 0; Index < InCount; Index++)
+    {
+        if((InParked->hThreads[Index] = CreateThread(
+                NULL,
+                InStackSize,
+                ParkedThread,
+                InParked,
+                (InStackSize != 0)?STACK_SIZE_PARAM_IS_A_RESERVATION:0,
+                NULL)) == NULL)
+            break;
+
+        InParked->Count++;
+    }
+
+    while(InParked->ReadyCount < (LONG)InParked->Count)
+    {
+        Sleep(10);
+    }
+
+    return InParked->Count == InCount;
+}
+
+static void StopParkedThreads(PARKED_THREADS* InParked)
+{
+    ULONG                   Index;
+
+    if(InParked->hRelease != NULL)
+        SetEvent(InParked->hRelease);
+
+    for(Index = 0; Index < InParked->Count; Index++)
+    {
+        WaitForSingleObject(InParked->hThreads[Index], INFINITE);
+        CloseHandle(InParked->hThreads[Index]);
+    }
+
+    if(InParked->hRelease != NULL)
+        CloseHandle(InParked->hRelease);
+
+    free(InParked->hThreads);
+    free(InParked->FirstCall);
+
+    memset(InParked, 0, sizeof(PARKED_THREADS));
+}
+
+static NTSTATUS BenchRegisteredThreads()
+{
+    /*
+        Per call cost of a barrier hook while 1, 16 and 128 threads own barrier storage.
+    */
+    static const ULONG      ThreadCounts[] = {1, 16, 128};
+    TRACED_HOOK_HANDLE      hHook = new HOOK_TRACE_INFO();
+    PARKED_THREADS          Parked;
+    ULONG                   Index;
+    NTSTATUS                NtStatus;
+
+    printf("\nBarrier call cost by registered threads:\n");
+
+    memset(&Parked, 0, sizeof(Parked));
+
+    FORCE(InstallHook((void*)BarrierTarget, (void*)BenchHandler, hHook));
+
+    for(Index = 0; Index < sizeof(ThreadCounts) / sizeof(ULONG); Index++)
+    {
+        // the measuring thread registers itself
+        if(!StartParkedThreads(&Parked, BarrierTarget, ThreadCounts[Index] - 1, 0, FALSE))
+            FORCE(STATUS_INSUFFICIENT_RESOURCES);
+
+        printf("    %4u threads: %8.1f ns per call\n", ThreadCounts[Index], MeasureCallCost(BarrierTarget));
+
+        StopParkedThreads(&Parked);
+    }
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    StopParkedThreads(&Parked);
+
+    RemoveAllHooks();
+
+    delete hHook;
+
+    return NtStatus;
+}
+
+static void PrintFirstCalls(
+            const char* InName,
+            PARKED_THREADS* InParked)
+{
+    double                  Sum = 0;
+    LONGLONG                Max = 0;
+    ULONG                   Index;
+
+    for(Index = 0; Index < InParked->Count; Index++)
+    {
+        Sum += (double)InParked->FirstCall[Index];
+
+        if(InParked->FirstCall[Index] > Max)
+            Max = InParked->FirstCall[Index];
+    }
+
+    printf("    %s first call: %8.2f us average, %8.2f us maximum\n",
+        InName,
+        Sum * 1e6 / Frequency.QuadPart / InParked->Count,
+        (double)Max * 1e6 / Frequency.QuadPart);
+}
+
+static NTSTATUS BenchFirstCall()
+{
+    /*
+        Memory and first call latency of 10k threads entering one hook each. The
+        baseline runs the same threads against an unhooked method.
+    */
+    TRACED_HOOK_HANDLE      hHook = new HOOK_TRACE_INFO();
+    PARKED_THREADS          Parked;
+    SIZE_T                  Before;
+    SIZE_T                  PlainBytes;
+    SIZE_T                  HookedBytes;
+    ULONG                   ActiveCount;
+    ULONG                   Capacity;
+    ULONG                   ReclaimedCount;
+    NTSTATUS                NtStatus;
+
+    printf("\nFirst call of %u threads:\n", FIRST_CALL_THREAD_COUNT);
+
+    memset(&Parked, 0, sizeof(Parked));
+
+    FORCE(InstallHook((void*)FirstCallTarget, (void*)BenchHandler, hHook));
+
+    // unhooked
+    Before = GetPrivateBytes();
+
+    if(!StartParkedThreads(&Parked, PlainTarget, FIRST_CALL_THREAD_COUNT, FIRST_CALL_STACK_SIZE, TRUE))
+        FORCE(STATUS_INSUFFICIENT_RESOURCES);
+
+    PlainBytes = GetPrivateBytes() - Before;
+
+    PrintFirstCalls("unhooked", &Parked);
+
+    StopParkedThreads(&Parked);
+
+    // hooked
+    Before = GetPrivateBytes();
+
+    if(!StartParkedThreads(&Parked, FirstCallTarget, FIRST_CALL_THREAD_COUNT, FIRST_CALL_STACK_SIZE, TRUE))
+        FORCE(STATUS_INSUFFICIENT_RESOURCES);
+
+    HookedBytes = GetPrivateBytes() - Before;
+
+    PrintFirstCalls("hooked  ", &Parked);
+
+    FORCE(LhBarrierGetThreadStatistics(&ActiveCount, &Capacity, &ReclaimedCount));
+
+    StopParkedThreads(&Parked);
+
+    printf("    private bytes: %u KB unhooked, %u KB hooked, %d bytes per thread for the barrier\n",
+        (ULONG)(PlainBytes / 1024),
+        (ULONG)(HookedBytes / 1024),
+        (int)(((LONGLONG)HookedBytes - (LONGLONG)PlainBytes) / FIRST_CALL_THREAD_COUNT));
+
+    printf("    barrier storage: %u active, %u capacity, %u reclaimed\n", ActiveCount, Capacity, ReclaimedCount);
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    StopParkedThreads(&Parked);
+
+    RemoveAllHooks();
+
+    delete hHook;
+
+    return NtStatus;
+}
+
+/*
+    Calls per second of all threads calling one hooked method...
+*/
+typedef struct _SCALING_
+{
+    BENCH_PROC*             Proc;
+    HANDLE                  hStart;
+    volatile LONG           IsRunning;
+    volatile LONG           ReadyCount;
+    volatile LONGLONG       Calls;
+}SCALING;
+
+static DWORD WINAPI ScalingThread(void* InParams)
+{
+    SCALING*                Scaling = (SCALING*)InParams;
+    BENCH_PROC* volatile    Proc = Scaling->Proc;
+    LONGLONG                Calls = 0;
+    ULONG                   Value = 0;
+
+    Value = Proc(Value);
+
+    InterlockedIncrement(&Scaling->ReadyCount);
+
+    WaitForSingleObject(Scaling->hStart, INFINITE);
+
+    while(Scaling->IsRunning)
+    {
+        Value = Proc(Value);
+
+        Calls++;
+    }
+
+    InterlockedExchangeAdd64(&Scaling->Calls, Calls);
+
+    return Value;
+}
+
+static double MeasureScaling(
+            BENCH_PROC* InProc,
+            ULONG InThreadCount)
+{
+    SCALING                 Scaling;
+    HANDLE*                 hThreads;
+    LARGE_INTEGER           Start;
+    LARGE_INTEGER           End;
+    ULONG                   Count;
+    ULONG                   Index;
+
+    memset(&Scaling, 0, sizeof(Scaling));
+
+    Scaling.Proc = InProc;
+    Scaling.IsRunning = TRUE;
+
+    if((hThreads = (HANDLE*)calloc(InThreadCount, sizeof(HANDLE))) == NULL)
+        return 0;
+
+    Scaling.hStart = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+    for(Count = 0; Count < InThreadCount; Count++)
+    {
+        if((hThreads[Count] = CreateThread(NULL, 0, ScalingThread, &Scaling, 0, NULL)) == NULL)
+            break;
+    }
+
+    while(Scaling.ReadyCount < (LONG)Count)
+    {
+        Sleep(1);
+    }
+
+    QueryPerformanceCounter(&Start);
+
+    SetEvent(Scaling.hStart);
+
+    Sleep(SCALING_DURATION);
+
+    InterlockedExchange(&Scaling.IsRunning, FALSE);
+
+    for(Index = 0; Index < Count; Index++)
+    {
+        WaitForSingleObject(hThreads[Index], INFINITE);
+        CloseHandle(hThreads[Index]);
+    }
+
+    QueryPerformanceCounter(&End);
+
+    CloseHandle(Scaling.hStart);
+
+    free(hThreads);
+
+    if(Count != InThreadCount)
+        return 0;
+
+    return (double)Scaling.Calls / GetElapsed(Start, End);
+}
+
+static NTSTATUS BenchScaling()
+{
+    TRACED_HOOK_HANDLE      hHook = new HOOK_TRACE_INFO();
+    ULONG                   ProcessorCount = GetProcessorCount();
+    ULONG                   ThreadCount;
+    double                  Single = 0;
+    double                  Rate;
+    NTSTATUS                NtStatus;
+
+    printf("\nBarrier calls per second from 1 to %u processors:\n", ProcessorCount);
+
+    FORCE(InstallHook((void*)BarrierTarget, (void*)BenchHandler, hHook));
+
+    for(ThreadCount = 1; ; ThreadCount = (ThreadCount * 2 < ProcessorCount)?ThreadCount * 2:ProcessorCount)
+    {
+        Rate = MeasureScaling(BarrierTarget, ThreadCount);
+
+        if(ThreadCount == 1)
+            Single = Rate;
+
+        printf("    %4u threads: %12.0f calls per second, %5.2fx\n", ThreadCount, Rate, (Single > 0)?Rate / Single:0);
+
+        if(ThreadCount >= ProcessorCount)
+            break;
+    }
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    RemoveAllHooks();
+
+    delete hHook;
+
+    return NtStatus;
+}
+
+static NTSTATUS BenchFragmentedInstall()
+{
+    /*
+        Install latency when the address space around the targets is reserved
+        except for one allocation granule every FRAGMENT_HOLE_DISTANCE bytes.
+    */
+    TRACED_HOOK_HANDLE*     hHooks = NULL;
+    UCHAR*                  Targets = NULL;
+    void**                  Fragments = NULL;
+    ULONG                   FragmentCount = 0;
+    ULONG                   MaxFragments;
+    SYSTEM_INFO             Info;
+    UCHAR*                  Address;
+    UCHAR*                  Start;
+    UCHAR*                  End;
+    LARGE_INTEGER           Before;
+    LARGE_INTEGER           After;
+    double                  Sum = 0;
+    double                  Max = 0;
+    double                  Elapsed;
+    ULONG                   HookCount;
+    ULONG                   RegionCount;
+    ULONG                   BytesPerHook;
+    ULONG                   Index;
+    NTSTATUS                NtStatus;
+
+    printf("\nInstalling %u hooks in a fragmented address space:\n", INSTALL_TARGET_COUNT);
+
+    GetSystemInfo(&Info);
+
+    if((Targets = (UCHAR*)VirtualAlloc(NULL, INSTALL_TARGET_COUNT * INSTALL_TARGET_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE)) == NULL)
+        FORCE(STATUS_NO_MEMORY);
+
+    // every target is a few NOPs followed by RET
+    for(Index = 0; Index < INSTALL_TARGET_COUNT * INSTALL_TARGET_SIZE; Index++)
+    {
+        Targets[Index] = ((Index % INSTALL_TARGET_SIZE) == INSTALL_TARGET_SIZE - 1)?0xC3:0x90;
+    }
+
+    FlushInstructionCache(GetCurrentProcess(), Targets, INSTALL_TARGET_COUNT * INSTALL_TARGET_SIZE);
+
+    MaxFragments = (ULONG)((2ULL * FRAGMENT_RANGE) / Info.dwAllocationGranularity);
+
+    if(((Fragments = (void**)calloc(MaxFragments, sizeof(void*))) == NULL) ||
+            ((hHooks = (TRACED_HOOK_HANDLE*)calloc(INSTALL_TARGET_COUNT, sizeof(TRACED_HOOK_HANDLE))) == NULL))
+        FORCE(STATUS_NO_MEMORY);
+
+    Start = ((ULONG_PTR)Targets > FRAGMENT_RANGE)?Targets - FRAGMENT_RANGE:(UCHAR*)Info.lpMinimumApplicationAddress;
+    End = Targets + FRAGMENT_RANGE;
+
+    Start = (UCHAR*)((ULONG_PTR)Start & ~((ULONG_PTR)Info.dwAllocationGranularity - 1));
+
+    for(Address = Start; (Address < End) && (FragmentCount < MaxFragments); Address += Info.dwAllocationGranularity)
+    {
+        if(((ULONG_PTR)Address % FRAGMENT_HOLE_DISTANCE) == 0)
+            continue;
+
+        if((Fragments[FragmentCount] = VirtualAlloc(Address, Info.dwAllocationGranularity, MEM_RESERVE, PAGE_NOACCESS)) != NULL)
+            FragmentCount++;
+    }
+
+    printf("    %u regions of %u KB reserved around the targets\n", FragmentCount, Info.dwAllocationGranularity / 1024);
+
+    for(Index = 0; Index < INSTALL_TARGET_COUNT; Index++)
+    {
+        hHooks[Index] = new HOOK_TRACE_INFO();
+
+        QueryPerformanceCounter(&Before);
+
+        FORCE(LhInstallHook(Targets + Index * INSTALL_TARGET_SIZE, (void*)BenchHandler, NULL, hHooks[Index]));
+
+        QueryPerformanceCounter(&After);
+
+        Elapsed = GetElapsed(Before, After) * 1e6;
+
+        Sum += Elapsed;
+
+        if(Elapsed > Max)
+            Max = Elapsed;
+    }
+
+    printf("    install: %8.2f us average, %8.2f us maximum\n", Sum / INSTALL_TARGET_COUNT, Max);
+
+    FORCE(LhGetMemoryStatistics(&HookCount, &RegionCount, &BytesPerHook));
+
+    printf("    %u hooks in %u regions, %u bytes per hook\n", HookCount, RegionCount, BytesPerHook);
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    RemoveAllHooks();
+
+    if(hHooks != NULL)
+    {
+        for(Index = 0; Index < INSTALL_TARGET_COUNT; Index++)
+        {
+            delete hHooks[Index];
+        }
+
+        free(hHooks);
+    }
+
+    for(Index = 0; Index < FragmentCount; Index++)
+    {
+        VirtualFree(Fragments[Index], 0, MEM_RELEASE);
+    }
+
+    free(Fragments);
+
+    if(Targets != NULL)
+        VirtualFree(Targets, 0, MEM_RELEASE);
+
+    return NtStatus;
+}
+
+static NTSTATUS BenchRawHook()
+{
+    /*
+        Raw hooks against barrier hooks, every handler returns immediately
+        unless it calls the original method.
+    */
+    TRACED_HOOK_HANDLE      hBarrier = new HOOK_TRACE_INFO();
+    TRACED_HOOK_HANDLE      hRaw = new HOOK_TRACE_INFO();
+    TRACED_HOOK_HANDLE      hRawBypass = new HOOK_TRACE_INFO();
+    NTSTATUS                NtStatus;
+
+    printf("\nRaw hooks and barrier hooks:\n");
+
+    FORCE(InstallHook((void*)BarrierTarget, (void*)BenchHandler, hBarrier));
+    FORCE(LhInstallRawHook((void*)RawTarget, (void*)BenchHandler, hRaw));
+    FORCE(LhInstallRawHook((void*)RawBypassTarget, (void*)RawBypassHandler, hRawBypass));
+    FORCE(LhGetHookBypassAddress(hRawBypass, (void***)&RawBypass));
+
+    printf("    unhooked:                 %8.1f ns per call\n", MeasureCallCost(PlainTarget));
+    printf("    barrier hook:             %8.1f ns per call\n", MeasureCallCost(BarrierTarget));
+    printf("    raw hook:                 %8.1f ns per call\n", MeasureCallCost(RawTarget));
+    printf("    raw hook, calls original: %8.1f ns per call\n", MeasureCallCost(RawBypassTarget));
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    RemoveAllHooks();
+
+    delete hBarrier;
+    delete hRaw;
+    delete hRawBypass;
+
+    return NtStatus;
+}
+
+static NTSTATUS BenchModuleLookup()
+{
+    /*
+        LhBarrierPointerToModule() with MODULE_COUNT additional modules. Those are
+        copies of EasyHook mapped without running their entry point.
+    */
+    WCHAR                   SourcePath[MAX_PATH];
+    WCHAR                   Directory[MAX_PATH];
+    WCHAR                   Path[MAX_PATH];
+    HMODULE                 hModules[MODULE_COUNT] = {NULL};
+    MODULEINFO              Info;
+    MODULE_INFORMATION      Mod;
+    ULONG                   ModuleCount = 0;
+    ULONG                   ProcessorCount = GetProcessorCount();
+    ULONG                   Index;
+    NTSTATUS                NtStatus;
+
+    printf("\nModule lookups with %u additional modules:\n", MODULE_COUNT);
+
+    Directory[0] = 0;
+
+    if((GetModuleFileNameW(GetModuleHandleA(EASYHOOK_DLL_NAME), SourcePath, MAX_PATH) == 0) ||
+            (GetTempPathW(MAX_PATH, Directory) == 0) ||
+            (wcscat_s(Directory, MAX_PATH, L"LocalHookBench") != 0))
+        FORCE(STATUS_INTERNAL_ERROR);
+
+    CreateDirectoryW(Directory, NULL);
+
+    for(Index = 0; Index < MODULE_COUNT; Index++)
+    {
+        swprintf_s(Path, MAX_PATH, L"%s\\Module%03u.dll", Directory, Index);
+
+        if(!CopyFileW(SourcePath, Path, FALSE) ||
+                ((hModules[Index] = LoadLibraryExW(Path, NULL, DONT_RESOLVE_DLL_REFERENCES)) == NULL))
+            FORCE(STATUS_INTERNAL_ERROR);
+
+        ModuleCount++;
+    }
+
+    FORCE(LhUpdateModuleInformation());
+
+    // random addresses within the additional modules, every one has to be found
+    for(Index = 0; Index < MODULE_POINTER_COUNT; Index++)
+    {
+        if(!GetModuleInformation(GetCurrentProcess(), hModules[rand() % MODULE_COUNT], &Info, sizeof(Info)))
+            FORCE(STATUS_INTERNAL_ERROR);
+
+        ModulePointers[Index] = (UCHAR*)Info.lpBaseOfDll + ((((ULONG)rand() << 15) | (ULONG)rand()) % Info.SizeOfImage);
+
+        FORCE(LhBarrierPointerToModule(ModulePointers[Index], &Mod));
+    }
+
+    printf("    %4u threads: %12.0f lookups per second\n", 1, MeasureScaling(LookupModuleProc, 1));
+    printf("    %4u threads: %12.0f lookups per second\n", ProcessorCount, MeasureScaling(LookupModuleProc, ProcessorCount));
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    for(Index = 0; Index < ModuleCount; Index++)
+    {
+        FreeLibrary(hModules[Index]);
+
+        swprintf_s(Path, MAX_PATH, L"%s\\Module%03u.dll", Directory, Index);
+
+        DeleteFileW(Path);
+    }
+
+    if(Directory[0] != 0)
+        RemoveDirectoryW(Directory);
+
+    LhUpdateModuleInformation();
+
+    return NtStatus;
+}
+
+static NTSTATUS BenchSampling()
+{
+    /*
+        Calls declined by a sampling policy against unhooked calls.
+    */
+    TRACED_HOOK_HANDLE      hHook = new HOOK_TRACE_INFO();
+    NTSTATUS                NtStatus;
+
+    printf("\nSampled hooks:\n");
+
+    FORCE(InstallHook((void*)SampledTarget, (void*)BenchHandler, hHook));
+
+    printf("    unhooked:                 %8.1f ns per call\n", MeasureCallCost(PlainTarget));
+    printf("    every call sampled:       %8.1f ns per call\n", MeasureCallCost(SampledTarget));
+
+    FORCE(LhSetSamplingPolicy(hHook, EASYHOOK_SAMPLING_EVERY_NTH, 1000000, 0));
+
+    printf("    one in a million sampled: %8.1f ns per call\n", MeasureCallCost(SampledTarget));
+
+    FORCE(LhSetSamplingPolicy(hHook, EASYHOOK_SAMPLING_RATE_LIMIT, 1, 1));
+
+    printf("    one per second sampled:   %8.1f ns per call\n", MeasureCallCost(SampledTarget));
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    RemoveAllHooks();
+
+    delete hHook;
+
+    return NtStatus;
+}
+
+extern "C" int main(int argc, wchar_t* argv[])
+{
+    NTSTATUS                NtStatus;
+
+    QueryPerformanceFrequency(&Frequency);
+
+    printf("EasyHook local hook benchmarks, %u processors\n", GetProcessorCount());
+
+    // must run before any other hook reserves memory near the targets
+    FORCE(BenchFragmentedInstall());
+
+    FORCE(BenchRegisteredThreads());
+
+    FORCE(BenchFirstCall());
+
+    FORCE(BenchScaling());
+
+    FORCE(BenchRawHook());
+
+    FORCE(BenchModuleLookup());
+
+    FORCE(BenchSampling());
+
+    return 0;
+
+ERROR_ABORT:
+
+	printf("\n[Error(0x%p)]: \"%S\" (code: %d {0x%p})\n", (PVOID)NtStatus, RtlGetLastErrorString(), RtlGetLastError(), (PVOID)RtlGetLastError());
+
+    return NtStatus;
+}
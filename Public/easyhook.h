@@ -95,12 +95,173 @@ DRIVER_SHARED_API(NTSTATUS, LhInstallHook(
             void* InCallback,
             TRACED_HOOK_HANDLE OutHandle));
 
+/*
+    Argument registers saved by the trampoline while entering the barrier,
+    see LhInstallHookEx().
+*/
+#define EASYHOOK_ARGS_DEFAULT           0x00000000
+#define EASYHOOK_ARGS_STACK_ONLY        0x00000001 // no parameters in general purpose registers
+#define EASYHOOK_ARGS_NO_FLOAT          0x00000002 // no parameters in XMM0-XMM3 (x64)
+
+DRIVER_SHARED_API(NTSTATUS, LhInstallHookEx(
+            void* InEntryPoint,
+            void* InHookProc,
+            void* InCallback,
+            ULONG InArgFlags,
+            TRACED_HOOK_HANDLE OutHandle));
+
+/*
+    Installs a hook without barrier. The handler is entered directly and
+    has to call the original method through LhGetHookBypassAddress().
+    There is no ACL, no callback and no reentrance protection. Execution
+    is not tracked, so the code of a removed raw hook is never reused.
+*/
+DRIVER_SHARED_API(NTSTATUS, LhInstallRawHook(
+            void* InEntryPoint,
+            void* InHookProc,
+            TRACED_HOOK_HANDLE OutHandle));
+
+typedef struct _HOOK_INSTALL_ENTRY_
+{
+	void*					EntryPoint;
+	void*					HookProc;
+	void*					Callback;
+	TRACED_HOOK_HANDLE		Handle;
+	NTSTATUS				Status; // out
+}HOOK_INSTALL_ENTRY;
+
+DRIVER_SHARED_API(NTSTATUS, LhInstallHooks(
+            HOOK_INSTALL_ENTRY* InEntries,
+            ULONG InCount,
+            BOOL InAllOrNothing));
+
+DRIVER_SHARED_API(NTSTATUS, LhFindHook(
+            void* InEntryPoint,
+            TRACED_HOOK_HANDLE* OutHandle));
+
+DRIVER_SHARED_API(NTSTATUS, LhFindHookById(
+            ULONG InHookId,
+            TRACED_HOOK_HANDLE* OutHandle));
+
+DRIVER_SHARED_API(NTSTATUS, LhGetHookId(
+            TRACED_HOOK_HANDLE InHandle,
+            ULONG* OutHookId));
+
+DRIVER_SHARED_API(NTSTATUS, LhGetHookBypassAddress(
+            TRACED_HOOK_HANDLE InHandle,
+            void*** OutAddress));
+
 DRIVER_SHARED_API(NTSTATUS, LhUninstallAllHooks());
 
 DRIVER_SHARED_API(NTSTATUS, LhUninstallHook(TRACED_HOOK_HANDLE InHandle));
 
+/*
+    Replaces handler and callback of an installed hook without touching
+    the entry point. The old handler is retired like a removed hook, so
+    after LhWaitForPendingRemovals() succeeded it is no longer executed.
+*/
+DRIVER_SHARED_API(NTSTATUS, LhReplaceHookHandler(
+            TRACED_HOOK_HANDLE InHandle,
+            void* InHookProc,
+            void* InCallback));
+
 DRIVER_SHARED_API(NTSTATUS, LhWaitForPendingRemovals());
 
+/*
+    Removed hooks are released in the background as soon as no thread
+    has been executing them for a short grace period. The callback is
+    invoked with STATUS_SUCCESS when the memory of a hook was released,
+    with STATUS_TIMEOUT when a hook is still busy after one second and
+    with STATUS_NOT_SUPPORTED when its entry point was overwritten by
+    someone else and thus can never be released.
+*/
+typedef void __stdcall HOOK_REMOVAL_CALLBACK(
+            void* InContext,
+            void* InEntryPoint,
+            NTSTATUS InStatus);
+
+DRIVER_SHARED_API(NTSTATUS, LhSetRemovalCallback(
+            HOOK_REMOVAL_CALLBACK* InCallback,
+            void* InContext));
+
+DRIVER_SHARED_API(NTSTATUS, LhQueryPendingRemovals(
+            ULONG* OutPendingCount,
+            ULONG* OutStuckCount));
+
+#ifndef DRIVER
+	DRIVER_SHARED_API(NTSTATUS, LhGetRemovalEvent(HANDLE* OutEvent));
+#endif
+
+/*
+    Restricts a hook to calls from the given modules (inclusive) or to calls
+    from all other modules (exclusive). The caller is determined by the
+    return address and checked before entering the barrier, so rejected 
+    calls go straight to the original method. Raw hooks don't support
+    caller filters.
+*/
+DRIVER_SHARED_API(NTSTATUS, LhSetCallerFilter(
+            TRACED_HOOK_HANDLE InHandle,
+            BOOL InIsExclusive,
+            HMODULE* InModuleList,
+            ULONG InModuleCount));
+
+/*
+    Per hook call statistics. While enabled, the barrier counts the calls it
+    passes to the handler and the calls it declines by reason. Counters are
+    sharded like the execution counter and only summed up when queried. 
+    Cycles are processor time stamp counter ticks spent in the handler,
+    including nested calls. Raw hooks don't support statistics.
+*/
+#define EASYHOOK_STATISTICS_COUNTERS        0x00000001
+#define EASYHOOK_STATISTICS_CYCLES          0x00000002
+
+typedef struct _HOOK_STATISTICS_
+{
+	ULONGLONG				Calls;
+	ULONGLONG				Handled;
+	// the thread is already executing the handler
+	ULONGLONG				Recursion;
+	ULONGLONG				AclDenied;
+	ULONGLONG				CallerFiltered;
+	// declined by the sampling policy
+	ULONGLONG				Unsampled;
+	ULONGLONG				LoaderLock;
+	// the per thread barrier storage could not be allocated
+	ULONGLONG				NoThreadStorage;
+	ULONGLONG				HandlerCycles;
+}HOOK_STATISTICS;
+
+DRIVER_SHARED_API(NTSTATUS, LhSetHookStatistics(
+            TRACED_HOOK_HANDLE InHandle,
+            ULONG InFlags));
+
+DRIVER_SHARED_API(NTSTATUS, LhQueryHookStatistics(
+            TRACED_HOOK_HANDLE InHandle,
+            HOOK_STATISTICS* OutStatistics));
+
+/*
+    Sampling policies only pass some calls to the handler, all others go 
+    straight to the original method. Sampling state is kept per thread, so
+    a rate limit applies to each thread on its own. The policy only sees
+    calls the handler would otherwise receive, calls declined by a caller
+    filter, an ACL or the loader lock neither consume nor skip a sample.
+*/
+#define EASYHOOK_SAMPLING_ALL               0x00000000
+#define EASYHOOK_SAMPLING_EVERY_NTH         0x00000001 // InRate = N
+#define EASYHOOK_SAMPLING_PROBABILISTIC     0x00000002 // InRate = N, one in N on average
+#define EASYHOOK_SAMPLING_RATE_LIMIT        0x00000003 // InRate = calls per second, InBurst = bucket size
+
+DRIVER_SHARED_API(NTSTATUS, LhSetSamplingPolicy(
+            TRACED_HOOK_HANDLE InHandle,
+            ULONG InMode,
+            ULONG InRate,
+            ULONG InBurst));
+
+DRIVER_SHARED_API(NTSTATUS, LhGetMemoryStatistics(
+            ULONG* OutHookCount,
+            ULONG* OutRegionCount,
+            ULONG* OutBytesPerHook));
+
 /*
     Setup the ACLs after hook installation. Please note that every
     hook starts suspended. You will have to set a proper ACL to
@@ -203,6 +364,40 @@ DRIVER_SHARED_API(NTSTATUS, LhBarrierCallStackTrace(
             ULONG InMaxMethodCount,
             ULONG* OutMethodCount));
 
+/*
+    Captures the call stack and attributes each frame to its module in one
+    pass. Walking frame pointers is much faster than unwinding, but ends at
+    the first return address that isn't within a known module or doesn't
+    follow a call. Most x64 code doesn't keep frame pointers, so unwinding
+    is the reliable choice there.
+*/
+#define EASYHOOK_STACK_TRACE_UNWIND         0x00000000 // RtlCaptureStackBackTrace()
+#define EASYHOOK_STACK_TRACE_FRAME_POINTERS 0x00000001
+
+typedef struct _STACK_FRAME_INFORMATION_
+{
+	PVOID					ReturnAddress;
+	// the module containing the return address, NULL if there is none
+	UCHAR*					ModuleBase;
+	ULONG					ModuleSize;
+}STACK_FRAME_INFORMATION;
+
+DRIVER_SHARED_API(NTSTATUS, LhBarrierCaptureStackTrace(
+            ULONG InFlags,
+            ULONG InFramesToSkip,
+            STACK_FRAME_INFORMATION* OutFrames,
+            ULONG InMaxFrameCount,
+            ULONG* OutFrameCount));
+
+/*
+    Reports the occupancy of the per thread barrier storage. The storage
+    grows on demand and entries of terminated threads are reclaimed.
+*/
+DRIVER_SHARED_API(NTSTATUS, LhBarrierGetThreadStatistics(
+            ULONG* OutActiveCount,
+            ULONG* OutCapacity,
+            ULONG* OutReclaimedCount));
+
 #ifdef DRIVER
 
 	#define DRIVER_EXPORT(proc)				PROC_##proc * proc
@@ -0,0 +1,286 @@
+/*
+    EasyHook - The reinvention of Windows API hooking
+
+    Copyright (C) 2009 Christoph Husse
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Please visit http://www.codeplex.com/easyhook for more information
+    about the project and latest updates.
+*/
+#include "stdafx.h"
+
+/*
+    Machine code samples with known decodings. When the decoder is changed,
+    every sample has to pass before a build is shipped.
+*/
+
+typedef struct _LH_LENGTH_SAMPLE_
+{
+    UCHAR                   Length;
+    UCHAR                   DispOffset;     // expected from LhDecodeInstructionLength()
+    UCHAR                   UdisLength;     // zero if Udis86 can't decode the instruction correctly
+    UCHAR                   Code[15];
+}LH_LENGTH_SAMPLE;
+
+/*
+    Lengths are the ones of objdump. Where Udis86 agrees, the sample also
+    cross-validates LhDecodeInstructionLength() against Udis86. Udis86 gets
+    VEX shifts by an immediate (71-73 /n ib) and "66 66 48 E8" TLS call
+    padding wrong and can't decode XOP and EVEX at all.
+*/
+static const LH_LENGTH_SAMPLE LhLengthCorpus[] =
+{
+    // nop
+    { 1, 0, 1, {0x90} },
+    // ret
+    { 1, 0, 1, {0xC3} },
+    // ret 8
+    { 3, 0, 3, {0xC2, 0x08, 0x00} },
+    // int3
+    { 1, 0, 1, {0xCC} },
+    // push ebp
+    { 1, 0, 1, {0x55} },
+    // mov edi, edi
+    { 2, 0, 2, {0x8B, 0xFF} },
+    // sub esp, 20h
+    { 3, 0, 3, {0x83, 0xEC, 0x20} },
+    // sub esp, 100h
+    { 6, 0, 6, {0x81, 0xEC, 0x00, 0x01, 0x00, 0x00} },
+    // push 1
+    { 2, 0, 2, {0x6A, 0x01} },
+    // push 12345678h
+    { 5, 0, 5, {0x68, 0x78, 0x56, 0x34, 0x12} },
+    // call rel32
+    { 5, 0, 5, {0xE8, 0x00, 0x00, 0x00, 0x00} },
+    // jmp rel8
+    { 2, 0, 2, {0xEB, 0xFE} },
+    // je rel8
+    { 2, 0, 2, {0x74, 0x05} },
+    // je rel32
+    { 6, 0, 6, {0x0F, 0x84, 0x00, 0x00, 0x00, 0x00} },
+    // jecxz rel8
+    { 2, 0, 2, {0xE3, 0xFE} },
+    // mov eax, [ebp-4]
+    { 3, 0, 3, {0x8B, 0x45, 0xFC} },
+    // mov eax, [ebp-100h]
+    { 6, 0, 6, {0x8B, 0x85, 0x00, 0xFF, 0xFF, 0xFF} },
+    // mov eax, [esp+8]
+    { 4, 0, 4, {0x8B, 0x44, 0x24, 0x08} },
+    // mov eax, [esp+100h]
+    { 7, 0, 7, {0x8B, 0x84, 0x24, 0x00, 0x01, 0x00, 0x00} },
+    // mov eax, [eax*4+0] - SIB without base
+    { 7, 0, 7, {0x8B, 0x04, 0x85, 0x00, 0x00, 0x00, 0x00} },
+    // mov eax, [esp]
+    { 3, 0, 3, {0x8B, 0x04, 0x24} },
+    // mov [ebp-2], ax
+    { 4, 0, 4, {0x66, 0x89, 0x45, 0xFE} },
+    // mov eax, 12345678h
+    { 5, 0, 5, {0xB8, 0x78, 0x56, 0x34, 0x12} },
+    // mov ax, 1234h - 66 shrinks an immz
+    { 4, 0, 4, {0x66, 0xB8, 0x34, 0x12} },
+    // mov dword ptr [ebp-4], 0
+    { 7, 0, 7, {0xC7, 0x45, 0xFC, 0x00, 0x00, 0x00, 0x00} },
+    // mov word ptr [ebp-2], 1234h
+    { 6, 0, 6, {0x66, 0xC7, 0x45, 0xFE, 0x34, 0x12} },
+    // test cl, 1 - F6 /0 has an imm8
+    { 3, 0, 3, {0xF6, 0xC1, 0x01} },
+    // not cl - other F6 forms have none
+    { 2, 0, 2, {0xF6, 0xD1} },
+    // test ecx, 12345678h
+    { 6, 0, 6, {0xF7, 0xC1, 0x78, 0x56, 0x34, 0x12} },
+    // neg ecx
+    { 2, 0, 2, {0xF7, 0xD9} },
+    // test cx, 1234h
+    { 5, 0, 5, {0x66, 0xF7, 0xC1, 0x34, 0x12} },
+    // enter 10h, 0
+    { 4, 0, 4, {0xC8, 0x10, 0x00, 0x00} },
+    // imul eax, eax, 8
+    { 3, 0, 3, {0x6B, 0xC0, 0x08} },
+    // movzx eax, al
+    { 3, 0, 3, {0x0F, 0xB6, 0xC0} },
+    // nop dword ptr [eax+eax+0]
+    { 5, 0, 5, {0x0F, 0x1F, 0x44, 0x00, 0x00} },
+    // nop word ptr [eax+eax+0]
+    { 9, 0, 9, {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00} },
+    // movss xmm0, [ebp-8]
+    { 5, 0, 5, {0xF3, 0x0F, 0x10, 0x45, 0xF8} },
+    // pshufb xmm0, xmm1
+    { 5, 0, 5, {0x66, 0x0F, 0x38, 0x00, 0xC1} },
+    // palignr xmm0, xmm1, 8
+    { 6, 0, 6, {0x66, 0x0F, 0x3A, 0x0F, 0xC1, 0x08} },
+    // pi2fd mm0, mm1 - 3DNow! has a trailing opcode byte
+    { 4, 0, 4, {0x0F, 0x0F, 0xC1, 0x0D} },
+    // rdtsc
+    { 2, 0, 2, {0x0F, 0x31} },
+    // lock cmpxchg [edx], ecx
+    { 4, 0, 4, {0xF0, 0x0F, 0xB1, 0x0A} },
+    // mov eax, es:[eax]
+    { 3, 0, 3, {0x26, 0x8B, 0x00} },
+    // rep movsd
+    { 2, 0, 2, {0xF3, 0xA5} },
+    // vmovdqa xmm0, xmm1
+    { 4, 0, 4, {0xC5, 0xF9, 0x6F, 0xC1} },
+    // vmovaps ymm0, [ebp-20h]
+    { 5, 0, 5, {0xC5, 0xFC, 0x28, 0x45, 0xE0} },
+    // vpshufb xmm0, xmm0, xmm1
+    { 5, 0, 5, {0xC4, 0xE2, 0x79, 0x00, 0xC1} },
+    // vpalignr xmm0, xmm0, xmm1, 8
+    { 6, 0, 6, {0xC4, 0xE3, 0x79, 0x0F, 0xC1, 0x08} },
+    // vpslld xmm1, xmm1, 7 - Udis86 misses the imm8
+    { 5, 0, 0, {0xC5, 0xF1, 0x72, 0xF1, 0x07} },
+    // vprotb xmm0, xmm1, 5 - XOP
+    { 6, 0, 0, {0x8F, 0xE8, 0x78, 0xC0, 0xC1, 0x05} },
+    // vmovaps zmm0, zmm1 - EVEX
+    { 6, 0, 0, {0x62, 0xF1, 0x7C, 0x48, 0x28, 0xC1} },
+    // vmovaps zmm0, [eax+40h] - EVEX scales disp8
+    { 7, 0, 0, {0x62, 0xF1, 0x7C, 0x48, 0x28, 0x40, 0x01} },
+    // valignd zmm0, zmm0, zmm1, 1
+    { 7, 0, 0, {0x62, 0xF3, 0x7D, 0x48, 0x03, 0xC1, 0x01} },
+#ifdef _M_X64
+    // mov rax, [rip+12345678h]
+    { 7, 3, 7, {0x48, 0x8B, 0x05, 0x78, 0x56, 0x34, 0x12} },
+    // lea r8, [rip-7]
+    { 7, 3, 7, {0x4C, 0x8D, 0x05, 0xF9, 0xFF, 0xFF, 0xFF} },
+    // jmp qword ptr [rip]
+    { 6, 2, 6, {0xFF, 0x25, 0x00, 0x00, 0x00, 0x00} },
+    // cmp dword ptr [rip+10h], 0
+    { 7, 2, 7, {0x83, 0x3D, 0x10, 0x00, 0x00, 0x00, 0x00} },
+    // cmp word ptr [rip+400h], 1234h
+    { 9, 3, 9, {0x66, 0x81, 0x3D, 0x00, 0x04, 0x00, 0x00, 0x34, 0x12} },
+    // mov dword ptr [rip+2000h], 1
+    { 10, 2, 10, {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00} },
+    // mov eax, [eip]
+    { 7, 3, 7, {0x67, 0x8B, 0x05, 0x00, 0x00, 0x00, 0x00} },
+    // vmovaps zmm0, [rip+1]
+    { 10, 6, 0, {0x62, 0xF1, 0x7C, 0x48, 0x28, 0x05, 0x01, 0x00, 0x00, 0x00} },
+    // mov [rsp+8], rbx
+    { 5, 0, 5, {0x48, 0x89, 0x5C, 0x24, 0x08} },
+    // push rbx
+    { 2, 0, 2, {0x40, 0x53} },
+    // push r15
+    { 2, 0, 2, {0x41, 0x57} },
+    // jmp r11
+    { 3, 0, 3, {0x41, 0xFF, 0xE3} },
+    // mov rax, 1122334455667788h
+    { 10, 0, 10, {0x48, 0xB8, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11} },
+    // mov rax, 12345678h - sign extended imm32
+    { 7, 0, 7, {0x48, 0xC7, 0xC0, 0x78, 0x56, 0x34, 0x12} },
+    // mov rax, [1122334455667788h]
+    { 10, 0, 10, {0x48, 0xA1, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11} },
+    // mov eax, [1122334455667788h]
+    { 9, 0, 9, {0xA1, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11} },
+    // movsxd rax, ecx
+    { 3, 0, 3, {0x48, 0x63, 0xC1} },
+    // popcnt rax, rcx
+    { 5, 0, 5, {0xF3, 0x48, 0x0F, 0xB8, 0xC1} },
+    // syscall
+    { 2, 0, 2, {0x0F, 0x05} },
+    // call rel32 - TLS padding, Udis86 gets the length wrong
+    { 8, 0, 0, {0x66, 0x66, 0x48, 0xE8, 0x00, 0x00, 0x00, 0x00} },
+    // vpslld xmm2, xmm8, 3 - Udis86 misses the imm8
+    { 6, 0, 0, {0xC4, 0xC1, 0x69, 0x72, 0xF0, 0x03} },
+    // mov rax, gs:[30h] - SIB without base is not RIP-relative
+    { 9, 0, 9, {0x65, 0x48, 0x8B, 0x04, 0x25, 0x30, 0x00, 0x00, 0x00} },
+#else
+    // mov eax, [12345678h]
+    { 5, 0, 5, {0xA1, 0x78, 0x56, 0x34, 0x12} },
+    // mov eax, fs:[18h]
+    { 6, 0, 6, {0x64, 0xA1, 0x18, 0x00, 0x00, 0x00} },
+    // mov eax, [12345678h] - absolute, not RIP-relative
+    { 6, 0, 6, {0x8B, 0x05, 0x78, 0x56, 0x34, 0x12} },
+    // mov eax, [0] - 16 bit moffs
+    { 4, 0, 4, {0x67, 0xA1, 0x00, 0x00} },
+    // mov eax, [bp+8] - 16 bit ModR/M
+    { 4, 0, 4, {0x67, 0x8B, 0x46, 0x08} },
+    // mov eax, [0] - 16 bit ModR/M without base
+    { 5, 0, 5, {0x67, 0x8B, 0x06, 0x00, 0x00} },
+    // call far
+    { 7, 0, 7, {0x9A, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00} },
+    // jmp far
+    { 7, 0, 7, {0xEA, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00} },
+    // aad
+    { 2, 0, 2, {0xD5, 0x0A} },
+    // inc eax
+    { 1, 0, 1, {0x40} },
+    // pushad
+    { 1, 0, 1, {0x60} },
+    // bound eax, [edx] - not EVEX without a register form
+    { 2, 0, 2, {0x62, 0x02} },
+    // les eax, [eax] - not VEX
+    { 2, 0, 2, {0xC4, 0x00} },
+    // lds eax, [eax] - not VEX
+    { 2, 0, 2, {0xC5, 0x00} },
+#endif
+};
+
+
+
+
+EASYHOOK_NT_INTERNAL LhTestLengthCorpus()
+{
+/*
+Description:
+
+    Decodes every sample of the length corpus with LhDecodeInstructionLength()
+    and, where it is known to be correct, with Udis86 and compares the
+    lengths and displacement offsets with the expected ones.
+
+Returns:
+
+    STATUS_INTERNAL_ERROR
+
+        At least one sample was not decoded as expected.
+*/
+    UCHAR                       Buffer[32];
+    CHAR                        Text[64];
+    const LH_LENGTH_SAMPLE*     Sample;
+    ULONG64                     Next;
+    ULONG                       UdisLength;
+    UCHAR                       DispOffset;
+    ULONG                       Index;
+    ULONG                       i;
+    NTSTATUS                    NtStatus;
+
+    for(Index = 0; Index < sizeof(LhLengthCorpus) / sizeof(LH_LENGTH_SAMPLE); Index++)
+    {
+        Sample = &LhLengthCorpus[Index];
+
+        // pad with NOPs, the decoder may look beyond the sample
+        for(i = 0; i < sizeof(Buffer); i++)
+            Buffer[i] = 0x90;
+
+        RtlCopyMemory(Buffer, (void*)Sample->Code, Sample->Length);
+
+        if(LhDecodeInstructionLength(Buffer, &DispOffset) != Sample->Length)
+            THROW(STATUS_INTERNAL_ERROR, L"An instruction of the length corpus has an unexpected length.");
+
+        if(DispOffset != Sample->DispOffset)
+            THROW(STATUS_INTERNAL_ERROR, L"An instruction of the length corpus has an unexpected displacement offset.");
+
+        if(Sample->UdisLength == 0)
+            continue;
+
+        if(!RTL_SUCCESS(LhDisassembleInstruction(Buffer, &UdisLength, Text, sizeof(Text), &Next)) ||
+                (UdisLength != Sample->UdisLength))
+            THROW(STATUS_INTERNAL_ERROR, L"Udis86 and the length corpus disagree on the length of an instruction.");
+    }
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
@@ -0,0 +1,51 @@
+#include "stdafx.h"
+#include <stdio.h>
+
+/*
+    Runs the machine code corpora against the decoder and relocation code of
+    EasyHook. The sources under test are compiled into this program, so the
+    corpora never ship with EasyHook itself.
+*/
+
+// allocated from by EasyHookDll\Rtl\memory.c in release builds, created by DllMain() otherwise
+HANDLE              hEasyHookHeap = NULL;
+
+EASYHOOK_NT_INTERNAL LhTestLengthCorpus();
+
+EASYHOOK_NT_INTERNAL LhTestRelocationCorpus();
+
+static ULONG        FailureCount = 0;
+
+static void RunCorpus(
+            const char* InName,
+            NTSTATUS InStatus)
+{
+    if(RTL_SUCCESS(InStatus))
+        printf("%s passed.\n", InName);
+    else
+    {
+        printf("%s failed (0x%08X): \"%S\"\n", InName, InStatus, RtlGetLastErrorString());
+
+        FailureCount++;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    hEasyHookHeap = GetProcessHeap();
+
+    RunCorpus("Length corpus", LhTestLengthCorpus());
+
+    RunCorpus("Relocation corpus", LhTestRelocationCorpus());
+
+    if(FailureCount != 0)
+    {
+        printf("\n[Error]: %u corpora failed.\n", FailureCount);
+
+        return 1;
+    }
+
+    printf("\nAll corpora passed.\n");
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+    EasyHook - The reinvention of Windows API hooking
+
+    Copyright (C) 2009 Christoph Husse
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Please visit http://www.codeplex.com/easyhook for more information
+    about the project and latest updates.
+*/
+#include "stdafx.h"
+
+/*
+    Machine code samples with known relocations. When the decoder or the
+    relocation code is changed, every sample has to pass before a build
+    is shipped. Each sample is decoded and relocated LH_SAMPLE_DISTANCE
+    bytes upwards, so RIP-relative displacements have to shrink by that
+    distance.
+*/
+#define LH_SAMPLE_DISTANCE          0x100
+
+typedef struct _LH_RELOCATION_SAMPLE_
+{
+    UCHAR                   Size;
+    UCHAR                   Count;
+    UCHAR                   Code[16];
+    UCHAR                   DispOffsets[4]; // expected per instruction, zero if not RIP-relative
+    NTSTATUS                Status;         // expected from LhRelocateEntryPoint()
+    UCHAR                   Relocated[16];
+}LH_RELOCATION_SAMPLE;
+
+static const LH_RELOCATION_SAMPLE LhRelocationCorpus[] =
+{
+#ifdef _M_X64
+    // mov rax, [rip+12345678h]
+    { 7, 1, {0x48, 0x8B, 0x05, 0x78, 0x56, 0x34, 0x12}, {3}, STATUS_SUCCESS,
+            {0x48, 0x8B, 0x05, 0x78, 0x55, 0x34, 0x12} },
+    // lea rcx, [rip]
+    { 7, 1, {0x48, 0x8D, 0x0D, 0x00, 0x00, 0x00, 0x00}, {3}, STATUS_SUCCESS,
+            {0x48, 0x8D, 0x0D, 0x00, 0xFF, 0xFF, 0xFF} },
+    // jmp qword ptr [rip+1000h]
+    { 6, 1, {0xFF, 0x25, 0x00, 0x10, 0x00, 0x00}, {2}, STATUS_SUCCESS,
+            {0xFF, 0x25, 0x00, 0x0F, 0x00, 0x00} },
+    // call qword ptr [rip-10h]
+    { 6, 1, {0xFF, 0x15, 0xF0, 0xFF, 0xFF, 0xFF}, {2}, STATUS_SUCCESS,
+            {0xFF, 0x15, 0xF0, 0xFE, 0xFF, 0xFF} },
+    // cmp dword ptr [rip+10h], 0 - the displacement is followed by an imm8
+    { 7, 1, {0x83, 0x3D, 0x10, 0x00, 0x00, 0x00, 0x00}, {2}, STATUS_SUCCESS,
+            {0x83, 0x3D, 0x10, 0xFF, 0xFF, 0xFF, 0x00} },
+    // mov dword ptr [rip+2000h], 1
+    { 10, 1, {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00}, {2}, STATUS_SUCCESS,
+             {0xC7, 0x05, 0x00, 0x1F, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00} },
+    // cmp word ptr [rip+400h], 1234h
+    { 9, 1, {0x66, 0x81, 0x3D, 0x00, 0x04, 0x00, 0x00, 0x34, 0x12}, {3}, STATUS_SUCCESS,
+            {0x66, 0x81, 0x3D, 0x00, 0x03, 0x00, 0x00, 0x34, 0x12} },
+    // mov byte ptr [rip+0FFFh], 1
+    { 7, 1, {0xC6, 0x05, 0xFF, 0x0F, 0x00, 0x00, 0x01}, {2}, STATUS_SUCCESS,
+            {0xC6, 0x05, 0xFF, 0x0E, 0x00, 0x00, 0x01} },
+    // test byte ptr [rip+10h], 80h
+    { 7, 1, {0xF6, 0x05, 0x10, 0x00, 0x00, 0x00, 0x80}, {2}, STATUS_SUCCESS,
+            {0xF6, 0x05, 0x10, 0xFF, 0xFF, 0xFF, 0x80} },
+    // imul eax, dword ptr [rip+200h], 1000
+    { 10, 1, {0x69, 0x05, 0x00, 0x02, 0x00, 0x00, 0xE8, 0x03, 0x00, 0x00}, {2}, STATUS_SUCCESS,
+             {0x69, 0x05, 0x00, 0x01, 0x00, 0x00, 0xE8, 0x03, 0x00, 0x00} },
+    // inc qword ptr [rip+10000h]
+    { 7, 1, {0x48, 0xFF, 0x05, 0x00, 0x00, 0x01, 0x00}, {3}, STATUS_SUCCESS,
+            {0x48, 0xFF, 0x05, 0x00, 0xFF, 0x00, 0x00} },
+    // bt dword ptr [rip+100h], 5
+    { 8, 1, {0x0F, 0xBA, 0x25, 0x00, 0x01, 0x00, 0x00, 0x05}, {3}, STATUS_SUCCESS,
+            {0x0F, 0xBA, 0x25, 0x00, 0x00, 0x00, 0x00, 0x05} },
+    // prefetcht0 byte ptr [rip+1000h]
+    { 7, 1, {0x0F, 0x18, 0x0D, 0x00, 0x10, 0x00, 0x00}, {3}, STATUS_SUCCESS,
+            {0x0F, 0x18, 0x0D, 0x00, 0x0F, 0x00, 0x00} },
+    // lock cmpxchg qword ptr [rip+80h], rcx
+    { 9, 1, {0xF0, 0x48, 0x0F, 0xB1, 0x0D, 0x80, 0x00, 0x00, 0x00}, {5}, STATUS_SUCCESS,
+            {0xF0, 0x48, 0x0F, 0xB1, 0x0D, 0x80, 0xFF, 0xFF, 0xFF} },
+    // movdqa xmm0, xmmword ptr [rip+40h]
+    { 8, 1, {0x66, 0x0F, 0x6F, 0x05, 0x40, 0x00, 0x00, 0x00}, {4}, STATUS_SUCCESS,
+            {0x66, 0x0F, 0x6F, 0x05, 0x40, 0xFF, 0xFF, 0xFF} },
+    // vmovdqu xmm0, xmmword ptr [rip+100h]
+    { 8, 1, {0xC5, 0xFA, 0x6F, 0x05, 0x00, 0x01, 0x00, 0x00}, {4}, STATUS_SUCCESS,
+            {0xC5, 0xFA, 0x6F, 0x05, 0x00, 0x00, 0x00, 0x00} },
+    // vmovaps zmm0, zmmword ptr [rip+1] - EVEX doesn't scale a disp32
+    { 10, 1, {0x62, 0xF1, 0x7C, 0x48, 0x28, 0x05, 0x01, 0x00, 0x00, 0x00}, {6}, STATUS_SUCCESS,
+             {0x62, 0xF1, 0x7C, 0x48, 0x28, 0x05, 0x01, 0xFF, 0xFF, 0xFF} },
+    // mov eax, dword ptr [eip]
+    { 7, 1, {0x67, 0x8B, 0x05, 0x00, 0x00, 0x00, 0x00}, {3}, STATUS_SUCCESS,
+            {0x67, 0x8B, 0x05, 0x00, 0xFF, 0xFF, 0xFF} },
+    // mov [rsp+8], rbx; mov rax, [rip+10h]
+    { 12, 2, {0x48, 0x89, 0x5C, 0x24, 0x08, 0x48, 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00}, {0, 3}, STATUS_SUCCESS,
+             {0x48, 0x89, 0x5C, 0x24, 0x08, 0x48, 0x8B, 0x05, 0x10, 0xFF, 0xFF, 0xFF} },
+    // push rbx; sub rsp, 20h; mov rax, [rip+3000h]
+    { 13, 3, {0x40, 0x53, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0x05, 0x00, 0x30, 0x00, 0x00}, {0, 0, 3}, STATUS_SUCCESS,
+             {0x40, 0x53, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0x05, 0x00, 0x2F, 0x00, 0x00} },
+    // mov rcx, [rip+8]; test rcx, rcx
+    { 10, 2, {0x48, 0x8B, 0x0D, 0x08, 0x00, 0x00, 0x00, 0x48, 0x85, 0xC9}, {3, 0}, STATUS_SUCCESS,
+             {0x48, 0x8B, 0x0D, 0x08, 0xFF, 0xFF, 0xFF, 0x48, 0x85, 0xC9} },
+    // mov rax, [rip-80000000h] - the relocated displacement is out of reach
+    { 7, 1, {0x48, 0x8B, 0x05, 0x00, 0x00, 0x00, 0x80}, {3}, STATUS_NOT_SUPPORTED,
+            {0} },
+#else
+    // mov edi, edi; push ebp; mov ebp, esp
+    { 5, 3, {0x8B, 0xFF, 0x55, 0x8B, 0xEC}, {0, 0, 0}, STATUS_SUCCESS,
+            {0x8B, 0xFF, 0x55, 0x8B, 0xEC} },
+    // mov eax, dword ptr [12345678h] - absolute on x86, no relocation
+    { 6, 1, {0x8B, 0x05, 0x78, 0x56, 0x34, 0x12}, {0}, STATUS_SUCCESS,
+            {0x8B, 0x05, 0x78, 0x56, 0x34, 0x12} },
+    // mov eax, dword ptr ds:[12345678h]
+    { 5, 1, {0xA1, 0x78, 0x56, 0x34, 0x12}, {0}, STATUS_SUCCESS,
+            {0xA1, 0x78, 0x56, 0x34, 0x12} },
+    // cmp dword ptr [12345678h], 0
+    { 7, 1, {0x83, 0x3D, 0x78, 0x56, 0x34, 0x12, 0x00}, {0}, STATUS_SUCCESS,
+            {0x83, 0x3D, 0x78, 0x56, 0x34, 0x12, 0x00} },
+    // push ebp; mov ebp, esp; push dword ptr fs:[0]
+    { 10, 3, {0x55, 0x8B, 0xEC, 0x64, 0xFF, 0x35, 0x00, 0x00, 0x00, 0x00}, {0, 0, 0}, STATUS_SUCCESS,
+             {0x55, 0x8B, 0xEC, 0x64, 0xFF, 0x35, 0x00, 0x00, 0x00, 0x00} },
+#endif
+};
+
+
+
+
+EASYHOOK_NT_INTERNAL LhTestRelocationCorpus()
+{
+/*
+Description:
+
+    Decodes and relocates every sample of the relocation corpus and
+    compares the displacement offsets and the relocated code with the
+    expected ones.
+
+Returns:
+
+    STATUS_INTERNAL_ERROR
+
+        At least one sample was not decoded or relocated as expected.
+*/
+    UCHAR                           Buffer[LH_SAMPLE_DISTANCE + 32];
+    const LH_RELOCATION_SAMPLE*     Sample;
+    LH_ENTRY_POINT                  Entry;
+    ULONG                           RelocSize;
+    ULONG                           Index;
+    ULONG                           i;
+    NTSTATUS                        NtStatus;
+
+    for(Index = 0; Index < sizeof(LhRelocationCorpus) / sizeof(LH_RELOCATION_SAMPLE); Index++)
+    {
+        Sample = &LhRelocationCorpus[Index];
+
+        // pad with NOPs, the decoder may look beyond the sample
+        for(i = 0; i < sizeof(Buffer); i++)
+            Buffer[i] = 0x90;
+
+        RtlCopyMemory(Buffer, (void*)Sample->Code, Sample->Size);
+
+        FORCE(LhDecodeEntryPoint(Buffer, Sample->Size, &Entry));
+
+        if((Entry.Size != Sample->Size) || (Entry.Count != Sample->Count))
+            THROW(STATUS_INTERNAL_ERROR, L"An instruction of the relocation corpus has an unexpected length.");
+
+        for(i = 0; i < Entry.Count; i++)
+        {
+            if(Entry.Instructions[i].DispOffset != Sample->DispOffsets[i])
+                THROW(STATUS_INTERNAL_ERROR, L"An instruction of the relocation corpus has an unexpected displacement offset.");
+        }
+
+        if(LhRelocateEntryPoint(&Entry, Buffer + LH_SAMPLE_DISTANCE, &RelocSize) != Sample->Status)
+            THROW(STATUS_INTERNAL_ERROR, L"A sample of the relocation corpus was not relocated as expected.");
+
+        if(Sample->Status != STATUS_SUCCESS)
+            continue;
+
+        if(RelocSize != Sample->Size)
+            THROW(STATUS_INTERNAL_ERROR, L"A sample of the relocation corpus has an unexpected relocated size.");
+
+        for(i = 0; i < RelocSize; i++)
+        {
+            if(Buffer[LH_SAMPLE_DISTANCE + i] != Sample->Relocated[i])
+                THROW(STATUS_INTERNAL_ERROR, L"A sample of the relocation corpus has unexpected relocated code.");
+        }
+    }
+
+    RETURN(STATUS_SUCCESS);
+
+THROW_OUTRO:
+FINALLY_OUTRO:
+    return NtStatus;
+}
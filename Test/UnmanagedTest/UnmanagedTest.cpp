@@ -0,0 +1,359 @@
+#include "EasyHook.h"
+#include <stdio.h>
+#include <malloc.h>
+
+#pragma warning(disable: 4005)
+#include <ntstatus.h>
+#pragma warning(default: 4005)
+
+#ifndef _M_X64
+    #pragma comment(lib, "EasyHook32.lib")
+#else
+    #pragma comment(lib, "EasyHook64.lib")
+#endif
+
+#define FORCE(expr)     {if(!SUCCEEDED(NtStatus = (expr))) goto ERROR_ABORT;}
+
+/*
+    Calls MulDiv() from several threads while handlers are replaced or removed.
+    MulDiv() is __stdcall, so on x86 every handler removes its arguments with
+    "ret 12" before returning into the trampoline. Callers vary their stack depth,
+    so the return address slot crosses the execution counter shard boundaries.
+
+    Every handler is identified by its callback. A handler counts the threads
+    executing it and must never be entered again after its removal completed.
+*/
+#define LOAD_THREAD_COUNT           4
+#define SWAP_ROUNDS                 100
+#define CHAIN_ROUNDS                100
+#define CHAIN_MEMBERS               2
+
+typedef int WINAPI MULDIV_PROC(int, int, int);
+
+typedef struct _TEST_HANDLER_
+{
+    volatile LONG           InFlight;
+    volatile LONG           IsRetired;
+    volatile LONG           Calls;
+}TEST_HANDLER;
+
+static MULDIV_PROC*         MulDivProc = NULL;
+static TEST_HANDLER         Handlers[SWAP_ROUNDS + 1];
+static TEST_HANDLER         ChainHandlers[CHAIN_ROUNDS + CHAIN_MEMBERS + 1];
+static volatile LONG        IsLoadRunning = FALSE;
+static volatile LONG        FailureCount = 0;
+
+static int TestHandler(int InNumber, int InNumerator, int InDenominator)
+{
+    TEST_HANDLER*           Handler = NULL;
+    int                     Result;
+    ULONG                   Index;
+
+    if(!SUCCEEDED(LhBarrierGetCallback((PVOID*)&Handler)) || (Handler == NULL))
+    {
+        InterlockedIncrement(&FailureCount);
+
+        return MulDivProc(InNumber, InNumerator, InDenominator);
+    }
+
+    // the swapping thread sets IsRetired before reading InFlight...
+    InterlockedIncrement(&Handler->InFlight);
+
+    if(InterlockedCompareExchange(&Handler->IsRetired, 0, 0) != 0)
+        InterlockedIncrement(&FailureCount);
+
+    InterlockedIncrement(&Handler->Calls);
+
+    // stay a while, so handlers are replaced while threads are executing them
+    for(Index = 0; Index < 256; Index++)
+    {
+        YieldProcessor();
+    }
+
+    // passed to the next handler or the original method
+    Result = MulDivProc(InNumber, InNumerator, InDenominator);
+
+    InterlockedDecrement(&Handler->InFlight);
+
+    return Result;
+}
+
+static int WINAPI MulDivHookA(int InNumber, int InNumerator, int InDenominator)
+{
+    return TestHandler(InNumber, InNumerator, InDenominator);
+}
+
+static int WINAPI MulDivHookB(int InNumber, int InNumerator, int InDenominator)
+{
+    return TestHandler(InNumber, InNumerator, InDenominator);
+}
+
+static int CallAtDepth(ULONG InDepth)
+{
+    volatile UCHAR*         Pad = (UCHAR*)_alloca(InDepth + 1);
+
+    Pad[0] = 0;
+
+    return MulDivProc(6, 7, 1);
+}
+
+static DWORD WINAPI LoadThread(void* InParams)
+{
+    ULONG                   Depth = 0;
+
+    while(IsLoadRunning)
+    {
+        if(CallAtDepth(Depth) != 42)
+            InterlockedIncrement(&FailureCount);
+
+        // two pages, so the return address slot crosses a shard boundary now and then
+        Depth = (Depth + sizeof(void*)) % 8192;
+    }
+
+    return 0;
+}
+
+static BOOL StartLoad(HANDLE* OutThreads)
+{
+    ULONG                   Index;
+
+    IsLoadRunning = TRUE;
+
+    for(Index = 0; Index < LOAD_THREAD_COUNT; Index++)
+    {
+        if((OutThreads[Index] = CreateThread(NULL, 0, LoadThread, NULL, 0, NULL)) == NULL)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void StopLoad(HANDLE* InThreads)
+{
+    ULONG                   Index;
+
+    IsLoadRunning = FALSE;
+
+    for(Index = 0; Index < LOAD_THREAD_COUNT; Index++)
+    {
+        if(InThreads[Index] != NULL)
+        {
+            WaitForSingleObject(InThreads[Index], INFINITE);
+            CloseHandle(InThreads[Index]);
+        }
+
+        InThreads[Index] = NULL;
+    }
+}
+
+static BOOL RetireHandler(TEST_HANDLER* InHandler)
+{
+    // every removal must have completed, otherwise the old handler might still run
+    if(LhWaitForPendingRemovals() != STATUS_SUCCESS)
+        return FALSE;
+
+    InterlockedExchange(&InHandler->IsRetired, TRUE);
+
+    return InterlockedCompareExchange(&InHandler->InFlight, 0, 0) == 0;
+}
+
+static NTSTATUS TestHandlerSwap()
+{
+    TRACED_HOOK_HANDLE      hHook = new HOOK_TRACE_INFO();
+    HANDLE                  hThreads[LOAD_THREAD_COUNT] = {NULL};
+    ULONG                   ACLEntries[1] = {0};
+    ULONG                   PendingCount;
+    ULONG                   StuckCount;
+    ULONG                   Round;
+    LONG                    Calls = 0;
+    NTSTATUS                NtStatus;
+
+    printf("Replacing a __stdcall handler under load...\n");
+
+    FORCE(LhInstallHook((void*)MulDivProc, (void*)MulDivHookA, &Handlers[0], hHook));
+
+    // intercept all threads except the one replacing handlers
+    FORCE(LhSetExclusiveACL(ACLEntries, 1, hHook));
+
+    if(!StartLoad(hThreads))
+        FORCE(STATUS_INSUFFICIENT_RESOURCES);
+
+    for(Round = 1; Round <= SWAP_ROUNDS; Round++)
+    {
+        FORCE(LhReplaceHookHandler(hHook, (Round & 1)?(void*)MulDivHookB:(void*)MulDivHookA, &Handlers[Round]));
+
+        if(!RetireHandler(&Handlers[Round - 1]))
+        {
+            printf("    Handler %u is still executed after its retirement.\n", Round - 1);
+
+            InterlockedIncrement(&FailureCount);
+        }
+    }
+
+    StopLoad(hThreads);
+
+    // drifting execution counter shards never become quiescent
+    FORCE(LhQueryPendingRemovals(&PendingCount, &StuckCount));
+
+    if(StuckCount != 0)
+    {
+        printf("    %u retired handlers are stuck.\n", StuckCount);
+
+        InterlockedIncrement(&FailureCount);
+    }
+
+    for(Round = 0; Round <= SWAP_ROUNDS; Round++)
+    {
+        Calls += Handlers[Round].Calls;
+    }
+
+    if(Calls == 0)
+    {
+        printf("    No call reached a handler.\n");
+
+        InterlockedIncrement(&FailureCount);
+    }
+
+    FORCE(LhUninstallHook(hHook));
+
+    if(LhWaitForPendingRemovals() != STATUS_SUCCESS)
+        InterlockedIncrement(&FailureCount);
+
+    delete hHook;
+
+    return STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    StopLoad(hThreads);
+
+    LhUninstallHook(hHook);
+    LhWaitForPendingRemovals();
+
+    delete hHook;
+
+    return NtStatus;
+}
+
+static NTSTATUS TestChainRemoval()
+{
+    TRACED_HOOK_HANDLE      hSite = new HOOK_TRACE_INFO();
+    TRACED_HOOK_HANDLE      hMembers[CHAIN_MEMBERS] = {NULL};
+    HANDLE                  hThreads[LOAD_THREAD_COUNT] = {NULL};
+    ULONG                   ACLEntries[1] = {0};
+    ULONG                   PendingCount;
+    ULONG                   StuckCount;
+    ULONG                   Round;
+    ULONG                   Index;
+    LONG                    Calls = 0;
+    NTSTATUS                NtStatus;
+
+    printf("Removing chained __stdcall handlers under load...\n");
+
+    for(Index = 0; Index < CHAIN_MEMBERS; Index++)
+    {
+        hMembers[Index] = new HOOK_TRACE_INFO();
+    }
+
+    // the first hook owns the patch site, all others share its trampoline
+    FORCE(LhInstallHook((void*)MulDivProc, (void*)MulDivHookA, &ChainHandlers[0], hSite));
+    FORCE(LhSetExclusiveACL(ACLEntries, 1, hSite));
+
+    for(Index = 0; Index < CHAIN_MEMBERS; Index++)
+    {
+        FORCE(LhInstallHook((void*)MulDivProc, (void*)MulDivHookB, &ChainHandlers[Index + 1], hMembers[Index]));
+        FORCE(LhSetExclusiveACL(ACLEntries, 1, hMembers[Index]));
+    }
+
+    if(!StartLoad(hThreads))
+        FORCE(STATUS_INSUFFICIENT_RESOURCES);
+
+    // replace the oldest chain member in every round
+    for(Round = 0; Round < CHAIN_ROUNDS; Round++)
+    {
+        Index = Round % CHAIN_MEMBERS;
+
+        FORCE(LhUninstallHook(hMembers[Index]));
+
+        if(!RetireHandler(&ChainHandlers[Round + 1]))
+        {
+            printf("    Chained handler %u is still executed after its removal.\n", Round + 1);
+
+            InterlockedIncrement(&FailureCount);
+        }
+
+        FORCE(LhInstallHook((void*)MulDivProc, (void*)MulDivHookB, &ChainHandlers[Round + CHAIN_MEMBERS + 1], hMembers[Index]));
+        FORCE(LhSetExclusiveACL(ACLEntries, 1, hMembers[Index]));
+    }
+
+    StopLoad(hThreads);
+
+    FORCE(LhQueryPendingRemovals(&PendingCount, &StuckCount));
+
+    if(StuckCount != 0)
+    {
+        printf("    %u removed chain members are stuck.\n", StuckCount);
+
+        InterlockedIncrement(&FailureCount);
+    }
+
+    for(Round = 0; Round < CHAIN_ROUNDS + CHAIN_MEMBERS + 1; Round++)
+    {
+        Calls += ChainHandlers[Round].Calls;
+    }
+
+    if(Calls == 0)
+    {
+        printf("    No call reached a chained handler.\n");
+
+        InterlockedIncrement(&FailureCount);
+    }
+
+    NtStatus = STATUS_SUCCESS;
+
+ERROR_ABORT:
+
+    StopLoad(hThreads);
+
+    LhUninstallAllHooks();
+
+    if(LhWaitForPendingRemovals() != STATUS_SUCCESS)
+        InterlockedIncrement(&FailureCount);
+
+    for(Index = 0; Index < CHAIN_MEMBERS; Index++)
+    {
+        delete hMembers[Index];
+    }
+
+    delete hSite;
+
+    return NtStatus;
+}
+
+extern "C" int main(int argc, wchar_t* argv[])
+{
+    NTSTATUS                NtStatus;
+
+    MulDivProc = (MULDIV_PROC*)GetProcAddress(GetModuleHandleA("kernel32.dll"), "MulDiv");
+
+    FORCE(TestHandlerSwap());
+
+    FORCE(TestChainRemoval());
+
+    if(FailureCount != 0)
+    {
+        printf("\n[Error]: %d checks failed.\n", FailureCount);
+
+        return 1;
+    }
+
+    printf("\nAll tests passed.\n");
+
+    return 0;
+
+ERROR_ABORT:
+
+	printf("\n[Error(0x%p)]: \"%S\" (code: %d {0x%p})\n", (PVOID)NtStatus, RtlGetLastErrorString(), RtlGetLastError(), (PVOID)RtlGetLastError());
+
+    return NtStatus;
+}